@@ -0,0 +1,180 @@
+/*
+   BLAKE2 reference source code package - reference C implementations
+
+   Copyright 2012, Samuel Neves <sneves@dei.uc.pt>.  You may use this under the
+   terms of the CC0, the OpenSSL Licence, or the Apache Public License 2.0, at
+   your option.  The terms of these licenses can be found at:
+
+   - CC0 1.0 Universal : http://creativecommons.org/publicdomain/zero/1.0
+   - OpenSSL license   : https://www.openssl.org/source/license.html
+   - Apache 2.0        : http://www.apache.org/licenses/LICENSE-2.0
+
+   More information about the BLAKE2 hash function can be found at
+   https://blake2.net.
+*/
+
+/* The blake2b compression function, split out of blake2b-ref.c so that
+   librsync can provide vectorized variants with a runtime dispatcher.
+
+   On x86 with a new enough gcc or clang we compile the round function
+   several times with different target ISAs (SSE4.1, AVX2) and pick the
+   best one the CPU reports on first use.  The round code itself is the
+   portable reference implementation; the target attribute lets the
+   compiler use the wider registers and vector instructions for it.  On
+   other architectures (including aarch64, where NEON is part of the
+   baseline ISA) the single reference variant is used directly. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "blake2.h"
+#include "blake2-impl.h"
+#include "blake2b-compress.h"
+
+static const uint64_t blake2b_IV[8] =
+{
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+  0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+  0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] =
+{
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 } ,
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 } ,
+  { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 } ,
+  {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 } ,
+  {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 } ,
+  {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 } ,
+  { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 } ,
+  { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 } ,
+  {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 } ,
+  { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13 , 0 } ,
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 } ,
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define G(r,i,a,b,c,d)                      \
+  do {                                      \
+    a = a + b + m[blake2b_sigma[r][2*i+0]]; \
+    d = rotr64(d ^ a, 32);                  \
+    c = c + d;                              \
+    b = rotr64(b ^ c, 24);                  \
+    a = a + b + m[blake2b_sigma[r][2*i+1]]; \
+    d = rotr64(d ^ a, 16);                  \
+    c = c + d;                              \
+    b = rotr64(b ^ c, 63);                  \
+  } while(0)
+
+#define ROUND(r)                    \
+  do {                              \
+    G(r,0,v[ 0],v[ 4],v[ 8],v[12]); \
+    G(r,1,v[ 1],v[ 5],v[ 9],v[13]); \
+    G(r,2,v[ 2],v[ 6],v[10],v[14]); \
+    G(r,3,v[ 3],v[ 7],v[11],v[15]); \
+    G(r,4,v[ 0],v[ 5],v[10],v[15]); \
+    G(r,5,v[ 1],v[ 6],v[11],v[12]); \
+    G(r,6,v[ 2],v[ 7],v[ 8],v[13]); \
+    G(r,7,v[ 3],v[ 4],v[ 9],v[14]); \
+  } while(0)
+
+/* The compression function body, shared by all variants. */
+#define BLAKE2B_COMPRESS_BODY                           \
+  uint64_t m[16];                                       \
+  uint64_t v[16];                                       \
+  size_t i;                                             \
+                                                        \
+  for( i = 0; i < 16; ++i ) {                           \
+    m[i] = load64( block + i * sizeof( m[i] ) );        \
+  }                                                     \
+                                                        \
+  for( i = 0; i < 8; ++i ) {                            \
+    v[i] = S->h[i];                                     \
+  }                                                     \
+                                                        \
+  v[ 8] = blake2b_IV[0];                                \
+  v[ 9] = blake2b_IV[1];                                \
+  v[10] = blake2b_IV[2];                                \
+  v[11] = blake2b_IV[3];                                \
+  v[12] = blake2b_IV[4] ^ S->t[0];                      \
+  v[13] = blake2b_IV[5] ^ S->t[1];                      \
+  v[14] = blake2b_IV[6] ^ S->f[0];                      \
+  v[15] = blake2b_IV[7] ^ S->f[1];                      \
+                                                        \
+  ROUND( 0 );                                           \
+  ROUND( 1 );                                           \
+  ROUND( 2 );                                           \
+  ROUND( 3 );                                           \
+  ROUND( 4 );                                           \
+  ROUND( 5 );                                           \
+  ROUND( 6 );                                           \
+  ROUND( 7 );                                           \
+  ROUND( 8 );                                           \
+  ROUND( 9 );                                           \
+  ROUND( 10 );                                          \
+  ROUND( 11 );                                          \
+                                                        \
+  for( i = 0; i < 8; ++i ) {                            \
+    S->h[i] = S->h[i] ^ v[i] ^ v[i + 8];                \
+  }
+
+static void blake2b_compress_ref( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+{
+  BLAKE2B_COMPRESS_BODY
+}
+
+/* Runtime dispatch is only available where the compiler supports
+   per-function target ISAs and __builtin_cpu_supports. */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    ((defined(__GNUC__) && __GNUC__ >= 6) || defined(__clang__)) && \
+    !defined(BLAKE2B_NO_DISPATCH)
+#define BLAKE2B_DISPATCH 1
+
+__attribute__((target("sse4.1")))
+static void blake2b_compress_sse41( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+{
+  BLAKE2B_COMPRESS_BODY
+}
+
+__attribute__((target("avx2")))
+static void blake2b_compress_avx2( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+{
+  BLAKE2B_COMPRESS_BODY
+}
+#endif
+
+#undef BLAKE2B_COMPRESS_BODY
+#undef G
+#undef ROUND
+
+#ifdef BLAKE2B_DISPATCH
+typedef void blake2b_compress_fn( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] );
+
+static blake2b_compress_fn *blake2b_compress_select( void )
+{
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx2" ) )
+    return blake2b_compress_avx2;
+  if( __builtin_cpu_supports( "sse4.1" ) )
+    return blake2b_compress_sse41;
+  return blake2b_compress_ref;
+}
+
+void blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+{
+  /* Resolved once on first use; subsequent reads of a fully written
+     function pointer are safe even if two threads race the first call,
+     because every variant computes the same result. */
+  static blake2b_compress_fn *compress_impl = NULL;
+
+  if( !compress_impl )
+    compress_impl = blake2b_compress_select();
+  compress_impl( S, block );
+}
+#else
+void blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+{
+  blake2b_compress_ref( S, block );
+}
+#endif
@@ -0,0 +1,33 @@
+/*
+   BLAKE2 compression function dispatch for librsync.
+
+   Copyright 2012, Samuel Neves <sneves@dei.uc.pt>.  You may use this under the
+   terms of the CC0, the OpenSSL Licence, or the Apache Public License 2.0, at
+   your option.  The terms of these licenses can be found at:
+
+   - CC0 1.0 Universal : http://creativecommons.org/publicdomain/zero/1.0
+   - OpenSSL license   : https://www.openssl.org/source/license.html
+   - Apache 2.0        : http://www.apache.org/licenses/LICENSE-2.0
+
+   More information about the BLAKE2 hash function can be found at
+   https://blake2.net.
+*/
+#ifndef BLAKE2B_COMPRESS_H
+#define BLAKE2B_COMPRESS_H
+
+#include "blake2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+  /* The compression function behind blake2b_update()/blake2b_final().
+     This resolves on first use to the fastest variant the running CPU
+     supports (AVX2, then SSE4.1, then the portable reference code). */
+  void blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] );
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -47,6 +47,10 @@
 #include <errno.h>
 #include <string.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include "librsync.h"
 #include "trace.h"
 #include "buf.h"
@@ -57,14 +61,153 @@ struct rs_filebuf {
         FILE *f;
         char            *buf;
         size_t          buf_len;
+        size_t          buf_alloc;      /* allocation behind buf; may
+                                         * exceed buf_len when pooled */
+        char            *cmp_buf;       /* read-back buffer, only for
+                                         * the sparse drain */
+};
+
+
+/** Idle buffers kept by a pool when none is requested explicitly. */
+#define RS_BUF_POOL_DEFAULT_MAX 16
+
+/** An idle buffer parked in a pool.
+ *
+ * The header is overlaid on the buffer memory itself, so the pool
+ * needs no allocations of its own. */
+typedef struct rs_buf_pool_entry {
+    struct rs_buf_pool_entry *next;
+    size_t alloc;
+} rs_buf_pool_entry_t;
+
+/** A pool of idle file buffers kept for reuse.
+ *
+ * Released buffers go on a free list and satisfy any later request
+ * they are big enough for, so a run over thousands of small files
+ * stops allocating IO buffers once the pool is warm. */
+struct rs_buf_pool {
+    rs_buf_pool_entry_t *idle;
+    int idle_count;
+    int max_idle;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t mutex;
+#endif
 };
 
+/** The installed pool consulted by rs_filebuf_new() and
+ * rs_filebuf_free(). */
+static rs_buf_pool_t *rs_buf_pool = NULL;
+
+static void rs_buf_pool_lock(rs_buf_pool_t *pool)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pool->mutex);
+#else
+    (void)pool;
+#endif
+}
+
+static void rs_buf_pool_unlock(rs_buf_pool_t *pool)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pool->mutex);
+#else
+    (void)pool;
+#endif
+}
+
+rs_buf_pool_t *rs_buf_pool_new(int max_idle)
+{
+    rs_buf_pool_t *pool;
+
+    pool = rs_alloc_struct(rs_buf_pool_t);
+    pool->max_idle = max_idle > 0 ? max_idle : RS_BUF_POOL_DEFAULT_MAX;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&pool->mutex, NULL);
+#endif
+    return pool;
+}
+
+void rs_buf_pool_install(rs_buf_pool_t *pool)
+{
+    rs_buf_pool = pool;
+}
+
+void rs_buf_pool_free(rs_buf_pool_t *pool)
+{
+    rs_buf_pool_entry_t *entry;
+
+    if (!pool)
+        return;
+    if (rs_buf_pool == pool)
+        rs_buf_pool = NULL;
+    while ((entry = pool->idle)) {
+        pool->idle = entry->next;
+        free(entry);
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&pool->mutex);
+#endif
+    free(pool);
+}
+
+/** Take an idle buffer of at least \p buf_len from the installed pool,
+ * or return NULL. */
+static char *rs_buf_pool_get(size_t buf_len, size_t *alloc)
+{
+    rs_buf_pool_t *pool = rs_buf_pool;
+    rs_buf_pool_entry_t *entry, **prev;
+
+    if (!pool)
+        return NULL;
+    rs_buf_pool_lock(pool);
+    for (prev = &pool->idle; (entry = *prev); prev = &entry->next) {
+        if (entry->alloc >= buf_len) {
+            *prev = entry->next;
+            pool->idle_count--;
+            break;
+        }
+    }
+    rs_buf_pool_unlock(pool);
+    if (!entry)
+        return NULL;
+    *alloc = entry->alloc;
+    return (char *)entry;
+}
+
+/** Park a buffer in the installed pool, or free it if there is no room
+ * or it is too small to hold the list header. */
+static void rs_buf_pool_put(char *buf, size_t alloc)
+{
+    rs_buf_pool_t *pool = rs_buf_pool;
+    rs_buf_pool_entry_t *entry;
+
+    if (!pool || alloc < sizeof(rs_buf_pool_entry_t)) {
+        free(buf);
+        return;
+    }
+    rs_buf_pool_lock(pool);
+    if (pool->idle_count < pool->max_idle) {
+        entry = (rs_buf_pool_entry_t *)buf;
+        entry->alloc = alloc;
+        entry->next = pool->idle;
+        pool->idle = entry;
+        pool->idle_count++;
+        buf = NULL;
+    }
+    rs_buf_pool_unlock(pool);
+    free(buf);
+}
+
 
 rs_filebuf_t *rs_filebuf_new(FILE *f, size_t buf_len)
 {
     rs_filebuf_t *pf = rs_alloc_struct(rs_filebuf_t);
 
-    pf->buf = rs_alloc(buf_len, "file buffer");
+    if (!(pf->buf = rs_buf_pool_get(buf_len, &pf->buf_alloc))) {
+        pf->buf = rs_alloc(buf_len, "file buffer");
+        pf->buf_alloc = buf_len;
+    }
     pf->buf_len = buf_len;
     pf->f = f;
 
@@ -74,7 +217,8 @@ rs_filebuf_t *rs_filebuf_new(FILE *f, size_t buf_len)
 
 void rs_filebuf_free(rs_filebuf_t *fb)
 {
-	free(fb->buf);
+        rs_buf_pool_put(fb->buf, fb->buf_alloc);
+        free(fb->cmp_buf);
         rs_bzero(fb, sizeof *fb);
         free(fb);
 }
@@ -184,3 +328,87 @@ rs_result rs_outfilebuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 
     return RS_DONE;
 }
+
+
+/** Shortest run of already-correct bytes worth seeking over rather
+ * than including in a write. */
+#define RS_INPLACE_MIN_SKIP 64
+
+/*
+ * Drain the output buffer into a read/write file, seeking over runs
+ * that already hold the right bytes instead of rewriting them.  The
+ * existing contents at the current position are read back and
+ * compared; only differing runs are written.  On a target that mostly
+ * matches the output (the common in-place patch case) this turns
+ * nearly all the IO into reads and saves the device the writes.
+ */
+rs_result rs_outfilebuf_drain_inplace(rs_job_t *job, rs_buffers_t *buf, void *opaque)
+{
+    int present;
+    rs_filebuf_t *fb = (rs_filebuf_t *) opaque;
+    FILE *f = fb->f;
+
+    /* This is only allowed if either the buf has no output buffer
+     * yet, or that buffer could possibly be BUF. */
+    if (buf->next_out == NULL) {
+        assert(buf->avail_out == 0);
+
+        buf->next_out = fb->buf;
+        buf->avail_out = fb->buf_len;
+
+        return RS_DONE;
+    }
+
+    assert(buf->avail_out <= fb->buf_len);
+    assert(buf->next_out >= fb->buf);
+    assert(buf->next_out <= fb->buf + fb->buf_len);
+
+    present = buf->next_out - fb->buf;
+    if (present > 0) {
+        long start = ftell(f);
+        size_t old_len, i = 0, run;
+
+        if (!fb->cmp_buf)
+            fb->cmp_buf = rs_alloc(fb->buf_len, "file compare buffer");
+        /* Read back what's already there; everything past old_len
+         * (short file) counts as differing. */
+        old_len = fread(fb->cmp_buf, 1, present, f);
+        if (old_len < (size_t)present && ferror(f)) {
+            rs_error("error reading back target file: %s", strerror(errno));
+            return RS_IO_ERROR;
+        }
+        clearerr(f);
+        while (i < (size_t)present) {
+            if (i < old_len && fb->cmp_buf[i] == fb->buf[i]) {
+                i++;
+                continue;
+            }
+            /* Find the end of this differing run and rewrite it; only
+             * a decent run of equal bytes ends the write, so scattered
+             * single-byte matches don't fragment it into tiny pieces. */
+            for (run = i + 1; run < (size_t)present; run++)
+                if (run + RS_INPLACE_MIN_SKIP <= old_len
+                    && !memcmp(fb->cmp_buf + run, fb->buf + run,
+                               RS_INPLACE_MIN_SKIP))
+                    break;
+            if (fseek(f, start + (long)i, SEEK_SET)
+                || fwrite(fb->buf + i, 1, run - i, f) != run - i) {
+                rs_error("error draining buf to file: %s", strerror(errno));
+                return RS_IO_ERROR;
+            }
+            i = run;
+        }
+        /* Leave the position at the end of the chunk. */
+        if (fseek(f, start + present, SEEK_SET)) {
+            rs_error("error seeking target file: %s", strerror(errno));
+            return RS_IO_ERROR;
+        }
+
+        buf->next_out = fb->buf;
+        buf->avail_out = fb->buf_len;
+
+        job->stats.out_bytes += present;
+    }
+
+    return RS_DONE;
+}
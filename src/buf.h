@@ -28,3 +28,5 @@ void rs_filebuf_free(rs_filebuf_t *fb);
 rs_result rs_infilebuf_fill(rs_job_t *, rs_buffers_t *buf, void *fb);
 
 rs_result rs_outfilebuf_drain(rs_job_t *, rs_buffers_t *, void *fb);
+
+rs_result rs_outfilebuf_drain_inplace(rs_job_t *, rs_buffers_t *, void *fb);
@@ -19,7 +19,10 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-rs_weak_sum_t rs_calc_weak_sum(void const *buf, size_t len);
+#include "weaksum.h"
+
+rs_weak_sum_t rs_calc_weak_sum(weaksum_kind_t kind, void const *buf, size_t len);
 
 void rs_calc_md4_sum(void const *buf, size_t buf_len, rs_strong_sum_t *);
+void rs_calc_md4_sum_n(void const *const *bufs, size_t buf_len, int count, rs_strong_sum_t *sums);
 void rs_calc_blake2_sum(void const *buf, size_t buf_len, rs_strong_sum_t *);
@@ -34,6 +34,7 @@ struct rs_op_kind_name const rs_op_kind_names[] = {
     {"END",       RS_KIND_END },
     {"COPY",      RS_KIND_COPY },
     {"LITERAL",   RS_KIND_LITERAL },
+    {"LITERAL_Z", RS_KIND_LITERAL_Z },
     {"SIGNATURE", RS_KIND_SIGNATURE },
     {"CHECKSUM",  RS_KIND_CHECKSUM },
     {"INVALID",   RS_KIND_INVALID },
@@ -39,6 +39,7 @@ enum rs_op_kind {
     RS_KIND_SIGNATURE,
     RS_KIND_COPY,
     RS_KIND_CHECKSUM,
+    RS_KIND_LITERAL_Z,          /* literal with a compressed payload */
     RS_KIND_RESERVED,           /* for future expansion */
 
     /* This one should never occur in file streams.  It's an
@@ -47,6 +48,21 @@ enum rs_op_kind {
 };
 
 
+/**
+ * Command bytes of the compact ::RS_DELTA2_MAGIC delta encoding.
+ *
+ * Unlike the v1 prototab, there is one byte per operation: parameters
+ * follow as LEB128 varints, and COPY offsets are zigzag-encoded deltas
+ * from the end of the previous copy.
+ */
+enum rs_delta2_op {
+    RS_OP2_END = 0x00,
+    RS_OP2_LITERAL = 0x01,
+    RS_OP2_COPY = 0x02,
+    RS_OP2_LITERAL_Z = 0x03     /* varint compressed len, raw len */
+};
+
+
 typedef struct rs_op_kind_name {
     char const           *name;
     enum rs_op_kind const    kind;
@@ -15,6 +15,9 @@
 /* Define this to enable trace code  */
 #cmakedefine DO_RS_TRACE
 
+/* Define this to also enable trace code on the scan hot paths  */
+#cmakedefine DO_RS_TRACE_HOT
+
 /* Define to 1 if you have `alloca', as a function or macro. */
 #cmakedefine HAVE_ALLOCA 1
 
@@ -24,6 +27,12 @@
 /* Define to 1 if you have the <bzlib.h> header file.  */
 #cmakedefine HAVE_BZLIB_H 1
 
+/* Define to 1 if you have the `clock_gettime' function. */
+#cmakedefine HAVE_CLOCK_GETTIME 1
+
+/* Define to 1 if you have the `gettimeofday' function. */
+#cmakedefine HAVE_GETTIMEOFDAY 1
+
 /* Define to 1 if you have the <dlfcn.h> header file. */
 #cmakedefine HAVE_DLFCN_H 1
 
@@ -69,9 +78,18 @@
 /* Define to 1 if you have the <mcheck.h> header file. */
 #cmakedefine HAVE_MCHECK_H 1
 
+/* Define to 1 if you have the <pthread.h> header file. */
+#cmakedefine HAVE_PTHREAD_H 1
+
 /* Define to 1 if you have the `memmove' function. */
 #cmakedefine HAVE_MEMMOVE 1
 
+/* Define to 1 if you have the `pread' function. */
+#cmakedefine HAVE_PREAD 1
+
+/* Define to 1 if you have the `copy_file_range' function. */
+#cmakedefine HAVE_COPY_FILE_RANGE 1
+
 /* Define to 1 if you have the <memory.h> header file. */
 #cmakedefine HAVE_MEMORY_H 1
 
@@ -105,6 +123,9 @@
 /* Define to 1 if you have the <sys/file.h> header file. */
 #cmakedefine HAVE_SYS_FILE_H 1
 
+/* Define to 1 if you have the <sys/mman.h> header file. */
+#cmakedefine HAVE_SYS_MMAN_H 1
+
 /* Define to 1 if you have the <sys/stat.h> header file. */
 #cmakedefine HAVE_SYS_STAT_H 1
 
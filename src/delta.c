@@ -67,6 +67,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "librsync.h"
 #include "emit.h"
@@ -75,7 +76,7 @@
 #include "sumset.h"
 #include "job.h"
 #include "trace.h"
-#include "rollsum.h"
+#include "weaksum.h"
 
 /**
  * 2002-06-26: Donovan Baarda
@@ -87,9 +88,11 @@
  *
  * In pysync a 'last' attribute is used to hold the last miss or match for
  * extending if possible. In this code, basis_len and scoop_pos are used
- * instead of 'last'. When basis_len > 0, last is a match. When basis_len =
- * 0 and scoop_pos is > 0, last is a miss. When both are 0, last is None
- * (ie, nothing).
+ * instead of 'last'. When basis_len > 0 there is a pending match; when
+ * scoop_pos > 0 there are pending miss bytes. Both can be pending at
+ * once: the match is kept unemitted across following misses so that a
+ * later match whose backward extension eats those misses can still
+ * merge with it; at flush time the copy is emitted before the literal.
  *
  * Pysync is also slightly different in that a 'flush' method is available
  * to force output of accumulated data. This 'flush' is use to finalise
@@ -117,11 +120,23 @@
 /* used by rdiff, but now redundant */
 int rs_roll_paranoia = 0;
 
+/** How many scan positions ahead to prefetch hashtable buckets for. */
+#define RS_SCAN_PREFETCH_DEPTH 8
+
+/** Misses before the scan considers an input stretch cold and starts
+ * skipping probes; see rs_delta_s_scan(). */
+#define RS_SCAN_COLD_MISSES 1024
+
+/** Most offsets skipped between probes in a cold stretch. */
+#define RS_SCAN_MAX_SKIP 15
+
 static rs_result rs_delta_s_scan(rs_job_t *job);
 static rs_result rs_delta_s_flush(rs_job_t *job);
 static rs_result rs_delta_s_end(rs_job_t *job);
 static inline void rs_getinput(rs_job_t *job);
-static inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos, size_t *match_len);
+static inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos, size_t *match_len,
+                               const size_t block_len);
+static inline void rs_extendmatch(rs_job_t *job, rs_long_t *match_pos, size_t *match_len);
 static inline rs_result rs_appendmatch(rs_job_t *job, rs_long_t match_pos, size_t match_len);
 static inline rs_result rs_appendmiss(rs_job_t *job, size_t miss_len);
 static inline rs_result rs_appendflush(rs_job_t *job);
@@ -132,39 +147,114 @@ static inline rs_result rs_processmiss(rs_job_t *job);
  * \brief Get a block of data if possible, and see if it matches.
  *
  * On each call, we try to process all of the input data available on the
- * scoop and input buffer. */
-static rs_result rs_delta_s_scan(rs_job_t *job)
+ * scoop and input buffer.
+ *
+ * This is the loop body shared by the scan statefns below; they pass
+ * block_len in as a compile-time constant for the common block sizes,
+ * so the window arithmetic and the prefetch loop get folded per size. */
+static inline rs_result rs_delta_scan(rs_job_t *job, const size_t block_len)
 {
-    const size_t   block_len = job->signature->block_len;
+    /* In hierarchical mode, hold back until a whole coarse block is in
+     * view so coarse matches are never scanned past. */
+    const size_t   scan_len = job->signature_coarse ?
+                       job->signature_coarse->block_len : block_len;
     rs_long_t      match_pos;
     size_t         match_len;
     rs_result      result;
-    Rollsum        test;
+    weaksum_t      test;
+    weaksum_t      ahead;        /* lookahead sum for bucket prefetch */
+    size_t         ahead_pos = 0;
+    int            ahead_valid = 0;
 
     rs_job_check(job);
-    /* read the input into the scoop */
+    /* read or borrow the input for scanning */
     rs_getinput(job);
     /* output any pending output from the tube */
     result=rs_tube_catchup(job);
     /* while output is not blocked and there is a block of data */
     while ((result==RS_DONE) &&
-           ((job->scoop_pos + block_len) < job->scoop_avail)) {
+           ((job->scoop_pos + scan_len) < job->scan_avail)) {
         /* check if this block matches */
-        if (rs_findmatch(job,&match_pos,&match_len)) {
-            /* append the match and reset the weak_sum */
+        if (rs_findmatch(job,&match_pos,&match_len,block_len)) {
+            /* extend the match into the surrounding bytes if we can */
+            rs_extendmatch(job,&match_pos,&match_len);
+            /* append the match and reset the weak sums */
             result=rs_appendmatch(job,match_pos,match_len);
-            RollsumInit(&job->weak_sum);
+            weaksum_reset(&job->weak_sum);
+            if (job->signature_coarse)
+                weaksum_reset(&job->weak_sum_coarse);
+            ahead_valid = 0;
+            job->miss_run = 0;
         } else {
-            /* rotate the weak_sum and append the miss byte */
-            RollsumRotate(&job->weak_sum, job->scoop_next[job->scoop_pos],
-                          job->scoop_next[job->scoop_pos + block_len]);
-            result=rs_appendmiss(job,1);
+            size_t skip = 1;
+            /* After a long cold stretch the input probably shares
+             * nothing with the basis, so probe only every skip-th
+             * offset, rolling the sum over the gap in one pass.  The
+             * skip grows with the miss run but stays odd, so repeated
+             * probes sweep every residue of a power-of-two block
+             * length.  A bloom hit (no false negatives) at a probe
+             * drops straight back to per-byte probing, so at worst one
+             * block boundary of a returning match is scanned coarsely.
+             * Hierarchical scans stay per-byte: the coarse sum rotates
+             * over a different window length. */
+            if (!job->signature_coarse
+                && job->miss_run >= RS_SCAN_COLD_MISSES) {
+                if (rs_signature_near_match(job->signature,
+                                            weaksum_digest(&job->weak_sum)))
+                    job->miss_run = 0;
+                else {
+                    size_t room =
+                        job->scan_avail - block_len - job->scoop_pos;
+                    skip = job->miss_run / RS_SCAN_COLD_MISSES;
+                    if (skip > RS_SCAN_MAX_SKIP)
+                        skip = RS_SCAN_MAX_SKIP;
+                    skip |= 1;
+                    if (skip > room)
+                        skip = room;
+                }
+            }
+            if (skip == 1) {
+                /* rotate the weak sums and append the miss byte */
+                weaksum_rotate(&job->weak_sum, job->scan_buf[job->scoop_pos],
+                               job->scan_buf[job->scoop_pos + block_len]);
+                if (job->signature_coarse
+                    && weaksum_count(&job->weak_sum_coarse))
+                    weaksum_rotate(&job->weak_sum_coarse,
+                                   job->scan_buf[job->scoop_pos],
+                                   job->scan_buf[job->scoop_pos + scan_len]);
+                /* Run a copy of the rolling sum a few positions ahead of
+                 * the scan and prefetch the bucket each digest hashes to.
+                 * A large signature table misses cache on nearly every
+                 * probe; issuing the fetch RS_SCAN_PREFETCH_DEPTH misses
+                 * early overlaps that latency with the scan itself. */
+                if (!ahead_valid) {
+                    ahead = job->weak_sum;
+                    ahead_pos = job->scoop_pos + 1;
+                    ahead_valid = 1;
+                }
+                while (ahead_pos <= job->scoop_pos + RS_SCAN_PREFETCH_DEPTH
+                       && ahead_pos + block_len < job->scan_avail) {
+                    rs_signature_prefetch_match(job->signature,
+                                                weaksum_digest(&ahead));
+                    weaksum_rotate(&ahead, job->scan_buf[ahead_pos],
+                                   job->scan_buf[ahead_pos + block_len]);
+                    ahead_pos++;
+                }
+            } else {
+                weaksum_rotate_n(&job->weak_sum,
+                                 job->scan_buf + job->scoop_pos,
+                                 job->scan_buf + job->scoop_pos + block_len,
+                                 skip);
+                ahead_valid = 0;
+            }
+            job->miss_run += skip;
+            result=rs_appendmiss(job,skip);
             if (rs_roll_paranoia) {
-                RollsumInit(&test);
-                RollsumUpdate(&test, job->scoop_next + job->scoop_pos, block_len);
-                if (RollsumDigest(&test) != RollsumDigest(&job->weak_sum)) {
+                weaksum_init(&test, job->weak_sum.kind);
+                weaksum_update(&test, job->scan_buf + job->scoop_pos, block_len);
+                if (weaksum_digest(&test) != weaksum_digest(&job->weak_sum)) {
                     rs_fatal("mismatch between rolled sum "FMT_WEAKSUM" and check "FMT_WEAKSUM"",
-                             RollsumDigest(&job->weak_sum), RollsumDigest(&test));
+                             weaksum_digest(&job->weak_sum), weaksum_digest(&test));
                 }
 
             }
@@ -177,7 +267,14 @@ static rs_result rs_delta_s_scan(rs_job_t *job)
             job->statefn=rs_delta_s_flush;
             return RS_RUNNING;
         } else {
-            /* we are blocked waiting for more data */
+            /* spill the sub-block tail of a borrowed buffer into the
+             * scoop, so the input is drained before we block */
+            if (!job->scoop_avail && job->stream->avail_in)
+                rs_scoop_input(job, job->stream->avail_in);
+            /* we are blocked until a whole scan window past scoop_pos
+             * is in view; tell the caller how much that takes */
+            job->input_needed =
+                job->scoop_pos + scan_len + 1 - job->scoop_avail;
             return RS_BLOCKED;
         }
     }
@@ -185,6 +282,61 @@ static rs_result rs_delta_s_scan(rs_job_t *job)
 }
 
 
+/** The generic scan statefn, taking the block length from the
+ * signature at runtime. */
+static rs_result rs_delta_s_scan(rs_job_t *job)
+{
+    return rs_delta_scan(job, job->signature->block_len);
+}
+
+/** Instantiate a scan statefn with LEN folded in as a constant, in the
+ * same spirit as the macro-parameterized instantiation hashtable.h uses
+ * for rs_block_sig/rs_block_match. */
+#define RS_DELTA_SCAN_INST(len) \
+    static rs_result rs_delta_s_scan_##len(rs_job_t *job) \
+    { \
+        return rs_delta_scan(job, len); \
+    }
+
+RS_DELTA_SCAN_INST(512)
+RS_DELTA_SCAN_INST(1024)
+RS_DELTA_SCAN_INST(2048)
+RS_DELTA_SCAN_INST(4096)
+RS_DELTA_SCAN_INST(8192)
+
+/** Pick the scan statefn for the job's signature block length: the
+ * common power-of-two sizes get their specialized loop, everything else
+ * the generic one. */
+static rs_result (*rs_delta_scan_statefn(rs_job_t *job))(rs_job_t *)
+{
+    switch (job->signature->block_len) {
+    case 512:
+        return rs_delta_s_scan_512;
+    case 1024:
+        return rs_delta_s_scan_1024;
+    case 2048:
+        return rs_delta_s_scan_2048;
+    case 4096:
+        return rs_delta_s_scan_4096;
+    case 8192:
+        return rs_delta_s_scan_8192;
+    default:
+        return rs_delta_s_scan;
+    }
+}
+
+/** Is this job's statefn the scan loop, in any of its instantiations? */
+static int rs_delta_statefn_is_scan(rs_job_t *job)
+{
+    return job->statefn == rs_delta_s_scan
+        || job->statefn == rs_delta_s_scan_512
+        || job->statefn == rs_delta_s_scan_1024
+        || job->statefn == rs_delta_s_scan_2048
+        || job->statefn == rs_delta_s_scan_4096
+        || job->statefn == rs_delta_s_scan_8192;
+}
+
+
 static rs_result rs_delta_s_flush(rs_job_t *job)
 {
     rs_long_t      match_pos;
@@ -192,21 +344,47 @@ static rs_result rs_delta_s_flush(rs_job_t *job)
     rs_result      result;
 
     rs_job_check(job);
-    /* read the input into the scoop */
+    /* read or borrow the input for scanning */
     rs_getinput(job);
     /* output any pending output */
     result=rs_tube_catchup(job);
     /* while output is not blocked and there is any remaining data */
-    while ((result==RS_DONE) && (job->scoop_pos < job->scoop_avail)) {
+    while ((result==RS_DONE) && (job->scoop_pos < job->scan_avail)) {
         /* check if this block matches */
-        if (rs_findmatch(job,&match_pos,&match_len)) {
-            /* append the match and reset the weak_sum */
+        if (rs_findmatch(job,&match_pos,&match_len,
+                         job->signature->block_len)) {
+            /* extend the match into the surrounding bytes if we can */
+            rs_extendmatch(job,&match_pos,&match_len);
+            /* append the match and reset the weak sums */
             result=rs_appendmatch(job,match_pos,match_len);
-            RollsumInit(&job->weak_sum);
+            weaksum_reset(&job->weak_sum);
+            if (job->signature_coarse)
+                weaksum_reset(&job->weak_sum_coarse);
         } else {
-            /* rollout from weak_sum and append the miss byte */
-            RollsumRollout(&job->weak_sum,job->scoop_next[job->scoop_pos]);
-            rs_trace("block reduced to "FMT_SIZE"", job->weak_sum.count);
+            /* rotate the weak_sum while a whole block remains (the
+             * flush can see more than one in hierarchical mode), else
+             * rollout and shrink towards the end */
+            if (job->scoop_pos + (size_t)job->signature->block_len
+                < job->scan_avail)
+                weaksum_rotate(&job->weak_sum, job->scan_buf[job->scoop_pos],
+                               job->scan_buf[job->scoop_pos
+                                             + job->signature->block_len]);
+            else {
+                weaksum_rollout(&job->weak_sum,job->scan_buf[job->scoop_pos]);
+                rs_trace_hot(job, "block reduced to "FMT_SIZE"", weaksum_count(&job->weak_sum));
+            }
+            if (job->signature_coarse
+                && weaksum_count(&job->weak_sum_coarse)) {
+                /* Keep the coarse sum rolling while a whole coarse
+                 * block remains, else drop it. */
+                size_t clen = job->signature_coarse->block_len;
+                if (job->scoop_pos + clen < job->scan_avail)
+                    weaksum_rotate(&job->weak_sum_coarse,
+                                   job->scan_buf[job->scoop_pos],
+                                   job->scan_buf[job->scoop_pos + clen]);
+                else
+                    weaksum_reset(&job->weak_sum_coarse);
+            }
             result=rs_appendmiss(job,1);
         }
     }
@@ -229,12 +407,27 @@ static rs_result rs_delta_s_end(rs_job_t *job)
 }
 
 
+/**
+ * Set up scan_buf/scan_avail for this iteration.
+ *
+ * If the scoop is empty, the scan borrows the caller's input buffer
+ * and works on it in place; nothing is copied.  Only when the scoop
+ * already holds a partial block does the input get copied in after it,
+ * to give the scan a contiguous view. */
 static inline void rs_getinput(rs_job_t *job) {
     size_t len;
 
-    len=rs_scoop_total_avail(job);
-    if (job->scoop_avail < len) {
-        rs_scoop_input(job,len);
+    if (!job->scoop_avail && job->stream->avail_in) {
+        /* the scoop is empty; scan the input buffer in place */
+        job->scan_buf=(rs_byte_t *)job->stream->next_in;
+        job->scan_avail=job->stream->avail_in;
+    } else {
+        len=rs_scoop_total_avail(job);
+        if (job->scoop_avail < len) {
+            rs_scoop_input(job,len);
+        }
+        job->scan_buf=job->scoop_next;
+        job->scan_avail=job->scoop_avail;
     }
 }
 
@@ -244,36 +437,149 @@ static inline void rs_getinput(rs_job_t *job) {
  * Note that this will calculate weak_sum if required. It will also
  * determine the match_len.
  *
- * Note that this routine could be modified to do xdelta style matches that
- * would extend matches past block boundaries by matching backwards and
- * forwards beyond the block boundaries. Extending backwards would require
- * decrementing scoop_pos as appropriate.
+ * Block-boundary matches found here are grown into xdelta style matches
+ * by rs_extendmatch() when the job has a basis copy_cb.
  */
-static inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos, size_t *match_len) {
-    const size_t block_len = job->signature->block_len;
+/** Probe a signature table for a match, adding the elapsed time to
+ * the job's find_secs when timing stats are enabled.  For 64-bit
+ * weaksums the rolling digest already carries the check half, so the
+ * lookup needs no calculation over the block. */
+static inline rs_long_t rs_findmatch_probe(rs_job_t *job, rs_signature_t *sig,
+                                           weaksum_t *sum,
+                                           void const *buf, size_t len)
+{
+    rs_long_t match_pos;
+    double t0;
 
+    if (job->stats_level < RS_STATS_TIMING) {
+        if (sum->kind == RS_RABINKARP64)
+            return rs_signature_find_match64(sig, weaksum_digest64(sum));
+        return rs_signature_find_match(sig, weaksum_digest(sum), buf, len);
+    }
+    t0 = rs_monotonic_seconds();
+    if (sum->kind == RS_RABINKARP64)
+        match_pos = rs_signature_find_match64(sig, weaksum_digest64(sum));
+    else
+        match_pos = rs_signature_find_match(sig, weaksum_digest(sum), buf, len);
+    job->stats.find_secs += rs_monotonic_seconds() - t0;
+    return match_pos;
+}
+
+
+static inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos, size_t *match_len,
+                               const size_t block_len) {
+    /* In hierarchical mode, try the small coarse-level table first
+     * whenever a whole coarse block is in view; a hit skips the fine
+     * table entirely for the length of the coarse block. */
+    if (job->signature_coarse) {
+        const size_t coarse_len = job->signature_coarse->block_len;
+
+        if (job->scan_avail - job->scoop_pos >= coarse_len) {
+            if (weaksum_count(&job->weak_sum_coarse) == 0)
+                weaksum_update(&job->weak_sum_coarse,
+                               job->scan_buf + job->scoop_pos, coarse_len);
+            *match_pos =
+                rs_findmatch_probe(job, job->signature_coarse,
+                                   &job->weak_sum_coarse,
+                                   job->scan_buf + job->scoop_pos,
+                                   coarse_len);
+            if (*match_pos != -1) {
+                *match_len = coarse_len;
+                return 1;
+            }
+        }
+    }
     /* calculate the weak_sum if we don't have one */
-    if (job->weak_sum.count == 0) {
+    if (weaksum_count(&job->weak_sum) == 0) {
         /* set match_len to min(block_len, scan_avail) */
-        *match_len=job->scoop_avail - job->scoop_pos;
+        *match_len=job->scan_avail - job->scoop_pos;
         if (*match_len > block_len) {
             *match_len = block_len;
         }
         /* Update the weak_sum */
-        RollsumUpdate(&job->weak_sum,job->scoop_next+job->scoop_pos,*match_len);
-        rs_trace("calculate weak sum from scratch length "FMT_SIZE"",job->weak_sum.count);
+        weaksum_update(&job->weak_sum,job->scan_buf+job->scoop_pos,*match_len);
+        rs_trace_hot(job, "calculate weak sum from scratch length "FMT_SIZE"", weaksum_count(&job->weak_sum));
     } else {
         /* set the match_len to the weak_sum count */
-        *match_len=job->weak_sum.count;
+        *match_len=weaksum_count(&job->weak_sum);
     }
-    *match_pos = rs_signature_find_match(job->signature,
-					 RollsumDigest(&job->weak_sum),
-					 job->scoop_next+job->scoop_pos,
-					 *match_len);
+    *match_pos = rs_findmatch_probe(job, job->signature,
+                                    &job->weak_sum,
+                                    job->scan_buf+job->scoop_pos,
+                                    *match_len);
     return *match_pos != -1;
 }
 
 
+/** Max bytes compared against the basis per extension step. */
+#define RS_EXTEND_CHUNK 1024
+
+/**
+ * Extend a match beyond the block boundaries by comparing bytes
+ * directly against the basis through the job's copy_cb.
+ *
+ * Backward extension eats into the pending miss bytes before scoop_pos,
+ * shrinking the literal that would otherwise be emitted; forward
+ * extension swallows bytes that would have had to realign first. A
+ * 1-byte insertion then costs a 1-byte literal instead of degrading
+ * every following block to literals until realignment.
+ *
+ * Does nothing on jobs without a copy_cb (plain rs_delta_begin()).
+ * Basis read failures just stop the extension; the block match itself
+ * already stands on the strong sum. */
+static inline void rs_extendmatch(rs_job_t *job, rs_long_t *match_pos, size_t *match_len)
+{
+    rs_byte_t chunk[RS_EXTEND_CHUNK];
+    const rs_byte_t *p;
+    void *buf;
+    size_t c, got, m;
+
+    if (!job->copy_cb)
+        return;
+    /* extend backwards into the pending miss bytes, but not into a
+       pending match's still unprocessed data before them */
+    while (job->scoop_pos > job->match_pend && *match_pos > 0) {
+        c = job->scoop_pos - job->match_pend;
+        if (c > RS_EXTEND_CHUNK)
+            c = RS_EXTEND_CHUNK;
+        if ((rs_long_t)c > *match_pos)
+            c = (size_t)*match_pos;
+        got = c;
+        buf = chunk;
+        if (job->copy_cb(job->copy_arg, *match_pos - c, &got, &buf) != RS_DONE
+            || got != c)
+            break;
+        p = (const rs_byte_t *)buf;
+        for (m = 0; m < c; m++)
+            if (p[c - 1 - m] != job->scan_buf[job->scoop_pos - 1 - m])
+                break;
+        job->scoop_pos -= m;
+        *match_pos -= m;
+        *match_len += m;
+        if (m < c)
+            break;
+    }
+    /* extend forwards into the unscanned bytes */
+    while (job->scoop_pos + *match_len < job->scan_avail) {
+        c = job->scan_avail - job->scoop_pos - *match_len;
+        if (c > RS_EXTEND_CHUNK)
+            c = RS_EXTEND_CHUNK;
+        got = c;
+        buf = chunk;
+        if (job->copy_cb(job->copy_arg, *match_pos + *match_len, &got, &buf)
+            != RS_DONE || got == 0)
+            break;
+        p = (const rs_byte_t *)buf;
+        for (m = 0; m < got; m++)
+            if (p[m] != job->scan_buf[job->scoop_pos + *match_len + m])
+                break;
+        *match_len += m;
+        if (m < got || got < c)
+            break;
+    }
+}
+
+
 /**
  * Append a match at match_pos of length match_len to the delta, extending
  * a previous match if possible, or flushing any previous miss/match. */
@@ -281,8 +587,11 @@ static inline rs_result rs_appendmatch(rs_job_t *job, rs_long_t match_pos, size_
 {
     rs_result result=RS_DONE;
 
-    /* if last was a match that can be extended, extend it */
-    if (job->basis_len && (job->basis_pos + job->basis_len) == match_pos) {
+    /* if last was a match that can be extended, extend it. This requires
+       that any miss bytes since it were eaten by backward extension in
+       rs_extendmatch(), or merging would drop them from the output. */
+    if (job->basis_len && (job->basis_pos + job->basis_len) == match_pos
+        && job->scoop_pos == job->match_pend) {
         job->basis_len+=match_len;
     } else {
         /* else appendflush the last value */
@@ -293,10 +602,12 @@ static inline rs_result rs_appendmatch(rs_job_t *job, rs_long_t match_pos, size_
     }
     /* increment scoop_pos to point at next unscanned data */
     job->scoop_pos+=match_len;
+    job->match_pend+=match_len;
     /* we can only process from the scoop if output is not blocked */
     if (result==RS_DONE) {
         /* process the match data off the scoop*/
         result=rs_processmatch(job);
+        job->match_pend=0;
     }
     return result;
 }
@@ -313,8 +624,10 @@ static inline rs_result rs_appendmiss(rs_job_t *job, size_t miss_len)
     const size_t   max_miss = 32768;  /* For 0.01% 3 command bytes overhead. */
     rs_result result=RS_DONE;
 
-    /* If last was a match, or max_miss misses, appendflush it. */
-    if (job->basis_len || (job->scoop_pos >= max_miss)) {
+    /* If we have max_miss misses, appendflush them. A pending match is
+       kept unflushed so a later match can still merge with it if
+       backward extension eats all the misses in between. */
+    if (job->scoop_pos >= max_miss) {
         result=rs_appendflush(job);
     }
     /* increment scoop_pos */
@@ -323,25 +636,89 @@ static inline rs_result rs_appendmiss(rs_job_t *job, size_t miss_len)
 }
 
 
+/** Literals shorter than this go out raw; a codec call plus the extra
+ * command byte isn't worth it for a handful of bytes. */
+#define RS_ZLIT_MIN 64
+
+/**
+ * Try to compress the pending miss bytes (scan_buf[0..scoop_pos)) into
+ * the job's codec scratch buffer.  Returns true only if the codec
+ * succeeded and actually made the data smaller; anything else falls
+ * back to a raw literal.
+ */
+static inline int rs_compressmiss(rs_job_t *job, size_t *comp_len)
+{
+    const size_t miss_len = job->scoop_pos;
+
+    if (job->z_alloc < miss_len) {
+        free(job->z_buf);
+        job->z_buf = rs_alloc(miss_len, "literal codec buffer");
+        job->z_alloc = miss_len;
+    }
+    /* a compressed literal only pays off if it shrinks */
+    *comp_len = miss_len - 1;
+    if (job->compress_cb(job->codec_arg, job->scan_buf, miss_len, job->z_buf,
+                         comp_len) != RS_DONE)
+        return 0;
+    return *comp_len > 0 && *comp_len < miss_len;
+}
+
+/**
+ * Emit the compressed payload for a LITERAL_Z and consume the raw miss
+ * bytes.  The payload is drained from the job-owned scratch buffer by
+ * the tube, so unlike rs_processmiss() the input can be advanced over
+ * immediately.
+ */
+static inline rs_result rs_processmiss_z(rs_job_t *job, size_t comp_len)
+{
+    const size_t miss_len = job->scoop_pos;
+
+    rs_tube_write_blob(job, job->z_buf, comp_len);
+    rs_scoop_advance(job, miss_len);
+    job->scan_buf += miss_len;
+    job->scan_avail -= miss_len;
+    job->scoop_pos = 0;
+    return rs_tube_catchup(job);
+}
+
 /**
- * Flush any accumulating hit or miss, appending it to the delta.
+ * Flush any accumulating hit and/or miss, appending them to the delta.
+ *
+ * A pending match always precedes any pending miss bytes in the input,
+ * so the copy is emitted before the literal.
  */
 static inline rs_result rs_appendflush(rs_job_t *job)
 {
-    /* if last is a match, emit it and reset last by resetting basis_len */
+    /* if there is a pending match, emit it and reset basis_len. */
     if (job->basis_len) {
-        rs_trace("matched "FMT_LONG" bytes at "FMT_LONG"!", job->basis_len, job->basis_pos);
+        rs_trace_hot(job, "matched "FMT_LONG" bytes at "FMT_LONG"!", job->basis_len, job->basis_pos);
         rs_emit_copy_cmd(job, job->basis_pos, job->basis_len);
         job->basis_len=0;
-        return rs_processmatch(job);
-    /* else if last is a miss, emit and process it*/
-    } else if (job->scoop_pos) {
-        rs_trace("got "FMT_SIZE" bytes of literal data", job->scoop_pos);
+    }
+    /* if the pending match's data wasn't processed when it was appended
+       (the tube was blocked at the time), consume it off the scoop now */
+    if (job->match_pend) {
+        rs_scoop_advance(job, job->match_pend);
+        job->scan_buf+=job->match_pend;
+        job->scan_avail-=job->match_pend;
+        job->scoop_pos-=job->match_pend;
+        job->match_pend=0;
+    }
+    /* if there are pending miss bytes, emit and process them */
+    if (job->scoop_pos) {
+        size_t comp_len;
+
+        rs_trace_hot(job, "got "FMT_SIZE" bytes of literal data", job->scoop_pos);
+        if (job->compress_cb && job->scoop_pos >= RS_ZLIT_MIN
+            && rs_compressmiss(job, &comp_len)) {
+            rs_emit_literal_z_cmd(job, comp_len, job->scoop_pos);
+            return rs_processmiss_z(job, comp_len);
+        }
         rs_emit_literal_cmd(job, job->scoop_pos);
         return rs_processmiss(job);
     }
-    /* otherwise, nothing to flush so we are done */
-    return RS_DONE;
+    /* output anything the emits queued up */
+    return rs_tube_catchup(job);
 }
 
 
@@ -351,14 +728,16 @@ static inline rs_result rs_appendflush(rs_job_t *job)
  * or RS_BLOCKED if it gets blocked. After it completes scoop_pos is reset
  * to still point at the next unscanned data.
  *
- * This function currently just removes data from the scoop and adjusts
- * scoop_pos appropriately. In the future this could be used for something
- * like context compressing of miss data. Note that it also calls
- * rs_tube_catchup to output any pending output. */
+ * This function currently just advances over the data in the scoop or
+ * the borrowed input buffer and adjusts scoop_pos appropriately. In the
+ * future this could be used for something like context compressing of
+ * miss data. Note that it also calls rs_tube_catchup to output any
+ * pending output. */
 static inline rs_result rs_processmatch(rs_job_t *job)
 {
-    job->scoop_avail-=job->scoop_pos;
-    job->scoop_next+=job->scoop_pos;
+    rs_scoop_advance(job, job->scoop_pos);
+    job->scan_buf+=job->scoop_pos;
+    job->scan_avail-=job->scoop_pos;
     job->scoop_pos=0;
     return rs_tube_catchup(job);
 }
@@ -379,9 +758,20 @@ static inline rs_result rs_processmatch(rs_job_t *job)
  * it. */
 static inline rs_result rs_processmiss(rs_job_t *job)
 {
-    rs_tube_copy(job, job->scoop_pos);
+    const size_t miss_len=job->scoop_pos;
+    rs_result result;
+
+    rs_tube_copy(job, miss_len);
     job->scoop_pos=0;
-    return rs_tube_catchup(job);
+    result=rs_tube_catchup(job);
+    if (result==RS_DONE) {
+        /* the copy consumed the miss data from under scan_buf */
+        job->scan_buf+=miss_len;
+        job->scan_avail-=miss_len;
+    }
+    /* on a partial copy the scan loop exits and rs_getinput() will
+     * recompute scan_buf once the tube has caught up */
+    return result;
 }
 
 
@@ -395,7 +785,7 @@ static rs_result rs_delta_s_slack(rs_job_t *job)
     size_t avail = stream->avail_in;
 
     if (avail) {
-        rs_trace("emit slack delta for "FMT_SIZE" available bytes", avail);
+        rs_trace_hot(job, "emit slack delta for "FMT_SIZE" available bytes", avail);
         rs_emit_literal_cmd(job, avail);
         rs_tube_copy(job, avail);
         return RS_RUNNING;
@@ -414,9 +804,9 @@ static rs_result rs_delta_s_header(rs_job_t *job)
 {
     rs_emit_delta_header(job);
     if (job->signature) {
-        job->statefn = rs_delta_s_scan;
+        job->statefn = rs_delta_scan_statefn(job);
     } else {
-        rs_trace("no signature provided for delta, using slack deltas");
+        rs_job_trace(job, "no signature provided for delta, using slack deltas");
         job->statefn = rs_delta_s_slack;
     }
     return RS_RUNNING;
@@ -434,7 +824,221 @@ rs_job_t *rs_delta_begin(rs_signature_t *sig)
         /* Caller must have called rs_build_hash_table() by now. */
         assert(sig->hashtable);
         job->signature = sig;
-        RollsumInit(&job->weak_sum);
+        weaksum_init(&job->weak_sum, rs_signature_weaksum_kind(sig));
+    }
+    return job;
+}
+
+
+rs_job_t *rs_delta_begin_v2(rs_signature_t *sig)
+{
+    rs_job_t *job = rs_delta_begin(sig);
+
+    job->delta_v2 = 1;
+    return job;
+}
+
+
+rs_job_t *rs_delta_begin_basis(rs_signature_t *sig, rs_copy_cb *copy_cb,
+                               void *copy_arg)
+{
+    rs_job_t *job = rs_delta_begin(sig);
+
+    job->copy_cb = copy_cb;
+    job->copy_arg = copy_arg;
+    return job;
+}
+
+
+rs_job_t *rs_delta_begin_hier(rs_signature_t *coarse_sig,
+                              rs_signature_t *fine_sig)
+{
+    rs_job_t *job = rs_delta_begin(fine_sig);
+
+    if (coarse_sig && coarse_sig->count > 0) {
+        rs_signature_check(coarse_sig);
+        /* Caller must have called rs_build_hash_table() by now. */
+        assert(coarse_sig->hashtable);
+        assert(fine_sig && coarse_sig->block_len > fine_sig->block_len);
+        job->signature_coarse = coarse_sig;
+        weaksum_init(&job->weak_sum_coarse,
+                     rs_signature_weaksum_kind(coarse_sig));
+    }
+    return job;
+}
+
+
+/** Magic marking a checkpoint image from rs_job_checkpoint(). */
+#define RS_CKPT_MAGIC 0x72734a31    /* "rsJ1" */
+
+/** The checkpoint image header, followed by the scoop contents.
+ *
+ * Like the v2 signature container this is a host-endian same-machine
+ * restart artifact, not a portable interchange format; the magic and
+ * the recorded rs_stats_t size reject images from a different build. */
+typedef struct rs_ckpt_header {
+    int magic;                  /**< RS_CKPT_MAGIC. */
+    int stats_size;             /**< sizeof(rs_stats_t) layout guard. */
+    int delta_v2;               /**< Emitting the v2 encoding? */
+    int weak_kind;              /**< The signature's weaksum_kind_t. */
+    int block_len;              /**< The signature's block length. */
+    rs_long_t basis_pos;        /**< Pending match start. */
+    rs_long_t basis_len;        /**< Pending match length. */
+    rs_long_t copy_ref;         /**< v2 COPY encoding reference. */
+    rs_long_t weak_count;       /**< Bytes in the rolling window. */
+    uint64_t weak_a;            /**< Rollsum s1 / rabinkarp hash. */
+    uint64_t weak_b;            /**< Rollsum s2 / rabinkarp mult. */
+    rs_long_t scoop_avail;      /**< Unprocessed input bytes following. */
+    rs_long_t scoop_pos;        /**< Scan position within them. */
+    rs_long_t match_pend;       /**< Pending match bytes in the scoop. */
+    rs_long_t miss_run;         /**< Adaptive probe-skipping miss run. */
+    rs_stats_t stats;           /**< Encoding statistics so far. */
+} rs_ckpt_header_t;
+
+/** Is this delta job at a point rs_job_checkpoint() can serialize? */
+static int rs_delta_can_checkpoint(rs_job_t *job)
+{
+    /* Only the plain streaming scan state is resumable: header not yet
+     * written, flushing, slack, hierarchical, parallel, fused and
+     * compressing jobs all carry state the image doesn't cover. */
+    return rs_delta_statefn_is_scan(job) && job->signature
+        && !job->signature_coarse && !job->pdelta && !job->sigdelta
+        && !job->compress_cb && !job->copy_cb;
+}
+
+size_t rs_job_checkpoint_size(rs_job_t *job)
+{
+    rs_job_check(job);
+    if (!rs_delta_can_checkpoint(job))
+        return 0;
+    return sizeof(rs_ckpt_header_t) + job->scoop_avail;
+}
+
+rs_result rs_job_checkpoint(rs_job_t *job, void *image, size_t len)
+{
+    rs_ckpt_header_t h;
+
+    rs_job_check(job);
+    if (!rs_delta_can_checkpoint(job)) {
+        rs_error("job is not a delta job at a resumable point");
+        return RS_PARAM_ERROR;
+    }
+    if (job->write_len || job->copy_len || job->blob_len
+        || job->stream->avail_in) {
+        /* The image only covers the scoop; pending output or unread
+         * input would be lost.  Iterate with output space until
+         * blocked on input first. */
+        rs_error("checkpoint requires drained output and consumed input");
+        return RS_BLOCKED;
+    }
+    if (len < sizeof(h) + job->scoop_avail) {
+        rs_error("checkpoint image " FMT_SIZE " bytes is too small", len);
+        return RS_PARAM_ERROR;
+    }
+    rs_bzero(&h, sizeof(h));
+    h.magic = RS_CKPT_MAGIC;
+    h.stats_size = (int)sizeof(rs_stats_t);
+    h.delta_v2 = job->delta_v2;
+    h.weak_kind = (int)job->weak_sum.kind;
+    h.block_len = job->signature->block_len;
+    h.basis_pos = job->basis_pos;
+    h.basis_len = job->basis_len;
+    h.copy_ref = job->copy_ref;
+    h.weak_count = (rs_long_t)weaksum_count(&job->weak_sum);
+    if (job->weak_sum.kind == RS_ROLLSUM) {
+        h.weak_a = job->weak_sum.sum.rs.s1;
+        h.weak_b = job->weak_sum.sum.rs.s2;
+    } else if (job->weak_sum.kind == RS_RABINKARP64) {
+        h.weak_a = job->weak_sum.sum.rk64.hash;
+        h.weak_b = job->weak_sum.sum.rk64.mult;
+    } else {
+        h.weak_a = job->weak_sum.sum.rk.hash;
+        h.weak_b = job->weak_sum.sum.rk.mult;
+    }
+    h.scoop_avail = (rs_long_t)job->scoop_avail;
+    h.scoop_pos = (rs_long_t)job->scoop_pos;
+    h.match_pend = (rs_long_t)job->match_pend;
+    h.miss_run = (rs_long_t)job->miss_run;
+    h.stats = job->stats;
+    memcpy(image, &h, sizeof(h));
+    if (job->scoop_avail)
+        memcpy((char *)image + sizeof(h), job->scoop_next, job->scoop_avail);
+    rs_job_trace(job, "checkpointed delta job: "FMT_SIZE" bytes, "
+                 FMT_LONG" input bytes done", sizeof(h) + job->scoop_avail,
+                 job->stats.in_bytes);
+    return RS_DONE;
+}
+
+rs_job_t *rs_job_resume(rs_signature_t *sig, const void *image, size_t len)
+{
+    const rs_ckpt_header_t *h = (const rs_ckpt_header_t *)image;
+    rs_job_t *job;
+
+    if (len < sizeof(*h) || h->magic != RS_CKPT_MAGIC
+        || h->stats_size != (int)sizeof(rs_stats_t)
+        || h->scoop_avail < 0
+        || (size_t)h->scoop_avail != len - sizeof(*h)
+        || h->scoop_pos < 0 || h->scoop_pos > h->scoop_avail
+        || h->match_pend < 0 || h->match_pend > h->scoop_pos
+        || h->miss_run < 0) {
+        rs_error("not a valid delta checkpoint image");
+        return NULL;
+    }
+    if (!sig || sig->count <= 0
+        || sig->block_len != h->block_len
+        || (int)rs_signature_weaksum_kind(sig) != h->weak_kind) {
+        rs_error("signature does not match the checkpointed delta job");
+        return NULL;
+    }
+    rs_signature_check(sig);
+    /* Caller must have called rs_build_hash_table() by now. */
+    assert(sig->hashtable);
+    job = rs_delta_begin(sig);
+    /* The delta header went out before the checkpoint; resume straight
+     * into the scan. */
+    job->statefn = rs_delta_scan_statefn(job);
+    job->delta_v2 = h->delta_v2;
+    job->basis_pos = h->basis_pos;
+    job->basis_len = h->basis_len;
+    job->copy_ref = h->copy_ref;
+    if (job->weak_sum.kind == RS_ROLLSUM) {
+        job->weak_sum.sum.rs.count = (size_t)h->weak_count;
+        job->weak_sum.sum.rs.s1 = (uint_fast16_t)h->weak_a;
+        job->weak_sum.sum.rs.s2 = (uint_fast16_t)h->weak_b;
+    } else if (job->weak_sum.kind == RS_RABINKARP64) {
+        /* The 64-bit hash and the matching mult = MULT^count both have
+         * to come back, or every rotate after resume computes a wrong
+         * digest and the scan silently never matches again. */
+        job->weak_sum.sum.rk64.count = (size_t)h->weak_count;
+        job->weak_sum.sum.rk64.hash = h->weak_a;
+        job->weak_sum.sum.rk64.mult = h->weak_b;
+    } else {
+        job->weak_sum.sum.rk.count = (size_t)h->weak_count;
+        job->weak_sum.sum.rk.hash = (uint32_t)h->weak_a;
+        job->weak_sum.sum.rk.mult = (uint32_t)h->weak_b;
+    }
+    job->stats = h->stats;
+    if (h->scoop_avail) {
+        /* A job recycled from a pool may come with a scoop already
+         * allocated; grow it only if needed. */
+        if (job->scoop_alloc < (size_t)h->scoop_avail) {
+            size_t newsize;
+            for (newsize = 64; newsize < 2 * (size_t)h->scoop_avail;
+                 newsize <<= 1) ;
+            if (job->scoop_buf)
+                free(job->scoop_buf);
+            job->scoop_buf = rs_alloc(newsize, "scoop buffer");
+            job->scoop_alloc = newsize;
+        }
+        job->scoop_next = job->scoop_buf;
+        job->scoop_avail = (size_t)h->scoop_avail;
+        memcpy(job->scoop_buf, (const char *)image + sizeof(*h),
+               job->scoop_avail);
     }
+    job->scoop_pos = (size_t)h->scoop_pos;
+    job->match_pend = (size_t)h->match_pend;
+    job->miss_run = (size_t)h->miss_run;
+    rs_job_trace(job, "resumed delta job from "FMT_LONG" input bytes",
+                 job->stats.in_bytes);
     return job;
 }
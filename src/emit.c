@@ -52,8 +52,13 @@
 void
 rs_emit_delta_header(rs_job_t *job)
 {
-    rs_trace("emit DELTA magic");
-    rs_squirt_n4(job, RS_DELTA_MAGIC);
+    if (job->delta_v2) {
+        rs_trace("emit DELTA2 magic");
+        rs_squirt_n4(job, RS_DELTA2_MAGIC);
+    } else {
+        rs_trace("emit DELTA magic");
+        rs_squirt_n4(job, RS_DELTA_MAGIC);
+    }
 }
 
 
@@ -63,7 +68,20 @@ void
 rs_emit_literal_cmd(rs_job_t *job, int len)
 {
     int cmd;
-    int param_len = rs_int_len(len);
+    int param_len;
+
+    if (job->delta_v2) {
+        rs_trace("emit v2 LITERAL(len=%d)", len);
+        rs_squirt_byte(job, RS_OP2_LITERAL);
+        rs_squirt_varint(job, len);
+
+        job->stats.lit_cmds++;
+        job->stats.lit_bytes += len;
+        job->stats.lit_cmdbytes += 1 + rs_varint_len(len);
+        return;
+    }
+
+    param_len = rs_int_len(len);
 
     if (param_len == 1)
         cmd = RS_OP_LITERAL_N1;
@@ -84,6 +102,67 @@ rs_emit_literal_cmd(rs_job_t *job, int len)
 }
 
 
+/** Write a LITERAL_Z command: a literal whose payload was compressed
+ * from raw_len down to comp_len bytes by the job's codec.  The payload
+ * itself is queued separately (see rs_tube_write_blob()). */
+void
+rs_emit_literal_z_cmd(rs_job_t *job, size_t comp_len, size_t raw_len)
+{
+    int cmd;
+    int comp_bytes, raw_bytes;
+
+    if (job->delta_v2) {
+        rs_trace("emit v2 LITERAL_Z(comp="FMT_SIZE", raw="FMT_SIZE")",
+                 comp_len, raw_len);
+        rs_squirt_byte(job, RS_OP2_LITERAL_Z);
+        rs_squirt_varint(job, comp_len);
+        rs_squirt_varint(job, raw_len);
+
+        job->stats.lit_cmds++;
+        job->stats.lit_bytes += raw_len;
+        job->stats.lit_cmdbytes +=
+            1 + rs_varint_len(comp_len) + rs_varint_len(raw_len);
+        return;
+    }
+
+    comp_bytes = rs_int_len(comp_len);
+    raw_bytes = rs_int_len(raw_len);
+
+    /* Commands ascend (1,1), (1,2), ... (8,8) like COPY. */
+    if (comp_bytes == 8)
+        cmd = RS_OP_LITERAL_Z_N8_N1;
+    else if (comp_bytes == 4)
+        cmd = RS_OP_LITERAL_Z_N4_N1;
+    else if (comp_bytes == 2)
+        cmd = RS_OP_LITERAL_Z_N2_N1;
+    else {
+        assert(comp_bytes == 1);
+        cmd = RS_OP_LITERAL_Z_N1_N1;
+    }
+
+    if (raw_bytes == 1)
+        ;
+    else if (raw_bytes == 2)
+        cmd += 1;
+    else if (raw_bytes == 4)
+        cmd += 2;
+    else {
+        assert(raw_bytes == 8);
+        cmd += 3;
+    }
+
+    rs_trace("emit LITERAL_Z_N%d_N%d(comp="FMT_SIZE", raw="FMT_SIZE"), cmd_byte=%#04x",
+             comp_bytes, raw_bytes, comp_len, raw_len, cmd);
+    rs_squirt_byte(job, cmd);
+    rs_squirt_netint(job, comp_len, comp_bytes);
+    rs_squirt_netint(job, raw_len, raw_bytes);
+
+    job->stats.lit_cmds++;
+    job->stats.lit_bytes += raw_len;
+    job->stats.lit_cmdbytes += 1 + comp_bytes + raw_bytes;
+}
+
+
 /** Write a COPY command for given offset and length.
  *
  * There is a choice of variable-length encodings, depending on the
@@ -96,6 +175,24 @@ rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
     const int where_bytes = rs_int_len(where);
     const int len_bytes   = rs_int_len(len);
 
+    if (job->delta_v2) {
+        /* Encode the offset relative to the end of the previous copy:
+         * near-sequential copies are the common case and zigzag to a
+         * byte or two. */
+        const rs_long_t diff = rs_zigzag(where - job->copy_ref);
+
+        rs_trace("emit v2 COPY(where="FMT_LONG", len="FMT_LONG")", where, len);
+        rs_squirt_byte(job, RS_OP2_COPY);
+        rs_squirt_varint(job, diff);
+        rs_squirt_varint(job, len);
+        job->copy_ref = where + len;
+
+        stats->copy_cmds++;
+        stats->copy_bytes += len;
+        stats->copy_cmdbytes += 1 + rs_varint_len(diff) + rs_varint_len(len);
+        return;
+    }
+
     /* Commands ascend (1,1), (1,2), ... (8, 8) */
     if (where_bytes == 8)
         cmd = RS_OP_COPY_N8_N1;
@@ -137,7 +234,7 @@ rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
 void
 rs_emit_end_cmd(rs_job_t *job)
 {
-    int cmd = RS_OP_END;
+    int cmd = job->delta_v2 ? RS_OP2_END : RS_OP_END;
 
     rs_trace("emit END, cmd_byte=%#04x", cmd);
     rs_squirt_byte(job, cmd);
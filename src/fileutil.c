@@ -20,6 +20,11 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+/* For copy_file_range(); must precede the first system include. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include "config.h"
 
 #include <assert.h>
@@ -37,12 +42,16 @@
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include <string.h>
 #include <errno.h>
 
 #include "librsync.h"
 #include "fileutil.h"
 #include "trace.h"
+#include "util.h"
 
 
 /* Use fseeko64, _fseeki64, or fseeko for long files if they exist. */
@@ -135,6 +144,47 @@ void rs_get_filesize(FILE *f, rs_long_t *size)
     }
 }
 
+#ifdef HAVE_SYS_MMAN_H
+
+void *rs_file_map(FILE *f, rs_long_t *len)
+{
+    struct stat st;
+    void *map;
+    int fd = fileno(f);
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || st.st_size == 0 || (rs_long_t)(size_t)st.st_size != (rs_long_t)st.st_size)
+        return NULL;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        rs_trace("mmap of fd%d failed: %s", fd, strerror(errno));
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+    *len = st.st_size;
+    return map;
+}
+
+void rs_file_unmap(void *map, rs_long_t len)
+{
+    munmap(map, len);
+}
+
+#else /* !HAVE_SYS_MMAN_H */
+
+void *rs_file_map(FILE *f, rs_long_t *len)
+{
+    return NULL;
+}
+
+void rs_file_unmap(void *map, rs_long_t len)
+{
+}
+
+#endif /* !HAVE_SYS_MMAN_H */
+
 rs_result rs_file_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
 {
     int        got;
@@ -157,3 +207,221 @@ rs_result rs_file_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
         return RS_DONE;
     }
 }
+
+/** Size of the rs_pread_copy_cb() readahead window. */
+#define RS_PREAD_WINDOW_SIZE (256 * 1024)
+
+#if defined(HAVE_PREAD) && defined(HAVE_FILENO)
+
+struct rs_pread_copy {
+    int fd;                     /* basis file descriptor */
+    rs_byte_t *window;          /* readahead window */
+    rs_long_t window_pos;       /* basis offset of window[0] */
+    size_t window_len;          /* valid bytes in window */
+};
+
+rs_pread_copy_t *rs_pread_copy_new(FILE *basis_file)
+{
+    rs_pread_copy_t *pc;
+    int fd = fileno(basis_file);
+
+    if (fd < 0)
+        return NULL;
+    pc = rs_alloc_struct(rs_pread_copy_t);
+    pc->fd = fd;
+    pc->window = rs_alloc(RS_PREAD_WINDOW_SIZE, "pread copy window");
+    pc->window_pos = 0;
+    pc->window_len = 0;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, RS_PREAD_WINDOW_SIZE, POSIX_FADV_WILLNEED);
+#endif
+    return pc;
+}
+
+rs_result rs_pread_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+{
+    rs_pread_copy_t *pc = (rs_pread_copy_t *)arg;
+    size_t avail;
+
+    if (pos < pc->window_pos
+        || pos >= pc->window_pos + (rs_long_t)pc->window_len) {
+        /* The request misses the window: read a whole window at pos.
+           pread() leaves the file position alone, so we never disturb
+           other users of the same descriptor. */
+        ssize_t got = pread(pc->fd, pc->window, RS_PREAD_WINDOW_SIZE, pos);
+
+        if (got < 0) {
+            rs_error("read error: %s", strerror(errno));
+            return RS_IO_ERROR;
+        } else if (got == 0) {
+            rs_error("unexpected eof on fd%d", pc->fd);
+            return RS_INPUT_ENDED;
+        }
+        pc->window_pos = pos;
+        pc->window_len = got;
+#ifdef POSIX_FADV_WILLNEED
+        /* COPY runs are mostly ascending, so tell the kernel to start
+           fetching the extent we'll probably want next. */
+        posix_fadvise(pc->fd, pos + got, RS_PREAD_WINDOW_SIZE,
+                      POSIX_FADV_WILLNEED);
+#endif
+    }
+    avail = pc->window_len - (size_t)(pos - pc->window_pos);
+    if (*len > avail)
+        *len = avail;
+    *buf = pc->window + (pos - pc->window_pos);
+    return RS_DONE;
+}
+
+void rs_pread_copy_free(rs_pread_copy_t *pc)
+{
+    free(pc->window);
+    rs_bzero(pc, sizeof *pc);
+    free(pc);
+}
+
+#else /* !HAVE_PREAD || !HAVE_FILENO */
+
+rs_pread_copy_t *rs_pread_copy_new(FILE *basis_file)
+{
+    return NULL;
+}
+
+rs_result rs_pread_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+{
+    return RS_UNIMPLEMENTED;
+}
+
+void rs_pread_copy_free(rs_pread_copy_t *pc)
+{
+}
+
+#endif /* !HAVE_PREAD || !HAVE_FILENO */
+
+struct rs_mmap_copy {
+    rs_byte_t *map;             /* read-only mapping of the basis */
+    rs_long_t len;              /* mapped length */
+};
+
+rs_mmap_copy_t *rs_mmap_copy_new(FILE *basis_file)
+{
+    rs_mmap_copy_t *mc;
+    rs_long_t len = 0;
+    void *map;
+
+    /* rs_file_map() already rejects non-regular, empty and
+       address-space-exceeding files, and is a stub without mmap(). */
+    if (!(map = rs_file_map(basis_file, &len)))
+        return NULL;
+    mc = rs_alloc_struct(rs_mmap_copy_t);
+    mc->map = map;
+    mc->len = len;
+    return mc;
+}
+
+rs_result rs_mmap_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+{
+    rs_mmap_copy_t *mc = (rs_mmap_copy_t *)arg;
+
+    if (pos >= mc->len) {
+        rs_error("unexpected eof: basis read at "FMT_LONG" past mapped "
+                 FMT_LONG"", pos, mc->len);
+        return RS_INPUT_ENDED;
+    }
+    if ((rs_long_t)*len > mc->len - pos)
+        *len = (size_t)(mc->len - pos);
+    /* Lend the mapping itself; the job copies straight from the page
+       cache into its output. */
+    *buf = mc->map + pos;
+    return RS_DONE;
+}
+
+void rs_mmap_copy_free(rs_mmap_copy_t *mc)
+{
+    rs_file_unmap(mc->map, mc->len);
+    rs_bzero(mc, sizeof *mc);
+    free(mc);
+}
+
+#if defined(HAVE_COPY_FILE_RANGE) && defined(HAVE_FILENO)
+
+struct rs_file_copy_range {
+    int basis_fd;
+    int out_fd;
+    FILE *out_file;             /* flushed before each kernel copy */
+    int disabled;               /* declined once; stop trying */
+};
+
+rs_file_copy_range_t *rs_file_copy_range_new(FILE *basis_file, FILE *new_file)
+{
+    rs_file_copy_range_t *cr;
+    struct stat st;
+    int basis_fd = fileno(basis_file);
+    int out_fd = fileno(new_file);
+
+    /* Only plain files on both sides; pipes and sockets stream as
+     * before. */
+    if (basis_fd < 0 || out_fd < 0
+        || fstat(basis_fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || fstat(out_fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+    cr = rs_alloc_struct(rs_file_copy_range_t);
+    cr->basis_fd = basis_fd;
+    cr->out_fd = out_fd;
+    cr->out_file = new_file;
+    return cr;
+}
+
+rs_result rs_file_copy_range_cb(void *arg, rs_long_t pos, rs_long_t *len)
+{
+    rs_file_copy_range_t *cr = (rs_file_copy_range_t *)arg;
+    off_t off_in = (off_t)pos;
+    ssize_t got;
+
+    if (cr->disabled) {
+        *len = 0;
+        return RS_DONE;
+    }
+    /* Push out anything stdio is still holding, so the kernel copy
+     * lands at the right offset. */
+    if (fflush(cr->out_file)) {
+        rs_error("flush failed: %s", strerror(errno));
+        return RS_IO_ERROR;
+    }
+    got = copy_file_range(cr->basis_fd, &off_in, cr->out_fd, NULL,
+                          (size_t)*len, 0);
+    if (got <= 0) {
+        /* EXDEV, ENOSYS, or a filesystem that can't; stream from now
+         * on. */
+        rs_trace("copy_file_range declined: %s", strerror(errno));
+        cr->disabled = 1;
+        *len = 0;
+        return RS_DONE;
+    }
+    *len = (rs_long_t)got;
+    return RS_DONE;
+}
+
+void rs_file_copy_range_free(rs_file_copy_range_t *cr)
+{
+    rs_bzero(cr, sizeof *cr);
+    free(cr);
+}
+
+#else /* !HAVE_COPY_FILE_RANGE || !HAVE_FILENO */
+
+rs_file_copy_range_t *rs_file_copy_range_new(FILE *basis_file, FILE *new_file)
+{
+    return NULL;
+}
+
+rs_result rs_file_copy_range_cb(void *arg, rs_long_t pos, rs_long_t *len)
+{
+    return RS_UNIMPLEMENTED;
+}
+
+void rs_file_copy_range_free(rs_file_copy_range_t *cr)
+{
+}
+
+#endif /* !HAVE_COPY_FILE_RANGE || !HAVE_FILENO */
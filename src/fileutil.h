@@ -22,3 +22,15 @@
 FILE * rs_file_open(char const *filename, char const * mode, int force);
 int rs_file_close(FILE * file);
 void rs_get_filesize(FILE *f, rs_long_t *size);
+
+/** Map a whole regular file read-only into memory.
+ *
+ * \param *len is set to the mapped length on success.
+ *
+ * \return The mapping, or NULL if the file can't be mapped (not a
+ * regular file, empty, or no mmap support); callers should fall back
+ * to buffered IO in that case. */
+void *rs_file_map(FILE *f, rs_long_t *len);
+
+/** Release a mapping obtained from rs_file_map(). */
+void rs_file_unmap(void *map, rs_long_t len);
@@ -19,6 +19,7 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "hashtable.h"
@@ -30,29 +31,158 @@
    marker for an empty bucket to avoid checking for NULL in the element table.
    If we do get a hash value of zero, we -1 to wrap it around to 0xffff. */
 
-/* Use max 0.8 load factor to avoid bad open addressing performance. */
-#define HASHTABLE_LOADFACTOR_NUM 8
-#define HASHTABLE_LOADFACTOR_DEN 10
+/* Use max 80% load factor by default to avoid bad open addressing
+   performance. */
+#define HASHTABLE_LOADFACTOR_PCT 80
 
-hashtable_t *_hashtable_new(int size)
+/* The largest table size worth allocating; see _hashtable_alloc(). */
+#if SIZE_MAX > 0xffffffffUL
+#define HASHTABLE_MAX_SIZE ((size_t)1 << 32)
+#else
+#define HASHTABLE_MAX_SIZE ((size_t)1 << 31)
+#endif
+
+/* The bucket tables are allocated through replaceable hooks so callers
+   can back them with huge pages or NUMA-local memory; see
+   hashtable_set_allocator(). The hashtable_t struct itself is small and
+   stays on plain calloc()/free(). */
+static void *_default_zalloc(size_t size)
+{
+    return calloc(1, size);
+}
+
+static void _default_zfree(void *ptr, size_t size)
+{
+    free(ptr);
+}
+
+static void *(*_table_zalloc)(size_t size) = _default_zalloc;
+static void (*_table_zfree)(void *ptr, size_t size) = _default_zfree;
+
+void hashtable_set_allocator(void *(*zalloc)(size_t size),
+                             void (*zfree)(void *ptr, size_t size))
+{
+    _table_zalloc = zalloc ? zalloc : _default_zalloc;
+    _table_zfree = zfree ? zfree : _default_zfree;
+}
+
+/* Get the shift from a mixed hash to a bloom bit index: the bloom has
+   size * 8 bits and is indexed by the hash's top bits. */
+static int _hashtable_bshift(size_t size)
+{
+    int bits;
+
+    for (bits = 3; bits < 32 && ((size_t)1 << bits) < size * 8; bits++) ;
+    return 32 - bits;
+}
+
+static hashtable_t *_hashtable_alloc(size_t size, int loadfactor)
 {
     hashtable_t *t;
-    int size2;
+    size_t size2;
 
+    if (loadfactor <= 0)
+        loadfactor = HASHTABLE_LOADFACTOR_PCT;
+    else if (loadfactor > 100)
+        loadfactor = 100;
     /* Adjust requested size to account for max load factor. */
-    size = 1 + size * HASHTABLE_LOADFACTOR_DEN / HASHTABLE_LOADFACTOR_NUM;
-    /* Use next power of 2 larger than the requested size. */
-    for (size2 = 1; size2 < size; size2 <<= 1) ;
-    if (!(t = calloc(1, sizeof(hashtable_t)+ size2 * sizeof(unsigned))))
+    size = 1 + size * 100 / loadfactor;
+    /* Use next power of 2 larger than the requested size. Bucket
+       indexes come from a 32-bit mixed hash, so larger tables would
+       just leave buckets unreachable. */
+    for (size2 = 1; size2 < size && size2 < HASHTABLE_MAX_SIZE; size2 <<= 1) ;
+    if (!(t = calloc(1, sizeof(hashtable_t))))
         return NULL;
-    if (!(t->etable = calloc(size2, sizeof(void *)))) {
+    if (!(t->ktable = _table_zalloc(size2 * sizeof(unsigned)))) {
         free(t);
         return NULL;
     }
     t->size = size2;
     t->count = 0;
+    t->bshift = _hashtable_bshift(size2);
+#ifndef HASHTABLE_NBLOOM
+    if (!(t->kbloom = _table_zalloc(size2))) {
+        _hashtable_free(t);
+        return NULL;
+    }
+#endif
+    /* The tag table is only filled in by instantiations with a TAG
+       method, but it's small enough to just always allocate. */
+    if (!(t->stable = _table_zalloc(size2))) {
+        _hashtable_free(t);
+        return NULL;
+    }
 #ifndef HASHTABLE_NSTATS
     t->find_count = t->match_count = t->hashcmp_count = t->entrycmp_count = 0;
+    t->stats_every = 1;
+#endif
+    return t;
+}
+
+hashtable_t *_hashtable_new(size_t size, int loadfactor)
+{
+    hashtable_t *t;
+
+    if (!(t = _hashtable_alloc(size, loadfactor)))
+        return NULL;
+    if (!(t->etable = _table_zalloc(t->size * sizeof(void *)))) {
+        _hashtable_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+hashtable_t *_hashtable_new_indexed(size_t size, void *base,
+                                    size_t entry_size, int loadfactor)
+{
+    hashtable_t *t;
+
+    assert(base != NULL);
+    assert(entry_size > 0);
+    if (!(t = _hashtable_alloc(size, loadfactor)))
+        return NULL;
+    /* Indexes are half the size of pointers on 64-bit platforms, so twice
+       as many entries fit in each cache line. They are 32 bits, so
+       indexed tables are limited to 2^32 entries; with only 32 bits of
+       mixed hash to spread keys over buckets, bigger tables wouldn't
+       probe well anyway. */
+    if (!(t->itable = _table_zalloc(t->size * sizeof(unsigned)))) {
+        _hashtable_free(t);
+        return NULL;
+    }
+    t->base = base;
+    t->entry_size = entry_size;
+    return t;
+}
+
+hashtable_t *_hashtable_new_mapped(size_t size, size_t count,
+                                   unsigned *ktable, unsigned *itable,
+                                   unsigned char *kbloom, void *base,
+                                   size_t entry_size)
+{
+    hashtable_t *t;
+
+    /* The tables come prebuilt (e.g. from an mmap'd signature file), so
+       size is the exact power-of-2 table size, not an entry count. */
+    assert(size > 0 && !(size & (size - 1)));
+    assert(ktable != NULL);
+    assert(itable != NULL);
+    assert(kbloom != NULL);
+    assert(base != NULL);
+    assert(entry_size > 0);
+    if (!(t = calloc(1, sizeof(hashtable_t))))
+        return NULL;
+    t->size = size;
+    t->count = count;
+    t->ktable = ktable;
+    t->itable = itable;
+    t->kbloom = kbloom;
+    t->bshift = _hashtable_bshift(size);
+    t->base = base;
+    t->entry_size = entry_size;
+    t->mapped = 1;
+#ifndef HASHTABLE_NSTATS
+    t->stats_every = 1;
 #endif
     return t;
 }
@@ -60,7 +190,19 @@ hashtable_t *_hashtable_new(int size)
 void _hashtable_free(hashtable_t *t)
 {
     if (t) {
-        free(t->etable);
+        if (!t->mapped) {
+            /* NULL guards spare zfree hooks that can't take NULL. */
+            if (t->etable)
+                _table_zfree(t->etable, t->size * sizeof(void *));
+            if (t->itable)
+                _table_zfree(t->itable, t->size * sizeof(unsigned));
+            if (t->ktable)
+                _table_zfree(t->ktable, t->size * sizeof(unsigned));
+            if (t->kbloom)
+                _table_zfree(t->kbloom, t->size);
+            if (t->stable)
+                _table_zfree(t->stable, t->size);
+        }
         free(t);
     }
 }
@@ -79,11 +221,11 @@ void *_hashtable_next(hashtable_iter_t *i)
     assert(i->htable != NULL);
     assert(i->index <= i->htable->size);
     const hashtable_t *t = i->htable;
-    void *e;
 
+    /* A zero hash key marks an empty bucket in both storage modes. */
     while (i->index < t->size) {
-        if ((e = t->etable[i->index++]))
-            return e;
+        if (t->ktable[i->index++])
+            return _hashtable_entry(t, i->index - 1);
     }
     return NULL;
 }
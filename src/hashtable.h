@@ -55,6 +55,9 @@
  * \param KEY - optional key type basename (default: ENTRY).
  * \param MATCH - optional match type basename (default: KEY).
  * \param NAME - optional hashtable type basename (default: ENTRY_hashtable).
+ * \param TAG - optional: define to store an ENTRY_tag() byte per entry
+ * and reject probe collisions with MATCH_tag() before the entry is
+ * even fetched for MATCH_CMP().
  *
  * Example: \code
  *   typedef ... key_t;
@@ -122,33 +125,99 @@
  * also access the whole entry_t object to match against more than
  * just the key. */
 
-/** The hashtable type. */
+/** The hashtable type.
+ *
+ * Entries are normally stored as pointers in etable.  When all entries
+ * live in one packed array, the table can instead be created with
+ * hashtable_new_indexed() and store 32-bit indexes into that array in
+ * itable.  This halves the entry table memory on 64-bit platforms,
+ * doubles the entries per cache line, and lets the base array be
+ * relocated with hashtable_set_base() without rebuilding the table. */
 typedef struct hashtable {
-    int size;                   /**< Size of allocated hashtable. */
-    int count;                  /**< Number of entries in hashtable. */
+    size_t size;                /**< Size of allocated hashtable. */
+    size_t count;               /**< Number of entries in hashtable. */
 #ifndef HASHTABLE_NSTATS
-    /* The following are for accumulating hashtable_find() stats. */
+    /* The following are for accumulating hashtable_find() stats. Only
+       every stats_every'th find is counted, so readers must scale by
+       stats_every; the default of 1 counts everything exactly. */
     long find_count;            /**< The count of finds tried. */
     long match_count;           /**< The count of matches found. */
     long hashcmp_count;         /**< The count of hash compares done. */
     long entrycmp_count;        /**< The count of entry compares done. */
+    unsigned stats_every;       /**< Count every Nth find (min 1). */
+    unsigned stats_tick;        /**< Finds since the last counted one. */
 #endif
     void **etable;              /**< Table of pointers to entries. */
-    unsigned ktable[];          /**< Table of hash keys. */
+    unsigned *itable;           /**< Table of entry indexes (indexed mode). */
+    void *base;                 /**< Entry array base (indexed mode). */
+    size_t entry_size;          /**< Packed entry size (indexed mode). */
+    int mapped;                 /**< Tables are in external (mmap'd) memory. */
+    int bshift;                 /**< Shift from a hash to a kbloom bit index. */
+    unsigned char *kbloom;      /**< Bloom filter over the hash keys. */
+    unsigned char *stable;      /**< Table of entry tag bytes (optional). */
+    unsigned *ktable;           /**< Table of hash keys. */
 } hashtable_t;
 
 /** The hashtable iterator type. */
 typedef struct hashtable_iter {
     hashtable_t *htable;        /**< The hashtable to iterate over. */
-    int index;                  /**< The index to scan from next. */
+    size_t index;               /**< The index to scan from next. */
 } hashtable_iter_t;
 
-/* void* implementations for the type-safe static inline wrappers below. */
-hashtable_t *_hashtable_new(int size);
+/* void* implementations for the type-safe static inline wrappers below.
+   The loadfactor argument is the max percentage of buckets to fill
+   (1..100), or 0 for the default. */
+hashtable_t *_hashtable_new(size_t size, int loadfactor);
+hashtable_t *_hashtable_new_indexed(size_t size, void *base,
+                                    size_t entry_size, int loadfactor);
+hashtable_t *_hashtable_new_mapped(size_t size, size_t count,
+                                   unsigned *ktable, unsigned *itable,
+                                   unsigned char *kbloom, void *base,
+                                   size_t entry_size);
 void _hashtable_free(hashtable_t *t);
 void *_hashtable_iter(hashtable_iter_t *i, hashtable_t *t);
 void *_hashtable_next(hashtable_iter_t *i);
 
+/** Replace the allocator used for the bucket tables.
+ *
+ * The tables dominate a large hashtable's memory and are probed at
+ * random, so applications may want to back them with huge pages or
+ * place them on a specific NUMA node. \p zalloc must return zero-filled
+ * memory or NULL on failure; \p zfree gets the same size back. Pass
+ * NULLs to restore the calloc()/free() defaults. Install before any
+ * tables are created and leave in place until they are all freed. */
+void hashtable_set_allocator(void *(*zalloc)(size_t size),
+                             void (*zfree)(void *ptr, size_t size));
+
+/** Get the entry at bucket i, for either storage mode. */
+static inline void *_hashtable_entry(const hashtable_t *t, size_t i)
+{
+    return t->base ? (char *)t->base + (size_t)t->itable[i] * t->entry_size
+        : t->etable[i];
+}
+
+/** Update the entry array base after it has been relocated (indexed
+ * mode only). */
+static inline void hashtable_set_base(hashtable_t *t, void *base)
+{
+    assert(t->base != NULL);
+    t->base = base;
+}
+
+#ifndef HASHTABLE_NSTATS
+/** Count stats for only every \p every'th find (0 or 1 for all).
+ *
+ * With a large interval the cost of stats in the probe loop drops to
+ * one counter test per find, cheap enough to leave on in production;
+ * the counters become sampled estimates that readers scale back up by
+ * stats_every. */
+static inline void hashtable_set_stats_sample(hashtable_t *t, unsigned every)
+{
+    t->stats_every = every ? every : 1;
+    t->stats_tick = 0;
+}
+#endif
+
 /** MurmurHash3 finalization mix function. */
 static inline unsigned mix32(unsigned int h)
 {
@@ -160,6 +229,46 @@ static inline unsigned mix32(unsigned int h)
     return h;
 }
 
+#ifndef HASHTABLE_NBLOOM
+/* The bloom filter has 8 bits per bucket and is indexed by the top bits
+   of the mixed hash, which are independent of the low bits used for the
+   bucket index. It lets the common "no such key" case answer from one
+   bit in a small table instead of probing cache lines of ktable. */
+
+/** Set the bloom filter bit for mixed hash \p mh. */
+static inline void _hashtable_setbloom(hashtable_t *t, unsigned mh)
+{
+    unsigned i = mh >> t->bshift;
+
+    t->kbloom[i / 8] |= (unsigned char)(1 << (i % 8));
+}
+
+/** Test the bloom filter bit for mixed hash \p mh. */
+static inline int _hashtable_getbloom(const hashtable_t *t, unsigned mh)
+{
+    unsigned i = mh >> t->bshift;
+
+    return (t->kbloom[i / 8] >> (i % 8)) & 1;
+}
+#endif                          /* !HASHTABLE_NBLOOM */
+
+/** Prefetch the lookup path for mixed hash \p mh: the bloom filter
+ * byte and the first candidate bucket.  Issued some work ahead of the
+ * matching find, this overlaps the memory latency of a large table
+ * with that work instead of taking it on the probe itself. */
+static inline void _hashtable_prefetch(const hashtable_t *t, unsigned mh)
+{
+#if defined(__GNUC__) || defined(__clang__)
+#ifndef HASHTABLE_NBLOOM
+    __builtin_prefetch(&t->kbloom[(mh >> t->bshift) / 8], 0, 0);
+#endif
+    __builtin_prefetch(&t->ktable[mh & (t->size - 1)], 0, 0);
+#else
+    (void)t;
+    (void)mh;
+#endif
+}
+
 #endif                          /* _HASHTABLE_H_ */
 
 /* If ENTRY is defined, define type-dependent static inline methods. */
@@ -187,22 +296,34 @@ static inline unsigned mix32(unsigned int h)
 #define KEY_HASH(k) _JOIN(KEY, _hash)(k)
 /** The match cmp(m, e) method. */
 #define MATCH_CMP(m, e) _JOIN(MATCH, _cmp)(m, e)
+#ifdef TAG
+/** The entry tag(e) method. */
+#define ENTRY_TAG(e) _JOIN(ENTRY, _tag)(e)
+/** The match tag(m) method. */
+#define MATCH_TAG(m) _JOIN(MATCH, _tag)(m)
+#endif
 #define _FUNC(f) _JOIN(NAME, f)
 
 /* Loop macro for probing table t for key k, setting hk to the hash for k
    reserving zero for empty buckets, and iterating with index i and entry
    hash h, terminating at an empty bucket. */
 #define _for_probe(t, k, hk, i, h) \
-    const unsigned mask = t->size - 1;\
-    unsigned hk = KEY_HASH((KEY_T *)k), i, s, h;\
+    const size_t mask = t->size - 1;\
+    unsigned hk = KEY_HASH((KEY_T *)k), s, h;\
+    size_t i;\
     hk = hk ? hk : -1;\
     for (i = mix32(hk) & mask, s = 0; (h = t->ktable[i]); i = (i + ++s) & mask)
 
-/* Conditional macro for incrementing stats counters. */
+/* Conditional macros for the sampled stats counters: _stats_sampled()
+   decides once per find whether this find is counted, and _stats_inc()
+   counts only when it was. */
 #ifndef HASHTABLE_NSTATS
-#define _stats_inc(c) (c++)
+#define _stats_sampled(t) \
+    (++(t)->stats_tick < (t)->stats_every ? 0 : ((t)->stats_tick = 0, 1))
+#define _stats_inc(on, c) do { if (on) (c)++; } while (0)
 #else
-#define _stats_inc(c)
+#define _stats_sampled(t) 0
+#define _stats_inc(on, c)
 #endif
 
 /** Allocate and initialize a hashtable instance.
@@ -217,9 +338,52 @@ static inline unsigned mix32(unsigned int h)
  * \param size - The desired minimum size of the hash table.
  *
  * \return The initialized hashtable instance or NULL if it failed. */
-static inline hashtable_t *_FUNC(_new)(int size)
+static inline hashtable_t *_FUNC(_new)(size_t size)
+{
+    return _hashtable_new(size, 0);
+}
+
+/** Like hashtable_new(), but with an explicit max load factor.
+ *
+ * Lower load factors trade memory for shorter probe sequences; higher
+ * ones pack the table tighter at the cost of more collisions.
+ *
+ * \param size - The desired minimum size of the hash table.
+ * \param loadfactor - Max percentage of buckets to fill (1..100), or 0
+ * for the default.
+ *
+ * \return The initialized hashtable instance or NULL if it failed. */
+static inline hashtable_t *_FUNC(_new_lf)(size_t size, int loadfactor)
+{
+    return _hashtable_new(size, loadfactor);
+}
+
+/** Allocate and initialize a hashtable instance in indexed mode.
+ *
+ * Like hashtable_new(), but all entries added must live inside one
+ * packed array starting at \p base with \p entry_size bytes per entry,
+ * and are stored as 32-bit indexes into that array. If the array is
+ * reallocated, call hashtable_set_base() with its new address.
+ *
+ * \param size - The desired minimum size of the hash table.
+ * \param *base - The start of the packed entry array.
+ * \param entry_size - The packed size of each entry.
+ *
+ * \return The initialized hashtable instance or NULL if it failed. */
+static inline hashtable_t *_FUNC(_new_indexed)(size_t size, void *base,
+                                               size_t entry_size)
+{
+    return _hashtable_new_indexed(size, base, entry_size, 0);
+}
+
+/** Like hashtable_new_indexed(), but with an explicit max load factor.
+ *
+ * \sa hashtable_new_lf() for the loadfactor argument. */
+static inline hashtable_t *_FUNC(_new_indexed_lf)(size_t size, void *base,
+                                                  size_t entry_size,
+                                                  int loadfactor)
 {
-    return _hashtable_new(size);
+    return _hashtable_new_indexed(size, base, entry_size, loadfactor);
 }
 
 /** Destroy and free a hashtable instance.
@@ -243,6 +407,7 @@ static inline void _FUNC(_stats_init)(hashtable_t *t)
 {
 #ifndef HASHTABLE_NSTATS
     t->find_count = t->match_count = t->hashcmp_count = t->entrycmp_count = 0;
+    t->stats_tick = 0;
 #endif
 }
 
@@ -265,6 +430,17 @@ static inline ENTRY_T *_FUNC(_add)(hashtable_t *t, ENTRY_T *e)
     _for_probe(t, e, he, i, h);
     t->count++;
     t->ktable[i] = he;
+#ifdef TAG
+    t->stable[i] = ENTRY_TAG(e);
+#endif
+#ifndef HASHTABLE_NBLOOM
+    _hashtable_setbloom(t, mix32(he));
+#endif
+    if (t->base) {
+        t->itable[i] =
+            (unsigned)(((char *)e - (char *)t->base) / t->entry_size);
+        return e;
+    }
     return t->etable[i] = e;
 }
 
@@ -281,14 +457,32 @@ static inline ENTRY_T *_FUNC(_find)(hashtable_t *t, MATCH_T *m)
 {
     assert(m != NULL);
     ENTRY_T *e;
+    const int stats_on = _stats_sampled(t);
+
+    (void)stats_on;
+    _stats_inc(stats_on, t->find_count);
+#ifndef HASHTABLE_NBLOOM
+    {
+        /* Answer the common "no such key" case from the bloom filter
+           without touching ktable at all. */
+        unsigned hb = KEY_HASH((KEY_T *)m);
 
-    _stats_inc(t->find_count);
+        if (!_hashtable_getbloom(t, mix32(hb ? hb : -1)))
+            return NULL;
+    }
+#endif
     _for_probe(t, m, hm, i, he) {
-        _stats_inc(t->hashcmp_count);
+        _stats_inc(stats_on, t->hashcmp_count);
         if (hm == he) {
-            _stats_inc(t->entrycmp_count);
-            if (!MATCH_CMP(m, e = t->etable[i])) {
-                _stats_inc(t->match_count);
+#ifdef TAG
+            /* Reject key collisions from the compact tag table without
+               fetching the entry itself (mapped tables have no tags). */
+            if (t->stable && t->stable[i] != MATCH_TAG(m))
+                continue;
+#endif
+            _stats_inc(stats_on, t->entrycmp_count);
+            if (!MATCH_CMP(m, e = _hashtable_entry(t, i))) {
+                _stats_inc(stats_on, t->match_count);
                 return e;
             }
         }
@@ -329,10 +523,13 @@ static inline ENTRY_T *_FUNC(_next)(hashtable_iter_t *i)
 #undef KEY
 #undef MATCH
 #undef NAME
+#undef TAG
 #undef ENTRY_T
 #undef KEY_T
 #undef MATCH_T
 #undef KEY_HASH
 #undef MATCH_CMP
+#undef ENTRY_TAG
+#undef MATCH_TAG
 #undef _FUNC
 #endif                          /* ENTRY */
@@ -49,6 +49,10 @@
 #include <stdio.h>
 #include <time.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include "librsync.h"
 #include "stream.h"
 #include "util.h"
@@ -60,15 +64,110 @@
 static rs_result rs_job_work(rs_job_t *job, rs_buffers_t *buffers);
 
 
-rs_job_t * rs_job_new(char const *job_name, rs_result (*statefn)(rs_job_t *))
+/** Idle jobs kept by a pool when none is requested explicitly. */
+#define RS_JOB_POOL_DEFAULT_MAX 64
+
+/** A pool of idle jobs kept for reuse.
+ *
+ * Released jobs keep their grown scoop allocations, so a steady stream
+ * of similarly sized jobs does no allocation at all once the pool is
+ * warm (see the old TODO at the top of scoop.c). */
+struct rs_job_pool {
+    rs_job_t            *idle;  /**< LIFO free list via job->pool_next. */
+    int                 idle_count;
+    int                 max_idle;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t     mutex;
+#endif
+};
+
+/** The installed pool consulted by rs_job_new() and rs_job_free(). */
+static rs_job_pool_t *rs_job_pool = NULL;
+
+static void rs_job_pool_lock(rs_job_pool_t *pool)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pool->mutex);
+#else
+    (void)pool;
+#endif
+}
+
+static void rs_job_pool_unlock(rs_job_pool_t *pool)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pool->mutex);
+#else
+    (void)pool;
+#endif
+}
+
+rs_job_pool_t *rs_job_pool_new(int max_idle)
+{
+    rs_job_pool_t *pool;
+
+    pool = rs_alloc_struct(rs_job_pool_t);
+    pool->max_idle = max_idle > 0 ? max_idle : RS_JOB_POOL_DEFAULT_MAX;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&pool->mutex, NULL);
+#endif
+    return pool;
+}
+
+void rs_job_pool_install(rs_job_pool_t *pool)
+{
+    rs_job_pool = pool;
+}
+
+void rs_job_pool_free(rs_job_pool_t *pool)
 {
     rs_job_t *job;
 
-    job = rs_alloc_struct(rs_job_t);
+    if (!pool)
+        return;
+    if (rs_job_pool == pool)
+        rs_job_pool = NULL;
+    while ((job = pool->idle)) {
+        pool->idle = job->pool_next;
+        free(job->scoop_buf);
+        free(job);
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&pool->mutex);
+#endif
+    free(pool);
+}
+
+
+rs_job_t * rs_job_new(char const *job_name, rs_result (*statefn)(rs_job_t *))
+{
+    rs_job_t *job = NULL;
+    rs_job_pool_t *pool = rs_job_pool;
+
+    if (pool) {
+        rs_job_pool_lock(pool);
+        if ((job = pool->idle)) {
+            pool->idle = job->pool_next;
+            pool->idle_count--;
+        }
+        rs_job_pool_unlock(pool);
+    }
+    if (job) {
+        /* Recycle the job, keeping its grown scoop allocation. */
+        rs_byte_t *scoop_buf = job->scoop_buf;
+        size_t scoop_alloc = job->scoop_alloc;
+        rs_bzero(job, sizeof *job);
+        job->scoop_buf = job->scoop_next = scoop_buf;
+        job->scoop_alloc = scoop_alloc;
+        rs_trace("recycled job with "FMT_SIZE" byte scoop", scoop_alloc);
+    } else {
+        job = rs_alloc_struct(rs_job_t);
+    }
 
     job->job_name = job_name;
     job->dogtag = RS_JOB_TAG;
     job->statefn = statefn;
+    job->trace_level = rs_trace_level;
 
     job->stats.op = job_name;
     job->stats.start = time(NULL);
@@ -81,9 +180,37 @@ rs_job_t * rs_job_new(char const *job_name, rs_result (*statefn)(rs_job_t *))
 
 rs_result rs_job_free(rs_job_t *job)
 {
-    free(job->scoop_buf);
+    rs_job_pool_t *pool = rs_job_pool;
+
+    if (job->pdelta)
+        rs_pdelta_free(job->pdelta);
+    if (job->psig)
+        rs_psig_free(job->psig);
+    if (job->multi)
+        rs_multi_basis_free(job->multi);
+    if (job->sigdelta)
+        rs_sigdelta_free(job->sigdelta);
     if (job->job_owns_sig)
           rs_free_sumset(job->signature);
+    /* The codec scratch buffer isn't kept across pool reuse. */
+    free(job->z_buf);
+    job->z_buf = NULL;
+    job->z_alloc = 0;
+    if (pool) {
+        rs_job_pool_lock(pool);
+        if (pool->idle_count < pool->max_idle) {
+            /* Park the job in the pool, scoop and all.  Clear the
+             * dogtag so use after free still trips the job check. */
+            job->dogtag = 0;
+            job->pool_next = pool->idle;
+            pool->idle = job;
+            pool->idle_count++;
+            rs_job_pool_unlock(pool);
+            return RS_DONE;
+        }
+        rs_job_pool_unlock(pool);
+    }
+    free(job->scoop_buf);
     rs_bzero(job, sizeof *job);
     free(job);
 
@@ -99,6 +226,10 @@ static rs_result rs_job_complete(rs_job_t *job, rs_result result)
 
     job->final_result = result;
     job->stats.end = time(NULL);
+    /* One last progress report so watchers see the final totals. */
+    if (job->progress_cb)
+        job->progress_cb(job->progress_arg, job->job_name,
+                         job->progress_in, job->progress_out);
     if (result != RS_DONE) {
         rs_error("%s job failed: %s", job->job_name, rs_strerror(result));
     } else {
@@ -131,18 +262,51 @@ rs_result rs_job_iter(rs_job_t *job, rs_buffers_t *buffers)
 }
 
 
+/** Run FN on JOB, adding the elapsed wall-clock time to *ACCUM when
+ * the job collects timing stats. */
+static inline rs_result rs_job_timed(rs_job_t *job,
+                                     rs_result (*fn)(rs_job_t *),
+                                     double *accum)
+{
+    rs_result result;
+    double t0;
+
+    if (job->stats_level < RS_STATS_TIMING)
+        return fn(job);
+    t0 = rs_monotonic_seconds();
+    result = fn(job);
+    *accum += rs_monotonic_seconds() - t0;
+    return result;
+}
+
+
+/** rs_tube_catchup() adapted to the state-function signature for
+ * rs_job_timed(). */
+static rs_result rs_job_tube_catchup(rs_job_t *job)
+{
+    return rs_tube_catchup(job);
+}
+
+
 static rs_result rs_job_work(rs_job_t *job, rs_buffers_t *buffers)
 {
     rs_result result;
+    size_t last_in, last_out;
 
     rs_job_check(job);
     assert(buffers);
 
     job->stream = buffers;
+    /* recomputed by whatever blocks on input this iteration */
+    job->input_needed = 0;
+    job->iter_out_mark = buffers->next_out;
+    last_in = buffers->avail_in;
+    last_out = buffers->avail_out;
     while (1) {
-        result = rs_tube_catchup(job);
+        result = rs_job_timed(job, rs_job_tube_catchup,
+                              &job->stats.tube_secs);
         if (result == RS_DONE && job->statefn) {
-            result = job->statefn(job);
+            result = rs_job_timed(job, job->statefn, &job->stats.scan_secs);
             if (result == RS_DONE) {
                 /* The job is done so clear statefn. */
                 job->statefn = NULL;
@@ -150,6 +314,29 @@ static rs_result rs_job_work(rs_job_t *job, rs_buffers_t *buffers)
                 continue;
             }
         }
+        /* Count what this step consumed and produced off the buffers,
+         * hashing and reporting as configured; one compare per step
+         * when neither is on. */
+        if (job->progress_cb || job->output_hash) {
+            size_t produced = last_out - buffers->avail_out;
+
+            if (job->output_hash && produced)
+                rs_mdfour_update(&job->output_md4,
+                                 buffers->next_out - produced, produced);
+            if (job->progress_cb) {
+                job->progress_in += (rs_long_t)(last_in - buffers->avail_in);
+                job->progress_out += (rs_long_t)produced;
+                job->progress_acc += (rs_long_t)(last_in - buffers->avail_in)
+                    + (rs_long_t)produced;
+                if (job->progress_acc >= job->progress_interval) {
+                    job->progress_acc = 0;
+                    job->progress_cb(job->progress_arg, job->job_name,
+                                     job->progress_in, job->progress_out);
+                }
+            }
+            last_in = buffers->avail_in;
+            last_out = buffers->avail_out;
+        }
         if (result == RS_BLOCKED)
             return result;
         if (result != RS_RUNNING)
@@ -165,6 +352,89 @@ rs_job_statistics(rs_job_t *job)
 }
 
 
+void
+rs_job_set_trace_level(rs_job_t *job, rs_loglevel level)
+{
+    rs_job_check(job);
+    job->trace_level = level;
+}
+
+
+void
+rs_job_set_stats_level(rs_job_t *job, rs_stats_level level)
+{
+    rs_job_check(job);
+    job->stats_level = level;
+}
+
+
+void
+rs_job_set_progress_cb(rs_job_t *job, rs_progress_cb *cb, void *opaque,
+                       rs_long_t interval_bytes)
+{
+    rs_job_check(job);
+    job->progress_cb = cb;
+    job->progress_arg = opaque;
+    job->progress_interval = interval_bytes > 0 ? interval_bytes : 1;
+}
+
+
+void
+rs_job_set_output_hash(rs_job_t *job, int enable)
+{
+    rs_job_check(job);
+    job->output_hash = enable;
+    if (enable)
+        rs_mdfour_begin(&job->output_md4);
+}
+
+
+void
+rs_job_output_sum(rs_job_t *job, unsigned char *result)
+{
+    rs_job_check(job);
+    rs_mdfour_result(&job->output_md4, result);
+}
+
+
+void
+rs_job_set_copy_range_cb(rs_job_t *job, rs_copy_range_cb *cb, void *opaque)
+{
+    rs_job_check(job);
+    job->copy_range_cb = cb;
+    job->copy_range_arg = opaque;
+}
+
+
+void
+rs_job_set_eager_build(rs_job_t *job, rs_long_t sig_fsize)
+{
+    rs_job_check(job);
+    job->eager_build = sig_fsize > 0;
+    if (sig_fsize > 0)
+        job->sig_fsize = sig_fsize;
+}
+
+
+void
+rs_job_set_compression(rs_job_t *job, rs_compress_cb *compress_cb,
+                       rs_decompress_cb *decompress_cb, void *opaque)
+{
+    rs_job_check(job);
+    job->compress_cb = compress_cb;
+    job->decompress_cb = decompress_cb;
+    job->codec_arg = opaque;
+}
+
+
+size_t
+rs_job_input_needed(rs_job_t *job)
+{
+    rs_job_check(job);
+    return job->input_needed;
+}
+
+
 int
 rs_job_input_is_ending(rs_job_t *job)
 {
@@ -20,7 +20,7 @@
  */
 
 #include "mdfour.h"
-#include "rollsum.h"
+#include "weaksum.h"
 
 /**
  * \struct rs_job
@@ -32,6 +32,20 @@ struct rs_job {
     /** Human-readable job operation name. */
     const char          *job_name;
 
+    /** Trace level for this job, seeded from the process-global level
+     * when the job is created; see rs_job_set_trace_level(). */
+    int                 trace_level;
+
+    /** Statistics granularity; see rs_job_set_stats_level(). */
+    int                 stats_level;
+
+    /** Build the hashtable while loading; see rs_job_set_eager_build(). */
+    int                 eager_build;
+
+    /** Accumulate output_md4 over the output stream; see
+     * rs_job_set_output_hash(). */
+    int                 output_hash;
+
     rs_buffers_t *stream;
 
     /** Callback for each processing step. */
@@ -62,8 +76,15 @@ struct rs_job {
     /** The weak signature digest used by readsums.c */
     rs_weak_sum_t       weak_sig;
 
-    /** The rollsum weak signature accumulator used by delta.c */
-    Rollsum             weak_sum;
+    /** The rolling weak signature accumulator used by delta.c */
+    weaksum_t           weak_sum;
+
+    /** Optional coarse-level signature for hierarchical deltas
+     * (rs_delta_begin_hier()), with its own rolling sum.  Checked
+     * before \ref signature whenever a whole coarse block is in
+     * view. */
+    rs_signature_t      *signature_coarse;
+    weaksum_t           weak_sum_coarse;
 
     /** Lengths of expected parameters. */
     rs_long_t           param1, param2;
@@ -85,9 +106,19 @@ struct rs_job {
     size_t      scoop_avail;           /* the data size */
     size_t      scoop_pos;             /* the scan position */
 
+    /** Where the delta scan reads from: either the scoop, or borrowed
+     * directly from the caller's input buffer when the scoop is empty.
+     * Recomputed by rs_getinput() on each state iteration. */
+    rs_byte_t   *scan_buf;
+    size_t      scan_avail;
+
     /** If USED is >0, then buf contains that much write data to
-     * be sent out. */
-    rs_byte_t   write_buf[36];
+     * be sent out.
+     *
+     * The buffer is sized to batch many small command headers up into
+     * one output write; rs_tube_catchup() holds on to write data until
+     * it is nearly full, a copy is queued, or the job has ended. */
+    rs_byte_t   write_buf[4096];
     int         write_len;
 
     /** If \p copy_len is >0, then that much data should be copied
@@ -97,12 +128,105 @@ struct rs_job {
     /** Copy from the basis position. */
     rs_long_t       basis_pos, basis_len;
 
+    /** Nonzero to emit or decode the compact ::RS_DELTA2_MAGIC varint
+     * encoding instead of the fixed-width prototab commands. */
+    int             delta_v2;
+
+    /** Partially-read varint, so decoding can resume after blocking
+     * mid-integer (see rs_suck_varint()). */
+    rs_long_t       varint_acc;
+    int             varint_shift;
+
+    /** Basis offset the next v2 COPY is encoded relative to: the byte
+     * after the previous copy, since most copies are
+     * near-sequential. */
+    rs_long_t       copy_ref;
+
+    /** Optional literal-payload codec (rs_job_set_compression()). */
+    rs_compress_cb      *compress_cb;
+    rs_decompress_cb    *decompress_cb;
+    void                *codec_arg;
+
+    /** Scratch buffer for codec input/output, grown as needed. */
+    rs_byte_t       *z_buf;
+    size_t          z_alloc;
+
+    /** A job-owned payload being drained through the tube after the
+     * write data; see rs_tube_write_blob(). */
+    const rs_byte_t *blob_buf;
+    size_t          blob_len;
+
+    /** Stitch-job state (stitch.c): segments consumed so far, and the
+     * decode-side v2 copy reference for the current segment. */
+    int             stitch_count;
+    rs_long_t       stitch_ref;
+
+    /** Additional input bytes needed before the job can make progress,
+     * recorded when an iteration blocks waiting for input; see
+     * rs_job_input_needed().  Zero when not blocked on input. */
+    size_t          input_needed;
+
+    /** Leading scoop bytes belonging to the pending match that have not
+     * been processed yet (only >0 after a blocked append in delta.c);
+     * scan_buf bytes [match_pend, scoop_pos) are pending miss bytes. */
+    size_t          match_pend;
+
+    /** Bytes scanned since the last match or near-match, driving the
+     * adaptive probe-skipping in rs_delta_s_scan(). */
+    size_t          miss_run;
+
+    /** Progress reporting; see rs_job_set_progress_cb().  The in/out
+     * totals are counted off the buffers in rs_job_work(), so they work
+     * with any driver; progress_acc is the combined bytes since the
+     * last report. */
+    rs_progress_cb  *progress_cb;
+    void            *progress_arg;
+    rs_long_t       progress_interval;
+    rs_long_t       progress_acc;
+    rs_long_t       progress_in, progress_out;
+
     /** Callback used to copy data from the basis into the output. */
     rs_copy_cb      *copy_cb;
     void            *copy_arg;
 
+    /** Optional kernel-side copy offload for large COPY commands; see
+     * rs_job_set_copy_range_cb().  iter_out_mark is next_out as of the
+     * current rs_job_iter() call, so the patch states can tell nothing
+     * has been written ahead of an offloaded copy. */
+    rs_copy_range_cb    *copy_range_cb;
+    void                *copy_range_arg;
+    char                *iter_out_mark;
+
+    /** Private state for the parallel delta engine (pdelta.c). */
+    struct rs_pdelta    *pdelta;
+
+    /** Private state for parallel signature generation (mksum.c). */
+    struct rs_psig      *psig;
+
+    /** Multi-basis copy dispatch state (patch.c), owned by the job. */
+    struct rs_multi_basis   *multi;
+
+    /** Fused signature+delta state (sigdelta.c), owned by the job. */
+    struct rs_sigdelta  *sigdelta;
+
+    /** Link in a job pool's idle list; only valid while the job is
+     * sitting released in a pool. */
+    rs_job_t            *pool_next;
+
 };
 
+/** Free the parallel delta state attached to a job, if any. */
+void rs_pdelta_free(struct rs_pdelta *pdelta);
+
+/** Free the parallel signature state attached to a job, if any. */
+void rs_psig_free(struct rs_psig *psig);
+
+/** Free the multi-basis dispatch state attached to a job, if any. */
+void rs_multi_basis_free(struct rs_multi_basis *multi);
+
+/** Free the fused signature+delta state attached to a job, if any. */
+void rs_sigdelta_free(struct rs_sigdelta *sd);
+
 
 rs_job_t * rs_job_new(const char *, rs_result (*statefn)(rs_job_t *));
 
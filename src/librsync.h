@@ -84,6 +84,21 @@ typedef enum {
      **/
     RS_DELTA_MAGIC          = 0x72730236,
 
+    /**
+     * A delta file in the compact v2 encoding.
+     *
+     * Command parameters are LEB128 varints rather than fixed-width
+     * integers, and COPY offsets are zigzag-encoded deltas from the
+     * end of the previous copy, so the near-sequential copy streams
+     * typical of lightly-changed files shrink to a few bytes per
+     * command.
+     *
+     * The four-byte literal \c "rs\x02F".
+     *
+     * \see rs_delta_begin_v2()
+     **/
+    RS_DELTA2_MAGIC         = 0x72730246,
+
     /**
      * A signature file with MD4 signatures.
      *
@@ -105,7 +120,62 @@ typedef enum {
      *
      * \see rs_sig_begin()
      **/
-    RS_BLAKE2_SIG_MAGIC     = 0x72730137
+    RS_BLAKE2_SIG_MAGIC     = 0x72730137,
+
+    /**
+     * A v2 signature container holding the packed block sums and a
+     * prebuilt hash index in an mmap-ready page-aligned layout, so it
+     * can be loaded in O(1) with rs_loadsig_mmap(). Stored in host byte
+     * order: intended for local signature caches, not network transfer.
+     *
+     * The four-byte literal \c "rs\x018".
+     *
+     * \see rs_sig2_save() and rs_loadsig_mmap()
+     **/
+    RS_SIG2_MAGIC           = 0x72730138,
+
+    /**
+     * A signature file with RabinKarp rollsum and MD4 hash.
+     *
+     * The RabinKarp rollsum has a much better distribution than the
+     * rsync rollsum, which gives fewer weaksum collisions and hence
+     * fewer expensive strongsum calculations when generating deltas.
+     * Uses a truncated MD4 strongsum, so it has the same security
+     * concerns as RS_MD4_SIG_MAGIC.
+     *
+     * The four-byte literal \c "rs\x01F".
+     *
+     * \see rs_sig_begin()
+     **/
+    RS_RK_MD4_SIG_MAGIC     = 0x72730146,
+
+    /**
+     * A signature file with RabinKarp rollsum and BLAKE2 hash.
+     *
+     * The four-byte literal \c "rs\x01G".
+     *
+     * \see rs_sig_begin()
+     **/
+    RS_RK_BLAKE2_SIG_MAGIC  = 0x72730147,
+
+    /**
+     * A signature file with a 64-bit RabinKarp rollsum and no
+     * per-block strong sum.
+     *
+     * The wider rolling sum serves as the whole block identity: the
+     * low half is the hashtable key and the high half a 4-byte check,
+     * so weak-sum hits during delta generation need no strong-sum
+     * calculation at all.  A colliding pair of blocks goes undetected
+     * with probability ~2^-64, and the sum is trivially forgeable, so
+     * this format is only for trusted pipelines where both endpoints
+     * share integrity guarantees and the result is verified end to end
+     * (e.g. with rs_job_set_output_hash() on the patch job).
+     *
+     * The four-byte literal \c "rs\x01W".
+     *
+     * \see rs_sig_begin()
+     **/
+    RS_RK64_SIG_MAGIC       = 0x72730157
 } rs_magic_number;
 
 
@@ -255,8 +325,23 @@ typedef struct rs_stats {
     rs_long_t       out_bytes;  /**< Total bytes written to output. */
 
     time_t          start, end;
+
+    /* Per-phase wall-clock accounting, only filled in when enabled
+     * with rs_job_set_stats_level(); all zero otherwise. */
+    double          scan_secs;  /**< Seconds in the job state functions;
+                                 * includes \ref find_secs. */
+    double          find_secs;  /**< Seconds probing the signature
+                                 * hashtable for matches. */
+    double          tube_secs;  /**< Seconds draining buffered output
+                                 * between state steps. */
 } rs_stats_t;
 
+/** Granularity of statistics collection; see rs_job_set_stats_level(). */
+typedef enum rs_stats_level {
+    RS_STATS_BASIC = 0,         /**< Counters only (the default). */
+    RS_STATS_TIMING = 1         /**< Also accumulate per-phase times. */
+} rs_stats_level;
+
 
 /** \typedef struct rs_mdfour rs_mdfour_t
  *
@@ -268,6 +353,7 @@ typedef struct rs_stats {
 typedef struct rs_mdfour rs_mdfour_t;
 
 extern const int RS_MD4_SUM_LENGTH, RS_BLAKE2_SUM_LENGTH;
+extern const int RS_RK64_SUM_LENGTH;
 
 #define RS_MAX_STRONG_SUM_LENGTH 32
 
@@ -275,6 +361,17 @@ typedef uint32_t rs_weak_sum_t;
 typedef unsigned char rs_strong_sum_t[RS_MAX_STRONG_SUM_LENGTH];
 
 void            rs_mdfour(unsigned char *out, void const *in, size_t);
+
+/**
+ * Hash four independent equal-length messages at once.
+ *
+ * Computes the same digests as four rs_mdfour() calls, but runs the
+ * messages through a multi-lane SIMD implementation where the platform
+ * has one, which is several times faster for batch work like
+ * signature generation.
+ */
+void            rs_mdfour4(unsigned char *const out[4],
+                           void const *const in[4], size_t n);
 void            rs_mdfour_begin(/* @out@ */ rs_mdfour_t * md);
 
 /**
@@ -328,6 +425,86 @@ void rs_free_sumset(rs_signature_t *);
 void rs_sumset_dump(rs_signature_t const *);
 
 
+/**
+ * Statistics of match lookups against a signature's hashtable.
+ *
+ * The counters are scaled estimates when sampling is on (see
+ * rs_signature_set_stats_sample()); calc_strong_count is always exact.
+ * All zero when the library was built with HASHTABLE_NSTATS.
+ *
+ * \sa rs_signature_get_stats()
+ */
+typedef struct rs_match_stats {
+    rs_long_t find_count;       /**< Match lookups tried. */
+    rs_long_t match_count;      /**< Lookups that found a match. */
+    rs_long_t hashcmp_count;    /**< Weak sum compares done. */
+    rs_long_t entrycmp_count;   /**< Strong sum compares done. */
+    rs_long_t calc_strong_count; /**< Strong sum calculations done. */
+    int sample_every;           /**< The sampling interval in effect. */
+} rs_match_stats_t;
+
+/**
+ * Count match-lookup statistics for only every \p every'th lookup.
+ *
+ * By default every lookup is counted, which costs an increment per
+ * probe in the delta scan's hottest loop.  With a larger interval the
+ * counters become sampled estimates (scaled back up when read) and the
+ * overhead drops to one counter test per lookup, cheap enough to leave
+ * enabled in production.  Takes effect from the next
+ * rs_build_hash_table() call, or immediately if the signature is
+ * already indexed.
+ */
+void rs_signature_set_stats_sample(rs_signature_t *sig, int every);
+
+/**
+ * Fetch the match-lookup statistics for a signature.
+ *
+ * Unlike rs_signature_log_stats() this returns the numbers instead of
+ * formatting them to the log, so callers can export them.
+ */
+void rs_signature_get_stats(rs_signature_t const *sig,
+                            rs_match_stats_t *stats);
+
+/**
+ * Allocate a large block for librsync.
+ *
+ * Must return zero-filled memory of at least \p size bytes, or NULL on
+ * failure.  \p arg is the pointer given to rs_set_large_alloc().
+ *
+ * \sa rs_set_large_alloc()
+ */
+typedef void *rs_large_alloc_fn(size_t size, void *arg);
+
+/**
+ * Release a block from ::rs_large_alloc_fn.
+ *
+ * \p size is the size originally requested, as needed by allocators
+ * like munmap() or numa_free().
+ *
+ * \sa rs_set_large_alloc()
+ */
+typedef void rs_large_free_fn(void *ptr, size_t size, void *arg);
+
+/**
+ * Install an allocator for librsync's large long-lived allocations.
+ *
+ * A loaded signature's block sums and hashtable can reach tens of GB
+ * and are probed at random addresses, so their memory backing matters:
+ * applications can supply an allocator that uses explicit huge pages
+ * (MAP_HUGETLB) or places the tables on the NUMA node of pinned worker
+ * threads (e.g. numa_alloc_onnode()).  By default librsync uses
+ * calloc() and requests transparent huge pages (MADV_HUGEPAGE) for
+ * blocks of 2MB and up.
+ *
+ * Pass NULLs to restore the defaults.  The hook applies to signature
+ * block sums and hashtable bucket tables, not small structs or job
+ * buffers.  Install it before building or loading any signatures and
+ * leave it in place until they have all been freed.
+ */
+void rs_set_large_alloc(rs_large_alloc_fn *alloc_fn, rs_large_free_fn *free_fn,
+                        void *arg);
+
+
 /**
  * Description of input and output buffers.
  *
@@ -462,31 +639,248 @@ rs_result rs_job_drive(rs_job_t *job, rs_buffers_t *buf,
  */
 const rs_stats_t * rs_job_statistics(rs_job_t *job);
 
+/**
+ * Set the trace level for one job.
+ *
+ * Jobs inherit the process-global level at creation time; the trace
+ * checks on the scan, scoop and tube paths consult only the job's own
+ * level, so a noisy global setting can be silenced for a
+ * performance-critical job (or one job traced in an otherwise quiet
+ * process) without those loops loading a shared global.
+ * \sa rs_trace_set_level()
+ */
+void            rs_job_set_trace_level(rs_job_t *job, rs_loglevel level);
+
+/**
+ * Set the statistics granularity for one job.
+ *
+ * At ::RS_STATS_TIMING the job accumulates per-phase wall-clock times
+ * into the scan_secs, find_secs and tube_secs fields of its
+ * ::rs_stats_t, showing whether a slow run spent its time scanning,
+ * probing the hashtable, or pushing buffered output.  The default
+ * ::RS_STATS_BASIC keeps today's counter-only behaviour with no clock
+ * reads on the processing path.
+ */
+void            rs_job_set_stats_level(rs_job_t *job, rs_stats_level level);
+
+/**
+ * Callback reporting the progress of a running job.
+ *
+ * \param opaque the pointer registered with the callback.
+ *
+ * \param op the job operation name, e.g. "delta" or "patch".
+ *
+ * \param in_bytes total input bytes the job has consumed so far.
+ *
+ * \param out_bytes total output bytes the job has produced so far.
+ */
+typedef void rs_progress_cb(void *opaque, char const *op,
+                            rs_long_t in_bytes, rs_long_t out_bytes);
+
+/**
+ * Register a progress callback on a job.
+ *
+ * The callback fires from inside rs_job_iter() roughly every \p
+ * interval_bytes of combined input and output, and once more with the
+ * final totals when the job completes, so callers blocked in
+ * rs_whole_run() can still watch throughput live.  The counters are
+ * maintained by the job itself and work with any buffer driver.  The
+ * cost when registered is one counter compare per processing step;
+ * pass a NULL \p cb to remove it.
+ */
+void rs_job_set_progress_cb(rs_job_t *job, rs_progress_cb *cb, void *opaque,
+                            rs_long_t interval_bytes);
+
+/**
+ * Hash everything the job writes to its output.
+ *
+ * The job then accumulates an MD4 of its output stream as it drains,
+ * readable with rs_job_output_sum() after the job completes.  Intended
+ * for end-to-end verification of ::RS_RK64_SIG_MAGIC patches, where
+ * there are no per-block strong sums.  Enabling it on a patch job
+ * disables the copy-range offload, since offloaded bytes never pass
+ * through the output stream.
+ */
+void rs_job_set_output_hash(rs_job_t *job, int enable);
+
+/**
+ * Get the MD4 sum of the job's output accumulated so far.
+ *
+ * \param result receives ::RS_MD4_SUM_LENGTH bytes.  Only meaningful
+ * with rs_job_set_output_hash() enabled, normally after the job is
+ * done.
+ */
+void rs_job_output_sum(rs_job_t *job, unsigned char *result);
+
+/**
+ * Type of an application-supplied compression function.
+ *
+ * Compress \p in_len bytes at \p in into \p out.  On entry \p *out_len
+ * holds the capacity of \p out; on success set it to the compressed
+ * size and return RS_DONE.  Return any other result to decline (for
+ * example when the data is incompressible or won't fit), in which case
+ * the literal is emitted raw.
+ */
+typedef rs_result rs_compress_cb(void *opaque, const void *in, size_t in_len,
+                                 void *out, size_t *out_len);
+
+/**
+ * Type of an application-supplied decompression function.
+ *
+ * The inverse of ::rs_compress_cb: expand \p in_len compressed bytes
+ * at \p in into \p out, whose capacity is in \p *out_len.  Set
+ * \p *out_len to the decompressed size and return RS_DONE; anything
+ * else fails the patch with RS_CORRUPT.
+ */
+typedef rs_result rs_decompress_cb(void *opaque, const void *in, size_t in_len,
+                                   void *out, size_t *out_len);
+
+/**
+ * Attach a literal-payload codec to a job.
+ *
+ * On a delta job, literal runs above a small threshold are passed to
+ * \p compress_cb and emitted as compressed-literal commands when that
+ * wins; data is compressed in-pipeline while it is still cache-hot,
+ * replacing a separate pass over the finished delta.  On a patch job,
+ * \p decompress_cb expands those commands; applying a delta that
+ * contains compressed literals without a codec fails.  Deltas from a
+ * job with no codec are unchanged, and the codec choice is the
+ * application's contract between its two ends (librsync records only
+ * the compressed and raw lengths).  Either callback may be NULL on a
+ * job that only runs the other direction.
+ */
+void            rs_job_set_compression(rs_job_t *job,
+                                       rs_compress_cb *compress_cb,
+                                       rs_decompress_cb *decompress_cb,
+                                       void *opaque);
+
+/**
+ * \brief How much more input the job needs before it can make
+ * progress.
+ *
+ * After rs_job_iter() returns ::RS_BLOCKED, this gives the minimum
+ * number of additional input bytes the next iteration needs to get
+ * past the point it blocked at - a delta scan wanting a full block of
+ * readahead, a patch job mid-command, and so on.  Event-driven callers
+ * can use it to set a socket low-water mark or batch the next read to
+ * exactly the required size instead of retrying the job on every small
+ * arrival.
+ *
+ * Returns 0 when the job is not waiting on input (for example when it
+ * blocked on output space); feeding more input then doesn't help.
+ * The value is a floor for progress, not the total remaining work.
+ **/
+size_t          rs_job_input_needed(rs_job_t *job);
+
 /** Deallocate job state.
+ *
+ * If a job pool is installed the job may be parked there for reuse
+ * instead of freed; see rs_job_pool_install().
  */
 rs_result       rs_job_free(rs_job_t *);
 
+/**
+ * \brief A pool of idle jobs kept for reuse.
+ *
+ * Applications that run many short-lived jobs can install a pool so
+ * that rs_job_free() parks jobs instead of freeing them and subsequent
+ * job creation recycles them, readahead buffers and all.  Once warm, a
+ * steady stream of similarly sized jobs then allocates nothing.
+ */
+typedef struct rs_job_pool rs_job_pool_t;
+
+/** Create a job pool.
+ *
+ * \param max_idle Maximum idle jobs to keep parked, or zero for a
+ * reasonable default.  Jobs freed while the pool is full are released
+ * normally.
+ */
+rs_job_pool_t *rs_job_pool_new(int max_idle);
+
+/** Install \p pool for all subsequent job creation and freeing, or
+ * uninstall with NULL.
+ *
+ * The pool itself is thread-safe, but installing or uninstalling one
+ * while jobs are in flight on other threads is not.
+ */
+void rs_job_pool_install(rs_job_pool_t *pool);
+
+/** Free a pool and all jobs parked in it, uninstalling it if it is
+ * installed.  Jobs still in flight are unaffected and will be released
+ * normally when freed.
+ */
+void rs_job_pool_free(rs_job_pool_t *pool);
+
+/**
+ * \brief Fill in default signature arguments for a file of a given size.
+ *
+ * Any of \p magic, \p block_len and \p strong_len that are zero are
+ * replaced with good defaults: the recommended signature format, a block
+ * length that grows with the square root of \p old_fsize, and the
+ * smallest strong sum truncation that keeps the chance of any block
+ * collision below one in 2^32 (from the birthday bound).  Non-zero
+ * arguments are left untouched, so callers can pin any subset.
+ *
+ * \param old_fsize Size of the old file in bytes, or -1 if unknown.
+ *
+ * \param magic Signature file format to generate, or zero for the
+ * recommended format.  See ::rs_magic_number.
+ *
+ * \param block_len Size of checksum blocks, or zero to choose from
+ * \p old_fsize.  Larger values make the signature shorter, and the
+ * delta longer.
+ *
+ * \param strong_len Bytes to truncate the strong signatures to, or zero
+ * to choose the shortest collision-safe length for \p old_fsize.
+ *
+ * \return RS_DONE, or RS_BAD_MAGIC if \p magic is not a valid signature
+ * magic number.
+ *
+ * \sa rs_sig_begin(), rs_sig_file()
+ */
+rs_result rs_sig_args(rs_long_t old_fsize, rs_magic_number *magic,
+                      size_t *block_len, size_t *strong_len);
+
 /**
  * \brief Start generating a signature.
  *
  * \return A new rs_job_t into which the old file data can be passed.
  *
  * \param sig_magic Indicates the version of signature file format to generate.
- * See ::rs_magic_number.
+ * See ::rs_magic_number.  Zero means the recommended format.
  *
  * \param new_block_len Size of checksum blocks.  Larger values make the
- * signature shorter, and the delta longer.
+ * signature shorter, and the delta longer.  Zero means pick a default;
+ * the file size isn't known here, so use rs_sig_args() beforehand if it
+ * is available.
  *
  * \param strong_sum_len If non-zero, truncate the strong signatures to this
- * many bytes, to make the signature shorter.  It's recommended you leave this
- * at zero to get the full strength.
+ * many bytes, to make the signature shorter.  Zero means use the full
+ * strength, or use rs_sig_args() to get the shortest safe truncation.
  *
- * \sa rs_sig_file()
+ * \sa rs_sig_args(), rs_sig_file()
  */
 rs_job_t *rs_sig_begin(size_t new_block_len,
                        size_t strong_sum_len,
                        rs_magic_number sig_magic);
 
+/**
+ * \brief Start generating a signature using several hashing threads.
+ *
+ * Batches of blocks are hashed concurrently and the sums emitted in
+ * order, so the output is byte-identical to rs_sig_begin().  On
+ * platforms without thread support, or when \p nthreads is <= 1, this
+ * is equivalent to rs_sig_begin().
+ *
+ * \param nthreads Number of hashing threads to use.
+ *
+ * \sa rs_sig_begin()
+ */
+rs_job_t *rs_sig_begin_parallel(size_t new_block_len,
+                                size_t strong_sum_len,
+                                rs_magic_number sig_magic,
+                                int nthreads);
+
 /**
  * Prepare to compute a streaming delta.
  *
@@ -495,6 +889,151 @@ rs_job_t *rs_sig_begin(size_t new_block_len,
  **/
 rs_job_t *rs_delta_begin(rs_signature_t *);
 
+/**
+ * Split a new file of \p new_len bytes into up to \p max_segs segments
+ * for segment-parallel delta generation.
+ *
+ * Fills \p starts (which must hold \p max_segs entries) with the byte
+ * offset of each segment and returns the number of segments chosen.
+ * Boundaries fall on \p block_len multiples so block-aligned content
+ * still matches right up to each seam, and tiny inputs get fewer
+ * segments than requested rather than sub-block slivers.
+ *
+ * Run one ordinary delta job per segment - each segment's bytes as
+ * that job's whole input - on as many cores as you like, then merge
+ * the resulting deltas with rs_delta_stitch_begin().
+ **/
+int rs_delta_segments(rs_long_t new_len, size_t block_len, int max_segs,
+                      rs_long_t *starts);
+
+/**
+ * Prepare to stitch per-segment deltas into one delta.
+ *
+ * The job's input is the segment deltas concatenated in segment order,
+ * each a complete delta as produced by rs_delta_begin() or
+ * rs_delta_begin_v2() (all in the same format); the output is a single
+ * valid delta for the whole file.  Inner headers and END commands are
+ * stripped, and a COPY ending one segment merges with a contiguous
+ * COPY starting the next, the same coalescing the scanner does within
+ * a segment.  COPY offsets address the shared basis, so they pass
+ * through unchanged.
+ *
+ * Because each segment is scanned independently, a match window that
+ * straddles a boundary is seen by neither side, so up to a block of
+ * literal data can appear per seam; cut segments with
+ * rs_delta_segments() to limit that to unaligned changes.
+ **/
+rs_job_t *rs_delta_stitch_begin(void);
+
+/**
+ * Like rs_delta_begin(), but emitting the compact ::RS_DELTA2_MAGIC
+ * varint encoding instead of the fixed-width v1 commands.
+ *
+ * The v2 delta is typically much smaller when it consists of many
+ * short, near-sequential COPY commands.  rs_patch_begin() decodes
+ * either format, switching on the magic; v1 remains the default for
+ * compatibility with other librsync implementations.
+ **/
+rs_job_t *rs_delta_begin_v2(rs_signature_t *);
+
+/**
+ * Prepare to compute a delta against two resolutions of signature.
+ *
+ * Both signatures describe the same basis: \p coarse_sig with large
+ * blocks (say a megabyte) and \p fine_sig with ordinary small blocks.
+ * The scan consults the small coarse table first and falls back to the
+ * fine one only where no whole coarse block matches, so on huge bases
+ * the hot hashtable stays cache-sized while small edits still get
+ * fine-block delta quality.  Both hash tables must be built, and the
+ * coarse block length must be greater than the fine one.  Needs
+ * readahead of one coarse block, so buffer use grows accordingly.
+ *
+ * \sa rs_delta_begin()
+ **/
+rs_job_t *rs_delta_begin_hier(rs_signature_t *coarse_sig,
+                              rs_signature_t *fine_sig);
+
+/**
+ * Prepare to compute a delta using several worker threads.
+ *
+ * Unlike rs_delta_begin(), the returned job buffers the whole input in
+ * memory before scanning it, so this is intended for large inputs that
+ * would leave cores idle under the streaming engine, not for
+ * incremental network use.  The output is a normal delta stream.
+ *
+ * On platforms without thread support, or when \p nthreads is <= 1,
+ * this is equivalent to rs_delta_begin().
+ *
+ * \param nthreads Number of scan threads to use.
+ **/
+rs_job_t *rs_delta_begin_parallel(rs_signature_t *, int nthreads);
+
+/**
+ * Get the image size rs_job_checkpoint() needs for this job.
+ *
+ * Returns 0 if the job cannot be checkpointed; see
+ * rs_job_checkpoint().
+ **/
+size_t rs_job_checkpoint_size(rs_job_t *job);
+
+/**
+ * Serialize a delta job's position into \p image for a later restart.
+ *
+ * A delta of a huge file can run for a long time; a checkpoint lets a
+ * restarted process continue from the last emitted command instead of
+ * byte zero.  The image holds the scan position, pending match, rolling
+ * checksum state, unprocessed buffered input and statistics — not the
+ * signature, which is re-attached by rs_job_resume().
+ *
+ * Checkpoint when rs_job_iter() has returned ::RS_BLOCKED waiting for
+ * input, with all pending output drained and all offered input
+ * consumed; otherwise ::RS_BLOCKED is returned and the caller should
+ * iterate further first.  Only plain streaming delta jobs from
+ * rs_delta_begin() or rs_delta_begin_v2() can be checkpointed; for
+ * anything else (or an image smaller than rs_job_checkpoint_size())
+ * this returns ::RS_PARAM_ERROR.
+ *
+ * The caller is responsible for persisting the delta bytes already
+ * written and for re-feeding input from the right offset after a
+ * resume (total bytes consumed so far is rs_job_statistics()
+ * ->in_bytes).  Like the v2 signature container, the image is a
+ * same-machine restart artifact, not a portable format.
+ **/
+rs_result rs_job_checkpoint(rs_job_t *job, void *image, size_t len);
+
+/**
+ * Recreate a delta job from a checkpoint image.
+ *
+ * \p sig must be the signature the checkpointed job was using (or one
+ * with the same block length and weaksum), with its hash table built.
+ * The returned job continues the scan exactly where the checkpoint was
+ * taken: append its output after the delta bytes already written, and
+ * feed it input starting at the in_bytes offset recorded in the image.
+ *
+ * Returns NULL and logs an error if the image is invalid or the
+ * signature doesn't match it.
+ **/
+rs_job_t *rs_job_resume(rs_signature_t *sig, const void *image, size_t len);
+
+/**
+ * Prepare to compute a delta and the input's new signature in one pass.
+ *
+ * The returned job behaves like one from rs_delta_begin(): it reads
+ * the new file and emits the delta against \p sig on its output
+ * stream.  As a side effect every input byte is also fed through a
+ * signature generator configured with \p new_block_len, \p strong_len
+ * and \p sig_magic (zeros mean automatic, as for rs_sig_begin()), so
+ * the input is read only once for both results.  The signature output
+ * is drained through \p sig_out_cb, which follows the rs_job_drive()
+ * output callback contract and is called with the internal signature
+ * job and its buffers.
+ *
+ * \sa rs_sig_delta_file()
+ **/
+rs_job_t *rs_sig_delta_begin(rs_signature_t *sig, size_t new_block_len,
+                             size_t strong_len, rs_magic_number sig_magic,
+                             rs_driven_cb *sig_out_cb, void *sig_out_arg);
+
 
 /**
  * \brief Read a signature from a file into an ::rs_signature structure
@@ -517,6 +1056,127 @@ rs_job_t *rs_loadsig_begin(rs_signature_t **);
 rs_result rs_build_hash_table(rs_signature_t* sums);
 
 
+/**
+ * Like rs_build_hash_table(), but inserting blocks from \p nthreads
+ * threads.
+ *
+ * A very large signature takes a long time to index single-threaded
+ * before the first match can be attempted.  Entries are read-only after
+ * the build, so threads can insert concurrently; the resulting table is
+ * equivalent to a serial build, though duplicate blocks racing may
+ * occasionally leave an extra (harmless) entry, so the exact delta
+ * bytes can vary between runs while the patched output cannot.
+ *
+ * Falls back to the serial build without thread support, when
+ * \p nthreads is <= 1, or when the signature is too small for threads
+ * to pay off.
+ */
+rs_result rs_build_hash_table_parallel(rs_signature_t *sums, int nthreads);
+
+
+/**
+ * Build the hashtable while a signature is loading.
+ *
+ * Call on a rs_loadsig_begin() job before iterating it, passing the
+ * signature file's size in bytes (the build needs the block array
+ * preallocated to its final size; pass 0 to disable).  Block insertion
+ * then runs on a thread trailing the parse, so table construction hides
+ * behind signature I/O instead of adding to first-delta latency, and
+ * the rs_build_hash_table() call afterwards just picks up the finished
+ * table.  A no-op for other job types or without thread support.
+ */
+void rs_job_set_eager_build(rs_job_t *job, rs_long_t sig_fsize);
+
+
+/**
+ * \brief Save a signature to \p sig_file in the ::RS_SIG2_MAGIC
+ * container format.
+ *
+ * The container stores the packed block sums and the prebuilt hash
+ * index page-aligned and in host byte order, so rs_loadsig_mmap() can
+ * map it back in without parsing or rebuilding anything.  The hash
+ * table is built first if the signature doesn't have one yet.
+ */
+rs_result rs_sig2_save(rs_signature_t *sums, FILE *sig_file);
+
+
+/**
+ * \brief Map a ::RS_SIG2_MAGIC signature file into memory in O(1).
+ *
+ * Returns a ready-to-use signature backed by an mmap of \p filename:
+ * no per-block parsing and no rs_build_hash_table() call is needed, and
+ * pages are faulted in lazily as the signature is probed.  The mapping
+ * is read-only; don't add blocks to the returned signature.  Release it
+ * with rs_free_sumset() as usual.
+ *
+ * Returns NULL if the file can't be opened, mapped, or isn't a valid
+ * v2 signature (including one saved on a platform with different byte
+ * order), in which case fall back to rs_loadsig_begin().
+ */
+rs_signature_t *rs_loadsig_mmap(const char *filename);
+
+
+/**
+ * \brief Load a signature, consulting an on-disk cache of prebuilt
+ * indexes first.
+ *
+ * The cache directory holds ::RS_SIG2_MAGIC containers named by a
+ * hash of the signature file's path, size and mtime.  On a hit the
+ * signature is mapped straight in - a stat and an mmap, no parsing
+ * and no rs_build_hash_table() call.  On a miss the v1 stream is
+ * parsed and indexed as usual and the result is saved back to the
+ * cache (atomically, so concurrent processes can share a cache
+ * directory); a changed signature file changes the key, so stale
+ * entries are never returned.  Pass a NULL \p cache_dir to skip the
+ * cache entirely.
+ *
+ * The returned signature is ready for rs_delta_begin() and is released
+ * with rs_free_sumset() as usual.
+ */
+rs_result rs_loadsig_cached(const char *sig_name, const char *cache_dir,
+                            rs_signature_t **sumset);
+
+
+/**
+ * \brief Return the image size needed to freeze \p sig with
+ * rs_signature_freeze().
+ *
+ * Builds the signature's hash table first if needed.  Returns 0 if the
+ * table can't be built.
+ */
+size_t rs_signature_freeze_size(rs_signature_t *sig);
+
+
+/**
+ * \brief Write a frozen, relocatable image of \p sig into \p image.
+ *
+ * The image is the same pointer-free ::RS_SIG2_MAGIC layout used on
+ * disk - block sums plus the prebuilt index as offsets, not pointers -
+ * so it can live in a memfd or shared memory segment and be attached
+ * from any process at any address with rs_signature_attach().  \p len
+ * must be at least rs_signature_freeze_size(); host byte order, so not
+ * a transfer format.
+ *
+ * \return RS_DONE, or RS_PARAM_ERROR if \p len is too small.
+ */
+rs_result rs_signature_freeze(rs_signature_t *sig, void *image, size_t len);
+
+
+/**
+ * \brief Use a frozen signature image in place, read-only.
+ *
+ * Returns a signature backed directly by \p image, ready for
+ * rs_delta_begin(); typically \p image is a shared mapping of a
+ * segment another process filled with rs_signature_freeze(), so every
+ * worker on the box shares one copy of the block sums and index.
+ * Release with rs_free_sumset() as usual; the image memory itself
+ * stays owned by the caller and must outlive the signature.
+ *
+ * Returns NULL if \p image is not a valid frozen signature.
+ */
+rs_signature_t *rs_signature_attach(void *image, size_t len);
+
+
 /**
  * \brief Callback used to retrieve parts of the basis file.
  *
@@ -534,6 +1194,19 @@ typedef rs_result rs_copy_cb(void *opaque, rs_long_t pos,
                              size_t *len, void **buf);
 
 
+/**
+ * \brief Prepare to compute a delta that can also read the basis.
+ *
+ * Like rs_delta_begin(), but \p copy_cb gives the job direct access to
+ * the basis, so block matches are extended backwards and forwards past
+ * block boundaries by byte comparison (xdelta style). A 1-byte
+ * insertion then costs a 1-byte literal instead of a block of literals
+ * until the scan realigns, which shrinks deltas on shifted data
+ * dramatically.
+ **/
+rs_job_t *rs_delta_begin_basis(rs_signature_t *, rs_copy_cb *copy_cb,
+                               void *copy_arg);
+
 
 /**
  * \brief Apply a \a delta to a \a basis file to recreate
@@ -560,6 +1233,62 @@ typedef rs_result rs_copy_cb(void *opaque, rs_long_t pos,
  */
 rs_job_t *rs_patch_begin(rs_copy_cb *copy_cb, void *copy_arg);
 
+/**
+ * \brief Merge the blocks of another signature into \p dest.
+ *
+ * Both signatures must have the same magic, block and strong sum
+ * lengths, and \p dest must not have its hash table built yet.  After
+ * merging, match offsets returned while computing a delta address the
+ * bases as if concatenated in merge order, each padded out to a whole
+ * number of blocks; rs_signature_basis_of() maps such an offset back
+ * to a basis.  Apply the delta with rs_patch_begin_multi().
+ *
+ * Matching against the union of several old versions raises hit rates
+ * considerably on rotated or snapshotted data.
+ *
+ * \return RS_DONE, or RS_PARAM_ERROR if the signatures don't agree or
+ * \p dest is already built or mapped.
+ */
+rs_result rs_signature_merge(rs_signature_t *dest, rs_signature_t const *src);
+
+/**
+ * \brief Map a merged-signature match offset back to its basis.
+ *
+ * \param local_pos If non-NULL, receives the offset within that basis.
+ *
+ * \return The basis id (position in merge order, the original
+ * signature being 0), or 0 with \p pos unchanged for signatures that
+ * were never merged.
+ */
+int rs_signature_basis_of(rs_signature_t const *sig, rs_long_t pos,
+                          rs_long_t *local_pos);
+
+/**
+ * \brief Callback used to copy data from one of several bases.
+ *
+ * As ::rs_copy_cb, with the extra \p basis argument naming which basis
+ * (in rs_signature_merge() order) the copy refers to.
+ */
+typedef rs_result rs_copy_multi_cb(void *opaque, int basis, rs_long_t pos,
+                                   size_t *len, void **buf);
+
+/**
+ * \brief Apply a delta made against a merged signature.
+ *
+ * \param copy_cb Callback to read a range out of one basis.
+ *
+ * \param basis_sizes, nbasis The byte size of each basis, in the order
+ * they were merged.
+ *
+ * \param block_len The block length the signatures were made with,
+ * needed to undo the per-basis block padding.
+ *
+ * \sa rs_signature_merge(), rs_patch_begin()
+ */
+rs_job_t *rs_patch_begin_multi(rs_copy_multi_cb *copy_cb, void *copy_arg,
+                               rs_long_t const *basis_sizes, int nbasis,
+                               size_t block_len);
+
 
 #ifndef RSYNC_NO_STDIO_INTERFACE
 #include <stdio.h>
@@ -573,6 +1302,62 @@ rs_job_t *rs_patch_begin(rs_copy_cb *copy_cb, void *copy_arg);
  * testing. */
 extern int rs_inbuflen, rs_outbuflen;
 
+/**
+ * Overlap file IO with computation in the whole-file operations.
+ *
+ * When non-zero, the whole-file functions below read ahead and write
+ * back on separate threads, keeping several buffers in flight so the
+ * job never stalls on the disk and the disk never idles during
+ * hashing.  The default 0 does all IO synchronously.  Has no effect on
+ * platforms without thread support. */
+extern int rs_async_io;
+
+/**
+ * \brief A pool of idle file IO buffers kept for reuse.
+ *
+ * The whole-file functions allocate fresh IO buffers per file, which
+ * adds up when driving thousands of small files.  Install a pool and
+ * freed buffers are parked on a free list instead, satisfying any
+ * later request they are big enough for.
+ */
+typedef struct rs_buf_pool rs_buf_pool_t;
+
+/** Create a buffer pool.
+ *
+ * \param max_idle Maximum idle buffers to keep parked, or zero for a
+ * reasonable default.  Buffers freed while the pool is full are
+ * released normally.
+ */
+rs_buf_pool_t *rs_buf_pool_new(int max_idle);
+
+/** Install \p pool for all subsequent file buffer use, or uninstall
+ * with NULL.
+ *
+ * The pool itself is thread-safe, but installing or uninstalling one
+ * while whole-file operations run on other threads is not.
+ */
+void rs_buf_pool_install(rs_buf_pool_t *pool);
+
+/** Free a pool and all buffers parked in it, uninstalling it if it is
+ * installed. */
+void rs_buf_pool_free(rs_buf_pool_t *pool);
+
+/** Pick IO buffer sizes for a whole-file operation.
+ *
+ * Sizes the buffers from the input file size and the signature block
+ * length: at least four blocks so the internal accumulator never
+ * grows mid-job, at most the file itself for small files, and up to a
+ * fixed cap of larger buffering for big streamed files.  The
+ * whole-file functions use this themselves; it is exposed for callers
+ * driving rs_whole_run() directly.
+ *
+ * \param fsize the input file size, or -1 if unknown.
+ *
+ * \param block_len the signature block length for the operation.
+ */
+void rs_whole_choose_buffers(rs_long_t fsize, size_t block_len,
+                             int *inbuflen, int *outbuflen);
+
 
 /**
  * Generate the signature of a basis file, and write it out to
@@ -582,12 +1367,14 @@ extern int rs_inbuflen, rs_outbuflen;
  *
  * \param sig_file Writable stdio file to which the signature will be written./
  *
- * \param block_len block size for signature generation, in bytes
+ * \param block_len block size for signature generation, in bytes, or
+ * zero to pick one from the basis file size with rs_sig_args()
  *
- * \param strong_len truncated length of strong checksums, in bytes
+ * \param strong_len truncated length of strong checksums, in bytes, or
+ * zero to pick one from the basis file size with rs_sig_args()
  *
  * \param sig_magic A signature magic number indicating
- * what format to use.
+ * what format to use, or zero for the recommended format.
  *
  * \param stats Optional pointer to receive statistics.
  *
@@ -612,6 +1399,127 @@ rs_result rs_loadsig_file(FILE *sig_file, rs_signature_t **sumset,
  **/
 rs_result rs_file_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf);
 
+/**
+ * State for rs_pread_copy_cb(). The contents are private.
+ **/
+typedef struct rs_pread_copy rs_pread_copy_t;
+
+/**
+ * Create the state for serving COPY commands from \p basis_file with
+ * pread() through an internal readahead window.
+ *
+ * Unlike rs_file_copy_cb() this never seeks the stream, so several
+ * jobs can patch against the same open basis file concurrently, each
+ * with its own state. Pass the returned state as the \p copy_arg for
+ * rs_patch_begin() with rs_pread_copy_cb(), and free it with
+ * rs_pread_copy_free() after the job.
+ *
+ * \return The new state, or NULL if the file has no descriptor or the
+ * platform has no pread(); fall back to rs_file_copy_cb() then.
+ **/
+rs_pread_copy_t *rs_pread_copy_new(FILE *basis_file);
+
+/**
+ * ::rs_copy_cb that reads the basis with pread() and readahead.
+ **/
+rs_result rs_pread_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf);
+
+/**
+ * Free the state created by rs_pread_copy_new().
+ **/
+void rs_pread_copy_free(rs_pread_copy_t *pc);
+
+/**
+ * State for rs_mmap_copy_cb(). The contents are private.
+ **/
+typedef struct rs_mmap_copy rs_mmap_copy_t;
+
+/**
+ * Create the state for serving COPY commands from a read-only mapping
+ * of the whole of \p basis_file.
+ *
+ * The callback lends pointers straight into the mapping instead of
+ * filling a buffer, so a COPY command costs a single memcpy from the
+ * page cache into the output stream and no read calls at all.  Pass
+ * the returned state as the \p copy_arg for rs_patch_begin() with
+ * rs_mmap_copy_cb(), and free it with rs_mmap_copy_free() after the
+ * job.
+ *
+ * \return The new state, or NULL if the file is not a plain nonempty
+ * file, doesn't fit in address space, or the platform has no mmap();
+ * fall back to rs_pread_copy_new() or rs_file_copy_cb() then.
+ **/
+rs_mmap_copy_t *rs_mmap_copy_new(FILE *basis_file);
+
+/**
+ * ::rs_copy_cb that lends pointers into a mapping of the basis.
+ **/
+rs_result rs_mmap_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf);
+
+/**
+ * Free the state created by rs_mmap_copy_new(), unmapping the basis.
+ **/
+void rs_mmap_copy_free(rs_mmap_copy_t *mc);
+
+/**
+ * Callback that copies a basis range directly to the final output.
+ *
+ * Invoked for large COPY commands instead of streaming them through
+ * the output buffer, so an implementation can keep the bytes entirely
+ * in the kernel (e.g. with copy_file_range()).  \p *len is the number
+ * of bytes wanted starting at basis offset \p pos; the callback sets
+ * it to the number actually copied, which may be less.  Setting it to
+ * 0 and returning ::RS_DONE declines the copy and the job streams it
+ * as usual.
+ */
+typedef rs_result rs_copy_range_cb(void *opaque, rs_long_t pos,
+                                   rs_long_t *len);
+
+/**
+ * Register a copy-range offload callback on a patch job.
+ *
+ * Large COPY extents are then handed to \p cb whenever every byte
+ * produced so far has already been drained, bypassing the output
+ * buffer completely.  Only usable with drivers that fully empty the
+ * output buffer between rs_job_iter() calls, as rs_whole_run() and
+ * rs_job_drive() do, and with the callback responsible for any
+ * flushing its output side needs.
+ */
+void rs_job_set_copy_range_cb(rs_job_t *job, rs_copy_range_cb *cb,
+                              void *opaque);
+
+/**
+ * State for rs_file_copy_range_cb(). The contents are private.
+ **/
+typedef struct rs_file_copy_range rs_file_copy_range_t;
+
+/**
+ * Create the state for offloading COPY commands from \p basis_file
+ * straight into \p new_file with copy_file_range().
+ *
+ * Pass the returned state to rs_job_set_copy_range_cb() with
+ * rs_file_copy_range_cb() on a patch job writing to \p new_file, and
+ * free it with rs_file_copy_range_free() after the job.  The callback
+ * flushes \p new_file before each kernel copy so the bytes land in
+ * order, and permanently declines after the first failure (e.g. the
+ * files are on different filesystems), falling back to streaming.
+ *
+ * \return The new state, or NULL if either file is not a plain file or
+ * the platform has no copy_file_range().
+ **/
+rs_file_copy_range_t *rs_file_copy_range_new(FILE *basis_file,
+                                             FILE *new_file);
+
+/**
+ * ::rs_copy_range_cb that copies with copy_file_range().
+ **/
+rs_result rs_file_copy_range_cb(void *arg, rs_long_t pos, rs_long_t *len);
+
+/**
+ * Free the state created by rs_file_copy_range_new().
+ **/
+void rs_file_copy_range_free(rs_file_copy_range_t *cr);
+
 
 /**
  * Generate a delta between a signature and a new file, int a delta file.
@@ -619,12 +1527,132 @@ rs_result rs_file_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf);
  **/
 rs_result rs_delta_file(rs_signature_t *, FILE *new_file, FILE *delta_file, rs_stats_t *);
 
+/**
+ * Like rs_delta_file(), but also opens the basis file for match
+ * extension past block boundaries; see rs_delta_begin_basis().
+ * \sa \ref api_whole
+ **/
+rs_result rs_delta_file_basis(rs_signature_t *, FILE *basis_file,
+                              FILE *new_file, FILE *delta_file, rs_stats_t *);
+
+/**
+ * In one pass over \p new_file, write its delta against \p sig into
+ * \p delta_file and its own new signature into \p sig_file; see
+ * rs_sig_delta_begin().  The signature parameters follow
+ * rs_sig_file(), with zero meaning a value chosen from the input file
+ * size.  \p stats reports the delta side.
+ * \sa \ref api_whole
+ **/
+rs_result rs_sig_delta_file(rs_signature_t *sig, FILE *new_file,
+                            FILE *sig_file, FILE *delta_file,
+                            size_t new_block_len, size_t strong_len,
+                            rs_magic_number sig_magic, rs_stats_t *stats);
+
+/**
+ * Like rs_sig_file(), but memory-maps the old file and feeds it to the
+ * job as one zero-copy input region.  Falls back to buffered IO if the
+ * file can't be mapped.
+ * \sa \ref api_whole
+ **/
+rs_result rs_sig_mmap(FILE *old_file, FILE *sig_file,
+                      size_t block_len, size_t strong_len,
+                      rs_magic_number sig_magic,
+                      rs_stats_t *stats);
+
+/**
+ * Like rs_delta_file(), but memory-maps the new file and feeds it to
+ * the job as one zero-copy input region.  Falls back to buffered IO if
+ * the file can't be mapped.
+ * \sa \ref api_whole
+ **/
+rs_result rs_delta_mmap(rs_signature_t *, FILE *new_file, FILE *delta_file, rs_stats_t *);
+
 
 /**
  * Apply a patch, relative to a basis, into a new file.
  * \sa \ref api_whole
  */
 rs_result rs_patch_file(FILE *basis_file, FILE *delta_file, FILE *new_file, rs_stats_t *);
+
+/**
+ * Apply a patch into an existing copy of the target, skipping writes
+ * for runs that are already correct.
+ *
+ * \p new_file must be opened read/write and positioned at the start;
+ * typically it holds an old or partial copy of the result.  Output is
+ * compared against what's already there and only differing runs are
+ * rewritten, with the file truncated to the new length at the end.
+ * On targets that are mostly up to date nearly all the write IO is
+ * skipped, at the cost of reading the target back once.
+ *
+ * \sa rs_patch_file()
+ */
+rs_result rs_patch_file_inplace(FILE *basis_file, FILE *delta_file,
+                                FILE *new_file, rs_stats_t *stats);
+
+/**
+ * \brief Generate the signature of an in-memory buffer in one pass.
+ *
+ * Unlike rs_sig_begin(), this runs a straight-line loop over \p old
+ * with no job, scoop or tube involvement, so it's the cheapest way to
+ * sign a buffer that's already complete in memory.  The output is
+ * byte-identical to the streaming signature.
+ *
+ * \param old, old_len The buffer to sign.
+ *
+ * \param block_len, strong_len, sig_magic As for rs_sig_begin(); zeros
+ * are resolved with rs_sig_args() from \p old_len.
+ *
+ * \param sig The output buffer; needs 12 bytes for the header plus
+ * (4 + strong_len) per block.
+ *
+ * \param sig_len On entry the size of \p sig; on success, the bytes
+ * written.
+ *
+ * \return RS_DONE, or RS_BLOCKED if \p sig is too small.
+ */
+rs_result rs_sig_buffer(const void *old, size_t old_len, size_t block_len,
+                        size_t strong_len, rs_magic_number sig_magic,
+                        void *sig, size_t *sig_len);
+
+/**
+ * \brief Generate a delta against an in-memory buffer in one pass.
+ *
+ * \param sig The signature of the old data, with its hash table built;
+ * NULL or empty for a "slack delta" of pure literals.
+ *
+ * \param new_buf, new_len The new data, complete in memory.
+ *
+ * \param delta The output buffer.  In the worst case the delta is the
+ * whole input as literals: allow new_len plus a few bytes of command
+ * overhead per block, plus 11 bytes of header and trailer.
+ *
+ * \param delta_len On entry the size of \p delta; on success, the
+ * bytes written.
+ *
+ * \return RS_DONE, or RS_BLOCKED if \p delta is too small.
+ */
+rs_result rs_delta_buffer(rs_signature_t *sig, const void *new_buf,
+                          size_t new_len, void *delta, size_t *delta_len);
+
+/**
+ * \brief Apply an in-memory delta to an in-memory basis in one pass.
+ *
+ * \param basis, basis_len The old data, complete in memory.
+ *
+ * \param delta, delta_len The complete delta.
+ *
+ * \param out The output buffer, sized for the whole new file.
+ *
+ * \param out_len On entry the size of \p out; on success, the bytes
+ * written.
+ *
+ * \return RS_DONE, RS_BLOCKED if \p out is too small, RS_BAD_MAGIC or
+ * RS_CORRUPT if \p delta is not a valid delta.
+ */
+rs_result rs_patch_buffer(const void *basis, size_t basis_len,
+                          const void *delta, size_t delta_len, void *out,
+                          size_t *out_len);
 #endif /* ! RSYNC_NO_STDIO_INTERFACE */
 
 #ifdef __cplusplus
@@ -382,3 +382,180 @@ rs_mdfour(unsigned char *out, void const *in, size_t n)
     rs_mdfour_update(&md, in, n);
     rs_mdfour_result(&md, out);
 }
+
+
+#if defined(__SSE2__) && !defined(WORDS_BIGENDIAN)
+
+/* Four-lane MD4 using SSE2, one independent message per 32-bit lane.
+ * MD4 has no instruction-level parallelism to speak of - every round
+ * depends on the last - so the only way to go faster is to hash
+ * several messages side by side.  The rounds below are the scalar
+ * ROUND1..3 with each operation widened to four lanes. */
+
+#include <emmintrin.h>
+
+#define F4(X,Y,Z) _mm_or_si128(_mm_and_si128(X,Y), _mm_andnot_si128(X,Z))
+#define G4(X,Y,Z) _mm_or_si128(_mm_or_si128(_mm_and_si128(X,Y), \
+                                            _mm_and_si128(X,Z)), \
+                               _mm_and_si128(Y,Z))
+#define H4(X,Y,Z) _mm_xor_si128(_mm_xor_si128(X,Y),(Z))
+#define lshift4(x,s) _mm_or_si128(_mm_slli_epi32(x,s), _mm_srli_epi32(x,32-(s)))
+
+#define ROUND1x4(a,b,c,d,k,s) \
+    a = lshift4(_mm_add_epi32(_mm_add_epi32(a, F4(b,c,d)), X[k]), s)
+#define ROUND2x4(a,b,c,d,k,s) \
+    a = lshift4(_mm_add_epi32(_mm_add_epi32(_mm_add_epi32(a, G4(b,c,d)), \
+                                            X[k]), K2), s)
+#define ROUND3x4(a,b,c,d,k,s) \
+    a = lshift4(_mm_add_epi32(_mm_add_epi32(_mm_add_epi32(a, H4(b,c,d)), \
+                                            X[k]), K3), s)
+
+/* An unaligned little-endian 32-bit load. */
+inline static uint32_t rs_md4_read4(unsigned char const *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+/** Accumulate one 64-byte chunk from each of four messages. */
+static void rs_mdfour64x4(__m128i state[4], unsigned char const *const p[4])
+{
+    const __m128i K2 = _mm_set1_epi32(0x5A827999);
+    const __m128i K3 = _mm_set1_epi32(0x6ED9EBA1);
+    __m128i X[16];
+    __m128i A, B, C, D;
+    int k;
+
+    for (k = 0; k < 16; k++)
+        X[k] = _mm_set_epi32(rs_md4_read4(p[3] + 4 * k),
+                             rs_md4_read4(p[2] + 4 * k),
+                             rs_md4_read4(p[1] + 4 * k),
+                             rs_md4_read4(p[0] + 4 * k));
+
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+
+    ROUND1x4(A, B, C, D, 0, 3);
+    ROUND1x4(D, A, B, C, 1, 7);
+    ROUND1x4(C, D, A, B, 2, 11);
+    ROUND1x4(B, C, D, A, 3, 19);
+    ROUND1x4(A, B, C, D, 4, 3);
+    ROUND1x4(D, A, B, C, 5, 7);
+    ROUND1x4(C, D, A, B, 6, 11);
+    ROUND1x4(B, C, D, A, 7, 19);
+    ROUND1x4(A, B, C, D, 8, 3);
+    ROUND1x4(D, A, B, C, 9, 7);
+    ROUND1x4(C, D, A, B, 10, 11);
+    ROUND1x4(B, C, D, A, 11, 19);
+    ROUND1x4(A, B, C, D, 12, 3);
+    ROUND1x4(D, A, B, C, 13, 7);
+    ROUND1x4(C, D, A, B, 14, 11);
+    ROUND1x4(B, C, D, A, 15, 19);
+
+    ROUND2x4(A, B, C, D, 0, 3);
+    ROUND2x4(D, A, B, C, 4, 5);
+    ROUND2x4(C, D, A, B, 8, 9);
+    ROUND2x4(B, C, D, A, 12, 13);
+    ROUND2x4(A, B, C, D, 1, 3);
+    ROUND2x4(D, A, B, C, 5, 5);
+    ROUND2x4(C, D, A, B, 9, 9);
+    ROUND2x4(B, C, D, A, 13, 13);
+    ROUND2x4(A, B, C, D, 2, 3);
+    ROUND2x4(D, A, B, C, 6, 5);
+    ROUND2x4(C, D, A, B, 10, 9);
+    ROUND2x4(B, C, D, A, 14, 13);
+    ROUND2x4(A, B, C, D, 3, 3);
+    ROUND2x4(D, A, B, C, 7, 5);
+    ROUND2x4(C, D, A, B, 11, 9);
+    ROUND2x4(B, C, D, A, 15, 13);
+
+    ROUND3x4(A, B, C, D, 0, 3);
+    ROUND3x4(D, A, B, C, 8, 9);
+    ROUND3x4(C, D, A, B, 4, 11);
+    ROUND3x4(B, C, D, A, 12, 15);
+    ROUND3x4(A, B, C, D, 2, 3);
+    ROUND3x4(D, A, B, C, 10, 9);
+    ROUND3x4(C, D, A, B, 6, 11);
+    ROUND3x4(B, C, D, A, 14, 15);
+    ROUND3x4(A, B, C, D, 1, 3);
+    ROUND3x4(D, A, B, C, 9, 9);
+    ROUND3x4(C, D, A, B, 5, 11);
+    ROUND3x4(B, C, D, A, 13, 15);
+    ROUND3x4(A, B, C, D, 3, 3);
+    ROUND3x4(D, A, B, C, 11, 9);
+    ROUND3x4(C, D, A, B, 7, 11);
+    ROUND3x4(B, C, D, A, 15, 15);
+
+    state[0] = _mm_add_epi32(state[0], A);
+    state[1] = _mm_add_epi32(state[1], B);
+    state[2] = _mm_add_epi32(state[2], C);
+    state[3] = _mm_add_epi32(state[3], D);
+}
+
+
+void
+rs_mdfour4(unsigned char *const out[4], void const *const in[4], size_t n)
+{
+    __m128i state[4];
+    unsigned char const *p[4];
+    unsigned char tail[4][128];
+    uint32_t w[4][4];
+    /* The messages all have the same length, so the padded final
+     * chunks have the same layout in every lane: one chunk when the
+     * leftover fits below the length field, otherwise two. */
+    size_t whole = n & ~(size_t)63, r = n - whole;
+    size_t tail_len = r < 56 ? 64 : 128;
+    size_t off;
+    int i, j;
+
+    state[0] = _mm_set1_epi32(0x67452301);
+    state[1] = _mm_set1_epi32(0xefcdab89);
+    state[2] = _mm_set1_epi32(0x98badcfe);
+    state[3] = _mm_set1_epi32(0x10325476);
+
+    for (off = 0; off < whole; off += 64) {
+        for (i = 0; i < 4; i++)
+            p[i] = (unsigned char const *)in[i] + off;
+        rs_mdfour64x4(state, p);
+    }
+
+    for (i = 0; i < 4; i++) {
+        memset(tail[i], 0, tail_len);
+        memcpy(tail[i], (unsigned char const *)in[i] + whole, r);
+        tail[i][r] = 0x80;
+        for (j = 0; j < 8; j++)
+            tail[i][tail_len - 8 + j] =
+                (unsigned char)(((uint64_t)n << 3) >> (8 * j));
+    }
+    for (off = 0; off < tail_len; off += 64) {
+        for (i = 0; i < 4; i++)
+            p[i] = tail[i] + off;
+        rs_mdfour64x4(state, p);
+    }
+
+    for (j = 0; j < 4; j++)
+        _mm_storeu_si128((__m128i *)w[j], state[j]);
+    for (i = 0; i < 4; i++) {
+        copy4(out[i], w[0][i]);
+        copy4(out[i] + 4, w[1][i]);
+        copy4(out[i] + 8, w[2][i]);
+        copy4(out[i] + 12, w[3][i]);
+    }
+}
+
+#else /* !__SSE2__ || WORDS_BIGENDIAN */
+
+void
+rs_mdfour4(unsigned char *const out[4], void const *const in[4], size_t n)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        rs_mdfour(out[i], in[i], n);
+}
+
+#endif /* !__SSE2__ || WORDS_BIGENDIAN */
@@ -121,6 +121,13 @@ foreach $i (@int_lens) {
   }
 }
 
+# Literals with a compressed payload: compressed length, then raw length.
+foreach $i (@int_lens) {
+  foreach $j (@int_lens) {
+    emit_cmd('LITERAL_Z', 0, $i, $j);
+  }
+}
+
 emit_cmd('RESERVED', $cmd_byte, 0, 0) while $cmd_byte <= 255;
 
 
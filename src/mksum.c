@@ -43,6 +43,10 @@
 #include <stdio.h>
 #include <assert.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include "librsync.h"
 #include "stream.h"
 #include "util.h"
@@ -55,6 +59,40 @@
 /* Possible state functions for signature generation. */
 static rs_result rs_sig_s_header(rs_job_t *);
 static rs_result rs_sig_s_generate(rs_job_t *);
+static rs_result rs_sig_s_generate_batch(rs_job_t *);
+static void rs_psig_attach(rs_job_t *job, int nthreads, int max_blocks);
+
+/** Maximum worker count for parallel signature generation. */
+#define RS_PSIG_MAX_THREADS 64
+/** Blocks hashed per worker in each batch. */
+#define RS_PSIG_BLOCKS_PER_THREAD 16
+/** Batch size used for single-threaded MD4 lane hashing. */
+#define RS_PSIG_MD4_BATCH 8
+
+/** Private state for batched signature generation.
+ *
+ * A batch of up to max_blocks whole blocks is read ahead, hashed by a
+ * pool of workers (or inline when nthreads is 1), and then the
+ * precomputed sums are emitted in order, one block per state
+ * iteration, exactly as the serial code would have written them.  The
+ * output is byte-identical to a serial signature. */
+struct rs_psig {
+    int nthreads;
+    int max_blocks;             /**< Batch capacity in blocks. */
+    int count;                  /**< Blocks in the current batch. */
+    int emit_idx;               /**< Next block to emit. */
+    size_t batch_len;           /**< Bytes covered by the batch. */
+    rs_weak_sum_t *weak_sums;
+    rs_strong_sum_t *strong_sums;
+};
+
+/** Arguments for one signature hashing worker. */
+typedef struct rs_psig_worker {
+    rs_signature_t *signature;
+    struct rs_psig *psig;
+    const rs_byte_t *buf;       /**< Start of the batch data. */
+    int first, last;            /**< Range of blocks [first, last). */
+} rs_psig_worker_t;
 
 
 
@@ -77,6 +115,16 @@ static rs_result rs_sig_s_header(rs_job_t *job)
              sig->magic, sig->block_len, sig->strong_sum_len);
     job->stats.block_len = sig->block_len;
 
+    /* MD4 strong sums can hash several blocks per call through the
+     * SIMD lanes, so batch even when no worker threads were asked
+     * for. */
+    if (!job->psig
+        && (sig->magic == RS_MD4_SIG_MAGIC || sig->magic == RS_RK_MD4_SIG_MAGIC))
+        rs_psig_attach(job, 1, RS_PSIG_MD4_BATCH);
+    if (job->psig) {
+        job->statefn = rs_sig_s_generate_batch;
+        return RS_RUNNING;
+    }
     job->statefn = rs_sig_s_generate;
     return RS_RUNNING;
 }
@@ -94,8 +142,20 @@ rs_sig_do_block(rs_job_t *job, const void *block, size_t len)
     rs_weak_sum_t       weak_sum;
     rs_strong_sum_t     strong_sum;
 
-    weak_sum = rs_calc_weak_sum(block, len);
-    rs_signature_calc_strong_sum(sig, block, len, &strong_sum);
+    if (sig->magic == RS_RK64_SIG_MAGIC) {
+        /* One rolling-sum pass yields both the key and the check. */
+        rabinkarp64_t rk;
+        uint64_t digest;
+
+        rabinkarp64_init(&rk);
+        rabinkarp64_update(&rk, block, len);
+        digest = rabinkarp64_digest(&rk);
+        weak_sum = (rs_weak_sum_t)digest;
+        rs_rk64_check_sum(digest, &strong_sum);
+    } else {
+        weak_sum = rs_signature_calc_weak_sum(sig, block, len);
+        rs_signature_calc_strong_sum(sig, block, len, &strong_sum);
+    }
     rs_squirt_n4(job, weak_sum);
     rs_tube_write(job, strong_sum, sig->strong_sum_len);
     if (rs_trace_enabled()) {
@@ -115,12 +175,25 @@ rs_sig_do_block(rs_job_t *job, const void *block, size_t len)
 static rs_result
 rs_sig_s_generate(rs_job_t *job)
 {
+    const size_t        pair_len = 4 + job->signature->strong_sum_len;
     rs_result           result;
     size_t              len;
     void                *block;
 
-    /* must get a whole block, otherwise try again */
+    /* Bulk path: process as many whole blocks as are already buffered
+     * in this one invocation, as long as each block's encoded sums fit
+     * the output directly (an empty tube writes straight to next_out).
+     * This removes a full job iteration of overhead per block, leaving
+     * generation hash-bound.  The tail and any partial block fall
+     * through to the one-at-a-time path below. */
     len = job->signature->block_len;
+    while (!job->write_len && job->stream->avail_out >= pair_len
+           && rs_scoop_readahead(job, len, &block) == RS_DONE) {
+        rs_scoop_advance(job, len);
+        rs_sig_do_block(job, block, len);
+    }
+
+    /* must get a whole block, otherwise try again */
     result = rs_scoop_read(job, len, &block);
     /* If we are near EOF, get whatever is left. */
     if (result == RS_INPUT_ENDED)
@@ -136,11 +209,309 @@ rs_sig_s_generate(rs_job_t *job)
 }
 
 
+/** Write out the precomputed sums for one block of a batch.
+ * \private */
+static rs_result rs_sig_emit_block(rs_job_t *job, rs_weak_sum_t weak_sum,
+                                   rs_strong_sum_t *strong_sum)
+{
+    rs_signature_t *sig = job->signature;
+
+    rs_squirt_n4(job, weak_sum);
+    rs_tube_write(job, strong_sum, sig->strong_sum_len);
+    if (rs_trace_enabled()) {
+        char strong_sum_hex[RS_MAX_STRONG_SUM_LENGTH * 2 + 1];
+        rs_hexify(strong_sum_hex, strong_sum, sig->strong_sum_len);
+        rs_trace("sent block: weak="FMT_WEAKSUM", strong=%s", weak_sum, strong_sum_hex);
+    }
+    job->stats.sig_blocks++;
+    return RS_RUNNING;
+}
+
+
+/** Hash one worker's share of a batch of blocks.
+ * \private */
+static void *rs_psig_hash_blocks(void *arg)
+{
+    rs_psig_worker_t *w = arg;
+    struct rs_psig *psig = w->psig;
+    rs_signature_t *sig = w->signature;
+    const size_t block_len = sig->block_len;
+    int full = w->last;
+    int i, j, n;
+
+    for (i = w->first; i < w->last; i++) {
+        size_t pos = (size_t)i * block_len;
+        size_t len = psig->batch_len - pos;
+        if (len > block_len)
+            len = block_len;
+        psig->weak_sums[i] = rs_signature_calc_weak_sum(sig, w->buf + pos, len);
+    }
+    i = w->first;
+    if (sig->magic == RS_MD4_SIG_MAGIC || sig->magic == RS_RK_MD4_SIG_MAGIC) {
+        /* Full-length blocks are independent equal-length messages, so
+         * hash them through the MD4 lanes; only a short final block
+         * falls through to the scalar loop. */
+        const void *bufs[RS_PSIG_MD4_BATCH];
+
+        if ((size_t)w->last * block_len > psig->batch_len)
+            full--;
+        while (i + 4 <= full) {
+            n = full - i;
+            if (n > RS_PSIG_MD4_BATCH)
+                n = RS_PSIG_MD4_BATCH;
+            for (j = 0; j < n; j++)
+                bufs[j] = w->buf + (size_t)(i + j) * block_len;
+            rs_calc_md4_sum_n(bufs, block_len, n, &psig->strong_sums[i]);
+            i += n;
+        }
+    }
+    for (; i < w->last; i++) {
+        size_t pos = (size_t)i * block_len;
+        size_t len = psig->batch_len - pos;
+        if (len > block_len)
+            len = block_len;
+        rs_signature_calc_strong_sum(sig, w->buf + pos, len,
+                                     &psig->strong_sums[i]);
+    }
+    return NULL;
+}
+
+
+/** Hash a whole batch of blocks, on the worker pool if there is one.
+ * \private */
+static void rs_psig_hash_batch(rs_job_t *job, const rs_byte_t *buf, int nblocks)
+{
+    struct rs_psig *psig = job->psig;
+    rs_psig_worker_t workers[RS_PSIG_MAX_THREADS];
+    int nworkers = psig->nthreads;
+    int s;
+
+    if (nworkers > nblocks)
+        nworkers = nblocks;
+    for (s = 0; s < nworkers; s++) {
+        workers[s].signature = job->signature;
+        workers[s].psig = psig;
+        workers[s].buf = buf;
+        workers[s].first = nblocks * s / nworkers;
+        workers[s].last = nblocks * (s + 1) / nworkers;
+    }
+#ifdef HAVE_PTHREAD_H
+    if (nworkers > 1) {
+        pthread_t threads[RS_PSIG_MAX_THREADS];
+        int created;
+
+        for (created = 1; created < nworkers; created++) {
+            if (pthread_create(&threads[created], NULL, rs_psig_hash_blocks,
+                               &workers[created])) {
+                rs_error("failed to create signature hash thread %d", created);
+                break;
+            }
+        }
+        rs_psig_hash_blocks(&workers[0]);
+        for (s = 1; s < created; s++)
+            pthread_join(threads[s], NULL);
+        /* Hash inline any shares that didn't get a thread. */
+        for (s = created; s < nworkers; s++)
+            rs_psig_hash_blocks(&workers[s]);
+        psig->count = nblocks;
+        psig->emit_idx = 0;
+        return;
+    }
+#endif
+    for (s = 0; s < nworkers; s++)
+        rs_psig_hash_blocks(&workers[s]);
+    psig->count = nblocks;
+    psig->emit_idx = 0;
+}
+
+
+/**
+ * State of hashing batches of blocks and emitting the sums in order.
+ * \private
+ */
+static rs_result rs_sig_s_generate_batch(rs_job_t *job)
+{
+    struct rs_psig *psig = job->psig;
+    const size_t block_len = job->signature->block_len;
+    rs_result result;
+    size_t len;
+    void *batch;
+
+    /* First drain any sums left over from the previous batch.  The
+     * first block goes out unconditionally (the tube can always stage
+     * one pair); the rest follow in the same invocation while they fit
+     * the output directly, so a whole batch usually costs one state
+     * iteration rather than one per block. */
+    if (psig->emit_idx < psig->count) {
+        const size_t pair_len = 4 + job->signature->strong_sum_len;
+        int i;
+
+        do {
+            i = psig->emit_idx++;
+            rs_sig_emit_block(job, psig->weak_sums[i], &psig->strong_sums[i]);
+        } while (psig->emit_idx < psig->count && !job->write_len
+                 && job->stream->avail_out >= pair_len);
+        return RS_RUNNING;
+    }
+    /* Read ahead a full batch of blocks, or whatever is left at EOF. */
+    len = (size_t)psig->max_blocks * block_len;
+    result = rs_scoop_readahead(job, len, &batch);
+    if (result == RS_INPUT_ENDED) {
+        len = rs_scoop_total_avail(job);
+        if (len == 0)
+            return RS_DONE;
+        result = rs_scoop_readahead(job, len, &batch);
+    }
+    if (result != RS_DONE) {
+        rs_trace("generate stopped: %s", rs_strerror(result));
+        return result;
+    }
+    psig->batch_len = len;
+    rs_trace("got "FMT_SIZE" byte batch", len);
+    rs_psig_hash_batch(job, batch, (int)((len + block_len - 1) / block_len));
+    /* The data is no longer needed once the sums are computed. */
+    rs_scoop_advance(job, len);
+    return RS_RUNNING;
+}
+
+void rs_psig_free(struct rs_psig *psig)
+{
+    free(psig->weak_sums);
+    free(psig->strong_sums);
+    free(psig);
+}
+
+
+/** Attach batch hashing state to a signature job.
+ * \private */
+static void rs_psig_attach(rs_job_t *job, int nthreads, int max_blocks)
+{
+    struct rs_psig *psig = rs_alloc_struct(struct rs_psig);
+
+    psig->nthreads = nthreads;
+    psig->max_blocks = max_blocks;
+    psig->weak_sums = rs_alloc(max_blocks * sizeof(rs_weak_sum_t),
+                               "psig weak sums");
+    psig->strong_sums = rs_alloc(max_blocks * sizeof(rs_strong_sum_t),
+                                 "psig strong sums");
+    job->psig = psig;
+}
+
+
+rs_job_t * rs_sig_begin_parallel(size_t new_block_len, size_t strong_sum_len,
+                                 rs_magic_number sig_magic, int nthreads)
+{
+    rs_job_t *job;
+
+    job = rs_sig_begin(new_block_len, strong_sum_len, sig_magic);
+#ifndef HAVE_PTHREAD_H
+    /* No thread support on this platform; batch on one thread. */
+    nthreads = 1;
+#endif
+    if (nthreads > RS_PSIG_MAX_THREADS)
+        nthreads = RS_PSIG_MAX_THREADS;
+    if (nthreads > 1)
+        rs_psig_attach(job, nthreads, nthreads * RS_PSIG_BLOCKS_PER_THREAD);
+    return job;
+}
+
+
+/** Smallest block length rs_sig_args() will pick automatically. */
+#define RS_SIG_MIN_BLOCK_LEN 256
+
+/* The number of bits needed to represent v. */
+static int rs_long_bits(rs_long_t v)
+{
+    int bits = 0;
+
+    while (v) {
+        v >>= 1;
+        bits++;
+    }
+    return bits;
+}
+
+/* The integer square root of v, rounded down. */
+static rs_long_t rs_long_sqrt(rs_long_t v)
+{
+    uint64_t u = (uint64_t)v, root = 0, b, t;
+
+    for (b = (uint64_t)1 << (rs_long_bits(v) / 2); b; b >>= 1) {
+        t = root | b;
+        if (t * t <= u)
+            root = t;
+    }
+    return (rs_long_t)root;
+}
+
+rs_result rs_sig_args(rs_long_t old_fsize, rs_magic_number *magic,
+                      size_t *block_len, size_t *strong_len)
+{
+    size_t max_strong_len;
+
+    /* Check the magic, defaulting to the recommended format. */
+    *magic = *magic ? *magic : RS_RK_BLAKE2_SIG_MAGIC;
+    switch (*magic) {
+    case RS_BLAKE2_SIG_MAGIC:
+    case RS_RK_BLAKE2_SIG_MAGIC:
+        max_strong_len = RS_BLAKE2_SUM_LENGTH;
+        break;
+    case RS_MD4_SIG_MAGIC:
+    case RS_RK_MD4_SIG_MAGIC:
+        max_strong_len = RS_MD4_SUM_LENGTH;
+        break;
+    case RS_RK64_SIG_MAGIC:
+        max_strong_len = RS_RK64_SUM_LENGTH;
+        break;
+    default:
+        rs_error("invalid magic %#x", (int)*magic);
+        return RS_BAD_MAGIC;
+    }
+    /* Pick a block length near sqrt(old_fsize), rounded up to a
+     * multiple of RS_SIG_MIN_BLOCK_LEN, so that both the signature and
+     * the number of delta commands grow with the square root of the
+     * file size rather than linearly. */
+    if (!*block_len) {
+        if (old_fsize < 0)
+            *block_len = RS_DEFAULT_BLOCK_LEN;
+        else {
+            rs_long_t len = rs_long_sqrt(old_fsize);
+            len += RS_SIG_MIN_BLOCK_LEN - 1;
+            len -= len % RS_SIG_MIN_BLOCK_LEN;
+            *block_len = len ? (size_t)len : RS_SIG_MIN_BLOCK_LEN;
+        }
+    }
+    /* Pick the smallest strong sum truncation that keeps the odds of
+     * any two different blocks colliding below 2^-32; by the birthday
+     * bound that needs 2*log2(block count) + 32 bits of strong sum. */
+    if (!*strong_len) {
+        if (old_fsize < 0)
+            *strong_len = max_strong_len;
+        else {
+            int bits = 2 * rs_long_bits(old_fsize / *block_len + 1) + 32;
+            *strong_len = (size_t)(bits + 7) / 8;
+            if (*strong_len > max_strong_len)
+                *strong_len = max_strong_len;
+        }
+    }
+    rs_trace("sig args for "FMT_LONG" byte file: magic=%#x, block_len="FMT_SIZE", strong_len="FMT_SIZE"",
+             old_fsize, (int)*magic, *block_len, *strong_len);
+    return RS_DONE;
+}
+
+
 rs_job_t * rs_sig_begin(size_t new_block_len, size_t strong_sum_len,
                         rs_magic_number sig_magic)
 {
     rs_job_t *job;
 
+    /* Resolve any zero "pick for me" arguments.  The file size isn't
+     * known here, so this fills in size-independent defaults; callers
+     * that do know it (e.g. rs_sig_file()) should use rs_sig_args()
+     * themselves for better choices.  A bad magic is left for
+     * rs_signature_init() to report when the job runs. */
+    rs_sig_args(-1, &sig_magic, &new_block_len, &strong_sum_len);
+
     job = rs_job_new("signature", rs_sig_s_header);
     job->signature = rs_alloc_struct(rs_signature_t);
     job->job_owns_sig = 1;
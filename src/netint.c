@@ -109,6 +109,32 @@ rs_squirt_netint(rs_job_t *job, rs_long_t d, int len)
 
 
 
+/**
+ * \brief Write an integer to a stream as an LEB128 varint.
+ *
+ * Seven bits per byte, least-significant group first, high bit set on
+ * every byte but the last.  \p d must be non-negative; signed values
+ * should be zigzag-mapped first (see rs_zigzag()).
+ */
+rs_result
+rs_squirt_varint(rs_job_t *job, rs_long_t d)
+{
+    unsigned char       buf[(RS_MAX_INT_BYTES * 8 + 6) / 7];
+    unsigned long long  v = (unsigned long long) d;
+    int                 len = 0;
+
+    do {
+        buf[len++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+
+    rs_tube_write(job, buf, len);
+
+    return RS_DONE;
+}
+
+
+
 rs_result
 rs_squirt_n4(rs_job_t *job, int val)
 {
@@ -142,6 +168,41 @@ rs_suck_netint(rs_job_t *job, rs_long_t *v, int len)
 }
 
 
+/**
+ * \brief Read an LEB128 varint from a stream.
+ *
+ * Unlike the fixed-width suck routines the length isn't known up
+ * front, so bytes are consumed as they arrive and a partial value is
+ * parked in the job (varint_acc/varint_shift) when the input blocks;
+ * just call again with more input.
+ */
+rs_result
+rs_suck_varint(rs_job_t *job, rs_long_t *v)
+{
+    unsigned char       b;
+    rs_result           result;
+
+    while ((result = rs_suck_byte(job, &b)) == RS_DONE) {
+        if (job->varint_shift > 63
+            || (job->varint_shift == 63 && (b & ~(unsigned char)1))) {
+            rs_error("varint overflows 64 bits");
+            return RS_CORRUPT;
+        }
+        job->varint_acc |= (rs_long_t)((unsigned long long)(b & 0x7f)
+                                       << job->varint_shift);
+        if (!(b & 0x80)) {
+            *v = job->varint_acc;
+            job->varint_acc = 0;
+            job->varint_shift = 0;
+            return RS_DONE;
+        }
+        job->varint_shift += 7;
+    }
+
+    return result;
+}
+
+
 rs_result
 rs_suck_byte(rs_job_t *job, unsigned char *v)
 {
@@ -167,6 +228,19 @@ rs_suck_n4(rs_job_t *job, int *v)
 }        
 
 
+int rs_varint_len(rs_long_t val)
+{
+    unsigned long long v = (unsigned long long) val;
+    int len = 1;
+
+    while (v > 0x7f) {
+        v >>= 7;
+        len++;
+    }
+    return len;
+}
+
+
 int rs_int_len(rs_long_t val)
 {
     if (!(val & ~(rs_long_t)0xff))
@@ -23,9 +23,27 @@
 rs_result rs_squirt_byte(rs_job_t *, unsigned char d);
 rs_result rs_squirt_netint(rs_job_t *, rs_long_t d, int len);
 rs_result rs_squirt_n4(rs_job_t *, int val);
+rs_result rs_squirt_varint(rs_job_t *, rs_long_t d);
 
 rs_result rs_suck_netint(rs_job_t *, rs_long_t *v, int len);
 rs_result rs_suck_byte(rs_job_t *, unsigned char *);
 rs_result rs_suck_n4(rs_job_t *, int *);
+rs_result rs_suck_varint(rs_job_t *, rs_long_t *v);
 
 int rs_int_len(rs_long_t val);
+int rs_varint_len(rs_long_t val);
+
+/** Zigzag-map a signed value so small magnitudes of either sign make
+ * short varints: 0, -1, 1, -2, ... become 0, 1, 2, 3, ... */
+static inline rs_long_t rs_zigzag(rs_long_t v)
+{
+    return (rs_long_t)(((unsigned long long)v << 1)
+                       ^ (v < 0 ? ~(unsigned long long)0 : 0));
+}
+
+static inline rs_long_t rs_unzigzag(rs_long_t z)
+{
+    unsigned long long u = (unsigned long long)z;
+
+    return (rs_long_t)((u >> 1) ^ (0 - (u & 1)));
+}
@@ -0,0 +1,309 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * Copyright (C) 2000, 2001 by Martin Pool <mbp@sourcefrog.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * oneshot.c -- Whole-buffer operations in a single pass.
+ *
+ * When both the input and the output are complete in-memory buffers
+ * there is nothing for the streaming machinery to do: no readahead to
+ * scoop up, no command headers to stage in the tube, no state to
+ * suspend.  These functions run straight-line loops over the buffers
+ * instead, producing and consuming exactly the same formats as the
+ * streaming jobs, for callers where the per-job fixed cost would
+ * otherwise dominate small operations.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "librsync.h"
+#include "command.h"
+#include "prototab.h"
+#include "netint.h"
+#include "sumset.h"
+#include "weaksum.h"
+#include "trace.h"
+
+
+/** An output cursor over a caller-supplied buffer. */
+typedef struct rs_obuf {
+    rs_byte_t *next;
+    rs_byte_t *end;
+} rs_obuf_t;
+
+/* Append a big-endian integer of the given width.  Returns false if it
+   doesn't fit. */
+static int rs_obuf_put_nint(rs_obuf_t *o, rs_long_t val, int width)
+{
+    int i;
+
+    if (o->end - o->next < width)
+        return 0;
+    for (i = width - 1; i >= 0; i--) {
+        o->next[i] = (rs_byte_t)val;
+        val >>= 8;
+    }
+    o->next += width;
+    return 1;
+}
+
+static int rs_obuf_put_bytes(rs_obuf_t *o, const void *buf, size_t len)
+{
+    if ((size_t)(o->end - o->next) < len)
+        return 0;
+    memcpy(o->next, buf, len);
+    o->next += len;
+    return 1;
+}
+
+/* Append a LITERAL command and its data, as rs_emit_literal_cmd()
+   would.  Long runs are split to keep each length in 32 bits. */
+static int rs_obuf_put_literal(rs_obuf_t *o, const rs_byte_t *buf, size_t len)
+{
+    size_t chunk;
+
+    while (len) {
+        chunk = len < 0x7fffffff ? len : 0x7fffffff;
+        int param_len = rs_int_len((rs_long_t)chunk);
+        int cmd = param_len == 1 ? RS_OP_LITERAL_N1
+            : param_len == 2 ? RS_OP_LITERAL_N2 : RS_OP_LITERAL_N4;
+        if (!rs_obuf_put_nint(o, cmd, 1)
+            || !rs_obuf_put_nint(o, (rs_long_t)chunk, param_len)
+            || !rs_obuf_put_bytes(o, buf, chunk))
+            return 0;
+        buf += chunk;
+        len -= chunk;
+    }
+    return 1;
+}
+
+/* Append a COPY command, as rs_emit_copy_cmd() would. */
+static int rs_obuf_put_copy(rs_obuf_t *o, rs_long_t where, rs_long_t len)
+{
+    const int where_bytes = rs_int_len(where);
+    const int len_bytes = rs_int_len(len);
+    int cmd;
+
+    if (where_bytes == 8)
+        cmd = RS_OP_COPY_N8_N1;
+    else if (where_bytes == 4)
+        cmd = RS_OP_COPY_N4_N1;
+    else if (where_bytes == 2)
+        cmd = RS_OP_COPY_N2_N1;
+    else
+        cmd = RS_OP_COPY_N1_N1;
+    if (len_bytes == 2)
+        cmd += 1;
+    else if (len_bytes == 4)
+        cmd += 2;
+    else if (len_bytes == 8)
+        cmd += 3;
+    return rs_obuf_put_nint(o, cmd, 1)
+        && rs_obuf_put_nint(o, where, where_bytes)
+        && rs_obuf_put_nint(o, len, len_bytes);
+}
+
+
+rs_result rs_sig_buffer(const void *old, size_t old_len, size_t block_len,
+                        size_t strong_len, rs_magic_number sig_magic,
+                        void *sig, size_t *sig_len)
+{
+    const rs_byte_t *p = old;
+    size_t remain = old_len, len;
+    rs_obuf_t o = {sig, (rs_byte_t *)sig + *sig_len};
+    rs_signature_t sums;
+    rs_strong_sum_t strong;
+    rs_result result;
+
+    if ((result = rs_sig_args((rs_long_t)old_len, &sig_magic, &block_len,
+                              &strong_len)) != RS_DONE)
+        return result;
+    /* Initialize a signature just for its validated parameters; no
+       blocks are ever added to it. */
+    if ((result = rs_signature_init(&sums, sig_magic, block_len, strong_len,
+                                    0)) != RS_DONE)
+        return result;
+    if (!rs_obuf_put_nint(&o, sums.magic, 4)
+        || !rs_obuf_put_nint(&o, sums.block_len, 4)
+        || !rs_obuf_put_nint(&o, sums.strong_sum_len, 4))
+        return RS_BLOCKED;
+    while (remain) {
+        len = remain < block_len ? remain : block_len;
+        rs_signature_calc_strong_sum(&sums, p, len, &strong);
+        if (!rs_obuf_put_nint(&o, rs_signature_calc_weak_sum(&sums, p, len), 4)
+            || !rs_obuf_put_bytes(&o, strong, strong_len))
+            return RS_BLOCKED;
+        p += len;
+        remain -= len;
+    }
+    *sig_len = o.next - (rs_byte_t *)sig;
+    rs_signature_done(&sums);
+    return RS_DONE;
+}
+
+
+rs_result rs_delta_buffer(rs_signature_t *sig, const void *new_buf,
+                          size_t new_len, void *delta, size_t *delta_len)
+{
+    const rs_byte_t *p = new_buf;
+    rs_obuf_t o = {delta, (rs_byte_t *)delta + *delta_len};
+    size_t pos = 0, miss_start = 0, win;
+    rs_long_t match, copy_pos = 0, copy_len = 0;
+    size_t block_len;
+    weaksum_t sum;
+
+    if (!rs_obuf_put_nint(&o, RS_DELTA_MAGIC, 4))
+        return RS_BLOCKED;
+    if (!sig || !sig->count) {
+        /* No signature: the whole input is one literal. */
+        if (!rs_obuf_put_literal(&o, p, new_len)
+            || !rs_obuf_put_nint(&o, RS_OP_END, 1))
+            return RS_BLOCKED;
+        *delta_len = o.next - (rs_byte_t *)delta;
+        return RS_DONE;
+    }
+    rs_signature_check(sig);
+    assert(sig->hashtable);
+    block_len = sig->block_len;
+    weaksum_init(&sum, rs_signature_weaksum_kind(sig));
+    win = new_len < block_len ? new_len : block_len;
+    weaksum_update(&sum, p, win);
+    while (win) {
+        match = rs_signature_find_match(sig, weaksum_digest(&sum), p + pos,
+                                        win);
+        if (match >= 0) {
+            /* Flush the pending literal and extend or queue a copy. */
+            if (copy_len && copy_pos + copy_len == match
+                && miss_start == pos) {
+                copy_len += win;
+            } else {
+                if (copy_len && !rs_obuf_put_copy(&o, copy_pos, copy_len))
+                    return RS_BLOCKED;
+                if (pos > miss_start
+                    && !rs_obuf_put_literal(&o, p + miss_start,
+                                            pos - miss_start))
+                    return RS_BLOCKED;
+                copy_pos = match;
+                copy_len = win;
+            }
+            pos += win;
+            miss_start = pos;
+            win = new_len - pos < block_len ? new_len - pos : block_len;
+            weaksum_reset(&sum);
+            weaksum_update(&sum, p + pos, win);
+        } else if (pos + win < new_len) {
+            /* Slide the full window forward a byte. */
+            weaksum_rotate(&sum, p[pos], p[pos + win]);
+            pos++;
+        } else {
+            /* At the end: shrink the window from the front. */
+            weaksum_rollout(&sum, p[pos]);
+            pos++;
+            win--;
+        }
+    }
+    if (copy_len && !rs_obuf_put_copy(&o, copy_pos, copy_len))
+        return RS_BLOCKED;
+    if (new_len > miss_start
+        && !rs_obuf_put_literal(&o, p + miss_start, new_len - miss_start))
+        return RS_BLOCKED;
+    if (!rs_obuf_put_nint(&o, RS_OP_END, 1))
+        return RS_BLOCKED;
+    *delta_len = o.next - (rs_byte_t *)delta;
+    return RS_DONE;
+}
+
+
+/* Read a big-endian integer of the given width, advancing the cursor.
+   Returns false if the input runs out. */
+static int rs_buf_get_nint(const rs_byte_t **p, const rs_byte_t *end,
+                           rs_long_t *val, size_t width)
+{
+    rs_long_t v = 0;
+
+    if ((size_t)(end - *p) < width)
+        return 0;
+    while (width--)
+        v = (v << 8) | *(*p)++;
+    *val = v;
+    return 1;
+}
+
+rs_result rs_patch_buffer(const void *basis, size_t basis_len,
+                          const void *delta, size_t delta_len, void *out,
+                          size_t *out_len)
+{
+    const rs_byte_t *p = delta, *pend = p + delta_len;
+    rs_obuf_t o = {out, (rs_byte_t *)out + *out_len};
+    const rs_prototab_ent_t *cmd;
+    rs_long_t magic = 0, param1, param2 = 0;
+    unsigned char op;
+
+    if (!rs_buf_get_nint(&p, pend, &magic, 4) || magic != RS_DELTA_MAGIC) {
+        rs_error("got magic number %#x rather than expected value %#x",
+                 (int)magic, RS_DELTA_MAGIC);
+        return RS_BAD_MAGIC;
+    }
+    while (p < pend) {
+        op = *p++;
+        cmd = &rs_prototab[op];
+        if (cmd->len_1) {
+            if (!rs_buf_get_nint(&p, pend, &param1, cmd->len_1))
+                break;
+        } else
+            param1 = cmd->immediate;
+        if (cmd->len_2 && !rs_buf_get_nint(&p, pend, &param2, cmd->len_2))
+            break;
+        switch (cmd->kind) {
+        case RS_KIND_LITERAL:
+            if ((rs_long_t)(pend - p) < param1)
+                goto corrupt;
+            if (!rs_obuf_put_bytes(&o, p, param1))
+                return RS_BLOCKED;
+            p += param1;
+            break;
+        case RS_KIND_COPY:
+            if (param1 < 0 || param2 < 0
+                || param1 + param2 > (rs_long_t)basis_len)
+                goto corrupt;
+            if (!rs_obuf_put_bytes(&o, (const rs_byte_t *)basis + param1,
+                                   param2))
+                return RS_BLOCKED;
+            break;
+        case RS_KIND_END:
+            *out_len = o.next - (rs_byte_t *)out;
+            return RS_DONE;
+        case RS_KIND_LITERAL_Z:
+            rs_error("compressed literals are not supported by rs_patch_buffer");
+            return RS_CORRUPT;
+        default:
+            rs_error("bogus command %#04x", op);
+            return RS_CORRUPT;
+        }
+    }
+  corrupt:
+    rs_error("delta ended without END command");
+    return RS_CORRUPT;
+}
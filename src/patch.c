@@ -44,12 +44,23 @@
 
 
 
+/** Smallest COPY extent worth a copy-range offload call; anything less
+ * streams through the output buffer as usual. */
+#define RS_COPY_OFFLOAD_MIN (128 * 1024)
+
 static rs_result rs_patch_s_cmdbyte(rs_job_t *);
 static rs_result rs_patch_s_params(rs_job_t *);
 static rs_result rs_patch_s_run(rs_job_t *);
 static rs_result rs_patch_s_literal(rs_job_t *);
+static rs_result rs_patch_s_literal_z(rs_job_t *);
 static rs_result rs_patch_s_copy(rs_job_t *);
 static rs_result rs_patch_s_copying(rs_job_t *);
+static rs_result rs_patch_s_v2_cmdbyte(rs_job_t *);
+static rs_result rs_patch_s_v2_literal(rs_job_t *);
+static rs_result rs_patch_s_v2_zlit_clen(rs_job_t *);
+static rs_result rs_patch_s_v2_zlit_rlen(rs_job_t *);
+static rs_result rs_patch_s_v2_where(rs_job_t *);
+static rs_result rs_patch_s_v2_len(rs_job_t *);
 
 
 /**
@@ -124,6 +135,10 @@ static rs_result rs_patch_s_run(rs_job_t *job)
         job->statefn = rs_patch_s_literal;
         return RS_RUNNING;
 
+    case RS_KIND_LITERAL_Z:
+        job->statefn = rs_patch_s_literal_z;
+        return RS_RUNNING;
+
     case RS_KIND_END:
         return RS_DONE;
         /* so we exit here; trying to continue causes an error */
@@ -164,6 +179,63 @@ static rs_result rs_patch_s_literal(rs_job_t *job)
 }
 
 
+/**
+ * Called on a LITERAL_Z command: param1 is the compressed payload
+ * length, param2 the raw length.  The payload is read in one piece,
+ * expanded through the job's codec into the scratch buffer, and
+ * drained to the output by the tube.
+ */
+static rs_result rs_patch_s_literal_z(rs_job_t *job)
+{
+    rs_long_t   comp_len = job->param1, raw_len = job->param2;
+    rs_result   result;
+    size_t      out_len;
+    void        *p;
+
+    rs_trace("LITERAL_Z(comp="FMT_LONG", raw="FMT_LONG")", comp_len, raw_len);
+
+    if (comp_len <= 0 || raw_len <= 0 || comp_len >= raw_len) {
+        rs_error("invalid lengths comp="FMT_LONG" raw="FMT_LONG" on LITERAL_Z command",
+                 comp_len, raw_len);
+        return RS_CORRUPT;
+    }
+
+    if (!job->decompress_cb) {
+        rs_error("delta contains compressed literals but the patch job has "
+                 "no codec; see rs_job_set_compression()");
+        return RS_PARAM_ERROR;
+    }
+
+    if ((result = rs_scoop_readahead(job, comp_len, &p)) != RS_DONE)
+        return result;
+
+    if (job->z_alloc < (size_t)raw_len) {
+        free(job->z_buf);
+        job->z_buf = rs_alloc(raw_len, "literal codec buffer");
+        job->z_alloc = raw_len;
+    }
+    out_len = raw_len;
+    if (job->decompress_cb(job->codec_arg, p, comp_len, job->z_buf, &out_len)
+        != RS_DONE || out_len != (size_t)raw_len) {
+        rs_error("decompression of "FMT_LONG" byte literal payload failed",
+                 comp_len);
+        return RS_CORRUPT;
+    }
+    rs_scoop_advance(job, comp_len);
+
+    job->stats.lit_cmds++;
+    job->stats.lit_bytes += raw_len;
+    if (!job->delta_v2)
+        job->stats.lit_cmdbytes += 1 + job->cmd->len_1 + job->cmd->len_2;
+
+    rs_tube_write_blob(job, job->z_buf, raw_len);
+
+    job->statefn = job->delta_v2 ? rs_patch_s_v2_cmdbyte
+                                 : rs_patch_s_cmdbyte;
+    return RS_RUNNING;
+}
+
+
 
 static rs_result rs_patch_s_copy(rs_job_t *job)
 {
@@ -199,6 +271,114 @@ static rs_result rs_patch_s_copy(rs_job_t *job)
 }
 
 
+/**
+ * Decode a LEB128 varint from a peeked buffer without consuming it.
+ *
+ * \return the number of bytes the varint occupies, or 0 if it is
+ * incomplete or overlong (the streaming parser will deal with it).
+ */
+static size_t rs_peek_varint(const rs_byte_t *p, size_t avail, rs_long_t *v)
+{
+    rs_long_t val = 0;
+    int shift = 0;
+    size_t i = 0;
+
+    while (i < avail) {
+        rs_byte_t b = p[i++];
+
+        if (shift > 63 || (shift == 63 && (b & ~1)))
+            return 0;
+        val |= (rs_long_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = val;
+            return i;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+
+/**
+ * Decode a big-endian netint of \p len bytes from a peeked buffer.
+ */
+static rs_long_t rs_peek_netint(const rs_byte_t *p, size_t len)
+{
+    rs_long_t v = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+
+/**
+ * Merge following contiguous COPY commands into the one being executed.
+ *
+ * rs_appendmatch() only merges matches it sees back-to-back, so deltas
+ * are full of adjacent COPYs whose extents abut in the basis.  Peeking
+ * at whole commands already buffered in the scoop or input and folding
+ * them into (basis_pos, basis_len) turns a run of small copy_cb reads
+ * into one large one.  Purely best-effort: a command split across the
+ * scoop boundary is left for the normal states to pick up.
+ */
+static void rs_patch_coalesce_copies(rs_job_t *job)
+{
+    rs_buffers_t *stream = job->stream;
+
+    while (1) {
+        const rs_byte_t *p;
+        size_t avail, consumed;
+        rs_long_t where, len;
+
+        if (job->scoop_avail) {
+            p = job->scoop_next;
+            avail = job->scoop_avail;
+        } else {
+            p = (const rs_byte_t *)stream->next_in;
+            avail = stream->avail_in;
+        }
+        if (!avail)
+            return;
+        if (job->delta_v2) {
+            rs_long_t diff;
+            size_t n1, n2;
+
+            if (p[0] != RS_OP2_COPY)
+                return;
+            if (!(n1 = rs_peek_varint(p + 1, avail - 1, &diff)))
+                return;
+            if (!(n2 = rs_peek_varint(p + 1 + n1, avail - 1 - n1, &len)))
+                return;
+            where = job->copy_ref + rs_unzigzag(diff);
+            consumed = 1 + n1 + n2;
+        } else {
+            const enum rs_op_kind kind = rs_prototab[p[0]].kind;
+            const size_t len_1 = rs_prototab[p[0]].len_1;
+            const size_t len_2 = rs_prototab[p[0]].len_2;
+
+            if (kind != RS_KIND_COPY || avail < 1 + len_1 + len_2)
+                return;
+            where = rs_peek_netint(p + 1, len_1);
+            len = rs_peek_netint(p + 1 + len_1, len_2);
+            consumed = 1 + len_1 + len_2;
+        }
+        if (len <= 0 || where != job->basis_pos + job->basis_len)
+            return;
+        rs_trace("merged COPY(where="FMT_LONG", len="FMT_LONG") into pending copy",
+                 where, len);
+        rs_scoop_advance(job, consumed);
+        job->basis_len += len;
+        if (job->delta_v2)
+            job->copy_ref = where + len;
+        job->stats.copy_cmds++;
+        job->stats.copy_bytes += len;
+        job->stats.copy_cmdbytes += consumed;
+    }
+}
+
+
 /**
  * Called when we're executing a COPY command and waiting for all the
  * data to be retrieved from the callback.
@@ -210,6 +390,43 @@ static rs_result rs_patch_s_copying(rs_job_t *job)
     void            *ptr;
     rs_buffers_t    *buffs = job->stream;
 
+    /* Fold any following contiguous COPY commands into this one, so
+     * the callback sees one large basis read instead of many small
+     * ones. */
+    rs_patch_coalesce_copies(job);
+
+    /* Offload a large copy straight from the basis to the output file
+     * when the caller registered a range callback and every byte
+     * produced so far has been drained: the tube is idle and nothing
+     * was written into the output buffer this iteration.  The copied
+     * bytes then never cross userspace; see rs_job_set_copy_range_cb(). */
+    if (job->copy_range_cb && !job->output_hash
+        && job->basis_len >= RS_COPY_OFFLOAD_MIN
+        && rs_tube_is_idle(job) && buffs->next_out == job->iter_out_mark) {
+        rs_long_t done = job->basis_len;
+
+        result = (job->copy_range_cb)(job->copy_range_arg, job->basis_pos,
+                                      &done);
+        if (result != RS_DONE)
+            return result;
+        if (done > 0) {
+            rs_trace("offloaded "FMT_LONG" copy bytes from offset "FMT_LONG"",
+                     done, job->basis_pos);
+            job->basis_pos += done;
+            job->basis_len -= done;
+            /* The bytes bypass the output stream, so account for them
+             * here; the drain side never sees them. */
+            job->stats.out_bytes += done;
+            job->progress_out += done;
+            job->progress_acc += done;
+            if (!job->basis_len)
+                job->statefn = job->delta_v2 ? rs_patch_s_v2_cmdbyte
+                                             : rs_patch_s_cmdbyte;
+            return RS_RUNNING;
+        }
+        /* The callback declined (e.g. cross-device); stream it. */
+    }
+
     /* copy only as much as will fit in the output buffer, so that we
      * don't have to block or store the input. */
     desired_len = len = (buffs->avail_out < job->basis_len) ? buffs->avail_out : job->basis_len;
@@ -246,13 +463,168 @@ static rs_result rs_patch_s_copying(rs_job_t *job)
 
     if (!job->basis_len) {
         /* Done! */
-        job->statefn = rs_patch_s_cmdbyte;
+        job->statefn = job->delta_v2 ? rs_patch_s_v2_cmdbyte
+                                     : rs_patch_s_cmdbyte;
     }
 
     return RS_RUNNING;
 }
 
 
+/**
+ * State of reading a command byte of the compact v2
+ * (::RS_DELTA2_MAGIC) encoding.  One byte per operation; the varint
+ * parameters are pulled in by the states below.
+ */
+static rs_result rs_patch_s_v2_cmdbyte(rs_job_t *job)
+{
+    rs_result result;
+
+    if ((result = rs_suck_byte(job, &job->op)) != RS_DONE)
+        return result;
+
+    switch (job->op) {
+    case RS_OP2_END:
+        rs_trace("got v2 END");
+        return RS_DONE;
+
+    case RS_OP2_LITERAL:
+        job->statefn = rs_patch_s_v2_literal;
+        return RS_RUNNING;
+
+    case RS_OP2_LITERAL_Z:
+        job->statefn = rs_patch_s_v2_zlit_clen;
+        return RS_RUNNING;
+
+    case RS_OP2_COPY:
+        job->statefn = rs_patch_s_v2_where;
+        return RS_RUNNING;
+
+    default:
+        rs_error("bogus v2 command %#04x", job->op);
+        return RS_CORRUPT;
+    }
+}
+
+
+/**
+ * Read a v2 LITERAL's length and start copying it through.
+ */
+static rs_result rs_patch_s_v2_literal(rs_job_t *job)
+{
+    rs_long_t   len;
+    rs_result   result;
+
+    if ((result = rs_suck_varint(job, &len)) != RS_DONE)
+        return result;
+
+    rs_trace("LITERAL(len="FMT_LONG")", len);
+
+    if (len < 0) {
+        rs_error("invalid length="FMT_LONG" on LITERAL command", len);
+        return RS_CORRUPT;
+    }
+
+    job->stats.lit_cmds++;
+    job->stats.lit_bytes    += len;
+    job->stats.lit_cmdbytes += 1 + rs_varint_len(len);
+
+    rs_tube_copy(job, len);
+
+    job->statefn = rs_patch_s_v2_cmdbyte;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Read a v2 LITERAL_Z's compressed payload length.
+ */
+static rs_result rs_patch_s_v2_zlit_clen(rs_job_t *job)
+{
+    rs_result result;
+
+    if ((result = rs_suck_varint(job, &job->param1)) != RS_DONE)
+        return result;
+
+    job->stats.lit_cmdbytes += 1 + rs_varint_len(job->param1);
+    job->statefn = rs_patch_s_v2_zlit_rlen;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Read a v2 LITERAL_Z's raw length and hand over to the common
+ * decompression state.
+ */
+static rs_result rs_patch_s_v2_zlit_rlen(rs_job_t *job)
+{
+    rs_result result;
+
+    if ((result = rs_suck_varint(job, &job->param2)) != RS_DONE)
+        return result;
+
+    job->stats.lit_cmdbytes += rs_varint_len(job->param2);
+    job->statefn = rs_patch_s_literal_z;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Read a v2 COPY's offset: a zigzag varint delta from the end of the
+ * previous copy.
+ */
+static rs_result rs_patch_s_v2_where(rs_job_t *job)
+{
+    rs_long_t   diff;
+    rs_result   result;
+
+    if ((result = rs_suck_varint(job, &diff)) != RS_DONE)
+        return result;
+
+    job->param1 = job->copy_ref + rs_unzigzag(diff);
+    job->stats.copy_cmdbytes += 1 + rs_varint_len(diff);
+
+    job->statefn = rs_patch_s_v2_len;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Read a v2 COPY's length and hand over to the common copying state.
+ */
+static rs_result rs_patch_s_v2_len(rs_job_t *job)
+{
+    rs_long_t   where = job->param1, len;
+    rs_result   result;
+
+    if ((result = rs_suck_varint(job, &len)) != RS_DONE)
+        return result;
+
+    rs_trace("COPY(where="FMT_LONG", len="FMT_LONG")", where, len);
+
+    if (len < 0) {
+        rs_error("invalid length="FMT_LONG" on COPY command", len);
+        return RS_CORRUPT;
+    }
+
+    if (where < 0) {
+        rs_error("invalid where="FMT_LONG" on COPY command", where);
+        return RS_CORRUPT;
+    }
+
+    job->basis_pos = where;
+    job->basis_len = len;
+    job->copy_ref = where + len;
+
+    job->stats.copy_cmds++;
+    job->stats.copy_bytes += len;
+    job->stats.copy_cmdbytes += rs_varint_len(len);
+
+    job->statefn = rs_patch_s_copying;
+    return RS_RUNNING;
+}
+
+
 /**
  * Called while we're trying to read the header of the patch.
  */
@@ -265,14 +637,16 @@ static rs_result rs_patch_s_header(rs_job_t *job)
     if ((result = rs_suck_n4(job, &v)) != RS_DONE)
         return result;
 
-    if (v != RS_DELTA_MAGIC) {
+    if (v == RS_DELTA_MAGIC) {
+        job->statefn = rs_patch_s_cmdbyte;
+    } else if (v == RS_DELTA2_MAGIC) {
+        job->delta_v2 = 1;
+        job->statefn = rs_patch_s_v2_cmdbyte;
+    } else {
         rs_error("got magic number %#x rather than expected value %#x", v, RS_DELTA_MAGIC);
         return RS_BAD_MAGIC;
-    } else
-        rs_trace("got patch magic %#x", v);
-
-
-    job->statefn = rs_patch_s_cmdbyte;
+    }
+    rs_trace("got patch magic %#x", v);
 
     return RS_RUNNING;
 }
@@ -290,3 +664,72 @@ rs_patch_begin(rs_copy_cb *copy_cb, void *copy_arg)
 
     return job;
 }
+
+
+/** State for dispatching copies to one of several bases.
+ *
+ * The delta's COPY offsets address the bases as if concatenated, each
+ * one padded out to a whole number of blocks; this maps them back to a
+ * basis id and a local offset (see rs_signature_merge()). */
+typedef struct rs_multi_basis {
+    rs_copy_multi_cb *copy_cb;
+    void *copy_arg;
+    int nbasis;
+    rs_long_t *starts;          /**< Merged-space start of each basis. */
+    rs_long_t *sizes;
+} rs_multi_basis_t;
+
+void rs_multi_basis_free(struct rs_multi_basis *multi)
+{
+    free(multi->starts);
+    free(multi->sizes);
+    free(multi);
+}
+
+/** A copy_cb that finds the right basis and forwards to the caller's
+ * multi-basis callback, clamping reads to the end of that basis. */
+static rs_result rs_multi_copy_cb(void *arg, rs_long_t pos, size_t *len,
+                                  void **buf)
+{
+    rs_multi_basis_t *m = arg;
+    int i = 0;
+
+    while (i + 1 < m->nbasis && pos >= m->starts[i + 1])
+        i++;
+    pos -= m->starts[i];
+    if (pos >= m->sizes[i]) {
+        rs_error("copy command points past end of basis %d", i);
+        return RS_CORRUPT;
+    }
+    if ((rs_long_t)*len > m->sizes[i] - pos)
+        *len = m->sizes[i] - pos;
+    return m->copy_cb(m->copy_arg, i, pos, len, buf);
+}
+
+rs_job_t *
+rs_patch_begin_multi(rs_copy_multi_cb *copy_cb, void *copy_arg,
+                     rs_long_t const *basis_sizes, int nbasis,
+                     size_t block_len)
+{
+    rs_multi_basis_t *m = rs_alloc_struct(rs_multi_basis_t);
+    rs_job_t *job;
+    rs_long_t next = 0;
+    int i;
+
+    assert(nbasis > 0);
+    assert(block_len > 0);
+    m->copy_cb = copy_cb;
+    m->copy_arg = copy_arg;
+    m->nbasis = nbasis;
+    m->starts = rs_alloc(nbasis * sizeof(m->starts[0]), "multi starts");
+    m->sizes = rs_alloc(nbasis * sizeof(m->sizes[0]), "multi sizes");
+    for (i = 0; i < nbasis; i++) {
+        m->starts[i] = next;
+        m->sizes[i] = basis_sizes[i];
+        /* Each basis occupies a whole number of blocks. */
+        next += (basis_sizes[i] + block_len - 1) / block_len * block_len;
+    }
+    job = rs_patch_begin(rs_multi_copy_cb, m);
+    job->multi = m;
+    return job;
+}
@@ -0,0 +1,351 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * Copyright (C) 2000, 2001 by Martin Pool <mbp@sourcefrog.net>
+ * Copyright (C) 2003 by Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * pdelta.c -- Parallel delta generation.
+ *
+ * rs_delta_begin_parallel() returns a job that runs the rollsum scan on
+ * several worker threads. Unlike the streaming engine in delta.c, it
+ * needs to see the whole input before scanning, so the job accumulates
+ * everything into the scoop until eof, partitions the buffer into one
+ * segment per thread, and scans the segments concurrently against the
+ * shared read-only signature. The per-segment match/miss runs are then
+ * stitched back together in input order and emitted through the normal
+ * tube machinery, so the resulting delta is a valid RS_DELTA_MAGIC
+ * stream indistinguishable from a serial one.
+ *
+ * A worker stops scanning at its segment boundary, but a match found
+ * near the end may extend into the next segment. The merge step keeps a
+ * running input position and trims the overlapping head off the next
+ * segment's runs, so every input byte is covered exactly once.
+ *
+ * The only data shared between workers is the signature. Lookups are
+ * read-only apart from the hashtable's optional stats counters, whose
+ * increments may race; the counts can come out slightly low but nothing
+ * else is affected.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "librsync.h"
+#include "emit.h"
+#include "stream.h"
+#include "util.h"
+#include "sumset.h"
+#include "job.h"
+#include "trace.h"
+#include "weaksum.h"
+
+#ifdef HAVE_PTHREAD_H
+
+/** Maximum worker count; segments smaller than this many blocks aren't
+ * worth a thread. */
+#define RS_PDELTA_MAX_THREADS 64
+#define RS_PDELTA_MIN_SEGMENT_BLOCKS 16
+
+/* Maximum accumulated miss run, matching rs_appendmiss() in delta.c. */
+#define RS_PDELTA_MAX_MISS 32768
+
+/** One match or miss run. A match has basis_pos >= 0; a miss has
+ * basis_pos == -1 and covers len literal bytes. */
+typedef struct rs_drun {
+    rs_long_t basis_pos;
+    size_t len;
+} rs_drun_t;
+
+/** A growable list of runs. */
+typedef struct rs_drun_list {
+    rs_drun_t *runs;
+    size_t count;
+    size_t size;
+} rs_drun_list_t;
+
+/** Per-worker scan arguments and results. */
+typedef struct rs_pdelta_seg {
+    rs_signature_t *signature;
+    const rs_byte_t *buf;       /**< The whole input buffer. */
+    size_t total;               /**< Total input length. */
+    size_t start;               /**< First scan position for this worker. */
+    size_t end;                 /**< First scan position of the next worker. */
+    rs_drun_list_t list;
+} rs_pdelta_seg_t;
+
+/** Private state for a parallel delta job. */
+struct rs_pdelta {
+    int nthreads;
+    rs_drun_list_t merged;
+    size_t emit_idx;
+};
+
+static void rs_drun_list_append(rs_drun_list_t *list, rs_long_t basis_pos, size_t len)
+{
+    rs_drun_t *last;
+
+    if (list->count) {
+        last = &list->runs[list->count - 1];
+        /* Extend a contiguous match, or grow a miss run up to the cap. */
+        if (basis_pos >= 0 && last->basis_pos >= 0
+            && last->basis_pos + (rs_long_t)last->len == basis_pos) {
+            last->len += len;
+            return;
+        }
+        if (basis_pos < 0 && last->basis_pos < 0
+            && last->len + len <= RS_PDELTA_MAX_MISS) {
+            last->len += len;
+            return;
+        }
+    }
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 64;
+        list->runs = rs_realloc(list->runs, list->size * sizeof(rs_drun_t), "pdelta run list");
+    }
+    list->runs[list->count].basis_pos = basis_pos;
+    list->runs[list->count].len = len;
+    list->count++;
+}
+
+/** Scan one segment, appending match/miss runs to the segment's list.
+ *
+ * This is the same scan delta.c does, including the shrinking-window
+ * handling for the final bytes of the input; only the last segment can
+ * reach that tail. */
+static void *rs_pdelta_scan_segment(void *arg)
+{
+    rs_pdelta_seg_t *seg = arg;
+    rs_signature_t *sig = seg->signature;
+    const size_t block_len = sig->block_len;
+    const rs_byte_t *buf = seg->buf;
+    size_t pos = seg->start;
+    size_t match_len;
+    rs_long_t match_pos;
+    weaksum_t sum;
+
+    weaksum_init(&sum, rs_signature_weaksum_kind(sig));
+    while (pos < seg->end) {
+        if (weaksum_count(&sum) == 0) {
+            match_len = seg->total - pos;
+            if (match_len > block_len)
+                match_len = block_len;
+            weaksum_update(&sum, buf + pos, match_len);
+        } else {
+            match_len = weaksum_count(&sum);
+        }
+        match_pos = rs_signature_find_match(sig, weaksum_digest(&sum),
+                                            buf + pos, match_len);
+        if (match_pos != -1) {
+            rs_drun_list_append(&seg->list, match_pos, match_len);
+            pos += match_len;
+            weaksum_reset(&sum);
+        } else {
+            if (pos + match_len < seg->total)
+                weaksum_rotate(&sum, buf[pos], buf[pos + match_len]);
+            else
+                weaksum_rollout(&sum, buf[pos]);
+            rs_drun_list_append(&seg->list, -1, 1);
+            pos++;
+        }
+    }
+    return NULL;
+}
+
+/** Merge per-segment run lists in order, trimming runs that overlap
+ * data already covered by a match extending out of the previous
+ * segment. */
+static void rs_pdelta_merge(struct rs_pdelta *pd, rs_pdelta_seg_t *segs, int nsegs)
+{
+    size_t gpos = 0;
+    int s;
+    size_t i;
+
+    for (s = 0; s < nsegs; s++) {
+        size_t rpos = segs[s].start;
+        for (i = 0; i < segs[s].list.count; i++) {
+            rs_drun_t run = segs[s].list.runs[i];
+            size_t run_start = rpos;
+            rpos += run.len;
+            if (rpos <= gpos)
+                continue;       /* entirely covered by the previous segment */
+            if (run_start < gpos) {
+                /* Trim the covered head. Trimming a match relies on the
+                 * matched block being byte-identical, the same
+                 * assumption a COPY command makes anyway. */
+                size_t trim = gpos - run_start;
+                if (run.basis_pos >= 0)
+                    run.basis_pos += trim;
+                run.len -= trim;
+            }
+            rs_drun_list_append(&pd->merged, run.basis_pos, run.len);
+            gpos = rpos;
+        }
+    }
+}
+
+/** Run the workers over the scooped input and build the merged run
+ * list. Called once, when all input has arrived. */
+static rs_result rs_pdelta_scan(rs_job_t *job)
+{
+    struct rs_pdelta *pd = job->pdelta;
+    const size_t total = job->scoop_avail;
+    const size_t block_len = job->signature->block_len;
+    rs_pdelta_seg_t *segs;
+    pthread_t *threads;
+    int nsegs, s;
+
+    /* Don't spin up threads for input that isn't worth splitting. */
+    nsegs = pd->nthreads;
+    while (nsegs > 1 && total / nsegs < RS_PDELTA_MIN_SEGMENT_BLOCKS * block_len)
+        nsegs--;
+    rs_trace("parallel scan of "FMT_SIZE" bytes on %d threads", total, nsegs);
+
+    segs = rs_alloc(nsegs * sizeof(rs_pdelta_seg_t), "pdelta segments");
+    threads = rs_alloc(nsegs * sizeof(pthread_t), "pdelta threads");
+    for (s = 0; s < nsegs; s++) {
+        rs_bzero(&segs[s], sizeof(segs[s]));
+        segs[s].signature = job->signature;
+        segs[s].buf = job->scoop_next;
+        segs[s].total = total;
+        segs[s].start = total * s / nsegs;
+        segs[s].end = total * (s + 1) / nsegs;
+    }
+    int created;
+    for (created = 1; created < nsegs; created++) {
+        if (pthread_create(&threads[created], NULL, rs_pdelta_scan_segment, &segs[created])) {
+            rs_error("failed to create delta scan thread %d", created);
+            break;
+        }
+    }
+    /* The calling thread scans the first segment itself. */
+    rs_pdelta_scan_segment(&segs[0]);
+    for (s = 1; s < created; s++)
+        pthread_join(threads[s], NULL);
+    /* Scan inline any segments that didn't get a thread. */
+    for (s = created; s < nsegs; s++)
+        rs_pdelta_scan_segment(&segs[s]);
+
+    rs_pdelta_merge(pd, segs, nsegs);
+    for (s = 0; s < nsegs; s++)
+        free(segs[s].list.runs);
+    free(segs);
+    free(threads);
+    return RS_DONE;
+}
+
+static rs_result rs_pdelta_s_emit(rs_job_t *job)
+{
+    struct rs_pdelta *pd = job->pdelta;
+    rs_result result;
+
+    /* The tube is idle when a statefn is entered, so each iteration can
+     * emit one run and then try to flush it. */
+    while (pd->emit_idx < pd->merged.count) {
+        rs_drun_t *run = &pd->merged.runs[pd->emit_idx++];
+        if (run->basis_pos >= 0) {
+            rs_trace("matched "FMT_SIZE" bytes at "FMT_LONG"!", run->len, run->basis_pos);
+            rs_emit_copy_cmd(job, run->basis_pos, run->len);
+            /* The matched data is dropped from the scoop. */
+            job->scoop_avail -= run->len;
+            job->scoop_next += run->len;
+        } else {
+            rs_trace("got "FMT_SIZE" bytes of literal data", run->len);
+            rs_emit_literal_cmd(job, run->len);
+            rs_tube_copy(job, run->len);
+        }
+        if ((result = rs_tube_catchup(job)) != RS_DONE)
+            return result;
+    }
+    rs_emit_end_cmd(job);
+    return RS_DONE;
+}
+
+/** Accumulate the whole input into the scoop, then scan it. */
+static rs_result rs_pdelta_s_fill(rs_job_t *job)
+{
+    rs_result result;
+    size_t len;
+
+    len = rs_scoop_total_avail(job);
+    if (job->scoop_avail < len)
+        rs_scoop_input(job, len);
+    if (!job->stream->eof_in)
+        return RS_BLOCKED;
+    if ((result = rs_pdelta_scan(job)) != RS_DONE)
+        return result;
+    job->statefn = rs_pdelta_s_emit;
+    return RS_RUNNING;
+}
+
+static rs_result rs_pdelta_s_header(rs_job_t *job)
+{
+    rs_emit_delta_header(job);
+    job->statefn = rs_pdelta_s_fill;
+    return RS_RUNNING;
+}
+
+void rs_pdelta_free(struct rs_pdelta *pd)
+{
+    free(pd->merged.runs);
+    free(pd);
+}
+
+rs_job_t *rs_delta_begin_parallel(rs_signature_t *sig, int nthreads)
+{
+    rs_job_t *job;
+
+    if (nthreads > RS_PDELTA_MAX_THREADS)
+        nthreads = RS_PDELTA_MAX_THREADS;
+    /* The serial streaming engine handles these cases already. */
+    if (nthreads <= 1 || !sig || sig->count == 0)
+        return rs_delta_begin(sig);
+
+    rs_signature_check(sig);
+    /* Caller must have called rs_build_hash_table() by now. */
+    assert(sig->hashtable);
+    job = rs_job_new("parallel delta", rs_pdelta_s_header);
+    job->signature = sig;
+    job->pdelta = rs_alloc_struct(struct rs_pdelta);
+    job->pdelta->nthreads = nthreads;
+    return job;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+void rs_pdelta_free(struct rs_pdelta *pd)
+{
+    free(pd);
+}
+
+rs_job_t *rs_delta_begin_parallel(rs_signature_t *sig, int nthreads)
+{
+    /* No thread support on this platform; use the serial engine. */
+    (void)nthreads;
+    return rs_delta_begin(sig);
+}
+
+#endif /* !HAVE_PTHREAD_H */
@@ -0,0 +1,78 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * rabinkarp -- The RabinKarp rolling checksum.
+ *
+ * Copyright (C) 2019 by Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include "rabinkarp.h"
+
+/* Constant multipliers for a 4x unrolled update; MULT4 is also applied to
+ * the accumulated hash for the 4 bytes shifted in per iteration. */
+#define MULT1 RABINKARP_MULT
+#define MULT2 (MULT1 * MULT1)
+#define MULT3 (MULT2 * MULT1)
+#define MULT4 (MULT3 * MULT1)
+
+/* The precomputed table of RABINKARP_MULT^(2^i) for i in 0..31, used for
+ * fast exponentiation by squaring. The tail of the table degenerates to
+ * 1 because the multiplier's even powers accumulate trailing zero bits
+ * modulo 2^32. */
+static const uint32_t RABINKARP_MULT_POW2[32] = {
+    0x08104225, 0xa5b71959, 0xf9c080f1, 0x7c71e2e1,
+    0x0bb409c1, 0x4dc72381, 0xd17a8701, 0x96260e01,
+    0x55101c01, 0x2d303801, 0x66a07001, 0xfe40e001,
+    0xc081c001, 0x91038001, 0x62070001, 0xc40e0001,
+    0x881c0001, 0x10380001, 0x20700001, 0x40e00001,
+    0x81c00001, 0x03800001, 0x07000001, 0x0e000001,
+    0x1c000001, 0x38000001, 0x70000001, 0xe0000001,
+    0xc0000001, 0x80000001, 0x00000001, 0x00000001,
+};
+
+/** Get RABINKARP_MULT^n using the precomputed power-of-2 powers table. */
+static inline uint32_t rabinkarp_pow(uint32_t n)
+{
+    const uint32_t *m = RABINKARP_MULT_POW2;
+    uint32_t ans = 1;
+
+    while (n) {
+        if (n & 1)
+            ans *= *m;
+        m++;
+        n >>= 1;
+    }
+    return ans;
+}
+
+void rabinkarp_update(rabinkarp_t *sum, const unsigned char *buf, size_t len)
+{
+    size_t n = len;
+    uint32_t hash = sum->hash;
+
+    while (n >= 4) {
+        hash = hash * MULT4 + buf[0] * MULT3 + buf[1] * MULT2 +
+            buf[2] * MULT1 + buf[3];
+        buf += 4;
+        n -= 4;
+    }
+    while (n) {
+        hash = hash * MULT1 + *buf++;
+        n--;
+    }
+    sum->hash = hash;
+    sum->count += len;
+    sum->mult *= rabinkarp_pow((uint32_t)len);
+}
@@ -50,9 +50,23 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <popt.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+#  include <direct.h>
+#  define mkdir(path, mode) _mkdir(path)
+#endif
+
 #ifdef HAVE_ZLIB_H
 #include <zlib.h>
 #endif
@@ -71,7 +85,7 @@
 
 #define PROGRAM "rdiff"
 
-static size_t block_len = RS_DEFAULT_BLOCK_LEN;
+static size_t block_len = 0;
 static size_t strong_len = 0;
 
 static int show_stats = 0;
@@ -80,6 +94,11 @@ static int bzip2_level = 0;
 static int gzip_level  = 0;
 static int file_force  = 0;
 
+static int recursive   = 0;
+static int num_jobs    = 0;
+
+static char *sig_cache_dir = NULL;
+
 enum {
     OPT_GZIP = 1069, OPT_BZIP2
 };
@@ -102,6 +121,9 @@ const struct poptOption opts[] = {
     { "gzip",        'z', POPT_ARG_NONE, 0,             OPT_GZIP },
     { "bzip2",       'i', POPT_ARG_NONE, 0,             OPT_BZIP2 },
     { "force",       'f', POPT_ARG_NONE, &file_force },
+    { "recursive",   'r', POPT_ARG_NONE, &recursive },
+    { "jobs",        'j', POPT_ARG_INT,  &num_jobs },
+    { "sig-cache",   'C', POPT_ARG_STRING, &sig_cache_dir },
     { "paranoia",     0,  POPT_ARG_NONE, &rs_roll_paranoia },
     { 0 }
 };
@@ -136,6 +158,10 @@ static void help(void) {
     printf("Usage: rdiff [OPTIONS] signature [BASIS [SIGNATURE]]\n"
            "             [OPTIONS] delta SIGNATURE [NEWFILE [DELTA]]\n"
            "             [OPTIONS] patch BASIS [DELTA [NEWFILE]]\n"
+           "             [OPTIONS] sigdelta OLDSIG NEWFILE DELTA NEWSIG\n"
+           "             [OPTIONS] signature -r BASISDIR SIGDIR\n"
+           "             [OPTIONS] delta -r SIGDIR NEWDIR DELTADIR\n"
+           "             [OPTIONS] serve\n"
            "\n"
            "Options:\n"
            "  -v, --verbose             Trace internal processing\n"
@@ -143,11 +169,15 @@ static void help(void) {
            "  -?, --help                Show this help message\n"
            "  -s, --statistics          Show performance statistics\n"
            "  -f, --force               Force overwriting existing files\n"
+           "  -r, --recursive           Operate on directory trees\n"
+           "  -j, --jobs=N              Worker threads for --recursive\n"
            "Signature generation options:\n"
-           "  -H, --hash=ALG            Hash algorithm: blake2 (default), md4\n"
+           "  -H, --hash=ALG            Hash algorithm: blake2 (default), md4,\n"
+           "                            rk_blake2, rk_md4\n"
            "Delta-encoding options:\n"
-           "  -b, --block-size=BYTES    Signature block size\n"
+           "  -b, --block-size=BYTES    Signature block size (default: from file size)\n"
            "  -S, --sum-size=BYTES      Set signature strength\n"
+           "  -C, --sig-cache=DIR       Cache prebuilt signature indexes in DIR\n"
            "      --paranoia            Verify all rolling checksums\n"
            "IO options:\n"
            "  -I, --input-size=BYTES    Input buffer size\n"
@@ -237,22 +267,19 @@ static void rdiff_options(poptContext opcon)
 
 
 /**
- * Generate signature from remaining command line arguments.
+ * Map the --hash name onto a signature magic, applying the per-hash
+ * default strong sum length.
  */
-static rs_result rdiff_sig(poptContext opcon)
+static rs_result rdiff_sig_magic(rs_long_t *sig_magic)
 {
-    FILE            *basis_file, *sig_file;
-    rs_stats_t      stats;
-    rs_result       result;
-    rs_long_t       sig_magic;
-
-    basis_file = rs_file_open(poptGetArg(opcon), "rb", file_force);
-    sig_file = rs_file_open(poptGetArg(opcon), "wb", file_force);
-
-    rdiff_no_more_args(opcon);
-
     if (!rs_hash_name || !strcmp(rs_hash_name, "blake2")) {
-        sig_magic = RS_BLAKE2_SIG_MAGIC;
+        *sig_magic = RS_BLAKE2_SIG_MAGIC;
+    } else if (!strcmp(rs_hash_name, "rk_blake2")) {
+        *sig_magic = RS_RK_BLAKE2_SIG_MAGIC;
+    } else if (!strcmp(rs_hash_name, "rk_md4")) {
+        if (!strong_len)
+            strong_len = 8;
+        *sig_magic = RS_RK_MD4_SIG_MAGIC;
     } else if (!strcmp(rs_hash_name, "md4")) {
         /* By default, for compatibility with rdiff 0.9.8 and before, mdfour
          * sums are truncated to only 8 bytes, making them even weaker, but
@@ -260,12 +287,451 @@ static rs_result rdiff_sig(poptContext opcon)
          */
         if (!strong_len)
             strong_len = 8;
-        sig_magic = RS_MD4_SIG_MAGIC;
+        *sig_magic = RS_MD4_SIG_MAGIC;
     } else {
         rs_error("unknown hash algorithm %s", rs_hash_name);
         return RS_PARAM_ERROR;
     }
 
+    return RS_DONE;
+}
+
+
+/** Most worker threads --recursive will run, however big --jobs is. */
+#define RDIFF_MAX_JOBS 64
+
+/** Worker threads used when --jobs is not given. */
+#define RDIFF_DEFAULT_JOBS 8
+
+/** File names found under a directory root, relative to that root. */
+typedef struct rdiff_filelist {
+    char            **names;
+    int             count;
+    int             alloc;
+} rdiff_filelist_t;
+
+/** Shared state for the --recursive worker pool.
+ *
+ * Workers claim the next unprocessed file under the mutex, run a whole
+ * signature or delta job on it with their own rs_job_t, then merge the
+ * per-file statistics into one batched total so output (stats, errors)
+ * is reported once per run rather than once per file.
+ */
+typedef struct rdiff_dirpool rdiff_dirpool_t;
+struct rdiff_dirpool {
+    rdiff_filelist_t *files;
+    int             next;       /* next unclaimed index in files */
+    rs_result       (*process)(rdiff_dirpool_t *pool, const char *name,
+                               rs_stats_t *stats);
+    const char      *in_root;   /* basis dir (signature) or new dir (delta) */
+    const char      *out_root;  /* where mirrored output files go */
+    const char      *sig_root;  /* signature dir, delta only */
+    rs_long_t       sig_magic;  /* signature only */
+    rs_result       result;     /* first failure, or RS_DONE */
+    rs_stats_t      total;      /* batched stats over all files */
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t mutex;
+#endif
+};
+
+
+/** Join ROOT and NAME with a slash into a new malloc'd path. */
+static char *rdiff_path_join(const char *root, const char *name)
+{
+    size_t len = strlen(root) + strlen(name) + 2;
+    char *path = rs_alloc(len, "path");
+
+    snprintf(path, len, "%s/%s", root, name);
+    return path;
+}
+
+
+static void rdiff_filelist_add(rdiff_filelist_t *list, const char *name)
+{
+    if (list->count == list->alloc) {
+        list->alloc = list->alloc ? 2 * list->alloc : 64;
+        list->names = rs_realloc(list->names,
+                                 list->alloc * sizeof(char *), "file list");
+    }
+    list->names[list->count++] = strdup(name);
+}
+
+
+static void rdiff_filelist_free(rdiff_filelist_t *list)
+{
+    int i;
+
+    for (i = 0; i < list->count; i++)
+        free(list->names[i]);
+    free(list->names);
+}
+
+
+/** Collect all regular files under ROOT/NAME into LIST, recursively.
+ * NAME is relative to ROOT and may be NULL for the root itself. */
+static rs_result rdiff_walk_dir(rdiff_filelist_t *list, const char *root,
+                                const char *name)
+{
+    char *dir_path = name ? rdiff_path_join(root, name) : strdup(root);
+    DIR *dir;
+    struct dirent *ent;
+    rs_result result = RS_DONE;
+
+    if (!(dir = opendir(dir_path))) {
+        rs_error("Error opening directory \"%s\": %s", dir_path,
+                 strerror(errno));
+        free(dir_path);
+        return RS_IO_ERROR;
+    }
+    while (result == RS_DONE && (ent = readdir(dir))) {
+        char *ent_name, *ent_path;
+        struct stat st;
+
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        ent_name = name ? rdiff_path_join(name, ent->d_name)
+            : strdup(ent->d_name);
+        ent_path = rdiff_path_join(root, ent_name);
+        if (stat(ent_path, &st)) {
+            rs_error("Error examining \"%s\": %s", ent_path, strerror(errno));
+            result = RS_IO_ERROR;
+        } else if (S_ISDIR(st.st_mode)) {
+            result = rdiff_walk_dir(list, root, ent_name);
+        } else if (S_ISREG(st.st_mode)) {
+            rdiff_filelist_add(list, ent_name);
+        } else {
+            rs_trace("skipping special file \"%s\"", ent_path);
+        }
+        free(ent_path);
+        free(ent_name);
+    }
+    closedir(dir);
+    free(dir_path);
+    return result;
+}
+
+
+/** Create PATH and any missing parents, like mkdir -p. */
+static rs_result rdiff_make_dirs(const char *path)
+{
+    char *copy = strdup(path);
+    char *slash = copy;
+
+    while ((slash = strchr(slash + 1, '/'))) {
+        *slash = '\0';
+        if (mkdir(copy, 0777) && errno != EEXIST) {
+            rs_error("Error creating directory \"%s\": %s", copy,
+                     strerror(errno));
+            free(copy);
+            return RS_IO_ERROR;
+        }
+        *slash = '/';
+    }
+    if (mkdir(copy, 0777) && errno != EEXIST) {
+        rs_error("Error creating directory \"%s\": %s", copy,
+                 strerror(errno));
+        free(copy);
+        return RS_IO_ERROR;
+    }
+    free(copy);
+    return RS_DONE;
+}
+
+
+/** Merge one file's statistics into the pool's batched total. */
+static void rdiff_stats_accumulate(rs_stats_t *total, const rs_stats_t *stats)
+{
+    total->lit_cmds += stats->lit_cmds;
+    total->lit_bytes += stats->lit_bytes;
+    total->lit_cmdbytes += stats->lit_cmdbytes;
+    total->copy_cmds += stats->copy_cmds;
+    total->copy_bytes += stats->copy_bytes;
+    total->copy_cmdbytes += stats->copy_cmdbytes;
+    total->sig_cmds += stats->sig_cmds;
+    total->sig_bytes += stats->sig_bytes;
+    total->false_matches += stats->false_matches;
+    total->sig_blocks += stats->sig_blocks;
+    total->in_bytes += stats->in_bytes;
+    total->out_bytes += stats->out_bytes;
+}
+
+
+/** Generate the signature for one file under the walked tree. */
+static rs_result rdiff_sig_one(rdiff_dirpool_t *pool, const char *name,
+                               rs_stats_t *stats)
+{
+    char *basis_name = rdiff_path_join(pool->in_root, name);
+    char *sig_name = rdiff_path_join(pool->out_root, name);
+    FILE *basis_file, *sig_file;
+    rs_result result;
+
+    basis_file = rs_file_open(basis_name, "rb", file_force);
+    sig_file = rs_file_open(sig_name, "wb", file_force);
+
+    result = rs_sig_file(basis_file, sig_file, block_len, strong_len,
+                         pool->sig_magic, stats);
+
+    rs_file_close(sig_file);
+    rs_file_close(basis_file);
+    free(sig_name);
+    free(basis_name);
+    return result;
+}
+
+
+/** Generate the delta for one file under the walked tree. */
+/** Load a signature ready for delta generation, through the on-disk
+ * cache when one is configured with --sig-cache. */
+static rs_result rdiff_loadsig(const char *sig_name, rs_signature_t **sumset)
+{
+    FILE *sig_file;
+    rs_stats_t stats;
+    rs_result result;
+
+    if (sig_cache_dir && strcmp(sig_name, "-") != 0)
+        return rs_loadsig_cached(sig_name, sig_cache_dir, sumset);
+    sig_file = rs_file_open(sig_name, "rb", file_force);
+    result = rs_loadsig_file(sig_file, sumset, &stats);
+    rs_file_close(sig_file);
+    if (result != RS_DONE)
+        return result;
+    if (show_stats)
+        rs_log_stats(&stats);
+    return rs_build_hash_table(*sumset);
+}
+
+
+static rs_result rdiff_delta_one(rdiff_dirpool_t *pool, const char *name,
+                                 rs_stats_t *stats)
+{
+    char *sig_name = rdiff_path_join(pool->sig_root, name);
+    char *new_name = rdiff_path_join(pool->in_root, name);
+    char *delta_name = rdiff_path_join(pool->out_root, name);
+    FILE *new_file, *delta_file;
+    rs_signature_t *sumset = NULL;
+    rs_result result;
+
+    new_file = rs_file_open(new_name, "rb", file_force);
+    delta_file = rs_file_open(delta_name, "wb", file_force);
+
+    result = rdiff_loadsig(sig_name, &sumset);
+    if (result == RS_DONE)
+        result = rs_delta_file(sumset, new_file, delta_file, stats);
+    if (sumset)
+        rs_free_sumset(sumset);
+
+    rs_file_close(delta_file);
+    rs_file_close(new_file);
+    free(delta_name);
+    free(new_name);
+    free(sig_name);
+    return result;
+}
+
+
+/** Process files claimed from the pool until none remain or one fails. */
+static void *rdiff_dir_worker(void *arg)
+{
+    rdiff_dirpool_t *pool = (rdiff_dirpool_t *)arg;
+
+    for (;;) {
+        const char *name;
+        rs_stats_t stats;
+        rs_result result;
+
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock(&pool->mutex);
+#endif
+        if (pool->result != RS_DONE || pool->next >= pool->files->count) {
+#ifdef HAVE_PTHREAD_H
+            pthread_mutex_unlock(&pool->mutex);
+#endif
+            break;
+        }
+        name = pool->files->names[pool->next++];
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock(&pool->mutex);
+#endif
+
+        /* The process function may fail before it ever writes stats
+         * (e.g. a signature that won't load), so don't accumulate
+         * stack garbage into the batched total. */
+        memset(&stats, 0, sizeof stats);
+        result = pool->process(pool, name, &stats);
+
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock(&pool->mutex);
+#endif
+        rdiff_stats_accumulate(&pool->total, &stats);
+        if (result != RS_DONE && pool->result == RS_DONE)
+            pool->result = result;
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock(&pool->mutex);
+#endif
+    }
+    return NULL;
+}
+
+
+/** Run the pool's work function over every collected file.
+ *
+ * With pthreads and more than one file this fans the files out across
+ * worker threads; otherwise the calling thread does them all.
+ */
+static rs_result rdiff_dir_run(rdiff_dirpool_t *pool, const char *op)
+{
+    pool->result = RS_DONE;
+    pool->total.op = op;
+    pool->total.start = time(NULL);
+#ifdef HAVE_PTHREAD_H
+    {
+        pthread_t threads[RDIFF_MAX_JOBS];
+        int nthreads = num_jobs > 0 ? num_jobs : RDIFF_DEFAULT_JOBS;
+        int i, started = 0;
+
+        if (nthreads > RDIFF_MAX_JOBS)
+            nthreads = RDIFF_MAX_JOBS;
+        if (nthreads > pool->files->count)
+            nthreads = pool->files->count;
+        pthread_mutex_init(&pool->mutex, NULL);
+        for (i = 0; i < nthreads; i++)
+            if (pthread_create(&threads[i], NULL, rdiff_dir_worker, pool))
+                break;
+            else
+                started++;
+        if (started)
+            for (i = 0; i < started; i++)
+                pthread_join(threads[i], NULL);
+        else
+            rdiff_dir_worker(pool);
+        pthread_mutex_destroy(&pool->mutex);
+    }
+#else
+    rdiff_dir_worker(pool);
+#endif
+    pool->total.end = time(NULL);
+    rs_trace("processed %d of %d files", pool->next, pool->files->count);
+    return pool->result;
+}
+
+
+/** Generate signatures for a whole directory tree: signature -r. */
+static rs_result rdiff_sig_dir(poptContext opcon)
+{
+    const char *basis_root, *sig_root;
+    rdiff_filelist_t files = {0, 0, 0};
+    rdiff_dirpool_t pool;
+    rs_result result;
+    int i;
+
+    if (!(basis_root = poptGetArg(opcon))
+        || !(sig_root = poptGetArg(opcon))) {
+        rdiff_usage("Usage for recursive signature: "
+                    "rdiff [OPTIONS] signature -r BASISDIR SIGDIR");
+        return RS_SYNTAX_ERROR;
+    }
+    rdiff_no_more_args(opcon);
+
+    rs_bzero(&pool, sizeof pool);
+    if ((result = rdiff_sig_magic(&pool.sig_magic)) != RS_DONE)
+        return result;
+    if ((result = rdiff_walk_dir(&files, basis_root, NULL)) != RS_DONE)
+        return result;
+    /* Mirror the directory layout before the workers start, so they
+     * never race to create a shared parent. */
+    for (i = 0; i < files.count; i++) {
+        char *sig_name = rdiff_path_join(sig_root, files.names[i]);
+        char *slash = strrchr(sig_name, '/');
+
+        *slash = '\0';
+        result = rdiff_make_dirs(sig_name);
+        free(sig_name);
+        if (result != RS_DONE)
+            return result;
+    }
+
+    pool.files = &files;
+    pool.process = rdiff_sig_one;
+    pool.in_root = basis_root;
+    pool.out_root = sig_root;
+    result = rdiff_dir_run(&pool, "signature");
+
+    if (show_stats)
+        rs_log_stats(&pool.total);
+
+    rdiff_filelist_free(&files);
+    return result;
+}
+
+
+/** Generate deltas for a whole directory tree: delta -r. */
+static rs_result rdiff_delta_dir(poptContext opcon)
+{
+    const char *sig_root, *new_root, *delta_root;
+    rdiff_filelist_t files = {0, 0, 0};
+    rdiff_dirpool_t pool;
+    rs_result result;
+    int i;
+
+    if (!(sig_root = poptGetArg(opcon))
+        || !(new_root = poptGetArg(opcon))
+        || !(delta_root = poptGetArg(opcon))) {
+        rdiff_usage("Usage for recursive delta: "
+                    "rdiff [OPTIONS] delta -r SIGDIR NEWDIR DELTADIR");
+        return RS_SYNTAX_ERROR;
+    }
+    rdiff_no_more_args(opcon);
+
+    if ((result = rdiff_walk_dir(&files, new_root, NULL)) != RS_DONE)
+        return result;
+    for (i = 0; i < files.count; i++) {
+        char *delta_name = rdiff_path_join(delta_root, files.names[i]);
+        char *slash = strrchr(delta_name, '/');
+
+        *slash = '\0';
+        result = rdiff_make_dirs(delta_name);
+        free(delta_name);
+        if (result != RS_DONE)
+            return result;
+    }
+
+    rs_bzero(&pool, sizeof pool);
+    pool.files = &files;
+    pool.process = rdiff_delta_one;
+    pool.in_root = new_root;
+    pool.out_root = delta_root;
+    pool.sig_root = sig_root;
+    result = rdiff_dir_run(&pool, "delta");
+
+    if (show_stats)
+        rs_log_stats(&pool.total);
+
+    rdiff_filelist_free(&files);
+    return result;
+}
+
+
+/**
+ * Generate signature from remaining command line arguments.
+ */
+static rs_result rdiff_sig(poptContext opcon)
+{
+    FILE            *basis_file, *sig_file;
+    rs_stats_t      stats;
+    rs_result       result;
+    rs_long_t       sig_magic;
+
+    if (recursive)
+        return rdiff_sig_dir(opcon);
+
+    basis_file = rs_file_open(poptGetArg(opcon), "rb", file_force);
+    sig_file = rs_file_open(poptGetArg(opcon), "wb", file_force);
+
+    rdiff_no_more_args(opcon);
+
+    if ((result = rdiff_sig_magic(&sig_magic)) != RS_DONE)
+        return result;
+
     result = rs_sig_file(basis_file, sig_file, block_len, strong_len,
                          sig_magic, &stats);
 
@@ -283,39 +749,82 @@ static rs_result rdiff_sig(poptContext opcon)
 
 static rs_result rdiff_delta(poptContext opcon)
 {
-    FILE            *sig_file, *new_file, *delta_file;
+    FILE            *new_file, *delta_file;
     char const      *sig_name;
     rs_result       result;
     rs_signature_t  *sumset;
     rs_stats_t      stats;
 
+    if (recursive)
+        return rdiff_delta_dir(opcon);
+
     if (!(sig_name = poptGetArg(opcon))) {
         rdiff_usage("Usage for delta: "
                     "rdiff [OPTIONS] delta SIGNATURE [NEWFILE [DELTA]]");
         return RS_SYNTAX_ERROR;
     }
 
-    sig_file = rs_file_open(sig_name, "rb", file_force);
     new_file = rs_file_open(poptGetArg(opcon), "rb", file_force);
     delta_file = rs_file_open(poptGetArg(opcon), "wb", file_force);
 
     rdiff_no_more_args(opcon);
 
-    result = rs_loadsig_file(sig_file, &sumset, &stats);
-    if (result != RS_DONE)
+    if ((result = rdiff_loadsig(sig_name, &sumset)) != RS_DONE)
         return result;
 
-    if (show_stats)
+    result = rs_delta_file(sumset, new_file, delta_file, &stats);
+
+    rs_file_close(delta_file);
+    rs_file_close(new_file);
+
+    if (show_stats) {
+        rs_signature_log_stats(sumset);
         rs_log_stats(&stats);
+    }
+
+    rs_free_sumset(sumset);
+
+    return result;
+}
+
+
+
+/** Fused one-pass signature+delta: sigdelta OLDSIG NEWFILE DELTA NEWSIG. */
+static rs_result rdiff_sig_delta(poptContext opcon)
+{
+    FILE            *new_file, *delta_file, *sig_file;
+    char const      *old_sig_name, *new_name, *delta_name, *sig_name;
+    rs_signature_t  *sumset;
+    rs_stats_t      stats;
+    rs_result       result;
+    rs_long_t       sig_magic;
 
-    if ((result = rs_build_hash_table(sumset)) != RS_DONE)
+    if (!(old_sig_name = poptGetArg(opcon))
+        || !(new_name = poptGetArg(opcon))
+        || !(delta_name = poptGetArg(opcon))
+        || !(sig_name = poptGetArg(opcon))) {
+        rdiff_usage("Usage for sigdelta: "
+                    "rdiff [OPTIONS] sigdelta OLDSIG NEWFILE DELTA NEWSIG");
+        return RS_SYNTAX_ERROR;
+    }
+    rdiff_no_more_args(opcon);
+
+    if ((result = rdiff_sig_magic(&sig_magic)) != RS_DONE)
         return result;
 
-    result = rs_delta_file(sumset, new_file, delta_file, &stats);
+    if ((result = rdiff_loadsig(old_sig_name, &sumset)) != RS_DONE)
+        return result;
+
+    new_file = rs_file_open(new_name, "rb", file_force);
+    delta_file = rs_file_open(delta_name, "wb", file_force);
+    sig_file = rs_file_open(sig_name, "wb", file_force);
 
+    result = rs_sig_delta_file(sumset, new_file, sig_file, delta_file,
+                               block_len, strong_len, sig_magic, &stats);
+
+    rs_file_close(sig_file);
     rs_file_close(delta_file);
     rs_file_close(new_file);
-    rs_file_close(sig_file);
 
     if (show_stats) {
         rs_signature_log_stats(sumset);
@@ -328,7 +837,6 @@ static rs_result rdiff_delta(poptContext opcon)
 }
 
 
-
 static rs_result rdiff_patch(poptContext opcon)
 {
     /*  patch BASIS [DELTA [NEWFILE]] */
@@ -337,6 +845,11 @@ static rs_result rdiff_patch(poptContext opcon)
     rs_stats_t          stats;
     rs_result           result;
 
+    if (recursive) {
+        rdiff_usage("rdiff: --recursive only applies to signature and delta");
+        return RS_SYNTAX_ERROR;
+    }
+
     if (!(basis_name = poptGetArg(opcon))) {
         rdiff_usage("Usage for patch: "
                     "rdiff [OPTIONS] patch BASIS [DELTA [NEW]]");
@@ -363,6 +876,300 @@ static rs_result rdiff_patch(poptContext opcon)
 
 
 
+/** Loaded signatures retained across serve requests. */
+#define RDIFF_SERVE_SIGS 8
+
+/** Idle jobs kept for reuse across serve requests. */
+#define RDIFF_SERVE_POOL 4
+
+/** Most whitespace-separated fields in one serve request. */
+#define RDIFF_SERVE_MAX_ARGS 6
+
+/** A signature retained by the serve-mode LRU, keyed by path and
+ * validated against the file's size and mtime so a rewritten signature
+ * file is reloaded rather than served stale. */
+typedef struct rdiff_serve_sig {
+    char            *name;
+    rs_long_t       size;
+    time_t          mtime;
+    unsigned long   stamp;      /* recency; higher is more recent */
+    rs_signature_t  *sig;
+} rdiff_serve_sig_t;
+
+static rdiff_serve_sig_t serve_sigs[RDIFF_SERVE_SIGS];
+static unsigned long serve_stamp = 0;
+
+
+/** fopen() for serve requests: reports the error and returns NULL
+ * rather than exiting like rs_file_open(), since the server must
+ * outlive a bad request. */
+static FILE *rdiff_serve_open(const char *filename, const char *mode)
+{
+    FILE *f;
+
+    if (!(f = fopen(filename, mode)))
+        rs_error("Error opening \"%s\" for %s: %s", filename,
+                 mode[0] == 'w' ? "write" : "read", strerror(errno));
+    return f;
+}
+
+
+/** Load and index one signature file for a serve request, through the
+ * on-disk cache when --sig-cache is configured. */
+static rs_result rdiff_serve_loadsig_file(const char *sig_name,
+                                          rs_signature_t **sumset)
+{
+    FILE *sig_file;
+    rs_result result;
+
+    if (sig_cache_dir)
+        return rs_loadsig_cached(sig_name, sig_cache_dir, sumset);
+    if (!(sig_file = rdiff_serve_open(sig_name, "rb")))
+        return RS_IO_ERROR;
+    result = rs_loadsig_file(sig_file, sumset, NULL);
+    fclose(sig_file);
+    if (result != RS_DONE)
+        return result;
+    return rs_build_hash_table(*sumset);
+}
+
+
+/** Fetch a signature through the serve-mode LRU, loading and caching it
+ * on a miss.  Cached signatures are owned by the cache, not the
+ * caller. */
+static rs_result rdiff_serve_loadsig(const char *sig_name,
+                                     rs_signature_t **sumset)
+{
+    struct stat st;
+    rdiff_serve_sig_t *slot, *lru = &serve_sigs[0];
+    rs_result result;
+    int i;
+
+    if (stat(sig_name, &st)) {
+        rs_error("Error examining \"%s\": %s", sig_name, strerror(errno));
+        return RS_IO_ERROR;
+    }
+    for (i = 0; i < RDIFF_SERVE_SIGS; i++) {
+        slot = &serve_sigs[i];
+        if (slot->sig && !strcmp(slot->name, sig_name)) {
+            if (slot->size == (rs_long_t)st.st_size
+                && slot->mtime == st.st_mtime) {
+                slot->stamp = ++serve_stamp;
+                *sumset = slot->sig;
+                return RS_DONE;
+            }
+            lru = slot;         /* stale: reload into the same slot */
+            break;
+        }
+        if (!slot->sig) {
+            if (lru->sig)
+                lru = slot;
+        } else if (lru->sig && slot->stamp < lru->stamp) {
+            lru = slot;
+        }
+    }
+    if ((result = rdiff_serve_loadsig_file(sig_name, sumset)) != RS_DONE)
+        return result;
+    if (lru->sig) {
+        rs_free_sumset(lru->sig);
+        free(lru->name);
+    }
+    lru->name = strdup(sig_name);
+    lru->size = (rs_long_t)st.st_size;
+    lru->mtime = st.st_mtime;
+    lru->stamp = ++serve_stamp;
+    lru->sig = *sumset;
+    return RS_DONE;
+}
+
+
+/** Drop any cached signature loaded from NAME, after rewriting it. */
+static void rdiff_serve_sig_forget(const char *name)
+{
+    int i;
+
+    for (i = 0; i < RDIFF_SERVE_SIGS; i++) {
+        if (serve_sigs[i].sig && !strcmp(serve_sigs[i].name, name)) {
+            rs_free_sumset(serve_sigs[i].sig);
+            free(serve_sigs[i].name);
+            memset(&serve_sigs[i], 0, sizeof(serve_sigs[i]));
+        }
+    }
+}
+
+
+/** Serve request: signature BASIS SIG [BLOCKLEN [STRONGLEN]]. */
+static rs_result rdiff_serve_sig(int argc, char **argv)
+{
+    FILE *basis_file, *sig_file;
+    size_t req_block = block_len, req_strong = strong_len;
+    rs_long_t sig_magic;
+    rs_result result;
+
+    if (argc < 3 || argc > 5)
+        return RS_SYNTAX_ERROR;
+    if (argc > 3)
+        req_block = (size_t)strtoul(argv[3], NULL, 10);
+    if (argc > 4)
+        req_strong = (size_t)strtoul(argv[4], NULL, 10);
+    if ((result = rdiff_sig_magic(&sig_magic)) != RS_DONE)
+        return result;
+    if (!(basis_file = rdiff_serve_open(argv[1], "rb")))
+        return RS_IO_ERROR;
+    if (!(sig_file = rdiff_serve_open(argv[2], "wb"))) {
+        fclose(basis_file);
+        return RS_IO_ERROR;
+    }
+    result = rs_sig_file(basis_file, sig_file, req_block, req_strong,
+                         sig_magic, NULL);
+    fclose(sig_file);
+    fclose(basis_file);
+    rdiff_serve_sig_forget(argv[2]);
+    return result;
+}
+
+
+/** Serve request: delta SIG NEWFILE DELTA.  The signature comes through
+ * the LRU, so repeated deltas against one signature skip the load and
+ * hashtable build. */
+static rs_result rdiff_serve_delta(int argc, char **argv)
+{
+    FILE *new_file, *delta_file;
+    rs_signature_t *sumset;
+    rs_result result;
+
+    if (argc != 4)
+        return RS_SYNTAX_ERROR;
+    if ((result = rdiff_serve_loadsig(argv[1], &sumset)) != RS_DONE)
+        return result;
+    if (!(new_file = rdiff_serve_open(argv[2], "rb")))
+        return RS_IO_ERROR;
+    if (!(delta_file = rdiff_serve_open(argv[3], "wb"))) {
+        fclose(new_file);
+        return RS_IO_ERROR;
+    }
+    result = rs_delta_file(sumset, new_file, delta_file, NULL);
+    fclose(delta_file);
+    fclose(new_file);
+    return result;
+}
+
+
+/** Serve request: patch BASIS DELTA NEWFILE. */
+static rs_result rdiff_serve_patch(int argc, char **argv)
+{
+    FILE *basis_file, *delta_file, *new_file;
+    rs_result result;
+
+    if (argc != 4)
+        return RS_SYNTAX_ERROR;
+    if (!(basis_file = rdiff_serve_open(argv[1], "rb")))
+        return RS_IO_ERROR;
+    if (!(delta_file = rdiff_serve_open(argv[2], "rb"))) {
+        fclose(basis_file);
+        return RS_IO_ERROR;
+    }
+    if (!(new_file = rdiff_serve_open(argv[3], "wb"))) {
+        fclose(delta_file);
+        fclose(basis_file);
+        return RS_IO_ERROR;
+    }
+    result = rs_patch_file(basis_file, delta_file, new_file, NULL);
+    fclose(new_file);
+    fclose(delta_file);
+    fclose(basis_file);
+    return result;
+}
+
+
+/**
+ * Serve requests from stdin until EOF or `quit`, to amortize process
+ * startup and signature loads over many small operations.
+ *
+ * Each request is length-prefixed: an ASCII decimal byte count, one
+ * whitespace character, then that many payload bytes.  The payload is
+ * an op word and whitespace-separated arguments:
+ *
+ *     signature BASIS SIG [BLOCKLEN [STRONGLEN]]
+ *     delta SIG NEWFILE DELTA
+ *     patch BASIS DELTA NEWFILE
+ *     quit
+ *
+ * One status line goes to stdout per request: `ok OP` or `error OP
+ * MESSAGE`.  The process stays warm between requests: jobs are recycled
+ * through a job pool, and the most recently loaded signatures are
+ * retained so repeated deltas against one signature reuse its index.
+ */
+static rs_result rdiff_serve(poptContext opcon)
+{
+    rs_job_pool_t *pool;
+    char *payload = NULL;
+    size_t payload_alloc = 0;
+    int i, c;
+
+    if (recursive) {
+        rdiff_usage("rdiff: --recursive does not apply to serve");
+        return RS_SYNTAX_ERROR;
+    }
+    rdiff_no_more_args(opcon);
+
+    pool = rs_job_pool_new(RDIFF_SERVE_POOL);
+    rs_job_pool_install(pool);
+
+    for (;;) {
+        unsigned long len;
+        char *argv[RDIFF_SERVE_MAX_ARGS], *tok;
+        int argc = 0;
+        rs_result result;
+
+        if (scanf("%9lu", &len) != 1)
+            break;              /* EOF, or junk we can't resync from */
+        if ((c = getchar()) != ' ' && c != '\n')
+            break;
+        if (len + 1 > payload_alloc) {
+            payload_alloc = len + 1;
+            payload = rs_realloc(payload, payload_alloc, "serve request");
+        }
+        if (fread(payload, 1, len, stdin) != len)
+            break;
+        payload[len] = '\0';
+
+        for (tok = strtok(payload, " \t\r\n");
+             tok && argc < RDIFF_SERVE_MAX_ARGS;
+             tok = strtok(NULL, " \t\r\n"))
+            argv[argc++] = tok;
+        if (!argc)
+            continue;
+        if (isprefix(argv[0], "quit"))
+            break;
+        if (isprefix(argv[0], "signature"))
+            result = rdiff_serve_sig(argc, argv);
+        else if (isprefix(argv[0], "delta"))
+            result = rdiff_serve_delta(argc, argv);
+        else if (isprefix(argv[0], "patch"))
+            result = rdiff_serve_patch(argc, argv);
+        else
+            result = RS_SYNTAX_ERROR;
+
+        if (result == RS_DONE)
+            printf("ok %s\n", argv[0]);
+        else
+            printf("error %s %s\n", argv[0], rs_strerror(result));
+        fflush(stdout);
+    }
+
+    for (i = 0; i < RDIFF_SERVE_SIGS; i++) {
+        if (serve_sigs[i].sig) {
+            rs_free_sumset(serve_sigs[i].sig);
+            free(serve_sigs[i].name);
+        }
+    }
+    free(payload);
+    rs_job_pool_free(pool);
+    return RS_DONE;
+}
+
+
 static rs_result rdiff_action(poptContext opcon)
 {
     const char      *action;
@@ -376,6 +1183,10 @@ static rs_result rdiff_action(poptContext opcon)
         return rdiff_delta(opcon);
     else if (isprefix(action, "patch"))
         return rdiff_patch(opcon);
+    else if (isprefix(action, "sigdelta"))
+        return rdiff_sig_delta(opcon);
+    else if (isprefix(action, "serve"))
+        return rdiff_serve(opcon);
 
     rdiff_usage("rdiff: You must specify an action: `signature', `delta', or `patch'.");
     return RS_SYNTAX_ERROR;
@@ -58,6 +58,7 @@ static rs_result rs_loadsig_add_sum(rs_job_t *job, rs_strong_sum_t *strong)
         rs_trace("got block: weak="FMT_WEAKSUM", strong=%s", job->weak_sig, hexbuf);
     }
     rs_signature_add_block(job->signature, job->weak_sig, strong);
+    rs_signature_build_publish(job->signature);
     job->stats.sig_blocks++;
     return RS_RUNNING;
 }
@@ -65,12 +66,48 @@ static rs_result rs_loadsig_add_sum(rs_job_t *job, rs_strong_sum_t *strong)
 
 static rs_result rs_loadsig_s_weak(rs_job_t *job)
 {
+    const size_t        pair_len = 4 + (size_t)job->signature->strong_sum_len;
+    const rs_byte_t     *p;
+    size_t              avail, npairs;
     int                 l;
     rs_result           result;
 
+    /* Bulk path: when whole (weak, strong) pairs are sitting in the
+     * scoop or the caller's input buffer, decode them in one tight
+     * loop straight into the signature's block array instead of a
+     * statefn dispatch and readahead check per sum.  Any trailing
+     * partial pair falls through to the streaming path below. */
+    if (job->scoop_avail) {
+        p = job->scoop_next;
+        avail = job->scoop_avail;
+    } else {
+        p = (const rs_byte_t *)job->stream->next_in;
+        avail = job->stream->avail_in;
+    }
+    if ((npairs = avail / pair_len)) {
+        rs_signature_t *sig = job->signature;
+        size_t i;
+
+        rs_trace("bulk load of "FMT_SIZE" signature blocks", npairs);
+        for (i = 0; i < npairs; i++) {
+            rs_weak_sum_t weak = ((rs_weak_sum_t)p[0] << 24)
+                | ((rs_weak_sum_t)p[1] << 16)
+                | ((rs_weak_sum_t)p[2] << 8) | (rs_weak_sum_t)p[3];
+            rs_signature_add_block(sig, weak, (rs_strong_sum_t *)(p + 4));
+            p += pair_len;
+        }
+        job->stats.sig_blocks += npairs;
+        rs_scoop_advance(job, npairs * pair_len);
+        /* hand the batch to an eager hashtable build, if one is on */
+        rs_signature_build_publish(sig);
+        return RS_RUNNING;
+    }
+
     if ((result = rs_suck_n4(job, &l)) != RS_DONE) {
-        if (result == RS_INPUT_ENDED)   /* ending here is OK */
+        if (result == RS_INPUT_ENDED) { /* ending here is OK */
+            rs_signature_build_join(job->signature);
             return RS_DONE;
+        }
         return result;
     }
     job->weak_sig = l;
@@ -110,6 +147,10 @@ static rs_result rs_loadsig_s_stronglen(rs_job_t *job)
 				    job->sig_block_len, job->sig_strong_len,
 				    job->sig_fsize)) != RS_DONE)
         return result;
+    /* With the block array preallocated from the signature file size,
+       the hashtable build can start now and trail the parse. */
+    if (job->eager_build)
+        rs_signature_build_start(job->signature);
     job->statefn = rs_loadsig_s_weak;
     return RS_RUNNING;
 }
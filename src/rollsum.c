@@ -21,34 +21,51 @@
  */
 #include "rollsum.h"
 
-#define DO1(buf,i)  {s1 += buf[i]; s2 += s1;}
-#define DO2(buf,i)  DO1(buf,i); DO1(buf,i+1);
-#define DO4(buf,i)  DO2(buf,i); DO2(buf,i+2);
-#define DO8(buf,i)  DO4(buf,i); DO4(buf,i+4);
-#define DO16(buf)   DO8(buf,0); DO8(buf,8);
+/* Both routines below are written as independent sum reductions with no
+ * loop-carried s2 += s1 dependency, so that compilers can vectorize them.
+ * The serial recurrence "s1 += b; s2 += s1" over a buffer expands to
+ *
+ *   s1' = s1 + sum(b[i])
+ *   s2' = s2 + len*s1 + sum((len-i)*b[i])
+ *
+ * and sum((len-i)*b[i]) = len*sum(b[i]) - sum(i*b[i]), leaving two plain
+ * reductions. ANSI C says no overflow for unsigned, and the digest only
+ * uses the low 16 bits of each sum, so wraparound is harmless. */
 
 void RollsumUpdate(Rollsum *sum, const unsigned char *buf, size_t len)
 {
-    /* ANSI C says no overflow for unsigned. zlib's adler32 goes to extra
-       effort to avoid overflow for its mod prime, which we don't have. */
-    size_t n = len;
-    uint_fast16_t s1 = sum->s1;
-    uint_fast16_t s2 = sum->s2;
+    size_t i;
+    uint_fast64_t s = 0, t = 0;
 
-    while (n >= 16) {
-        DO16(buf);
-        buf += 16;
-        n -= 16;
-    }
-    while (n != 0) {
-        s1 += *buf++;
-        s2 += s1;
-        n--;
+    for (i = 0; i < len; i++) {
+        s += buf[i];
+        t += (uint_fast64_t)i * buf[i];
     }
+    sum->s2 += len * sum->s1 + len * s - t;
+    sum->s1 += s;
     /* Increment s1 and s2 by the amounts added by the char offset. */
-    s1 += len * ROLLSUM_CHAR_OFFSET;
-    s2 += ((len * (len + 1)) / 2) * ROLLSUM_CHAR_OFFSET;
+    sum->s1 += len * ROLLSUM_CHAR_OFFSET;
+    sum->s2 += ((len * (len + 1)) / 2) * ROLLSUM_CHAR_OFFSET;
     sum->count += len;          /* Increment sum count. */
-    sum->s1 = s1;
-    sum->s2 = s2;
+}
+
+/* Roll the window over len bytes in one call, equivalent to calling
+ * RollsumRotate(sum, out_buf[i], in_buf[i]) for i in 0..len-1. The out_buf
+ * and in_buf spans are typically window-size apart in the same buffer and
+ * may overlap. */
+void RollsumRotateN(Rollsum *sum, const unsigned char *out_buf,
+                    const unsigned char *in_buf, size_t len)
+{
+    size_t i;
+    uint_fast64_t sin = 0, tin = 0, sout = 0, tout = 0;
+
+    for (i = 0; i < len; i++) {
+        sin += in_buf[i];
+        tin += (uint_fast64_t)i * in_buf[i];
+        sout += out_buf[i];
+        tout += (uint_fast64_t)i * out_buf[i];
+    }
+    sum->s2 += len * sum->s1 + len * (sin - sout) - (tin - tout)
+        - sum->count * (sout + len * ROLLSUM_CHAR_OFFSET);
+    sum->s1 += sin - sout;
 }
@@ -40,6 +40,11 @@ typedef struct _Rollsum {
 
 void RollsumUpdate(Rollsum *sum, const unsigned char *buf, size_t len);
 
+/* Bulk equivalent of len calls to RollsumRotate(), rolling the window
+ * out over out_buf[0..len-1] and in over in_buf[0..len-1]. */
+void RollsumRotateN(Rollsum *sum, const unsigned char *out_buf,
+                    const unsigned char *in_buf, size_t len);
+
 /* static inline implementations of simple routines */
 static inline void RollsumInit(Rollsum *sum)
 {
@@ -83,21 +83,27 @@ void rs_scoop_input(rs_job_t *job, size_t len)
     assert(len > job->scoop_avail);
 
     if (job->scoop_alloc < len) {
-        /* Need to allocate a larger scoop.*/
+        /* Need to allocate a larger scoop. Allocate double the needed
+         * size so refills can keep appending behind the consumed front
+         * for a long time before any compaction is needed. */
         rs_byte_t *newbuf;
         size_t newsize;
-        for (newsize = 64; newsize < len; newsize <<= 1);
+        for (newsize = 64; newsize < 2 * len; newsize <<= 1);
         newbuf = rs_alloc(newsize, "scoop buffer");
         if (job->scoop_avail)
             memcpy(newbuf, job->scoop_next, job->scoop_avail);
         if (job->scoop_buf)
             free(job->scoop_buf);
         job->scoop_buf = job->scoop_next = newbuf;
-        rs_trace("resized scoop buffer to "FMT_SIZE" bytes from "FMT_SIZE"", newsize, job->scoop_alloc);
+        rs_job_trace(job, "resized scoop buffer to "FMT_SIZE" bytes from "FMT_SIZE"", newsize, job->scoop_alloc);
         job->scoop_alloc = newsize;
-    } else if (job->scoop_buf != job->scoop_next) {
-        /* Move existing data to the front of the scoop. */
-        rs_trace("moving scoop "FMT_SIZE" bytes to reuse "FMT_SIZE" bytes",
+    } else if ((size_t)(job->scoop_next - job->scoop_buf) + len > job->scoop_alloc) {
+        /* Not enough free space left behind the tail for len bytes:
+         * move the retained data back to the front of the scoop. The
+         * allocation is at least double the readahead window, so this
+         * happens at most once per half a buffer of consumed input
+         * rather than on every refill. */
+        rs_job_trace(job, "moving scoop "FMT_SIZE" bytes to reuse "FMT_SIZE" bytes",
                  job->scoop_avail, (size_t)(job->scoop_next - job->scoop_buf));
         memmove(job->scoop_buf, job->scoop_next, job->scoop_avail);
         job->scoop_next = job->scoop_buf;
@@ -108,10 +114,11 @@ void rs_scoop_input(rs_job_t *job, size_t len)
     tocopy = len - job->scoop_avail;
     if (tocopy > stream->avail_in)
         tocopy = stream->avail_in;
-    assert(tocopy + job->scoop_avail <= job->scoop_alloc);
+    assert((size_t)(job->scoop_next - job->scoop_buf) + job->scoop_avail
+           + tocopy <= job->scoop_alloc);
 
     memcpy(job->scoop_next + job->scoop_avail, stream->next_in, tocopy);
-    rs_trace("accepted "FMT_SIZE" bytes from input to scoop", tocopy);
+    rs_trace_hot(job, "accepted "FMT_SIZE" bytes from input to scoop", tocopy);
     job->scoop_avail += tocopy;
     stream->next_in += tocopy;
     stream->avail_in -= tocopy;
@@ -136,12 +143,12 @@ void rs_scoop_advance(rs_job_t *job, size_t len)
      * at them all at the same time. */
     if (job->scoop_avail) {
         /* reading from the scoop buffer */
-         rs_trace("advance over "FMT_SIZE" bytes from scoop", len);
+         rs_trace_hot(job, "advance over "FMT_SIZE" bytes from scoop", len);
         assert(len <= job->scoop_avail);
         job->scoop_avail -= len;
         job->scoop_next += len;
     } else {
-        rs_trace("advance over "FMT_SIZE" bytes from input buffer", len);
+        rs_trace_hot(job, "advance over "FMT_SIZE" bytes from input buffer", len);
         assert(len <= stream->avail_in);
         stream->avail_in -= len;
         stream->next_in += len;
@@ -170,25 +177,28 @@ rs_result rs_scoop_readahead(rs_job_t *job, size_t len, void **ptr)
     if (!job->scoop_avail && stream->avail_in >= len) {
         /* The scoop is empty and there's enough data in the input. */
         *ptr = stream->next_in;
-        rs_trace("got "FMT_SIZE" bytes direct from input", len);
+        rs_trace_hot(job, "got "FMT_SIZE" bytes direct from input", len);
         return RS_DONE;
     } else if (job->scoop_avail < len && stream->avail_in) {
         /* There is not enough data in the scoop. */
-        rs_trace("scoop has less than "FMT_SIZE" bytes, scooping from "FMT_SIZE" input bytes", len, stream->avail_in);
+        rs_trace_hot(job, "scoop has less than "FMT_SIZE" bytes, scooping from "FMT_SIZE" input bytes", len, stream->avail_in);
         rs_scoop_input(job, len);
     }
     if (job->scoop_avail >= len) {
         /* There is enough data in the scoop now. */
-        rs_trace("scoop has at least "FMT_SIZE" bytes, this is enough", job->scoop_avail);
+        rs_trace_hot(job, "scoop has at least "FMT_SIZE" bytes, this is enough", job->scoop_avail);
         *ptr = job->scoop_next;
         return RS_DONE;
     } else if (stream->eof_in) {
         /* Not enough input data and at EOF. */
-        rs_trace("reached end of input stream");
+        rs_job_trace(job, "reached end of input stream");
         return RS_INPUT_ENDED;
     } else {
-        /* Not enough input data yet. */
-        rs_trace("blocked with insufficient input data");
+        /* Not enough input data yet.  Record the shortfall so callers
+         * of rs_job_iter() can batch the next read to the right size
+         * (see rs_job_input_needed()). */
+        job->input_needed = len - job->scoop_avail;
+        rs_trace_hot(job, "blocked with insufficient input data");
         return RS_BLOCKED;
     }
 }
@@ -0,0 +1,405 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * Copyright (C) 1999, 2000, 2001 by Martin Pool <mbp@sourcefrog.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** \file sig2.c
+ * The RS_SIG2_MAGIC mmap-able signature container.
+ *
+ * The v1 signature stream has to be parsed block by block and then
+ * indexed with rs_build_hash_table(), which dominates delta startup
+ * time for large basis files. The v2 container instead stores the
+ * packed block_sigs array and the prebuilt hashtable key and index
+ * tables page-aligned in the file, so rs_loadsig_mmap() can map the
+ * whole thing read-only and use it in place; pages are faulted in
+ * lazily as the signature is probed.
+ *
+ * Everything after the header is in host byte order and the layout
+ * depends on the strong sum length, so a v2 file is a local cache
+ * format, not a transfer format; the magic check rejects files saved
+ * with a different byte order because the magic itself won't match. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "librsync.h"
+#include "sumset.h"
+#include "util.h"
+#include "trace.h"
+
+/** Alignment of the block_sigs and ktable sections in the file. */
+#define RS_SIG2_ALIGN 4096
+
+/** On-disk header of a v2 signature container. Host byte order. */
+typedef struct rs_sig2_header {
+    unsigned magic;             /**< RS_SIG2_MAGIC. */
+    unsigned sig_magic;         /**< The contained signature's magic. */
+    unsigned block_len;         /**< The block length. */
+    unsigned strong_sum_len;    /**< The block strong sum length. */
+    unsigned count;             /**< Number of blocks. */
+    unsigned table_size;        /**< Hashtable size (power of 2, 0 if empty). */
+    unsigned table_count;       /**< Number of hashtable entries. */
+    unsigned reserved;          /**< Zero, reserved for future use. */
+    rs_long_t sigs_off;         /**< Offset of the packed block_sigs. */
+    rs_long_t ktable_off;       /**< Offset of the hashtable keys. */
+    rs_long_t itable_off;       /**< Offset of the hashtable indexes. */
+    rs_long_t bloom_off;        /**< Offset of the hashtable bloom filter. */
+    rs_long_t file_len;         /**< Total container length. */
+} rs_sig2_header_t;
+
+/** Check that a signature fits the container's 32-bit count and table
+ * size header fields.  Signatures beyond that can only live in memory. */
+static int rs_sig2_fits(const rs_signature_t *sig)
+{
+    return sig->count <= (rs_long_t)0xffffffff
+        && (!sig->hashtable || sig->hashtable->size <= (size_t)0xffffffff);
+}
+
+/** Round an offset up to the next RS_SIG2_ALIGN boundary. */
+static rs_long_t rs_sig2_align(rs_long_t off)
+{
+    return (off + RS_SIG2_ALIGN - 1) & ~(rs_long_t)(RS_SIG2_ALIGN - 1);
+}
+
+/** Write zeros to pad the file from \p pos up to \p to. */
+static rs_result rs_sig2_pad(FILE *f, rs_long_t pos, rs_long_t to)
+{
+    static const char zeros[256] = { 0 };
+
+    while (pos < to) {
+        size_t n = to - pos < (rs_long_t)sizeof(zeros)
+            ? (size_t)(to - pos) : sizeof(zeros);
+        if (fwrite(zeros, 1, n, f) != n)
+            return RS_IO_ERROR;
+        pos += n;
+    }
+    return RS_DONE;
+}
+
+/** Fill in the container header and section offsets for \p sig.
+ * The signature's hashtable must already be built. */
+static void rs_sig2_layout(rs_signature_t *sig, rs_sig2_header_t *h)
+{
+    hashtable_t *t = sig->hashtable;
+    size_t entry_size = rs_block_sig_size(sig);
+
+    memset(h, 0, sizeof(*h));
+    h->magic = RS_SIG2_MAGIC;
+    h->sig_magic = sig->magic;
+    h->block_len = sig->block_len;
+    h->strong_sum_len = sig->strong_sum_len;
+    h->count = (unsigned)sig->count;
+    h->sigs_off = RS_SIG2_ALIGN;
+    if (sig->count) {
+        /* An empty signature's hashtable has no index table to save. */
+        assert(t->itable != NULL);
+        h->table_size = (unsigned)t->size;
+        h->table_count = (unsigned)t->count;
+        h->ktable_off = rs_sig2_align(h->sigs_off + sig->count * entry_size);
+        h->itable_off = h->ktable_off + h->table_size * sizeof(unsigned);
+        h->bloom_off = h->itable_off + h->table_size * sizeof(unsigned);
+        h->file_len = h->bloom_off + h->table_size;
+    } else {
+        h->ktable_off = h->itable_off = h->bloom_off = h->file_len =
+            h->sigs_off;
+    }
+}
+
+/** Fill \p bloom (table_size bytes) with the hashtable's bloom filter,
+ * reconstructing it from ktable when built with HASHTABLE_NBLOOM so
+ * bloom-enabled readers still get real bits. */
+static void rs_sig2_bloom(const hashtable_t *t, unsigned char *bloom)
+{
+    size_t i;
+
+    if (t->kbloom) {
+        memcpy(bloom, t->kbloom, t->size);
+        return;
+    }
+    memset(bloom, 0, t->size);
+    for (i = 0; i < t->size; i++)
+        if (t->ktable[i]) {
+            unsigned bi = mix32(t->ktable[i]) >> t->bshift;
+
+            bloom[bi / 8] |= (unsigned char)(1 << (bi % 8));
+        }
+}
+
+rs_result rs_sig2_save(rs_signature_t *sig, FILE *f)
+{
+    rs_sig2_header_t h;
+    hashtable_t *t;
+    size_t entry_size;
+    rs_result result;
+
+    rs_signature_check(sig);
+    if (!sig->hashtable && (result = rs_build_hash_table(sig)) != RS_DONE)
+        return result;
+    if (!rs_sig2_fits(sig)) {
+        rs_error("signature too large for a v2 container");
+        return RS_PARAM_ERROR;
+    }
+    t = sig->hashtable;
+    entry_size = rs_block_sig_size(sig);
+    rs_sig2_layout(sig, &h);
+    if (fwrite(&h, sizeof(h), 1, f) != 1
+        || rs_sig2_pad(f, sizeof(h), h.sigs_off) != RS_DONE)
+        goto io_error;
+    if (sig->count) {
+        if (fwrite(sig->block_sigs, entry_size, sig->count, f)
+            != (size_t)sig->count
+            || rs_sig2_pad(f, h.sigs_off + sig->count * entry_size,
+                           h.ktable_off) != RS_DONE
+            || fwrite(t->ktable, sizeof(unsigned), t->size, f)
+            != (size_t)t->size
+            || fwrite(t->itable, sizeof(unsigned), t->size, f)
+            != (size_t)t->size)
+            goto io_error;
+        if (t->kbloom) {
+            if (fwrite(t->kbloom, 1, t->size, f) != (size_t)t->size)
+                goto io_error;
+        } else {
+            unsigned char *bloom = rs_alloc_struct0(t->size, "sig2 bloom");
+            size_t n;
+
+            rs_sig2_bloom(t, bloom);
+            n = fwrite(bloom, 1, t->size, f);
+            free(bloom);
+            if (n != (size_t)t->size)
+                goto io_error;
+        }
+    }
+    if (fflush(f) != 0)
+        goto io_error;
+    return RS_DONE;
+
+  io_error:
+    rs_error("error writing v2 signature: %s", strerror(errno));
+    return RS_IO_ERROR;
+}
+
+
+/** Build a signature over a v2 container image already in memory.
+ *
+ * Validates the header against \p len and constructs a read-only
+ * signature whose block_sigs and hashtable point into the image.  The
+ * caller keeps ownership of the image memory; sig->map is left unset. */
+static rs_signature_t *rs_sig2_attach(void *image, size_t len)
+{
+    const rs_sig2_header_t *h;
+    rs_signature_t *sig;
+    size_t entry_size;
+
+    if (len < sizeof(rs_sig2_header_t))
+        return NULL;
+    h = (const rs_sig2_header_t *)image;
+    /* A byte-swapped magic from a foreign-endian image fails here too. */
+    if (h->magic != RS_SIG2_MAGIC
+        || (h->sig_magic != RS_BLAKE2_SIG_MAGIC
+            && h->sig_magic != RS_MD4_SIG_MAGIC
+            && h->sig_magic != RS_RK_BLAKE2_SIG_MAGIC
+            && h->sig_magic != RS_RK_MD4_SIG_MAGIC
+            && h->sig_magic != RS_RK64_SIG_MAGIC)
+        || h->block_len == 0 || h->strong_sum_len == 0
+        || h->strong_sum_len > RS_MAX_STRONG_SUM_LENGTH
+        || h->file_len != (rs_long_t)len
+        /* Every section offset must sit inside the image and in layout
+         * order, or a corrupt header walks the reader out of bounds. */
+        || h->sigs_off < (rs_long_t)sizeof(*h)
+        || h->sigs_off > (rs_long_t)len
+        || h->ktable_off < h->sigs_off || h->ktable_off > (rs_long_t)len
+        || h->itable_off < h->ktable_off || h->itable_off > (rs_long_t)len
+        || h->bloom_off < h->itable_off || h->bloom_off > (rs_long_t)len
+        || h->bloom_off + (rs_long_t)h->table_size > (rs_long_t)len
+        || (h->table_size & (h->table_size - 1)) != 0
+        || (h->count != 0) != (h->table_size != 0)
+        || h->table_count > h->count)
+        return NULL;
+    sig = rs_alloc_struct(rs_signature_t);
+    sig->magic = h->sig_magic;
+    sig->block_len = h->block_len;
+    sig->strong_sum_len = h->strong_sum_len;
+    sig->count = sig->size = h->count;
+    sig->block_sigs = (char *)image + h->sigs_off;
+    entry_size = rs_block_sig_size(sig);
+    /* With the offsets ordered and inside the image these sums cannot
+     * overflow; check each section's extent fits before the next. */
+    if (h->sigs_off + (rs_long_t)h->count * (rs_long_t)entry_size
+        > h->ktable_off
+        || h->ktable_off + (rs_long_t)(h->table_size * sizeof(unsigned))
+        > h->itable_off
+        || h->itable_off + (rs_long_t)(h->table_size * sizeof(unsigned))
+        > h->bloom_off) {
+        free(sig);
+        return NULL;
+    }
+    if (h->count)
+        sig->hashtable =
+            _hashtable_new_mapped(h->table_size, h->table_count,
+                                  (unsigned *)((char *)image + h->ktable_off),
+                                  (unsigned *)((char *)image + h->itable_off),
+                                  (unsigned char *)image + h->bloom_off,
+                                  sig->block_sigs, entry_size);
+    else
+        sig->hashtable = _hashtable_new(0, 0);
+    if (!sig->hashtable) {
+        free(sig);
+        return NULL;
+    }
+    rs_signature_check(sig);
+    return sig;
+}
+
+
+size_t rs_signature_freeze_size(rs_signature_t *sig)
+{
+    rs_sig2_header_t h;
+
+    rs_signature_check(sig);
+    if (!sig->hashtable && rs_build_hash_table(sig) != RS_DONE)
+        return 0;
+    if (!rs_sig2_fits(sig))
+        return 0;
+    rs_sig2_layout(sig, &h);
+    return (size_t)h.file_len;
+}
+
+
+rs_result rs_signature_freeze(rs_signature_t *sig, void *image, size_t len)
+{
+    rs_sig2_header_t h;
+    hashtable_t *t;
+    rs_result result;
+
+    rs_signature_check(sig);
+    if (!sig->hashtable && (result = rs_build_hash_table(sig)) != RS_DONE)
+        return result;
+    if (!rs_sig2_fits(sig)) {
+        rs_error("signature too large for a v2 container");
+        return RS_PARAM_ERROR;
+    }
+    t = sig->hashtable;
+    rs_sig2_layout(sig, &h);
+    if (len < (size_t)h.file_len)
+        return RS_PARAM_ERROR;
+    memset(image, 0, (size_t)h.file_len);
+    memcpy(image, &h, sizeof(h));
+    if (sig->count) {
+        memcpy((char *)image + h.sigs_off, sig->block_sigs,
+               (size_t)sig->count * rs_block_sig_size(sig));
+        memcpy((char *)image + h.ktable_off, t->ktable,
+               (size_t)t->size * sizeof(unsigned));
+        memcpy((char *)image + h.itable_off, t->itable,
+               (size_t)t->size * sizeof(unsigned));
+        rs_sig2_bloom(t, (unsigned char *)image + h.bloom_off);
+    }
+    rs_trace("froze signature: "FMT_LONG" bytes, "FMT_LONG" blocks",
+             h.file_len, sig->count);
+    return RS_DONE;
+}
+
+
+rs_signature_t *rs_signature_attach(void *image, size_t len)
+{
+    rs_signature_t *sig;
+
+    if (!(sig = rs_sig2_attach(image, len)))
+        rs_error("not a valid frozen signature image");
+    return sig;
+}
+
+
+#ifdef HAVE_SYS_MMAN_H
+
+rs_signature_t *rs_loadsig_mmap(const char *filename)
+{
+    struct stat st;
+    rs_signature_t *sig;
+    void *map;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        rs_error("couldn't open signature %s: %s", filename, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || st.st_size < (rs_long_t)sizeof(rs_sig2_header_t)
+        || (rs_long_t)(size_t)st.st_size != (rs_long_t)st.st_size) {
+        rs_error("%s is not a mappable signature file", filename);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        rs_error("mmap of %s failed: %s", filename, strerror(errno));
+        return NULL;
+    }
+    if (!(sig = rs_sig2_attach(map, (size_t)st.st_size))) {
+        rs_error("%s is not a valid v2 signature", filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    sig->map = map;
+    sig->map_len = st.st_size;
+    rs_trace("mapped signature %s: " FMT_SIZE " bytes, " FMT_LONG " blocks",
+             filename, sig->map_len, sig->count);
+    return sig;
+}
+
+void rs_sig2_unmap(rs_signature_t *sig)
+{
+    if (sig->map) {
+        munmap(sig->map, sig->map_len);
+        sig->map = NULL;
+        sig->map_len = 0;
+    }
+}
+
+#else /* !HAVE_SYS_MMAN_H */
+
+rs_signature_t *rs_loadsig_mmap(const char *filename)
+{
+    rs_error("mapped signatures are not supported on this platform");
+    return NULL;
+}
+
+void rs_sig2_unmap(rs_signature_t *sig)
+{
+}
+
+#endif /* !HAVE_SYS_MMAN_H */
+
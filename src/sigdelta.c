@@ -0,0 +1,154 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * Copyright (C) 2000, 2001 by Martin Pool <mbp@sourcefrog.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+                              /*
+                               | Do two things at once and you
+                               | do neither.
+                               |        -- Publilius Syrus
+                               */
+
+/*
+ * sigdelta.c -- Fused signature and delta generation in one pass.
+ *
+ * A sync pipeline often needs both the delta of a new file against an
+ * old signature and the signature of that same new file for the next
+ * round.  Running the two jobs separately reads the input twice; this
+ * wrapper reads it once.  The fused job is an ordinary delta job whose
+ * state function first taps every newly arrived input byte into an
+ * embedded signature job, then pulls the same bytes into the scoop so
+ * the delta scanner finds them there.  Because the delta side only
+ * ever sees data through the scoop, each input byte is tapped exactly
+ * once, at the moment it enters the job.
+ *
+ * The embedded signature job's output cannot share the delta output
+ * stream, so it is drained through a caller-supplied rs_driven_cb,
+ * the same callback type rs_job_drive() uses; rs_outfilebuf_drain()
+ * with a filebuf works directly.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "librsync.h"
+#include "job.h"
+#include "stream.h"
+#include "sumset.h"
+#include "util.h"
+#include "trace.h"
+
+/** Private state for a fused signature+delta job. */
+struct rs_sigdelta {
+    rs_job_t        *sig_job;       /* embedded signature generator */
+    rs_buffers_t    sig_buf;        /* its private buffer set */
+    rs_driven_cb    *sig_out_cb;    /* drains the signature output */
+    void            *sig_out_arg;
+    int             sig_done;       /* signature job has completed */
+    /** The delta side's real state function; job->statefn stays on the
+     * tapping wrapper until the job completes. */
+    rs_result       (*statefn)(rs_job_t *);
+};
+
+
+void rs_sigdelta_free(struct rs_sigdelta *sd)
+{
+    if (sd->sig_job)
+        rs_job_free(sd->sig_job);
+    free(sd);
+}
+
+
+/** Run the embedded signature job until its input is consumed, or all
+ * the way to completion when FINISH is set, draining output through
+ * the callback after every step. */
+static rs_result rs_sigdelta_pump(struct rs_sigdelta *sd, int finish)
+{
+    rs_result       result, iores;
+
+    do {
+        result = rs_job_iter(sd->sig_job, &sd->sig_buf);
+        if (result != RS_DONE && result != RS_BLOCKED)
+            return result;
+        iores = sd->sig_out_cb(sd->sig_job, &sd->sig_buf, sd->sig_out_arg);
+        if (iores != RS_DONE)
+            return iores;
+    } while (sd->sig_buf.avail_in || (finish && result != RS_DONE));
+
+    return RS_DONE;
+}
+
+
+/** State wrapper run in place of the delta state functions.
+ *
+ * Taps fresh input into the signature job, moves it into the scoop,
+ * then hands over to the current delta state.
+ */
+static rs_result rs_sigdelta_s_drive(rs_job_t *job)
+{
+    struct rs_sigdelta *sd = job->sigdelta;
+    rs_buffers_t *stream = job->stream;
+    rs_result result;
+
+    if (stream->avail_in) {
+        sd->sig_buf.next_in = stream->next_in;
+        sd->sig_buf.avail_in = stream->avail_in;
+        if ((result = rs_sigdelta_pump(sd, 0)) != RS_DONE)
+            return result;
+        /* Absorb the tapped bytes into the scoop so the delta scanner
+         * reads them from there and they are never presented again. */
+        rs_scoop_input(job, job->scoop_avail + stream->avail_in);
+        assert(stream->avail_in == 0);
+    }
+    if (stream->eof_in && !sd->sig_done) {
+        sd->sig_buf.eof_in = 1;
+        if ((result = rs_sigdelta_pump(sd, 1)) != RS_DONE)
+            return result;
+        sd->sig_done = 1;
+    }
+
+    /* Run the real delta state; it may advance job->statefn, which we
+     * stash so the wrapper keeps control of the job. */
+    job->statefn = sd->statefn;
+    result = job->statefn(job);
+    sd->statefn = job->statefn;
+    job->statefn = rs_sigdelta_s_drive;
+    return result;
+}
+
+
+rs_job_t *rs_sig_delta_begin(rs_signature_t *sig, size_t new_block_len,
+                             size_t strong_len, rs_magic_number sig_magic,
+                             rs_driven_cb *sig_out_cb, void *sig_out_arg)
+{
+    rs_job_t *job = rs_delta_begin(sig);
+    struct rs_sigdelta *sd = rs_alloc_struct(struct rs_sigdelta);
+
+    sd->sig_job = rs_sig_begin(new_block_len, strong_len, sig_magic);
+    sd->sig_out_cb = sig_out_cb;
+    sd->sig_out_arg = sig_out_arg;
+    sd->statefn = job->statefn;
+    job->statefn = rs_sigdelta_s_drive;
+    job->sigdelta = sd;
+    job->job_name = job->stats.op = "sigdelta";
+    return job;
+}
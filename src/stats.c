@@ -93,6 +93,12 @@ rs_format_stats(rs_stats_t const * stats,
                          stats->sig_blocks, stats->block_len);
     }
 
+    if (stats->scan_secs || stats->find_secs || stats->tube_secs) {
+        len += snprintf(buf+len, size-len,
+                        " phases[scan %.3fs (find %.3fs), tube %.3fs]",
+                        stats->scan_secs, stats->find_secs, stats->tube_secs);
+    }
+
     sec = (stats->end - stats->start);
     if (sec == 0) sec = 1; // avoid division by zero
     mbps_in = stats->in_bytes / 1e6 / sec;
@@ -0,0 +1,358 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- library for network deltas
+ *
+ * Copyright (C) 2000, 2001 by Martin Pool <mbp@sourcefrog.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * stitch.c -- Stitch per-segment deltas into one delta.
+ *
+ * For very large inputs the delta scan parallelizes at the segment
+ * level: split the new file into N byte ranges (rs_delta_segments()),
+ * run one ordinary delta job per range against the same loaded
+ * signature on as many cores as you like, then feed the resulting
+ * deltas, concatenated in segment order, through the job returned by
+ * rs_delta_stitch_begin().  The stitcher strips the inner headers and
+ * END commands, passes literals through untouched, and merges a COPY
+ * that ends a segment with a contiguous COPY that starts the next one,
+ * the same coalescing rs_appendmatch() does within one scan.
+ *
+ * COPY offsets address the basis, which all segments share, so no
+ * offset fixup is needed.  The only cost of segmenting is that a match
+ * window spanning a boundary can't be found by either side, so up to a
+ * block of literal data may appear at each seam; cutting segments on
+ * block multiples keeps that to the unaligned-change case.
+ *
+ * Both the fixed-width v1 and varint v2 encodings are handled; all
+ * segments must use the same one, and the output uses it too.
+ * Compressed literal payloads pass through without recompression.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "librsync.h"
+#include "emit.h"
+#include "stream.h"
+#include "util.h"
+#include "netint.h"
+#include "command.h"
+#include "prototab.h"
+#include "job.h"
+#include "trace.h"
+
+
+static rs_result rs_stitch_s_header(rs_job_t *);
+static rs_result rs_stitch_s_between(rs_job_t *);
+static rs_result rs_stitch_s_cmdbyte(rs_job_t *);
+static rs_result rs_stitch_s_params(rs_job_t *);
+static rs_result rs_stitch_s_v2_cmdbyte(rs_job_t *);
+static rs_result rs_stitch_s_v2_param1(rs_job_t *);
+static rs_result rs_stitch_s_v2_param2(rs_job_t *);
+static rs_result rs_stitch_s_run(rs_job_t *);
+
+
+/** Emit the held-back COPY, if any.  A copy is kept pending so a
+ * contiguous one from the next command or segment can merge into it. */
+static void rs_stitch_flush(rs_job_t *job)
+{
+    if (job->basis_len) {
+        rs_emit_copy_cmd(job, job->basis_pos, job->basis_len);
+        job->basis_len = 0;
+    }
+}
+
+
+/**
+ * Read a segment's delta magic.  The first segment decides the
+ * encoding and emits the output header; later segments must match.
+ */
+static rs_result rs_stitch_s_header(rs_job_t *job)
+{
+    int v;
+    rs_result result;
+
+    if ((result = rs_suck_n4(job, &v)) != RS_DONE)
+        return result;
+
+    if (v != RS_DELTA_MAGIC && v != RS_DELTA2_MAGIC) {
+        rs_error("got magic number %#x rather than a delta magic", v);
+        return RS_BAD_MAGIC;
+    }
+    if (!job->stitch_count) {
+        job->delta_v2 = (v == RS_DELTA2_MAGIC);
+        rs_emit_delta_header(job);
+    } else if (job->delta_v2 != (v == RS_DELTA2_MAGIC)) {
+        rs_error("segment %d delta format differs from the first segment's",
+                 job->stitch_count);
+        return RS_BAD_MAGIC;
+    }
+    job->stitch_count++;
+    /* each segment's encoder started with a fresh copy reference */
+    job->stitch_ref = 0;
+    rs_trace("stitching segment %d", job->stitch_count);
+
+    job->statefn = job->delta_v2 ? rs_stitch_s_v2_cmdbyte
+                                 : rs_stitch_s_cmdbyte;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Between segments: either another header follows, or the input ends
+ * and the stitched delta can be finished off.
+ */
+static rs_result rs_stitch_s_between(rs_job_t *job)
+{
+    if (rs_scoop_total_avail(job) < 4 && rs_job_input_is_ending(job)) {
+        if (rs_scoop_total_avail(job)) {
+            rs_error("trailing garbage after segment %d's END command",
+                     job->stitch_count);
+            return RS_CORRUPT;
+        }
+        rs_stitch_flush(job);
+        rs_emit_end_cmd(job);
+        return RS_DONE;
+    }
+    return rs_stitch_s_header(job);
+}
+
+
+/** Read a v1 command byte, then its fixed-width parameters. */
+static rs_result rs_stitch_s_cmdbyte(rs_job_t *job)
+{
+    rs_result result;
+
+    if ((result = rs_suck_byte(job, &job->op)) != RS_DONE)
+        return result;
+
+    job->cmd = &rs_prototab[job->op];
+    if (job->cmd->len_1)
+        job->statefn = rs_stitch_s_params;
+    else {
+        job->param1 = job->cmd->immediate;
+        job->statefn = rs_stitch_s_run;
+    }
+    return RS_RUNNING;
+}
+
+
+static rs_result rs_stitch_s_params(rs_job_t *job)
+{
+    size_t len = job->cmd->len_1 + job->cmd->len_2;
+    rs_result result;
+    void *p;
+
+    if ((result = rs_scoop_readahead(job, len, &p)) != RS_DONE)
+        return result;
+
+    result = rs_suck_netint(job, &job->param1, job->cmd->len_1);
+    assert(result == RS_DONE);
+    if (job->cmd->len_2) {
+        result = rs_suck_netint(job, &job->param2, job->cmd->len_2);
+        assert(result == RS_DONE);
+    }
+    job->statefn = rs_stitch_s_run;
+    return RS_RUNNING;
+}
+
+
+/** Read a v2 command byte; its varint parameters follow. */
+static rs_result rs_stitch_s_v2_cmdbyte(rs_job_t *job)
+{
+    rs_result result;
+
+    if ((result = rs_suck_byte(job, &job->op)) != RS_DONE)
+        return result;
+
+    switch (job->op) {
+    case RS_OP2_END:
+        job->cmd = NULL;
+        job->statefn = rs_stitch_s_run;
+        return RS_RUNNING;
+    case RS_OP2_LITERAL:
+    case RS_OP2_COPY:
+    case RS_OP2_LITERAL_Z:
+        job->statefn = rs_stitch_s_v2_param1;
+        return RS_RUNNING;
+    default:
+        rs_error("bogus v2 command %#04x", job->op);
+        return RS_CORRUPT;
+    }
+}
+
+
+static rs_result rs_stitch_s_v2_param1(rs_job_t *job)
+{
+    rs_result result;
+
+    if ((result = rs_suck_varint(job, &job->param1)) != RS_DONE)
+        return result;
+
+    /* COPY offsets are zigzag deltas from the end of the previous
+     * copy; undo that here so rs_stitch_s_run sees an absolute offset
+     * and re-encoding restarts the reference cleanly per output. */
+    if (job->op == RS_OP2_COPY)
+        job->param1 = job->stitch_ref + rs_unzigzag(job->param1);
+
+    job->statefn = (job->op == RS_OP2_LITERAL) ? rs_stitch_s_run
+                                               : rs_stitch_s_v2_param2;
+    return RS_RUNNING;
+}
+
+
+static rs_result rs_stitch_s_v2_param2(rs_job_t *job)
+{
+    rs_result result;
+
+    if ((result = rs_suck_varint(job, &job->param2)) != RS_DONE)
+        return result;
+
+    if (job->op == RS_OP2_COPY)
+        job->stitch_ref = job->param1 + job->param2;
+
+    job->statefn = rs_stitch_s_run;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Replay one decoded command into the output, holding COPYs back for
+ * merging.  Literal payloads are copied straight through the tube.
+ */
+static rs_result rs_stitch_s_run(rs_job_t *job)
+{
+    enum rs_op_kind kind;
+    rs_long_t where, len;
+
+    if (job->delta_v2) {
+        switch (job->op) {
+        case RS_OP2_END:
+            kind = RS_KIND_END;
+            break;
+        case RS_OP2_LITERAL:
+            kind = RS_KIND_LITERAL;
+            break;
+        case RS_OP2_COPY:
+            kind = RS_KIND_COPY;
+            break;
+        default:
+            kind = RS_KIND_LITERAL_Z;
+            break;
+        }
+    } else {
+        kind = job->cmd->kind;
+    }
+
+    switch (kind) {
+    case RS_KIND_LITERAL:
+        len = job->param1;
+        if (len < 0) {
+            rs_error("invalid length="FMT_LONG" on LITERAL command", len);
+            return RS_CORRUPT;
+        }
+        rs_stitch_flush(job);
+        rs_emit_literal_cmd(job, len);
+        rs_tube_copy(job, len);
+        break;
+
+    case RS_KIND_LITERAL_Z:
+        if (job->param1 <= 0 || job->param2 <= 0) {
+            rs_error("invalid lengths on LITERAL_Z command");
+            return RS_CORRUPT;
+        }
+        rs_stitch_flush(job);
+        rs_emit_literal_z_cmd(job, job->param1, job->param2);
+        rs_tube_copy(job, job->param1);
+        break;
+
+    case RS_KIND_COPY:
+        where = job->param1;
+        len = job->param2;
+        if (where < 0 || len < 0) {
+            rs_error("invalid COPY(where="FMT_LONG", len="FMT_LONG")",
+                     where, len);
+            return RS_CORRUPT;
+        }
+        /* merge with the pending copy if contiguous, as
+         * rs_appendmatch() would */
+        if (job->basis_len && job->basis_pos + job->basis_len == where) {
+            job->basis_len += len;
+        } else {
+            rs_stitch_flush(job);
+            job->basis_pos = where;
+            job->basis_len = len;
+        }
+        break;
+
+    case RS_KIND_END:
+        /* end of one segment's delta; more may follow */
+        job->statefn = rs_stitch_s_between;
+        return RS_RUNNING;
+
+    default:
+        rs_error("bogus command %#04x", job->op);
+        return RS_CORRUPT;
+    }
+
+    job->statefn = job->delta_v2 ? rs_stitch_s_v2_cmdbyte
+                                 : rs_stitch_s_cmdbyte;
+    return RS_RUNNING;
+}
+
+
+rs_job_t *rs_delta_stitch_begin(void)
+{
+    return rs_job_new("stitch", rs_stitch_s_header);
+}
+
+
+int rs_delta_segments(rs_long_t new_len, size_t block_len, int max_segs,
+                      rs_long_t *starts)
+{
+    /* Segments below this aren't worth a scheduling seam. */
+    const rs_long_t min_seg = (rs_long_t)block_len * 16;
+    rs_long_t seg, pos;
+    int n, i;
+
+    assert(block_len > 0);
+    assert(max_segs > 0);
+
+    if (new_len <= 0) {
+        starts[0] = 0;
+        return 1;
+    }
+
+    n = max_segs;
+    if (new_len < min_seg * n)
+        n = new_len > min_seg ? (int)(new_len / min_seg) : 1;
+
+    seg = (new_len / n / block_len) * block_len;
+    if (seg < (rs_long_t)block_len)
+        seg = block_len;
+
+    pos = 0;
+    for (i = 0; i < n && pos < new_len; i++) {
+        starts[i] = pos;
+        pos += seg;
+    }
+    return i ? i : 1;
+}
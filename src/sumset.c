@@ -22,6 +22,10 @@
 
 #include "config.h"
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include <assert.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -35,6 +39,7 @@
 
 const int RS_MD4_SUM_LENGTH = 16;
 const int RS_BLAKE2_SUM_LENGTH = 32;
+const int RS_RK64_SUM_LENGTH = 4;
 
 static void rs_block_sig_init(rs_block_sig_t *sig, rs_weak_sum_t weak_sum, rs_strong_sum_t *strong_sum, int strong_len)
 {
@@ -64,7 +69,8 @@ static void rs_block_match_init(rs_block_match_t *match, rs_signature_t *sig, rs
     match->len = len;
 }
 
-static inline int rs_block_match_cmp(rs_block_match_t *match, const rs_block_sig_t *block_sig)
+/* Calculate the match's strong sum lazily if it hasn't been done yet. */
+static inline void rs_block_match_calc_strong(rs_block_match_t *match)
 {
     /* If buf is not NULL, the strong sum is yet to be calculated. */
     if (match->buf) {
@@ -74,6 +80,25 @@ static inline int rs_block_match_cmp(rs_block_match_t *match, const rs_block_sig
         rs_signature_calc_strong_sum(match->signature, match->buf, match->len, &(match->block_sig.strong_sum));
         match->buf = NULL;
     }
+}
+
+/* An 8-bit tag of the strong sum, kept in the hashtable's compact tag
+   table so most weak-sum collisions are rejected without fetching the
+   packed entry from the much larger block_sigs array. */
+static inline unsigned char rs_block_sig_tag(const rs_block_sig_t *sig)
+{
+    return ((const unsigned char *)sig->strong_sum)[0];
+}
+
+static inline unsigned char rs_block_match_tag(rs_block_match_t *match)
+{
+    rs_block_match_calc_strong(match);
+    return rs_block_sig_tag(&match->block_sig);
+}
+
+static inline int rs_block_match_cmp(rs_block_match_t *match, const rs_block_sig_t *block_sig)
+{
+    rs_block_match_calc_strong(match);
     return memcmp(&match->block_sig.strong_sum, &block_sig->strong_sum, match->signature->strong_sum_len);
 }
 
@@ -81,24 +106,19 @@ static inline int rs_block_match_cmp(rs_block_match_t *match, const rs_block_sig
 #define ENTRY rs_block_sig
 #define MATCH rs_block_match
 #define NAME hashtable
+#define TAG
 #include "hashtable.h"
 
-/* Get the size of a packed rs_block_sig_t. */
-static inline size_t rs_block_sig_size(const rs_signature_t *sig)
-{
-    return offsetof(rs_block_sig_t, strong_sum) + sig->strong_sum_len;
-}
-
 /* Get the pointer to the block_sig_t from a block index. */
-static inline rs_block_sig_t *rs_block_sig_ptr(const rs_signature_t *sig, int block_idx)
+static inline rs_block_sig_t *rs_block_sig_ptr(const rs_signature_t *sig, rs_long_t block_idx)
 {
-    return (rs_block_sig_t*)((char*)sig->block_sigs + block_idx * rs_block_sig_size(sig));
+    return (rs_block_sig_t*)((char*)sig->block_sigs + block_idx * (rs_long_t)rs_block_sig_size(sig));
 }
 
 /* Get the index of a block from a block_sig_t pointer. */
-static inline int rs_block_sig_idx(const rs_signature_t *sig, rs_block_sig_t *block_sig)
+static inline rs_long_t rs_block_sig_idx(const rs_signature_t *sig, rs_block_sig_t *block_sig)
 {
-    return ((char *)block_sig - (char *)sig->block_sigs) / rs_block_sig_size(sig);
+    return ((char *)block_sig - (char *)sig->block_sigs) / (rs_long_t)rs_block_sig_size(sig);
 }
 
 rs_result rs_signature_init(rs_signature_t *sig, int magic, int block_len, int strong_len, rs_long_t sig_fsize)
@@ -109,11 +129,16 @@ rs_result rs_signature_init(rs_signature_t *sig, int magic, int block_len, int s
     magic = magic ? magic : RS_BLAKE2_SIG_MAGIC;
     switch (magic) {
     case RS_BLAKE2_SIG_MAGIC:
+    case RS_RK_BLAKE2_SIG_MAGIC:
         max_strong_len = RS_BLAKE2_SUM_LENGTH;
         break;
     case RS_MD4_SIG_MAGIC:
+    case RS_RK_MD4_SIG_MAGIC:
         max_strong_len = RS_MD4_SUM_LENGTH;
         break;
+    case RS_RK64_SIG_MAGIC:
+        max_strong_len = RS_RK64_SUM_LENGTH;
+        break;
     default:
         rs_error("invalid magic %#x", magic);
         return RS_BAD_MAGIC;
@@ -130,14 +155,20 @@ rs_result rs_signature_init(rs_signature_t *sig, int magic, int block_len, int s
     sig->count = 0;
     /* Calculate the number of blocks if we have the signature file size. */
     /* Magic+header is 12 bytes, each block thereafter is 4 bytes weak_sum+strong_sum_len bytes */
-    sig->size = (int)(sig_fsize ? (sig_fsize - 12) / (4 + strong_len) : 0);
+    sig->size = sig_fsize ? (sig_fsize - 12) / (4 + strong_len) : 0;
     if (sig->size)
-        sig->block_sigs = rs_alloc(sig->size * rs_block_sig_size(sig), "signature->block_sigs");
+        sig->block_sigs = rs_alloc_large((size_t)sig->size * rs_block_sig_size(sig), "signature->block_sigs");
     else
         sig->block_sigs = NULL;
     sig->hashtable = NULL;
+    sig->map = NULL;
+    sig->map_len = 0;
+    sig->merge_count = 0;
+    sig->merge_starts = NULL;
+    sig->builder = NULL;
 #ifndef HASHTABLE_NSTATS
     sig->calc_strong_count = 0;
+    sig->stats_sample = 1;
 #endif
     rs_signature_check(sig);
     return RS_DONE;
@@ -145,7 +176,10 @@ rs_result rs_signature_init(rs_signature_t *sig, int magic, int block_len, int s
 
 void rs_signature_done(rs_signature_t *sig)
 {
+    rs_signature_build_abort(sig);
     hashtable_free(sig->hashtable);
+    rs_sig2_unmap(sig);
+    free(sig->merge_starts);
     rs_bzero(sig, sizeof(*sig));
 }
 
@@ -154,14 +188,74 @@ rs_block_sig_t *rs_signature_add_block(rs_signature_t *sig, rs_weak_sum_t weak_s
     rs_signature_check(sig);
     /* If block_sigs is full, allocate more space. */
     if (sig->count == sig->size) {
+        size_t old_len = (size_t)sig->size * rs_block_sig_size(sig);
+
+        /* An eager build must not see the array move; the preallocation
+           estimate was wrong, so discard the partial table. */
+        rs_signature_build_abort(sig);
         sig->size = sig->size ? sig->size * 2 : 16;
-        sig->block_sigs = rs_realloc(sig->block_sigs, sig->size * rs_block_sig_size(sig), "signature->block_sigs");
+        sig->block_sigs = rs_realloc_large(sig->block_sigs, old_len,
+                                           (size_t)sig->size * rs_block_sig_size(sig),
+                                           "signature->block_sigs");
+        /* The hashtable stores block indexes, so it survives the
+           relocation once told the new base. */
+        if (sig->hashtable)
+            hashtable_set_base(sig->hashtable, sig->block_sigs);
     }
     rs_block_sig_t *b = rs_block_sig_ptr(sig, sig->count++);
     rs_block_sig_init(b, weak_sum, strong_sum, sig->strong_sum_len);
     return b;
 }
 
+rs_result rs_signature_merge(rs_signature_t *dest, rs_signature_t const *src)
+{
+    rs_long_t i;
+
+    rs_signature_check(dest);
+    rs_signature_check(src);
+    if (dest->magic != src->magic || dest->block_len != src->block_len
+        || dest->strong_sum_len != src->strong_sum_len) {
+        rs_error("can't merge signatures with different parameters");
+        return RS_PARAM_ERROR;
+    }
+    if (dest->hashtable || dest->map) {
+        rs_error("can't merge into a built or mapped signature");
+        return RS_PARAM_ERROR;
+    }
+    /* Record where each basis starts in the merged block array; the
+       first merge also records the original signature as basis 0. */
+    dest->merge_starts = rs_realloc(dest->merge_starts,
+                                    (dest->merge_count + 2)
+                                    * sizeof(dest->merge_starts[0]),
+                                    "signature->merge_starts");
+    if (!dest->merge_count)
+        dest->merge_starts[dest->merge_count++] = 0;
+    dest->merge_starts[dest->merge_count++] = dest->count;
+    for (i = 0; i < src->count; i++) {
+        rs_block_sig_t *b = rs_block_sig_ptr(src, i);
+        rs_signature_add_block(dest, b->weak_sum, &b->strong_sum);
+    }
+    rs_trace("merged "FMT_LONG" blocks onto "FMT_LONG" as basis %d", src->count,
+             dest->count - src->count, dest->merge_count - 1);
+    return RS_DONE;
+}
+
+int rs_signature_basis_of(rs_signature_t const *sig, rs_long_t pos,
+                          rs_long_t *local_pos)
+{
+    int i = 0;
+    rs_long_t block = pos / sig->block_len;
+
+    if (sig->merge_count) {
+        while (i + 1 < sig->merge_count && block >= sig->merge_starts[i + 1])
+            i++;
+        pos -= (rs_long_t)sig->merge_starts[i] * sig->block_len;
+    }
+    if (local_pos)
+        *local_pos = pos;
+    return i;
+}
+
 rs_long_t rs_signature_find_match(rs_signature_t *sig, rs_weak_sum_t weak_sum, void const *buf, size_t len)
 {
     rs_block_match_t m;
@@ -170,48 +264,463 @@ rs_long_t rs_signature_find_match(rs_signature_t *sig, rs_weak_sum_t weak_sum, v
     rs_signature_check(sig);
     rs_block_match_init(&m, sig, weak_sum, NULL, buf, len);
     if ((b = hashtable_find(sig->hashtable, &m))) {
-        return (rs_long_t)rs_block_sig_idx(sig, b) * sig->block_len;
+        return rs_block_sig_idx(sig, b) * sig->block_len;
     }
     return -1;
 }
 
+rs_long_t rs_signature_find_match64(rs_signature_t *sig, uint64_t digest)
+{
+    rs_block_match_t m;
+    rs_block_sig_t *b;
+    rs_strong_sum_t check;
+
+    rs_signature_check(sig);
+    /* The check half is already in hand, so init the match with it and
+     * no buffer; nothing is ever calculated on a weak hit. */
+    rs_rk64_check_sum(digest, &check);
+    rs_block_match_init(&m, sig, (rs_weak_sum_t)digest, &check, NULL, 0);
+    if ((b = hashtable_find(sig->hashtable, &m))) {
+        return rs_block_sig_idx(sig, b) * sig->block_len;
+    }
+    return -1;
+}
+
+void rs_signature_prefetch_match(rs_signature_t *sig, rs_weak_sum_t weak_sum)
+{
+    /* Mirror the hashing done by hashtable_find() on a block match,
+     * whose key hash is the weak sum itself. */
+    unsigned hk = (unsigned)weak_sum;
+
+    _hashtable_prefetch(sig->hashtable, mix32(hk ? hk : -1));
+}
+
+int rs_signature_near_match(rs_signature_t *sig, rs_weak_sum_t weak_sum)
+{
+#ifndef HASHTABLE_NBLOOM
+    unsigned hk = (unsigned)weak_sum;
+
+    return _hashtable_getbloom(sig->hashtable, mix32(hk ? hk : -1));
+#else
+    /* Without a bloom filter everything looks near; callers fall back
+     * to per-offset probing. */
+    (void)sig;
+    (void)weak_sum;
+    return 1;
+#endif
+}
+
+void rs_signature_set_stats_sample(rs_signature_t *sig, int every)
+{
+#ifndef HASHTABLE_NSTATS
+    rs_signature_check(sig);
+    sig->stats_sample = every > 1 ? every : 1;
+    if (sig->hashtable)
+        hashtable_set_stats_sample(sig->hashtable,
+                                   (unsigned)sig->stats_sample);
+#else
+    (void)sig;
+    (void)every;
+#endif
+}
+
+void rs_signature_get_stats(rs_signature_t const *sig, rs_match_stats_t *stats)
+{
+    rs_bzero(stats, sizeof(*stats));
+    stats->sample_every = 1;
+#ifndef HASHTABLE_NSTATS
+    {
+        hashtable_t *t = sig->hashtable;
+
+        if (t && t->stats_every) {
+            /* Counts are sampled once per stats_every finds; scaling
+               back up gives an unbiased estimate of the totals. */
+            stats->sample_every = (int)t->stats_every;
+            stats->find_count = (rs_long_t)t->find_count * t->stats_every;
+            stats->match_count = (rs_long_t)t->match_count * t->stats_every;
+            stats->hashcmp_count =
+                (rs_long_t)t->hashcmp_count * t->stats_every;
+            stats->entrycmp_count =
+                (rs_long_t)t->entrycmp_count * t->stats_every;
+        }
+        stats->calc_strong_count = sig->calc_strong_count;
+    }
+#endif
+}
+
 void rs_signature_log_stats(rs_signature_t const *sig)
 {
 #ifndef HASHTABLE_NSTATS
-    hashtable_t *t = sig->hashtable;
+    rs_match_stats_t s;
 
+    rs_signature_get_stats(sig, &s);
     rs_log(RS_LOG_INFO|RS_LOG_NONAME,
-           "match statistics: signature[%ld searches, %ld (%.3f%%) matches, "
-           "%ld (%.3fx) weak sum compares, %ld (%.3f%%) strong sum compares, "
-           "%ld (%.3f%%) strong sum calcs]",
-           t->find_count,
-           t->match_count, 100.0 * (double)t->match_count / t->find_count,
-           t->hashcmp_count, (double)t->hashcmp_count / t->find_count,
-           t->entrycmp_count, 100.0 * (double)t->entrycmp_count / t->find_count,
-           sig->calc_strong_count, 100.0 * (double)sig->calc_strong_count / t->find_count);
+           "match statistics: signature["FMT_LONG" searches, "FMT_LONG" (%.3f%%) matches, "
+           FMT_LONG" (%.3fx) weak sum compares, "FMT_LONG" (%.3f%%) strong sum compares, "
+           FMT_LONG" (%.3f%%) strong sum calcs] (1/%d sampled)",
+           s.find_count,
+           s.match_count, 100.0 * (double)s.match_count / s.find_count,
+           s.hashcmp_count, (double)s.hashcmp_count / s.find_count,
+           s.entrycmp_count, 100.0 * (double)s.entrycmp_count / s.find_count,
+           s.calc_strong_count, 100.0 * (double)s.calc_strong_count / s.find_count,
+           s.sample_every);
 #endif
 }
 
-rs_result rs_build_hash_table(rs_signature_t *sig)
+/** Create the (empty) hashtable for a signature, sized for \p size
+ * entries. */
+static hashtable_t *rs_hash_table_new(rs_signature_t *sig, size_t size)
+{
+    /* Route the bucket tables through the large allocator so they get
+       huge-page advice, or the rs_set_large_alloc() hook if one is
+       installed. */
+    hashtable_set_allocator(rs_calloc_large, rs_free_large);
+    /* Use indexed mode: block_sigs is packed, and 32-bit indexes halve
+       the entry table size compared to pointers. An empty signature has
+       no block_sigs array, so it gets an ordinary empty table. */
+    if (sig->block_sigs)
+        return hashtable_new_indexed(size, sig->block_sigs,
+                                     rs_block_sig_size(sig));
+    return hashtable_new(size);
+}
+
+/** Insert blocks [\p start, \p end) into a signature's hashtable,
+ * deduplicating like rs_build_hash_table().  Returns the first index
+ * not inserted (< \p end only if the table filled up). */
+static rs_long_t rs_hash_table_insert(rs_signature_t *sig, rs_long_t start,
+                                      rs_long_t end)
 {
     rs_block_match_t m;
     rs_block_sig_t *b;
-    int i;
+    rs_long_t i;
 
-    rs_signature_check(sig);
-    sig->hashtable = hashtable_new(sig->count);
-    if (!sig->hashtable)
-        return RS_MEM_ERROR;
-    for (i = 0; i < sig->count; i++) {
+    for (i = start; i < end; i++) {
         b = rs_block_sig_ptr(sig, i);
         rs_block_match_init(&m, sig, b->weak_sum, &b->strong_sum, NULL, 0);
-        if (!hashtable_find(sig->hashtable, &m))
-            hashtable_add(sig->hashtable, b);
+        if (!hashtable_find(sig->hashtable, &m)
+            && !hashtable_add(sig->hashtable, b))
+            return i;
     }
+    return end;
+}
+
+/** Reset the hashtable stats after a build. */
+static void rs_hash_table_stats_init(rs_signature_t *sig)
+{
     hashtable_stats_init(sig->hashtable);
+#ifndef HASHTABLE_NSTATS
+    hashtable_set_stats_sample(sig->hashtable, (unsigned)sig->stats_sample);
+#endif
+}
+
+rs_result rs_build_hash_table(rs_signature_t *sig)
+{
+    rs_signature_check(sig);
+    rs_signature_build_join(sig);
+    if (sig->hashtable)
+        return RS_DONE;
+    if (!(sig->hashtable = rs_hash_table_new(sig, (size_t)sig->count)))
+        return RS_MEM_ERROR;
+    rs_hash_table_insert(sig, 0, sig->count);
+    rs_hash_table_stats_init(sig);
     return RS_DONE;
 }
 
+#if defined(HAVE_PTHREAD_H) && defined(__GNUC__)
+
+/** Most threads worth spawning for a table build. */
+#define RS_BUILD_MAX_THREADS 64
+/** Don't bother spawning a thread for fewer blocks than this. */
+#define RS_BUILD_BLOCKS_PER_THREAD 65536
+
+/** Insert one block into the hashtable, racing with other inserters.
+ *
+ * This mirrors the template's find-before-add, but claims buckets with
+ * a compare-and-swap so threads can insert concurrently.  The race
+ * window where a claimed bucket's itable/stable are not yet written can
+ * only affect deduplication, never lookup correctness: a missed
+ * duplicate is just an extra entry, and a stale compare can only skip a
+ * block whose sums equal some entry already (or about to be) in the
+ * table.  Lookups don't run until the build threads are joined. */
+static void rs_hash_table_insert_atomic(rs_signature_t *sig, hashtable_t *t,
+                                        rs_long_t idx, rs_long_t *added)
+{
+    rs_block_sig_t *b = rs_block_sig_ptr(sig, idx);
+    const size_t mask = t->size - 1;
+    const unsigned char tag = rs_block_sig_tag(b);
+    unsigned hk = rs_block_sig_hash(b);
+    unsigned mh, s = 0, h;
+    size_t i;
+
+    hk = hk ? hk : (unsigned)-1;
+    mh = mix32(hk);
+    for (i = mh & mask;; i = (i + ++s) & mask) {
+        h = __atomic_load_n(&t->ktable[i], __ATOMIC_ACQUIRE);
+        if (!h) {
+            unsigned expect = 0;
+
+            if (__atomic_compare_exchange_n(&t->ktable[i], &expect, hk, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                t->itable[i] = (unsigned)idx;
+                t->stable[i] = tag;
+#ifndef HASHTABLE_NBLOOM
+                {
+                    unsigned bi = mh >> t->bshift;
+
+                    __atomic_fetch_or(&t->kbloom[bi / 8],
+                                      (unsigned char)(1 << (bi % 8)),
+                                      __ATOMIC_RELAXED);
+                }
+#endif
+                (*added)++;
+                return;
+            }
+            h = expect;
+        }
+        if (h == hk && t->stable[i] == tag) {
+            rs_block_sig_t *e = (rs_block_sig_t *)((char *)t->base
+                                                   + (size_t)t->itable[i]
+                                                   * t->entry_size);
+
+            if (e->weak_sum == b->weak_sum
+                && !memcmp(e->strong_sum, b->strong_sum,
+                           (size_t)sig->strong_sum_len))
+                return;
+        }
+    }
+}
+
+/** One build thread's slice of the block array. */
+struct rs_build_slice {
+    rs_signature_t *sig;
+    hashtable_t *t;
+    rs_long_t start, end;
+    rs_long_t added;
+};
+
+static void *rs_build_slice_run(void *arg)
+{
+    struct rs_build_slice *slice = arg;
+    rs_long_t i;
+
+    for (i = slice->start; i < slice->end; i++)
+        rs_hash_table_insert_atomic(slice->sig, slice->t, i, &slice->added);
+    return NULL;
+}
+
+rs_result rs_build_hash_table_parallel(rs_signature_t *sig, int nthreads)
+{
+    struct rs_build_slice slices[RS_BUILD_MAX_THREADS];
+    pthread_t threads[RS_BUILD_MAX_THREADS];
+    rs_long_t per_thread;
+    int i, created;
+
+    rs_signature_check(sig);
+    rs_signature_build_join(sig);
+    if (sig->hashtable)
+        return RS_DONE;
+    if (nthreads > RS_BUILD_MAX_THREADS)
+        nthreads = RS_BUILD_MAX_THREADS;
+    if ((rs_long_t)nthreads > sig->count / RS_BUILD_BLOCKS_PER_THREAD)
+        nthreads = (int)(sig->count / RS_BUILD_BLOCKS_PER_THREAD);
+    if (nthreads <= 1 || !sig->block_sigs)
+        return rs_build_hash_table(sig);
+    if (!(sig->hashtable = rs_hash_table_new(sig, (size_t)sig->count)))
+        return RS_MEM_ERROR;
+    per_thread = (sig->count + nthreads - 1) / nthreads;
+    for (created = 0; created < nthreads; created++) {
+        struct rs_build_slice *slice = &slices[created];
+
+        slice->sig = sig;
+        slice->t = sig->hashtable;
+        slice->start = created * per_thread;
+        slice->end = slice->start + per_thread;
+        if (slice->end > sig->count)
+            slice->end = sig->count;
+        slice->added = 0;
+        if (pthread_create(&threads[created], NULL, rs_build_slice_run,
+                           slice) != 0)
+            break;
+    }
+    if (!created) {
+        /* No threads at all; fall back to the serial insert. */
+        rs_hash_table_insert(sig, 0, sig->count);
+        rs_hash_table_stats_init(sig);
+        return RS_DONE;
+    }
+    for (i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+        sig->hashtable->count += (size_t)slices[i].added;
+    }
+    /* If thread creation stopped short, insert the rest serially. */
+    if (created < nthreads)
+        rs_hash_table_insert(sig, slices[created - 1].end, sig->count);
+    rs_hash_table_stats_init(sig);
+    rs_trace("built hashtable with %d threads: "FMT_SIZE" of "FMT_LONG
+             " blocks", created, sig->hashtable->count, sig->count);
+    return RS_DONE;
+}
+
+#else /* !HAVE_PTHREAD_H || !__GNUC__ */
+
+rs_result rs_build_hash_table_parallel(rs_signature_t *sig, int nthreads)
+{
+    (void)nthreads;
+    return rs_build_hash_table(sig);
+}
+
+#endif /* !HAVE_PTHREAD_H || !__GNUC__ */
+
+#ifdef HAVE_PTHREAD_H
+
+/** State for building the hashtable on a thread while the signature is
+ * still being loaded; see rs_signature_build_start(). */
+struct rs_sig_builder {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    rs_signature_t *sig;
+    rs_long_t published;        /**< Blocks the loader has made visible. */
+    rs_long_t built;            /**< Blocks inserted so far. */
+    int done;                   /**< Loader finished (or aborted). */
+    int failed;                 /**< Table filled up; must rebuild. */
+};
+
+static void *rs_sig_builder_run(void *arg)
+{
+    struct rs_sig_builder *b = arg;
+    rs_long_t todo;
+
+    for (;;) {
+        pthread_mutex_lock(&b->mutex);
+        while (!b->done && b->built == b->published)
+            pthread_cond_wait(&b->cond, &b->mutex);
+        todo = b->published;
+        if (b->done && b->built == todo) {
+            pthread_mutex_unlock(&b->mutex);
+            return NULL;
+        }
+        pthread_mutex_unlock(&b->mutex);
+        /* Blocks [built, todo) are stable: the loader only appends, and
+           aborts the builder before any reallocation. */
+        if (rs_hash_table_insert(b->sig, b->built, todo) != todo)
+            b->failed = 1;
+        pthread_mutex_lock(&b->mutex);
+        b->built = todo;
+        pthread_mutex_unlock(&b->mutex);
+        if (b->failed)
+            return NULL;
+    }
+}
+
+void rs_signature_build_start(rs_signature_t *sig)
+{
+    struct rs_sig_builder *b;
+
+    /* Needs the block array preallocated to its final size, or the
+       loader's reallocations would move it under the builder. */
+    if (sig->builder || sig->hashtable || !sig->size || !sig->block_sigs)
+        return;
+    if (!(sig->hashtable = rs_hash_table_new(sig, (size_t)sig->size)))
+        return;
+    b = rs_alloc_struct(struct rs_sig_builder);
+    b->sig = sig;
+    pthread_mutex_init(&b->mutex, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    if (pthread_create(&b->thread, NULL, rs_sig_builder_run, b) != 0) {
+        pthread_mutex_destroy(&b->mutex);
+        pthread_cond_destroy(&b->cond);
+        free(b);
+        hashtable_free(sig->hashtable);
+        sig->hashtable = NULL;
+        return;
+    }
+    sig->builder = b;
+    rs_trace("started eager hashtable build for "FMT_LONG" blocks",
+             sig->size);
+}
+
+void rs_signature_build_publish(rs_signature_t *sig)
+{
+    struct rs_sig_builder *b = sig->builder;
+
+    if (!b)
+        return;
+    pthread_mutex_lock(&b->mutex);
+    b->published = sig->count;
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+void rs_signature_build_abort(rs_signature_t *sig)
+{
+    struct rs_sig_builder *b = sig->builder;
+
+    if (!b)
+        return;
+    /* Marking the build failed makes the join below discard the
+       partial table instead of finishing it. */
+    b->failed = 1;
+    rs_signature_build_join(sig);
+}
+
+void rs_signature_build_join(rs_signature_t *sig)
+{
+    struct rs_sig_builder *b = sig->builder;
+    rs_long_t built;
+
+    if (!b)
+        return;
+    pthread_mutex_lock(&b->mutex);
+    b->done = 1;
+    b->published = b->built;    /* stop at what's done; rest is ours */
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->mutex);
+    pthread_join(b->thread, NULL);
+    built = b->built;
+    if (b->failed) {
+        /* The table was sized from a preallocation estimate that turned
+           out too small; throw it away and let rs_build_hash_table()
+           redo it at the right size. */
+        hashtable_free(sig->hashtable);
+        sig->hashtable = NULL;
+    } else {
+        rs_hash_table_insert(sig, built, sig->count);
+        rs_hash_table_stats_init(sig);
+        rs_trace("eager hashtable build covered "FMT_LONG" of "FMT_LONG
+                 " blocks before join", built, sig->count);
+    }
+    pthread_mutex_destroy(&b->mutex);
+    pthread_cond_destroy(&b->cond);
+    free(b);
+    sig->builder = NULL;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+void rs_signature_build_start(rs_signature_t *sig)
+{
+    (void)sig;
+}
+
+void rs_signature_build_publish(rs_signature_t *sig)
+{
+    (void)sig;
+}
+
+void rs_signature_build_join(rs_signature_t *sig)
+{
+    (void)sig;
+}
+
+void rs_signature_build_abort(rs_signature_t *sig)
+{
+    (void)sig;
+}
+
+#endif /* !HAVE_PTHREAD_H */
+
 void rs_free_sumset(rs_signature_t *psums)
 {
     rs_signature_done(psums);
@@ -220,16 +729,16 @@ void rs_free_sumset(rs_signature_t *psums)
 
 void rs_sumset_dump(rs_signature_t const *sums)
 {
-    int i;
+    rs_long_t i;
     rs_block_sig_t *b;
     char strong_hex[RS_MAX_STRONG_SUM_LENGTH * 3];
 
-    rs_log(RS_LOG_INFO|RS_LOG_NONAME, "sumset info: magic=%#x, block_len=%d, block_num=%d",
+    rs_log(RS_LOG_INFO|RS_LOG_NONAME, "sumset info: magic=%#x, block_len=%d, block_num="FMT_LONG,
            sums->magic, sums->block_len, sums->count);
 
     for (i = 0; i < sums->count; i++) {
         b = rs_block_sig_ptr(sums, i);
         rs_hexify(strong_hex, b->strong_sum, sums->strong_sum_len);
-        rs_log(RS_LOG_INFO|RS_LOG_NONAME, "sum %6d: weak="FMT_WEAKSUM", strong=%s", i, b->weak_sum, strong_hex);
+        rs_log(RS_LOG_INFO|RS_LOG_NONAME, "sum %6"PRIdMAX": weak="FMT_WEAKSUM", strong=%s", i, b->weak_sum, strong_hex);
     }
 }
@@ -21,6 +21,7 @@
  */
 
 #include <assert.h>
+#include <stddef.h>
 #include "hashtable.h"
 #include "checksum.h"
 
@@ -38,13 +39,19 @@ struct rs_signature {
     int magic;                  /**< The signature magic value. */
     int block_len;              /**< The block length. */
     int strong_sum_len;         /**< The block strong sum length. */
-    int count;                  /**< Total number of blocks. */
-    int size;                   /**< Total number of blocks allocated. */
+    rs_long_t count;            /**< Total number of blocks. */
+    rs_long_t size;             /**< Total number of blocks allocated. */
     void *block_sigs;           /**< The packed block_sigs for all blocks. */
     hashtable_t *hashtable;     /**< The hashtable for finding matches. */
+    void *map;                  /**< The mmap the signature lives in, if any. */
+    size_t map_len;             /**< The length of the mmap. */
+    int merge_count;            /**< Bases merged in (0 if never merged). */
+    rs_long_t *merge_starts;    /**< First block index of each basis. */
+    struct rs_sig_builder *builder; /**< Eager hashtable build in progress. */
     /* The is extra stats not included in the hashtable stats. */
 #ifndef HASHTABLE_NSTATS
     long calc_strong_count;     /**< The count of strongsum calcs done. */
+    int stats_sample;           /**< Sampling interval for the hashtable. */
 #endif
 };
 
@@ -73,28 +80,111 @@ rs_block_sig_t *rs_signature_add_block(rs_signature_t *sig, rs_weak_sum_t weak_s
 /** Find a matching block offset in a signature. */
 rs_long_t rs_signature_find_match(rs_signature_t *sig, rs_weak_sum_t weak_sum, void const *buf, size_t len);
 
+/** Find a matching block offset in an ::RS_RK64_SIG_MAGIC signature.
+ *
+ * The full rolling digest carries both the key and the check half, so
+ * a weak-sum hit costs no calculation over the block at all. */
+rs_long_t rs_signature_find_match64(rs_signature_t *sig, uint64_t digest);
+
+/** Prefetch the hashtable lookup path for a weak sum, ahead of a
+ * rs_signature_find_match() call with the same sum. */
+void rs_signature_prefetch_match(rs_signature_t *sig, rs_weak_sum_t weak_sum);
+
+/** Might the signature contain a block with this weak sum?
+ *
+ * A cheap bloom filter test with no false negatives, used by the delta
+ * scan to tell cold input stretches from near-matches. */
+int rs_signature_near_match(rs_signature_t *sig, rs_weak_sum_t weak_sum);
+
 /** Log the rs_signature_find_match() stats. */
 void rs_signature_log_stats(rs_signature_t const *sig);
 
+/** Start building the hashtable on a thread while blocks are still
+ * being added, so table construction hides behind signature I/O.
+ * Needs the block array preallocated to its final size; a no-op
+ * otherwise or without thread support. */
+void rs_signature_build_start(rs_signature_t *sig);
+
+/** Tell an eager build the blocks added so far are ready to insert. */
+void rs_signature_build_publish(rs_signature_t *sig);
+
+/** Finish an eager build: insert any remaining blocks and leave the
+ * hashtable ready for matching. */
+void rs_signature_build_join(rs_signature_t *sig);
+
+/** Stop an eager build and discard the partial table, e.g. because the
+ * block array is about to be reallocated. */
+void rs_signature_build_abort(rs_signature_t *sig);
+
+/** Release the mmap backing a signature loaded with rs_loadsig_mmap(). */
+void rs_sig2_unmap(rs_signature_t *sig);
+
+/** Get the size of a packed rs_block_sig_t. */
+static inline size_t rs_block_sig_size(const rs_signature_t *sig)
+{
+    return offsetof(rs_block_sig_t, strong_sum) + sig->strong_sum_len;
+}
+
 /** Assert that a signature is valid.
  *
  * We don't use a static inline function here so that assert failure output
  * points at where rs_signature_check() was called from. */
 #define rs_signature_check(sig) do {\
-    assert(((sig)->magic == RS_BLAKE2_SIG_MAGIC && (sig)->strong_sum_len <= RS_BLAKE2_SUM_LENGTH)\
-           || ((sig)->magic == RS_MD4_SIG_MAGIC && (sig)->strong_sum_len <= RS_MD4_SUM_LENGTH));\
+    assert((((sig)->magic == RS_BLAKE2_SIG_MAGIC || (sig)->magic == RS_RK_BLAKE2_SIG_MAGIC)\
+            && (sig)->strong_sum_len <= RS_BLAKE2_SUM_LENGTH)\
+           || (((sig)->magic == RS_MD4_SIG_MAGIC || (sig)->magic == RS_RK_MD4_SIG_MAGIC)\
+               && (sig)->strong_sum_len <= RS_MD4_SUM_LENGTH)\
+           || ((sig)->magic == RS_RK64_SIG_MAGIC\
+               && (sig)->strong_sum_len <= RS_RK64_SUM_LENGTH));\
     assert(0 < (sig)->block_len);\
     assert(0 < (sig)->strong_sum_len && (sig)->strong_sum_len <= RS_MAX_STRONG_SUM_LENGTH);\
     assert(0 <= (sig)->count && (sig)->count <= (sig)->size);\
-    assert(!(sig)->hashtable || (sig)->hashtable->count <= (sig)->count);\
+    assert(!(sig)->hashtable || (sig)->hashtable->count <= (size_t)(sig)->count);\
 } while (0)
 
+/** Get the weaksum implementation to use for a signature. */
+static inline weaksum_kind_t rs_signature_weaksum_kind(rs_signature_t const *sig)
+{
+    if (sig->magic == RS_RK_BLAKE2_SIG_MAGIC || sig->magic == RS_RK_MD4_SIG_MAGIC)
+        return RS_RABINKARP;
+    if (sig->magic == RS_RK64_SIG_MAGIC)
+        return RS_RABINKARP64;
+    return RS_ROLLSUM;
+}
+
+/** Pack the check half of a 64-bit rolling digest into a strong sum
+ * buffer: the high 32 bits, big-endian, as ::RS_RK64_SIG_MAGIC stores
+ * and compares them. */
+static inline void rs_rk64_check_sum(uint64_t digest, rs_strong_sum_t *sum)
+{
+    unsigned char *p = (unsigned char *)sum;
+
+    p[0] = (unsigned char)(digest >> 56);
+    p[1] = (unsigned char)(digest >> 48);
+    p[2] = (unsigned char)(digest >> 40);
+    p[3] = (unsigned char)(digest >> 32);
+}
+
+/** Calculate the weak sum of a buffer. */
+static inline rs_weak_sum_t rs_signature_calc_weak_sum(rs_signature_t const *sig, void const *buf, size_t len)
+{
+    return rs_calc_weak_sum(rs_signature_weaksum_kind(sig), buf, len);
+}
+
 /** Calculate the strong sum of a buffer. */
 static inline void rs_signature_calc_strong_sum(rs_signature_t const *sig, void const *buf, size_t len,
                                                 rs_strong_sum_t *sum)
 {
-    if (sig->magic == RS_BLAKE2_SIG_MAGIC) {
+    if (sig->magic == RS_BLAKE2_SIG_MAGIC || sig->magic == RS_RK_BLAKE2_SIG_MAGIC) {
         rs_calc_blake2_sum(buf, len, sum);
+    } else if (sig->magic == RS_RK64_SIG_MAGIC) {
+        /* No strong sum: the check is the high half of the rolling
+         * digest over the block. */
+        rabinkarp64_t rk;
+
+        rabinkarp64_init(&rk);
+        rabinkarp64_update(&rk, buf, len);
+        rs_rk64_check_sum(rabinkarp64_digest(&rk), sum);
     } else {
         rs_calc_md4_sum(buf, len, sum);
     }
@@ -101,27 +101,36 @@ rs_trace_set_level(rs_loglevel level)
 }
 
 
+/** Format and emit a message without consulting rs_trace_level; the
+ * caller has already decided it should be shown. */
 static void
-rs_log_va(int flags, char const *fn, char const *fmt, va_list va)
+rs_log_va_out(int flags, char const *fn, char const *fmt, va_list va)
 {
     int level = flags & RS_LOG_PRIMASK;
+    char            buf[1000];
+    char            full_buf[1000];
 
-    if (rs_trace_impl && level <= rs_trace_level) {
-        char            buf[1000];
-        char            full_buf[1000];
+    vsnprintf(buf, sizeof buf - 1, fmt, va);
 
-        vsnprintf(buf, sizeof buf - 1, fmt, va);
+    if (flags & RS_LOG_NONAME) {
+        snprintf(full_buf, sizeof full_buf - 1,
+                 "%s: %s%s\n", MY_NAME, rs_severities[level], buf);
+    } else {
+        snprintf(full_buf, sizeof full_buf - 1,
+                 "%s: %s(%s) %s\n", MY_NAME, rs_severities[level], fn, buf);
+    }
 
-        if (flags & RS_LOG_NONAME) {
-            snprintf(full_buf, sizeof full_buf - 1,
-                     "%s: %s%s\n", MY_NAME, rs_severities[level], buf);
-        } else {
-            snprintf(full_buf, sizeof full_buf - 1,
-                     "%s: %s(%s) %s\n", MY_NAME, rs_severities[level], fn, buf);
-        }
+    rs_trace_impl(level, full_buf);
+}
 
-        rs_trace_impl(level, full_buf);
-    }
+
+static void
+rs_log_va(int flags, char const *fn, char const *fmt, va_list va)
+{
+    int level = flags & RS_LOG_PRIMASK;
+
+    if (rs_trace_impl && level <= rs_trace_level)
+        rs_log_va_out(flags, fn, fmt, va);
 }
 
 
@@ -154,6 +163,37 @@ rs_log0(int level, char const *fn, char const *fmt, ...)
 }
 
 
+/* Called by the per-job trace macros once the job-level check has
+ * already passed; only the trace destination is consulted here. */
+void
+rs_log0_nocheck(int level, char const *fn, char const *fmt, ...)
+{
+    va_list         va;
+
+    if (!rs_trace_impl)
+        return;
+    va_start(va, fmt);
+    rs_log_va_out(level, fn, fmt, va);
+    va_end(va);
+}
+
+
+/* This is called directly if the machine doesn't allow varargs
+ * macros; without the macro there is no cheap job-level gate, so fall
+ * back to the process-global one. */
+void
+rs_job_trace0(void const *UNUSED(job), char const *s, ...)
+{
+#ifdef DO_RS_TRACE
+    va_list  va;
+
+    va_start(va, s);
+    rs_log_va(RS_LOG_DEBUG, PACKAGE, s, va);
+    va_end(va);
+#endif /* !DO_RS_TRACE */
+}
+
+
 void
 rs_trace_stderr(rs_loglevel UNUSED(level), char const *msg)
 {
@@ -64,6 +64,27 @@ void rs_log0(int level, char const *fn, char const *fmt, ...)
 #  define rs_trace(fmt, arg...)
 #endif	/* !DO_RS_TRACE */
 
+/* Like rs_trace(), but gated on the job's own trace level rather than
+ * the process global, so hot paths load no shared cache line; see
+ * rs_job_set_trace_level(). */
+#ifdef DO_RS_TRACE
+#  define rs_job_trace(job, fmt, arg...)                                \
+    do { if (((job)->trace_level & RS_LOG_PRIMASK) >= RS_LOG_DEBUG)     \
+        rs_log0_nocheck(RS_LOG_DEBUG, __FUNCTION__, fmt , ##arg);       \
+    } while (0)
+#else
+#  define rs_job_trace(job, fmt, arg...)
+#endif	/* !DO_RS_TRACE */
+
+/* Traces that fire once per scan/scoop/tube iteration.  Even in a
+ * tracing build these stay compiled out unless DO_RS_TRACE_HOT is
+ * also defined, so the scan loops carry no per-iteration trace cost. */
+#if defined(DO_RS_TRACE) && defined(DO_RS_TRACE_HOT)
+#  define rs_trace_hot(job, fmt, arg...) rs_job_trace(job, fmt , ##arg)
+#else
+#  define rs_trace_hot(job, fmt, arg...)
+#endif	/* !DO_RS_TRACE_HOT */
+
 #define rs_log(l, s, str...) do {              \
      rs_log0((l), __FUNCTION__, (s) , ##str);  \
      } while (0)
@@ -86,9 +107,17 @@ void rs_log0(int level, char const *fn, char const *fmt, ...)
 #  define rs_fatal rs_fatal0
 #  define rs_error rs_error0
 #  define rs_log   rs_log0_nofn
+#  define rs_job_trace rs_job_trace0
+#  define rs_trace_hot rs_job_trace0
 #endif				/* ! __GNUC__ */
 
 void rs_trace0(char const *s, ...);
+void rs_job_trace0(void const *job, char const *s, ...);
+void rs_log0_nocheck(int level, char const *fn, char const *fmt, ...)
+#if defined(__clang__) || defined(__GNUC__)
+    __attribute__ ((format(printf, 3, 4)))
+#endif
+    ;
 void rs_fatal0(char const *s, ...);
 void rs_error0(char const *s, ...);
 void rs_log0(int level, char const *fn, char const *fmt, ...);
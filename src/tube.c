@@ -42,7 +42,19 @@
  * bytes), and also an instruction to copy data from the stream's
  * input or from some other location.  Both literal data and a copy
  * command can be queued at the same time, but only in that order and
- * at most one of each. */
+ * at most one of each.
+ *
+ * Write data is not pushed to the output as soon as it arrives;
+ * rs_tube_catchup() lets command headers accumulate in write_buf until
+ * it is nearly full, a copy gets queued behind them, or the job's
+ * state machine has finished. Deltas made of many small COPY commands
+ * then go out in a few large writes instead of one small write per
+ * command. */
+
+/** Keep at least this much write_buf free at each catchup, so the next
+ * state iteration's commands always fit. The largest staged chunk is a
+ * signature block: 4 bytes weak sum plus a max 32 byte strong sum. */
+#define RS_TUBE_CMD_MAX 64
 
 
 /*
@@ -83,7 +95,7 @@ static void rs_tube_catchup_write(rs_job_t *job)
         len = stream->avail_out;
 
     if (!stream->avail_out) {
-        rs_trace("no output space available");
+        rs_trace_hot(job, "no output space available");
         return;
     }
 
@@ -92,7 +104,7 @@ static void rs_tube_catchup_write(rs_job_t *job)
     stream->avail_out -= len;
 
     remain = job->write_len - len;
-    rs_trace("transmitted %d write bytes from tube, %d remain to be sent", len, remain);
+    rs_trace_hot(job, "transmitted %d write bytes from tube, %d remain to be sent", len, remain);
 
     if (remain > 0) {
         /* Still something left in the tube... */
@@ -105,6 +117,31 @@ static void rs_tube_catchup_write(rs_job_t *job)
 }
 
 
+/**
+ * Send out as much of the pending blob as the output will take.
+ *
+ * \sa rs_tube_write_blob()
+ */
+static void rs_tube_catchup_blob(rs_job_t *job)
+{
+    rs_buffers_t *stream = job->stream;
+    size_t len = job->blob_len;
+
+    if (len > stream->avail_out)
+        len = stream->avail_out;
+
+    memcpy(stream->next_out, job->blob_buf, len);
+    stream->next_out += len;
+    stream->avail_out -= len;
+
+    job->blob_buf += len;
+    job->blob_len -= len;
+
+    rs_trace_hot(job, "transmitted "FMT_SIZE" blob bytes from tube, "FMT_SIZE" remain to be sent",
+                 len, job->blob_len);
+}
+
+
 /**
  * Execute a copy command, taking data from the scoop.
  *
@@ -130,7 +167,7 @@ rs_tube_copy_from_scoop(rs_job_t *job)
 
     job->copy_len -= this_len;
 
-    rs_trace("caught up on "FMT_SIZE" copied bytes from scoop, "FMT_SIZE" remain there, "FMT_LONG" remain to be copied",
+    rs_trace_hot(job, "caught up on "FMT_SIZE" copied bytes from scoop, "FMT_SIZE" remain there, "FMT_LONG" remain to be copied",
              this_len, job->scoop_avail, job->copy_len);
 }
 
@@ -155,7 +192,7 @@ static void rs_tube_catchup_copy(rs_job_t *job)
     if (job->copy_len && !job->scoop_avail) {
         size_t this_copy = rs_buffers_copy(job->stream, job->copy_len);
         job->copy_len -= this_copy;
-        rs_trace("copied "FMT_SIZE" bytes from input buffer, "FMT_LONG" remain to be copied", this_copy, job->copy_len);
+        rs_trace_hot(job, "copied "FMT_SIZE" bytes from input buffer, "FMT_LONG" remain to be copied", this_copy, job->copy_len);
     }
 }
 
@@ -168,11 +205,23 @@ static void rs_tube_catchup_copy(rs_job_t *job)
 int rs_tube_catchup(rs_job_t *job)
 {
     if (job->write_len) {
+        /* Batch up small writes while no copy or blob is queued behind
+         * them and the job is still producing commands; the data goes
+         * out in one memcpy when the buffer fills or the job ends. */
+        if (!job->copy_len && !job->blob_len && job->statefn
+            && job->write_len <= (int)(sizeof(job->write_buf) - RS_TUBE_CMD_MAX))
+            return RS_DONE;
         rs_tube_catchup_write(job);
         if (job->write_len)
             return RS_BLOCKED;
     }
 
+    if (job->blob_len) {
+        rs_tube_catchup_blob(job);
+        if (job->blob_len)
+            return RS_BLOCKED;
+    }
+
     if (job->copy_len) {
         rs_tube_catchup_copy(job);
         if (job->copy_len) {
@@ -192,7 +241,7 @@ int rs_tube_catchup(rs_job_t *job)
  * output. */
 int rs_tube_is_idle(rs_job_t const *job)
 {
-    return job->write_len == 0 && job->copy_len == 0;
+    return job->write_len == 0 && job->copy_len == 0 && job->blob_len == 0;
 }
 
 
@@ -226,10 +275,44 @@ void rs_tube_copy(rs_job_t *job, int len)
  * We can't accept write data if there's already a copy command in the
  * tube, because the write data comes out first.
  */
+/**
+ * Queue a job-owned buffer to be sent out after any pending write
+ * data.  Unlike rs_tube_write() the data is not copied, so it can be
+ * arbitrarily large, but \p buf must stay valid and unchanged until
+ * the tube drains (compressed literal payloads live in job->z_buf,
+ * which satisfies this).
+ */
+void
+rs_tube_write_blob(rs_job_t *job, const void *buf, size_t len)
+{
+    assert(job->copy_len == 0);
+    assert(job->blob_len == 0);
+
+    job->blob_buf = buf;
+    job->blob_len = len;
+}
+
+
 void
 rs_tube_write(rs_job_t *job, const void *buf, size_t len)
 {
+    rs_buffers_t *stream = job->stream;
+
     assert(job->copy_len == 0);
+    assert(job->blob_len == 0);
+
+    /* Direct path (the old TODO above): with nothing staged ahead of
+     * this data and room in the output, encode straight into next_out
+     * and skip the write_buf hop.  Callers drive jobs with buffers far
+     * larger than a command, so batching happens in the caller's
+     * output buffer itself and write_buf becomes a fallback for when
+     * the output is nearly full. */
+    if (!job->write_len && stream->avail_out >= len) {
+        memcpy(stream->next_out, buf, len);
+        stream->next_out += len;
+        stream->avail_out -= len;
+        return;
+    }
 
     if (len > sizeof(job->write_buf) - job->write_len) {
         rs_fatal("tube popped when trying to write "FMT_SIZE" bytes!", len);
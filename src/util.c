@@ -26,8 +26,16 @@
 
 
 #include "config.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef HAVE_GETTIMEOFDAY
+#include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "librsync.h"
 #include "util.h"
@@ -77,3 +85,97 @@ rs_realloc(void *ptr, size_t size, char const *name)
      }
      return p;
 }
+
+
+/* Large allocations below this size are not worth huge-page advice.
+   2MB is the common x86-64 huge page size. */
+#define RS_HUGEPAGE_MIN ((size_t)2 << 20)
+
+static rs_large_alloc_fn *rs_large_alloc_hook = NULL;
+static rs_large_free_fn *rs_large_free_hook = NULL;
+static void *rs_large_hook_arg = NULL;
+
+void
+rs_set_large_alloc(rs_large_alloc_fn *alloc_fn, rs_large_free_fn *free_fn,
+                   void *arg)
+{
+    rs_large_alloc_hook = alloc_fn;
+    rs_large_free_hook = free_fn;
+    rs_large_hook_arg = arg;
+}
+
+void *
+rs_calloc_large(size_t size)
+{
+    void           *p;
+
+    if (rs_large_alloc_hook)
+        return rs_large_alloc_hook(size, rs_large_hook_arg);
+    if (!(p = calloc(1, size)))
+        return NULL;
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_HUGEPAGE)
+    /* Ask for transparent huge pages to cut dTLB misses during random
+       probing. calloc gives no alignment promise, so advise only the
+       page-aligned interior; best effort, errors ignored. */
+    if (size >= RS_HUGEPAGE_MIN) {
+        const uintptr_t pmask = 4096 - 1;
+        uintptr_t start = ((uintptr_t)p + pmask) & ~pmask;
+        size_t len = (size - (start - (uintptr_t)p)) & ~pmask;
+
+        if (len)
+            madvise((void *)start, len, MADV_HUGEPAGE);
+    }
+#endif
+    return p;
+}
+
+void
+rs_free_large(void *ptr, size_t size)
+{
+    if (rs_large_free_hook)
+        rs_large_free_hook(ptr, size, rs_large_hook_arg);
+    else
+        free(ptr);
+}
+
+void *
+rs_alloc_large(size_t size, char const *name)
+{
+    void           *p;
+
+    if (!(p = rs_calloc_large(size))) {
+        rs_fatal("couldn't allocate instance of %s", name);
+    }
+    return p;
+}
+
+void *
+rs_realloc_large(void *ptr, size_t old_size, size_t new_size, char const *name)
+{
+    void           *p;
+
+    p = rs_alloc_large(new_size, name);
+    if (ptr) {
+        memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+        rs_free_large(ptr, old_size);
+    }
+    return p;
+}
+
+double
+rs_monotonic_seconds(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#elif defined(HAVE_GETTIMEOFDAY)
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#else
+    return (double)time(NULL);
+#endif
+}
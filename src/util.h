@@ -24,8 +24,21 @@ void * rs_alloc(size_t size, char const *name);
 void * rs_realloc(void *ptr, size_t size, char const *name);
 void *rs_alloc_struct0(size_t size, char const *name);
 
+/* Allocators for large long-lived blocks (block_sigs, hashtable
+ * tables).  These go through the rs_set_large_alloc() hook if one is
+ * installed, and by default add transparent huge page advice for big
+ * blocks.  Memory is zero-filled and must be released with
+ * rs_free_large() passing the allocated size. */
+void *rs_calloc_large(size_t size);
+void *rs_alloc_large(size_t size, char const *name);
+void *rs_realloc_large(void *ptr, size_t old_size, size_t new_size, char const *name);
+void rs_free_large(void *ptr, size_t size);
+
 void rs_bzero(void *buf, size_t size);
 
+/** Read a monotonic wall clock in seconds, for phase timing. */
+double rs_monotonic_seconds(void);
+
 /*
  * Allocate and zero-fill an instance of TYPE.
  */
@@ -0,0 +1,148 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * weaksum -- The rsync/rollsum/rabinkarp weaksum dispatcher.
+ *
+ * Copyright (C) 2019 by Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef _WEAKSUM_H_
+#define _WEAKSUM_H_
+
+#include "rollsum.h"
+#include "rabinkarp.h"
+
+/** The possible weaksum implementations.
+ *
+ * The classic rollsum is kept for compatibility with old signatures, but
+ * rabinkarp has much better distribution, which means fewer weaksum
+ * collisions triggering strongsum calculations during delta generation. */
+typedef enum {
+    RS_ROLLSUM,                 /**< The rollsum implementation. */
+    RS_RABINKARP,               /**< The rabinkarp implementation. */
+    RS_RABINKARP64,             /**< The 64-bit rabinkarp implementation. */
+} weaksum_kind_t;
+
+/** The weaksum state with implementation. */
+typedef struct weaksum {
+    weaksum_kind_t kind;
+    union {
+        Rollsum rs;
+        rabinkarp_t rk;
+        rabinkarp64_t rk64;
+    } sum;
+} weaksum_t;
+
+static inline void weaksum_init(weaksum_t *sum, weaksum_kind_t kind)
+{
+    sum->kind = kind;
+    if (sum->kind == RS_ROLLSUM)
+        RollsumInit(&sum->sum.rs);
+    else if (sum->kind == RS_RABINKARP64)
+        rabinkarp64_init(&sum->sum.rk64);
+    else
+        rabinkarp_init(&sum->sum.rk);
+}
+
+/** Reset a weaksum, keeping its implementation. */
+static inline void weaksum_reset(weaksum_t *sum)
+{
+    weaksum_init(sum, sum->kind);
+}
+
+static inline size_t weaksum_count(weaksum_t *sum)
+{
+    /* We take advantage of sum->sum.rs.count overlaying sum->sum.rk.count. */
+    return sum->sum.rs.count;
+}
+
+static inline void weaksum_update(weaksum_t *sum, const unsigned char *buf,
+                                  size_t len)
+{
+    if (sum->kind == RS_ROLLSUM)
+        RollsumUpdate(&sum->sum.rs, buf, len);
+    else if (sum->kind == RS_RABINKARP64)
+        rabinkarp64_update(&sum->sum.rk64, buf, len);
+    else
+        rabinkarp_update(&sum->sum.rk, buf, len);
+}
+
+static inline void weaksum_rotate(weaksum_t *sum, unsigned char out,
+                                  unsigned char in)
+{
+    if (sum->kind == RS_ROLLSUM)
+        RollsumRotate(&sum->sum.rs, out, in);
+    else if (sum->kind == RS_RABINKARP64)
+        rabinkarp64_rotate(&sum->sum.rk64, out, in);
+    else
+        rabinkarp_rotate(&sum->sum.rk, out, in);
+}
+
+/** Rotate the window forward over len bytes in one call. */
+static inline void weaksum_rotate_n(weaksum_t *sum,
+                                    const unsigned char *out_buf,
+                                    const unsigned char *in_buf, size_t len)
+{
+    if (sum->kind == RS_ROLLSUM)
+        RollsumRotateN(&sum->sum.rs, out_buf, in_buf, len);
+    else if (sum->kind == RS_RABINKARP64)
+        rabinkarp64_rotate_n(&sum->sum.rk64, out_buf, in_buf, len);
+    else
+        rabinkarp_rotate_n(&sum->sum.rk, out_buf, in_buf, len);
+}
+
+static inline void weaksum_rollin(weaksum_t *sum, unsigned char in)
+{
+    if (sum->kind == RS_ROLLSUM)
+        RollsumRollin(&sum->sum.rs, in);
+    else if (sum->kind == RS_RABINKARP64)
+        rabinkarp64_rollin(&sum->sum.rk64, in);
+    else
+        rabinkarp_rollin(&sum->sum.rk, in);
+}
+
+static inline void weaksum_rollout(weaksum_t *sum, unsigned char out)
+{
+    if (sum->kind == RS_ROLLSUM)
+        RollsumRollout(&sum->sum.rs, out);
+    else if (sum->kind == RS_RABINKARP64)
+        rabinkarp64_rollout(&sum->sum.rk64, out);
+    else
+        rabinkarp_rollout(&sum->sum.rk, out);
+}
+
+static inline uint32_t weaksum_digest(weaksum_t *sum)
+{
+    if (sum->kind == RS_ROLLSUM)
+        return RollsumDigest(&sum->sum.rs);
+    else if (sum->kind == RS_RABINKARP64)
+        /* The low half; the high half is kept as the block check. */
+        return (uint32_t)rabinkarp64_digest(&sum->sum.rk64);
+    else
+        return rabinkarp_digest(&sum->sum.rk);
+}
+
+/** Get the full digest of a 64-bit weaksum.
+ *
+ * Only meaningful for RS_RABINKARP64 sums; the 32-bit kinds just
+ * widen their digest. */
+static inline uint64_t weaksum_digest64(weaksum_t *sum)
+{
+    if (sum->kind == RS_RABINKARP64)
+        return rabinkarp64_digest(&sum->sum.rk64);
+    return weaksum_digest(sum);
+}
+
+#endif                          /* _WEAKSUM_H_ */
@@ -39,6 +39,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "librsync.h"
 
@@ -56,6 +63,49 @@
  */
 int rs_inbuflen = 0, rs_outbuflen = 0;
 
+/**
+ * Overlap whole-file IO with computation on separate threads.
+ */
+int rs_async_io = 0;
+
+
+/** Bounds for rs_whole_choose_buffers(). */
+#define RS_WHOLE_MIN_BUFLEN (4*1024)
+#define RS_WHOLE_MAX_BUFLEN (1024*1024)
+
+/** Pick IO buffer sizes for a whole-file operation.
+ *
+ * The input buffer covers at least four blocks, so the scoop is sized
+ * right on the first fill and never grows mid-job, and at most the
+ * whole file, so runs over many small files don't drag around big
+ * idle buffers.  Files bigger than the base size stream through
+ * larger buffers up to a fixed cap.  The rs_inbuflen and rs_outbuflen
+ * globals still override the result in rs_whole_run().
+ *
+ * \param fsize the input file size, or -1 if unknown.
+ *
+ * \param block_len the signature block length for the operation. */
+void rs_whole_choose_buffers(rs_long_t fsize, size_t block_len,
+                             int *inbuflen, int *outbuflen)
+{
+    rs_long_t len;
+
+    len = 4 * (rs_long_t)block_len;
+    if (len < RS_WHOLE_MIN_BUFLEN)
+        len = RS_WHOLE_MIN_BUFLEN;
+    if (fsize >= 0 && fsize < len) {
+        /* No point buffering much past the end of the file; keep a
+         * floor big enough for the magic headers. */
+        len = fsize > 64 ? fsize : 64;
+    } else if (fsize > len) {
+        len = fsize > RS_WHOLE_MAX_BUFLEN ? RS_WHOLE_MAX_BUFLEN : fsize;
+    }
+    *inbuflen = (int)len;
+    /* Worst case delta output is the input plus command headers; round
+     * the output side up to the same size. */
+    *outbuflen = (int)len;
+}
+
 
 /** Run a job continuously, with input to/from the two specified files.
  *
@@ -73,6 +123,12 @@ int rs_inbuflen = 0, rs_outbuflen = 0;
  *
  * \return RS_DONE if the job completed, or otherwise an error result.
  */
+#ifdef HAVE_PTHREAD_H
+static rs_result rs_whole_run_threaded(rs_job_t *job, FILE *in_file,
+                                       FILE *out_file, int inbuflen,
+                                       int outbuflen);
+#endif
+
 rs_result
 rs_whole_run(rs_job_t *job, FILE *in_file, FILE *out_file, int inbuflen, int outbuflen)
 {
@@ -80,6 +136,11 @@ rs_whole_run(rs_job_t *job, FILE *in_file, FILE *out_file, int inbuflen, int out
     rs_result       result;
     rs_filebuf_t    *in_fb = NULL, *out_fb = NULL;
 
+#ifdef HAVE_PTHREAD_H
+    if (rs_async_io && in_file && out_file)
+        return rs_whole_run_threaded(job, in_file, out_file, inbuflen,
+                                     outbuflen);
+#endif
     /* Override buffer sizes if rs_inbuflen or rs_outbuflen are set. */
     inbuflen = rs_inbuflen ? rs_inbuflen : inbuflen;
     outbuflen = rs_outbuflen ? rs_outbuflen : outbuflen;
@@ -98,6 +159,362 @@ rs_whole_run(rs_job_t *job, FILE *in_file, FILE *out_file, int inbuflen, int out
 }
 
 
+#ifdef HAVE_PTHREAD_H
+
+/** Buffers kept in flight on each side of the async driver. */
+#define RS_ASYNC_NBUF 4
+
+/** A bounded ring of buffers handed between an IO thread and the job
+ * loop.  The producer fills slot (head + count) % RS_ASYNC_NBUF while
+ * it is unpublished, then increments count; the consumer takes slot
+ * head and advances it. */
+typedef struct rs_async_ring {
+    struct {
+        rs_byte_t *data;
+        size_t len;             /**< Valid bytes in the slot. */
+        int eof;                /**< No more data follows this slot. */
+    } slot[RS_ASYNC_NBUF];
+    int head, count;
+    int shutdown;               /**< Producer side is finished. */
+    rs_result io_result;        /**< Sticky first IO error. */
+    FILE *file;
+    size_t buf_len;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} rs_async_ring_t;
+
+static void rs_async_ring_init(rs_async_ring_t *r, FILE *file, size_t buf_len)
+{
+    int i;
+
+    rs_bzero(r, sizeof(*r));
+    for (i = 0; i < RS_ASYNC_NBUF; i++)
+        r->slot[i].data = rs_alloc(buf_len, "async buffer");
+    r->io_result = RS_DONE;
+    r->file = file;
+    r->buf_len = buf_len;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
+}
+
+static void rs_async_ring_done(rs_async_ring_t *r)
+{
+    int i;
+
+    for (i = 0; i < RS_ASYNC_NBUF; i++)
+        free(r->slot[i].data);
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->cond);
+}
+
+/** Read ahead into the ring until EOF, error, or shutdown. */
+static void *rs_async_reader(void *arg)
+{
+    rs_async_ring_t *r = arg;
+    int idx, eof = 0;
+    size_t len;
+
+    while (!eof) {
+        pthread_mutex_lock(&r->mutex);
+        while (r->count == RS_ASYNC_NBUF && !r->shutdown)
+            pthread_cond_wait(&r->cond, &r->mutex);
+        if (r->shutdown) {
+            pthread_mutex_unlock(&r->mutex);
+            return NULL;
+        }
+        idx = (r->head + r->count) % RS_ASYNC_NBUF;
+        pthread_mutex_unlock(&r->mutex);
+
+        len = fread(r->slot[idx].data, 1, r->buf_len, r->file);
+        eof = len < r->buf_len;
+        r->slot[idx].len = len;
+        r->slot[idx].eof = eof;
+
+        pthread_mutex_lock(&r->mutex);
+        if (eof && ferror(r->file)) {
+            rs_error("error filling read ahead buffer: %s", strerror(errno));
+            r->io_result = RS_IO_ERROR;
+        }
+        r->count++;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->mutex);
+    }
+    return NULL;
+}
+
+/** Write published slots out of the ring until told to shut down. */
+static void *rs_async_writer(void *arg)
+{
+    rs_async_ring_t *r = arg;
+    int idx;
+
+    for (;;) {
+        pthread_mutex_lock(&r->mutex);
+        while (!r->count && !r->shutdown)
+            pthread_cond_wait(&r->cond, &r->mutex);
+        if (!r->count && r->shutdown) {
+            pthread_mutex_unlock(&r->mutex);
+            return NULL;
+        }
+        idx = r->head;
+        pthread_mutex_unlock(&r->mutex);
+
+        if (r->io_result == RS_DONE
+            && fwrite(r->slot[idx].data, 1, r->slot[idx].len, r->file)
+            != r->slot[idx].len) {
+            rs_error("error draining write buffer: %s", strerror(errno));
+            r->io_result = RS_IO_ERROR;
+        }
+
+        pthread_mutex_lock(&r->mutex);
+        r->head = (r->head + 1) % RS_ASYNC_NBUF;
+        r->count--;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->mutex);
+    }
+}
+
+/** Run a job with reads and writes overlapped on their own threads.
+ *
+ * A reader thread keeps up to RS_ASYNC_NBUF input buffers in flight
+ * and a writer thread drains finished output buffers, so the job loop
+ * stalls only when it genuinely outruns the disk on both sides. */
+static rs_result rs_whole_run_threaded(rs_job_t *job, FILE *in_file,
+                                       FILE *out_file, int inbuflen,
+                                       int outbuflen)
+{
+    rs_buffers_t buf;
+    rs_result result;
+    rs_async_ring_t in_ring, out_ring;
+    pthread_t reader, writer;
+    int in_idx = -1, out_idx = -1, in_done = 0;
+    size_t out_used = 0;
+
+    inbuflen = rs_inbuflen ? rs_inbuflen : inbuflen;
+    outbuflen = rs_outbuflen ? rs_outbuflen : outbuflen;
+    rs_async_ring_init(&in_ring, in_file, inbuflen);
+    rs_async_ring_init(&out_ring, out_file, outbuflen);
+    if (pthread_create(&reader, NULL, rs_async_reader, &in_ring)) {
+        rs_async_ring_done(&in_ring);
+        rs_async_ring_done(&out_ring);
+        rs_trace("no threads available, running synchronously");
+        return rs_whole_run(job, in_file, out_file, inbuflen, outbuflen);
+    }
+    if (pthread_create(&writer, NULL, rs_async_writer, &out_ring)) {
+        long buffered = 0;
+        int i;
+
+        /* The reader is already filling the in ring; it must be told
+         * to stop and joined before the ring can be torn down. */
+        pthread_mutex_lock(&in_ring.mutex);
+        in_ring.shutdown = 1;
+        pthread_cond_broadcast(&in_ring.cond);
+        pthread_mutex_unlock(&in_ring.mutex);
+        pthread_join(reader, NULL);
+        /* Put back whatever it read ahead so the synchronous fallback
+         * starts from the right offset. */
+        for (i = 0; i < in_ring.count; i++)
+            buffered +=
+                (long)in_ring.slot[(in_ring.head + i) % RS_ASYNC_NBUF].len;
+        rs_async_ring_done(&in_ring);
+        rs_async_ring_done(&out_ring);
+        if (buffered && fseek(in_file, -buffered, SEEK_CUR)) {
+            rs_error("cannot put back read ahead input: %s",
+                     strerror(errno));
+            return RS_IO_ERROR;
+        }
+        rs_trace("no threads available, running synchronously");
+        return rs_whole_run(job, in_file, out_file, inbuflen, outbuflen);
+    }
+
+    rs_bzero(&buf, sizeof(buf));
+    do {
+        /* Wait for the next read ahead buffer, unless input has ended
+         * or the current one still has data. */
+        if (!in_done && in_idx < 0) {
+            pthread_mutex_lock(&in_ring.mutex);
+            while (!in_ring.count)
+                pthread_cond_wait(&in_ring.cond, &in_ring.mutex);
+            in_idx = in_ring.head;
+            pthread_mutex_unlock(&in_ring.mutex);
+            buf.next_in = (char *)in_ring.slot[in_idx].data;
+            buf.avail_in = in_ring.slot[in_idx].len;
+            buf.eof_in = in_ring.slot[in_idx].eof;
+        }
+        if (in_ring.io_result != RS_DONE) {
+            result = in_ring.io_result;
+            break;
+        }
+
+        /* Claim an output slot to fill, waiting for the writer if all
+         * are in flight. */
+        if (out_idx < 0) {
+            pthread_mutex_lock(&out_ring.mutex);
+            while (out_ring.count == RS_ASYNC_NBUF)
+                pthread_cond_wait(&out_ring.cond, &out_ring.mutex);
+            out_idx = (out_ring.head + out_ring.count) % RS_ASYNC_NBUF;
+            pthread_mutex_unlock(&out_ring.mutex);
+            out_used = 0;
+        }
+        buf.next_out = (char *)out_ring.slot[out_idx].data + out_used;
+        buf.avail_out = outbuflen - out_used;
+
+        result = rs_job_iter(job, &buf);
+
+        out_used = outbuflen - buf.avail_out;
+        if (in_idx >= 0 && !buf.avail_in) {
+            /* Recycle the drained input buffer. */
+            in_done = buf.eof_in;
+            pthread_mutex_lock(&in_ring.mutex);
+            in_ring.head = (in_ring.head + 1) % RS_ASYNC_NBUF;
+            in_ring.count--;
+            pthread_cond_broadcast(&in_ring.cond);
+            pthread_mutex_unlock(&in_ring.mutex);
+            in_idx = -1;
+        }
+        if (out_used && (!buf.avail_out || result == RS_DONE)) {
+            /* Publish the output buffer to the writer. */
+            out_ring.slot[out_idx].len = out_used;
+            pthread_mutex_lock(&out_ring.mutex);
+            out_ring.count++;
+            pthread_cond_broadcast(&out_ring.cond);
+            pthread_mutex_unlock(&out_ring.mutex);
+            out_idx = -1;
+        }
+    } while (result == RS_BLOCKED);
+
+    /* Stop both threads and collect any writer error. */
+    pthread_mutex_lock(&in_ring.mutex);
+    in_ring.shutdown = 1;
+    pthread_cond_broadcast(&in_ring.cond);
+    pthread_mutex_unlock(&in_ring.mutex);
+    pthread_mutex_lock(&out_ring.mutex);
+    out_ring.shutdown = 1;
+    pthread_cond_broadcast(&out_ring.cond);
+    pthread_mutex_unlock(&out_ring.mutex);
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    if (result == RS_DONE && out_ring.io_result != RS_DONE)
+        result = out_ring.io_result;
+    rs_async_ring_done(&in_ring);
+    rs_async_ring_done(&out_ring);
+    return result;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+
+/** Run a job as rs_whole_run() does, but with IO overlapped on
+ * separate threads when the platform supports it.
+ *
+ * Equivalent to setting ::rs_async_io around an rs_whole_run() call;
+ * both files must be given for the overlap to apply. */
+rs_result
+rs_whole_run_async(rs_job_t *job, FILE *in_file, FILE *out_file, int inbuflen, int outbuflen)
+{
+#ifdef HAVE_PTHREAD_H
+    if (in_file && out_file)
+        return rs_whole_run_threaded(job, in_file, out_file, inbuflen,
+                                     outbuflen);
+#endif
+    return rs_whole_run(job, in_file, out_file, inbuflen, outbuflen);
+}
+
+
+
+/** The input mapping for rs_whole_run_mmap(). */
+typedef struct rs_mapbuf {
+    char *map;
+    rs_long_t len;
+    int presented;
+} rs_mapbuf_t;
+
+/** Input callback presenting a whole mapped file as one buffer. */
+static rs_result rs_inmapbuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
+{
+    rs_mapbuf_t *mb = opaque;
+
+    if (!mb->presented) {
+        buf->next_in = mb->map;
+        buf->avail_in = mb->len;
+        buf->eof_in = 1;
+        mb->presented = 1;
+    }
+    return RS_DONE;
+}
+
+/** Run a job with the input file mapped into memory instead of read
+ * through stdio buffers.
+ *
+ * The whole file is presented to the job as a single input region with
+ * eof_in set, so nothing is copied between read buffers and the job can
+ * scan the mapping in place.  Falls back to rs_whole_run() when the
+ * input can't be mapped (not a regular file, empty, or no mmap).
+ *
+ * \param inbuflen, outbuflen - buffer sizes for the fallback path and
+ * the output side, as for rs_whole_run(). */
+rs_result
+rs_whole_run_mmap(rs_job_t *job, FILE *in_file, FILE *out_file, int inbuflen, int outbuflen)
+{
+    rs_buffers_t    buf;
+    rs_result       result;
+    rs_mapbuf_t     mapbuf = {NULL, 0, 0};
+    rs_filebuf_t    *out_fb = NULL;
+
+    if (!in_file || !(mapbuf.map = rs_file_map(in_file, &mapbuf.len)))
+        return rs_whole_run(job, in_file, out_file, inbuflen, outbuflen);
+    rs_trace("mapped "FMT_LONG" input bytes", mapbuf.len);
+    outbuflen = rs_outbuflen ? rs_outbuflen : outbuflen;
+    if (out_file)
+        out_fb = rs_filebuf_new(out_file, outbuflen);
+    result = rs_job_drive(job, &buf,
+                          rs_inmapbuf_fill, &mapbuf,
+                          out_fb ? rs_outfilebuf_drain : NULL, out_fb);
+    if (out_fb)
+        rs_filebuf_free(out_fb);
+    rs_file_unmap(mapbuf.map, mapbuf.len);
+    return result;
+}
+
+
+rs_result
+rs_sig_mmap(FILE *old_file, FILE *sig_file, size_t new_block_len,
+            size_t strong_len, rs_magic_number sig_magic, rs_stats_t *stats)
+{
+    rs_job_t        *job;
+    rs_result       r;
+    rs_long_t       fsize = -1;
+
+    rs_get_filesize(old_file, &fsize);
+    if ((r = rs_sig_args(fsize, &sig_magic, &new_block_len, &strong_len)) != RS_DONE)
+        return r;
+    job = rs_sig_begin(new_block_len, strong_len, sig_magic);
+    r = rs_whole_run_mmap(job, old_file, sig_file, 4 * new_block_len,
+                          12 + 4*(4 + strong_len));
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+
+    return r;
+}
+
+
+rs_result
+rs_delta_mmap(rs_signature_t *sig, FILE *new_file, FILE *delta_file,
+              rs_stats_t *stats)
+{
+    rs_job_t        *job;
+    rs_result       r;
+
+    job = rs_delta_begin(sig);
+    r = rs_whole_run_mmap(job, new_file, delta_file, sig->block_len,
+                          10 + 4*sig->block_len);
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+    return r;
+}
+
 
 rs_result
 rs_sig_file(FILE *old_file, FILE *sig_file, size_t new_block_len,
@@ -107,10 +524,15 @@ rs_sig_file(FILE *old_file, FILE *sig_file, size_t new_block_len,
 {
     rs_job_t        *job;
     rs_result       r;
+    rs_long_t       fsize = -1;
+    int             inbuflen, outbuflen;
 
+    rs_get_filesize(old_file, &fsize);
+    if ((r = rs_sig_args(fsize, &sig_magic, &new_block_len, &strong_len)) != RS_DONE)
+        return r;
     job = rs_sig_begin(new_block_len, strong_len, sig_magic);
-    /* Size inbuf for 4 blocks, outbuf for header + 4 blocksums. */
-    r = rs_whole_run(job, old_file, sig_file, 4 * new_block_len, 12 + 4*(4 + strong_len));
+    rs_whole_choose_buffers(fsize, new_block_len, &inbuflen, &outbuflen);
+    r = rs_whole_run(job, old_file, sig_file, inbuflen, outbuflen);
     if (stats)
         memcpy(stats, &job->stats, sizeof *stats);
     rs_job_free(job);
@@ -144,10 +566,13 @@ rs_delta_file(rs_signature_t *sig, FILE *new_file, FILE *delta_file,
 {
     rs_job_t            *job;
     rs_result           r;
+    rs_long_t           fsize = -1;
+    int                 inbuflen, outbuflen;
 
     job = rs_delta_begin(sig);
-    /* Size inbuf for 1 block, outbuf for literal cmd + 4 blocks. */
-    r = rs_whole_run(job, new_file, delta_file, sig->block_len, 10 + 4*sig->block_len);
+    rs_get_filesize(new_file, &fsize);
+    rs_whole_choose_buffers(fsize, sig->block_len, &inbuflen, &outbuflen);
+    r = rs_whole_run(job, new_file, delta_file, inbuflen, outbuflen);
     if (stats)
         memcpy(stats, &job->stats, sizeof *stats);
     rs_job_free(job);
@@ -155,17 +580,271 @@ rs_delta_file(rs_signature_t *sig, FILE *new_file, FILE *delta_file,
 }
 
 
-rs_result rs_patch_file(FILE *basis_file, FILE *delta_file, FILE *new_file,
-                        rs_stats_t *stats)
+rs_result
+rs_delta_file_basis(rs_signature_t *sig, FILE *basis_file, FILE *new_file,
+                    FILE *delta_file, rs_stats_t *stats)
+{
+    rs_job_t            *job;
+    rs_result           r;
+    rs_pread_copy_t     *pc;
+    rs_long_t           fsize = -1;
+    int                 inbuflen, outbuflen;
+
+    if ((pc = rs_pread_copy_new(basis_file)))
+        job = rs_delta_begin_basis(sig, rs_pread_copy_cb, pc);
+    else
+        job = rs_delta_begin_basis(sig, rs_file_copy_cb, basis_file);
+    rs_get_filesize(new_file, &fsize);
+    rs_whole_choose_buffers(fsize, sig->block_len, &inbuflen, &outbuflen);
+    r = rs_whole_run(job, new_file, delta_file, inbuflen, outbuflen);
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+    if (pc)
+        rs_pread_copy_free(pc);
+    return r;
+}
+
+
+rs_result
+rs_sig_delta_file(rs_signature_t *sig, FILE *new_file, FILE *sig_file,
+                  FILE *delta_file, size_t new_block_len, size_t strong_len,
+                  rs_magic_number sig_magic, rs_stats_t *stats)
 {
     rs_job_t            *job;
     rs_result           r;
+    rs_buffers_t        buf;
+    rs_filebuf_t        *in_fb, *out_fb, *sig_fb;
+    rs_long_t           fsize = -1;
+    size_t              inbuflen, outbuflen;
 
-    job = rs_patch_begin(rs_file_copy_cb, basis_file);
+    rs_get_filesize(new_file, &fsize);
+    if ((r = rs_sig_args(fsize, &sig_magic, &new_block_len, &strong_len)) != RS_DONE)
+        return r;
+    /* Size inbuf for 4 of the larger blocks, outbuf as for a delta;
+     * rs_inbuflen and rs_outbuflen override as usual. */
+    inbuflen = new_block_len;
+    if (sig && sig->block_len > inbuflen)
+        inbuflen = sig->block_len;
+    inbuflen = rs_inbuflen ? (size_t)rs_inbuflen : 4 * inbuflen;
+    outbuflen = rs_outbuflen ? (size_t)rs_outbuflen : 10 + 4 * new_block_len;
+    in_fb = rs_filebuf_new(new_file, inbuflen);
+    out_fb = rs_filebuf_new(delta_file, outbuflen);
+    sig_fb = rs_filebuf_new(sig_file, outbuflen);
+    job = rs_sig_delta_begin(sig, new_block_len, strong_len, sig_magic,
+                             rs_outfilebuf_drain, sig_fb);
+    r = rs_job_drive(job, &buf,
+                     rs_infilebuf_fill, in_fb,
+                     rs_outfilebuf_drain, out_fb);
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+    rs_filebuf_free(sig_fb);
+    rs_filebuf_free(out_fb);
+    rs_filebuf_free(in_fb);
+    return r;
+}
+
+
+rs_result rs_patch_file(FILE *basis_file, FILE *delta_file, FILE *new_file,
+                        rs_stats_t *stats)
+{
+    rs_job_t                *job;
+    rs_result               r;
+    rs_mmap_copy_t          *mc;
+    rs_pread_copy_t         *pc = NULL;
+    rs_file_copy_range_t    *cr = NULL;
+
+    /* Prefer lending pointers out of a mapping of the whole basis, so
+     * a COPY is one memcpy from the page cache; then positioned reads
+     * with readahead; then the seeking callback. */
+    if ((mc = rs_mmap_copy_new(basis_file)))
+        job = rs_patch_begin(rs_mmap_copy_cb, mc);
+    else if ((pc = rs_pread_copy_new(basis_file)))
+        job = rs_patch_begin(rs_pread_copy_cb, pc);
+    else
+        job = rs_patch_begin(rs_file_copy_cb, basis_file);
+    /* Offload large COPY extents in the kernel when both files allow
+     * it.  Not with async IO: the offload needs the output drained in
+     * order, and there the writer runs on its own thread. */
+    if (!rs_async_io && (cr = rs_file_copy_range_new(basis_file, new_file)))
+        rs_job_set_copy_range_cb(job, rs_file_copy_range_cb, cr);
     /* Default size inbuf and outbuf 64K. */
     r = rs_whole_run(job, delta_file, new_file, 64*1024, 64*1024);
     if (stats)
         memcpy(stats, &job->stats, sizeof *stats);
     rs_job_free(job);
+    if (mc)
+        rs_mmap_copy_free(mc);
+    if (pc)
+        rs_pread_copy_free(pc);
+    if (cr)
+        rs_file_copy_range_free(cr);
     return r;
 }
+
+
+rs_result rs_patch_file_inplace(FILE *basis_file, FILE *delta_file,
+                                FILE *new_file, rs_stats_t *stats)
+{
+    rs_job_t            *job;
+    rs_result           r;
+    rs_mmap_copy_t      *mc;
+    rs_pread_copy_t     *pc = NULL;
+    rs_buffers_t        buf;
+    rs_filebuf_t        *in_fb, *out_fb;
+    int                 inbuflen = 64*1024, outbuflen = 64*1024;
+
+    if ((mc = rs_mmap_copy_new(basis_file)))
+        job = rs_patch_begin(rs_mmap_copy_cb, mc);
+    else if ((pc = rs_pread_copy_new(basis_file)))
+        job = rs_patch_begin(rs_pread_copy_cb, pc);
+    else
+        job = rs_patch_begin(rs_file_copy_cb, basis_file);
+    /* As rs_patch_file(), but drain through the comparing writer so
+     * already-correct runs of the target are seeked over, not
+     * rewritten. */
+    inbuflen = rs_inbuflen ? rs_inbuflen : inbuflen;
+    outbuflen = rs_outbuflen ? rs_outbuflen : outbuflen;
+    in_fb = rs_filebuf_new(delta_file, inbuflen);
+    out_fb = rs_filebuf_new(new_file, outbuflen);
+    r = rs_job_drive(job, &buf, rs_infilebuf_fill, in_fb,
+                     rs_outfilebuf_drain_inplace, out_fb);
+    rs_filebuf_free(in_fb);
+    rs_filebuf_free(out_fb);
+    if (r == RS_DONE) {
+        /* Drop whatever the old target held past the new length. */
+        fflush(new_file);
+#ifdef HAVE_UNISTD_H
+        if (ftruncate(fileno(new_file), ftell(new_file)))
+            r = RS_IO_ERROR;
+#endif
+    }
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+    if (mc)
+        rs_mmap_copy_free(mc);
+    if (pc)
+        rs_pread_copy_free(pc);
+    return r;
+}
+
+
+/** Build the cache entry path for a signature file's current identity,
+ * or return NULL if it can't be stat'ed.  The name is a hash of the
+ * path, size and mtime, so a changed signature file simply misses. */
+static char *rs_sigcache_path(const char *sig_name, const char *cache_dir)
+{
+#ifdef HAVE_SYS_STAT_H
+    struct stat st;
+    rs_mdfour_t md;
+    unsigned char digest[16];
+    char info[64], hex[33];
+    char *path;
+
+    if (stat(sig_name, &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+    snprintf(info, sizeof(info), FMT_LONG":"FMT_LONG,
+             (rs_long_t)st.st_size, (rs_long_t)st.st_mtime);
+    rs_mdfour_begin(&md);
+    rs_mdfour_update(&md, sig_name, strlen(sig_name) + 1);
+    rs_mdfour_update(&md, info, strlen(info));
+    rs_mdfour_result(&md, digest);
+    rs_hexify(hex, digest, (int)sizeof(digest));
+    path = rs_alloc(strlen(cache_dir) + sizeof(hex) + 7, "sig cache path");
+    sprintf(path, "%s/%s.sig2", cache_dir, hex);
+    return path;
+#else
+    (void)sig_name;
+    (void)cache_dir;
+    return NULL;
+#endif
+}
+
+/** Save \p sig into the cache at \p cache_path.
+ *
+ * Written to a temporary name and renamed into place, so concurrent
+ * processes warming the same entry never see a half-written file.
+ * Failures only cost the next run a rebuild, so they are traced and
+ * ignored. */
+static void rs_sigcache_save(rs_signature_t *sig, const char *cache_path)
+{
+    char *tmp_path;
+    FILE *f;
+    long uniq;
+
+#ifdef HAVE_UNISTD_H
+    uniq = (long)getpid();
+#else
+    uniq = (long)(size_t)sig;
+#endif
+    tmp_path = rs_alloc(strlen(cache_path) + 32, "sig cache tmp path");
+    sprintf(tmp_path, "%s.tmp%ld", cache_path, uniq);
+    if (!(f = fopen(tmp_path, "wb"))) {
+        rs_trace("couldn't write signature cache %s: %s", tmp_path,
+                 strerror(errno));
+        free(tmp_path);
+        return;
+    }
+    if (rs_sig2_save(sig, f) != RS_DONE) {
+        fclose(f);
+        remove(tmp_path);
+    } else if (fclose(f) != 0) {
+        remove(tmp_path);
+    } else if (rename(tmp_path, cache_path) != 0) {
+        rs_trace("couldn't install signature cache %s: %s", cache_path,
+                 strerror(errno));
+        remove(tmp_path);
+    } else {
+        rs_trace("cached signature as %s", cache_path);
+    }
+    free(tmp_path);
+}
+
+rs_result rs_loadsig_cached(const char *sig_name, const char *cache_dir,
+                            rs_signature_t **sumset)
+{
+    char *cache_path = NULL;
+    FILE *sig_file;
+    rs_result result;
+
+    *sumset = NULL;
+    if (cache_dir
+        && (cache_path = rs_sigcache_path(sig_name, cache_dir))) {
+#ifdef HAVE_SYS_MMAN_H
+        struct stat st;
+
+        /* Probe quietly first; a miss is the normal cold case, not an
+         * error worth logging. */
+        if (stat(cache_path, &st) == 0
+            && (*sumset = rs_loadsig_mmap(cache_path))) {
+            free(cache_path);
+            return RS_DONE;
+        }
+#endif
+    }
+    /* Cold path: parse the v1 stream and build the index. */
+    if (!(sig_file = fopen(sig_name, "rb"))) {
+        rs_error("couldn't open signature %s: %s", sig_name, strerror(errno));
+        free(cache_path);
+        return RS_IO_ERROR;
+    }
+    result = rs_loadsig_file(sig_file, sumset, NULL);
+    fclose(sig_file);
+    if (result == RS_DONE)
+        result = rs_build_hash_table(*sumset);
+    if (result != RS_DONE) {
+        if (*sumset) {
+            rs_free_sumset(*sumset);
+            *sumset = NULL;
+        }
+        free(cache_path);
+        return result;
+    }
+    if (cache_path) {
+        rs_sigcache_save(*sumset, cache_path);
+        free(cache_path);
+    }
+    return RS_DONE;
+}
@@ -21,3 +21,5 @@
 
 
 rs_result rs_whole_run(rs_job_t *job, FILE *in_file, FILE *out_file, int inbuflen, int outbuflen);
+
+rs_result rs_whole_run_async(rs_job_t *job, FILE *in_file, FILE *out_file, int inbuflen, int outbuflen);
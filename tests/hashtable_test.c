@@ -23,6 +23,7 @@
 #undef NDEBUG
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include "hashtable.h"
 
@@ -174,5 +175,39 @@ int main(int argc, char **argv)
     assert(count == 258);
     hashtable_free(t);
 
+    /* Test hashtable_new_indexed() with entries packed in an array. */
+    t = hashtable_new_indexed(256, entry, sizeof(entry_t));
+    assert(t->size == 512);
+    assert(t->count == 0);
+    assert(t->etable == NULL);
+    assert(t->itable != NULL);
+    for (i = 0; i < 256; i++)
+        assert(hashtable_add(t, &entry[i]) == &entry[i]);
+    assert(t->count == 256);
+    for (i = 0; i < 256; i++) {
+        match_init(&m, i);
+        assert(hashtable_find(t, &m) == &entry[i]);
+    }
+    match_init(&m, 256);
+    assert(hashtable_find(t, &m) == NULL);      /* Find missing entry. */
+
+    /* Test hashtable_set_base() after relocating the entry array. */
+    entry_t entry2[256];
+    memcpy(entry2, entry, sizeof(entry));
+    hashtable_set_base(t, entry2);
+    for (i = 0; i < 256; i++) {
+        match_init(&m, i);
+        assert(hashtable_find(t, &m) == &entry2[i]);
+    }
+
+    /* Test iterators over indexed entries. */
+    count = 0;
+    for (p = hashtable_iter(&iter, t); p != NULL; p = hashtable_next(&iter)) {
+        assert(&entry2[0] <= p && p <= &entry2[255]);
+        count++;
+    }
+    assert(count == 256);
+    hashtable_free(t);
+
     return 0;
 }
@@ -77,5 +77,15 @@ int main(int argc, char **argv)
         buf[i] = i;
     RollsumUpdate(&r, buf, 256);
     assert(RollsumDigest(&r) == 0x3a009e80);
+
+    /* Test RollsumRotateN() */
+    RollsumInit(&r);
+    RollsumUpdate(&r, buf, 4);  /* [0,1,2,3] */
+    RollsumRotateN(&r, buf, buf + 4, 4);        /* [4,5,6,7] */
+    assert(r.count == 4);
+    assert(RollsumDigest(&r) == 0x01680092);
+    RollsumRotateN(&r, buf + 4, buf + 8, 96);   /* [100,101,102,103] */
+    assert(r.count == 4);
+    assert(RollsumDigest(&r) == 0x05280212);
     return 0;
 }
@@ -0,0 +1,272 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * rs_bench -- microbenchmarks for librsync hot paths.
+ *
+ * Copyright (C) 2000, 2001 by Martin Pool <mbp@sourcefrog.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Reports MB/s for the bulk primitives and end-to-end sig/delta/patch,
+ * and ns/op for the per-byte and per-probe operations, so optimization
+ * work on the library has an in-tree baseline to verify against. Run
+ * it via the "bench" target or directly; it is not a correctness test
+ * and is not run by "make test". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "librsync.h"
+#include "rollsum.h"
+#include "checksum.h"
+
+/** Size of the in-memory corpus for the primitive benchmarks. */
+#define BENCH_BUF_SIZE (16 << 20)
+
+/** Size of the on-disk corpus for the end-to-end benchmarks. */
+#define BENCH_FILE_SIZE (8 << 20)
+
+#define BENCH_BLOCK_LEN 2048
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned char *random_buf(size_t len, unsigned seed)
+{
+    unsigned char *buf = malloc(len);
+    size_t i;
+
+    assert(buf != NULL);
+    srand(seed);
+    for (i = 0; i < len; i++)
+        buf[i] = rand();
+    return buf;
+}
+
+static void report_rate(const char *name, double secs, double bytes)
+{
+    printf("%-32s %8.1f MB/s\n", name, bytes / secs / 1e6);
+}
+
+static void report_op(const char *name, double secs, double ops)
+{
+    printf("%-32s %8.1f ns/op\n", name, secs / ops * 1e9);
+}
+
+static void bench_rollsum(const unsigned char *buf)
+{
+    Rollsum sum;
+    double t;
+    size_t i;
+    int rep;
+    unsigned sink = 0;
+
+    RollsumInit(&sum);
+    t = now();
+    for (rep = 0; rep < 4; rep++) {
+        RollsumUpdate(&sum, buf, BENCH_BUF_SIZE);
+        sink += RollsumDigest(&sum);
+    }
+    report_rate("RollsumUpdate", now() - t, 4.0 * BENCH_BUF_SIZE);
+
+    RollsumInit(&sum);
+    RollsumUpdate(&sum, buf, BENCH_BLOCK_LEN);
+    t = now();
+    for (i = 0; i < BENCH_BUF_SIZE - BENCH_BLOCK_LEN; i++)
+        RollsumRotate(&sum, buf[i], buf[i + BENCH_BLOCK_LEN]);
+    report_op("RollsumRotate", now() - t,
+              (double)(BENCH_BUF_SIZE - BENCH_BLOCK_LEN));
+    sink += RollsumDigest(&sum);
+    if (sink == 0x12345678)
+        printf("unlikely\n");    /* Keep the digests from being optimized out. */
+}
+
+static void bench_strongsum(const unsigned char *buf)
+{
+    rs_strong_sum_t sum;
+    double t;
+    size_t pos;
+
+    t = now();
+    for (pos = 0; pos + BENCH_BLOCK_LEN <= BENCH_BUF_SIZE;
+         pos += BENCH_BLOCK_LEN)
+        rs_calc_blake2_sum(buf + pos, BENCH_BLOCK_LEN, &sum);
+    report_rate("rs_calc_blake2_sum", now() - t, (double)BENCH_BUF_SIZE);
+
+    t = now();
+    for (pos = 0; pos + BENCH_BLOCK_LEN <= BENCH_BUF_SIZE;
+         pos += BENCH_BLOCK_LEN)
+        rs_calc_md4_sum(buf + pos, BENCH_BLOCK_LEN, &sum);
+    report_rate("rs_calc_md4_sum", now() - t, (double)BENCH_BUF_SIZE);
+}
+
+/* A minimal entry type to instantiate the hashtable for probing
+ * benchmarks, the same shape as hashtable_test.c uses. */
+typedef struct bentry {
+    int key;
+} bentry_t;
+
+static int bentry_hash(const bentry_t *e)
+{
+    return e->key;
+}
+
+static int bentry_cmp(bentry_t *m, const bentry_t *e)
+{
+    return m->key - e->key;
+}
+
+#define ENTRY bentry
+#include "hashtable.h"
+
+static void bench_hashtable(void)
+{
+    static const int loads[] = { 25, 50, 80 };
+    const int size = 1 << 20;
+    unsigned l, i, n, finds;
+    char name[64];
+    double t;
+    void *sink = NULL;
+
+    for (l = 0; l < sizeof(loads) / sizeof(loads[0]); l++) {
+        hashtable_t *ht = bentry_hashtable_new(size);
+        bentry_t *entries;
+        bentry_t m;
+
+        n = (unsigned)((long)ht->size * loads[l] / 100);
+        entries = malloc(n * sizeof(bentry_t));
+        assert(entries != NULL);
+        for (i = 0; i < n; i++) {
+            entries[i].key = i * 2654435761u;
+            bentry_hashtable_add(ht, &entries[i]);
+        }
+        finds = 4 << 20;
+        t = now();
+        for (i = 0; i < finds; i++) {
+            m.key = (i % n) * 2654435761u;
+            sink = bentry_hashtable_find(ht, &m);
+        }
+        snprintf(name, sizeof(name), "hashtable_find hit (%d%% load)",
+                 loads[l]);
+        report_op(name, now() - t, (double)finds);
+
+        t = now();
+        for (i = 0; i < finds; i++) {
+            m.key = i * 2654435761u + 1;
+            sink = bentry_hashtable_find(ht, &m);
+        }
+        snprintf(name, sizeof(name), "hashtable_find miss (%d%% load)",
+                 loads[l]);
+        report_op(name, now() - t, (double)finds);
+        bentry_hashtable_free(ht);
+        free(entries);
+    }
+    if (sink == (void *)bench_hashtable)
+        printf("unlikely\n");   /* Keep the finds from being optimized out. */
+}
+
+static FILE *temp_file_from(const unsigned char *buf, size_t len)
+{
+    FILE *f = tmpfile();
+
+    assert(f != NULL);
+    if (len)
+        assert(fwrite(buf, 1, len, f) == len);
+    rewind(f);
+    return f;
+}
+
+static void bench_whole(const char *corpus, const unsigned char *basis_buf,
+                        const unsigned char *new_buf, size_t len)
+{
+    FILE *basis = temp_file_from(basis_buf, len);
+    FILE *new_file = temp_file_from(new_buf, len);
+    FILE *sig_file = tmpfile(), *delta_file = tmpfile(), *out = tmpfile();
+    rs_signature_t *sig = NULL;
+    char name[64];
+    double t;
+
+    assert(sig_file && delta_file && out);
+    t = now();
+    assert(rs_sig_file(basis, sig_file, BENCH_BLOCK_LEN, 0,
+                       RS_BLAKE2_SIG_MAGIC, NULL) == RS_DONE);
+    snprintf(name, sizeof(name), "sig (%s)", corpus);
+    report_rate(name, now() - t, (double)len);
+
+    rewind(sig_file);
+    assert(rs_loadsig_file(sig_file, &sig, NULL) == RS_DONE);
+    assert(rs_build_hash_table(sig) == RS_DONE);
+
+    t = now();
+    assert(rs_delta_file(sig, new_file, delta_file, NULL) == RS_DONE);
+    snprintf(name, sizeof(name), "delta (%s)", corpus);
+    report_rate(name, now() - t, (double)len);
+
+    rewind(delta_file);
+    rewind(basis);
+    t = now();
+    assert(rs_patch_file(basis, delta_file, out, NULL) == RS_DONE);
+    snprintf(name, sizeof(name), "patch (%s)", corpus);
+    report_rate(name, now() - t, (double)len);
+
+    rs_free_sumset(sig);
+    fclose(basis);
+    fclose(new_file);
+    fclose(sig_file);
+    fclose(delta_file);
+    fclose(out);
+}
+
+static void bench_end_to_end(void)
+{
+    unsigned char *basis = random_buf(BENCH_FILE_SIZE, 7);
+    unsigned char *other = random_buf(BENCH_FILE_SIZE, 13);
+    unsigned char *shifted = malloc(BENCH_FILE_SIZE);
+
+    assert(shifted != NULL);
+    /* Shift the basis by half a block so no block is found in place. */
+    memcpy(shifted, other, BENCH_BLOCK_LEN / 2);
+    memcpy(shifted + BENCH_BLOCK_LEN / 2, basis,
+           BENCH_FILE_SIZE - BENCH_BLOCK_LEN / 2);
+
+    bench_whole("identical", basis, basis, BENCH_FILE_SIZE);
+    bench_whole("shifted", basis, shifted, BENCH_FILE_SIZE);
+    bench_whole("random", basis, other, BENCH_FILE_SIZE);
+
+    free(basis);
+    free(other);
+    free(shifted);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char *buf = random_buf(BENCH_BUF_SIZE, 42);
+
+    printf("%s benchmarks\n", rs_librsync_version);
+    bench_rollsum(buf);
+    bench_strongsum(buf);
+    bench_hashtable();
+    bench_end_to_end();
+    free(buf);
+    return 0;
+}
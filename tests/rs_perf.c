@@ -0,0 +1,399 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * rs_perf -- end-to-end throughput regression runner.
+ *
+ * Copyright (C) 2000, 2001 by Martin Pool <mbp@sourcefrog.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Where rs_bench times isolated primitives, rs_perf generates
+ * deterministic corpora with controlled mutation profiles -- sparse
+ * byte edits, insertions that shift block alignment, block moves,
+ * append-only growth, and unrelated data that exercises
+ * rs_appendmiss()'s max_miss splitting -- then runs the whole
+ * sig/delta/patch pipeline over each at several block lengths and
+ * reports MB/s and delta-size ratios.  Every patch result is compared
+ * back against the mutated file, so a wrong delta fails loudly.
+ *
+ * Run with no arguments it just reports.  "rs_perf --write FILE"
+ * records the numbers as a baseline; "rs_perf FILE" compares against a
+ * recorded baseline and exits nonzero if throughput drops by more than
+ * a third or deltas grow, which is what the "perf" target is for.  It
+ * is not a correctness test and is not run by "make test". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "librsync.h"
+
+/** Size of the generated basis files. */
+#define PERF_FILE_SIZE (8 << 20)
+
+/** Slack beyond the basis size for growing mutation profiles. */
+#define PERF_FILE_SLACK (2 << 20)
+
+/** Fraction of a baseline's throughput that must be sustained. */
+#define PERF_MIN_SPEEDUP 0.67
+
+/** Slack allowed over a baseline's delta-size ratio. */
+#define PERF_RATIO_SLACK 0.02
+
+static const int perf_block_lens[] = { 512, 2048, 8192 };
+
+#define PERF_NBLOCK_LENS \
+    ((int)(sizeof(perf_block_lens) / sizeof(perf_block_lens[0])))
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned char *random_buf(size_t len, unsigned seed)
+{
+    unsigned char *buf = malloc(len);
+    size_t i;
+
+    assert(buf != NULL);
+    srand(seed);
+    for (i = 0; i < len; i++)
+        buf[i] = rand();
+    return buf;
+}
+
+static FILE *temp_file_from(const unsigned char *buf, size_t len)
+{
+    FILE *f = tmpfile();
+
+    assert(f != NULL);
+    if (len)
+        assert(fwrite(buf, 1, len, f) == len);
+    rewind(f);
+    return f;
+}
+
+/* Mutation profiles.  Each writes a mutated copy of basis into out
+ * (PERF_FILE_SIZE + PERF_FILE_SLACK bytes) and returns the new length.
+ * All are deterministic so recorded baselines stay comparable. */
+
+/** The trivial no-change case; deltas should be almost all COPY. */
+static size_t mutate_identical(const unsigned char *basis, unsigned char *out)
+{
+    memcpy(out, basis, PERF_FILE_SIZE);
+    return PERF_FILE_SIZE;
+}
+
+/** Sparse single-byte edits, one per 64KB; block alignment is kept, so
+ * each edit costs one block-sized miss. */
+static size_t mutate_edits(const unsigned char *basis, unsigned char *out)
+{
+    size_t pos;
+
+    memcpy(out, basis, PERF_FILE_SIZE);
+    for (pos = 1000; pos < PERF_FILE_SIZE; pos += 64 * 1024)
+        out[pos] ^= 0xff;
+    return PERF_FILE_SIZE;
+}
+
+/** Short insertions, one per 256KB, shifting the alignment of
+ * everything behind them; this stresses the scanner's per-byte
+ * realignment until the rolling sum locks back on. */
+static size_t mutate_inserts(const unsigned char *basis, unsigned char *out)
+{
+    size_t in = 0, on = 0, next = 100 * 1000;
+
+    while (in < PERF_FILE_SIZE) {
+        if (in == next) {
+            memset(out + on, 0x55, 17);
+            on += 17;
+            next += 256 * 1024;
+        }
+        out[on++] = basis[in++];
+    }
+    return on;
+}
+
+/** Swap the first and last quarters of the file; everything still
+ * matches, but far from its original offset. */
+static size_t mutate_moves(const unsigned char *basis, unsigned char *out)
+{
+    const size_t q = PERF_FILE_SIZE / 4;
+
+    memcpy(out, basis + 3 * q, q);
+    memcpy(out + q, basis + q, 2 * q);
+    memcpy(out + 3 * q, basis, q);
+    return PERF_FILE_SIZE;
+}
+
+/** Append-only growth: the basis plus a megabyte of new data. */
+static size_t mutate_append(const unsigned char *basis, unsigned char *out)
+{
+    size_t i;
+
+    memcpy(out, basis, PERF_FILE_SIZE);
+    srand(99);
+    for (i = 0; i < (1 << 20); i++)
+        out[PERF_FILE_SIZE + i] = rand();
+    return PERF_FILE_SIZE + (1 << 20);
+}
+
+/** Unrelated data: no matches at all, so the delta is one long run of
+ * literals split at rs_appendmiss()'s max_miss boundary. */
+static size_t mutate_random(const unsigned char *basis, unsigned char *out)
+{
+    size_t i;
+
+    (void)basis;
+    srand(4711);
+    for (i = 0; i < PERF_FILE_SIZE; i++)
+        out[i] = rand();
+    return PERF_FILE_SIZE;
+}
+
+typedef size_t perf_mutate_fn(const unsigned char *basis, unsigned char *out);
+
+static const struct perf_profile {
+    const char *name;
+    perf_mutate_fn *mutate;
+} perf_profiles[] = {
+    {"identical", mutate_identical},
+    {"edits", mutate_edits},
+    {"inserts", mutate_inserts},
+    {"moves", mutate_moves},
+    {"append", mutate_append},
+    {"random", mutate_random},
+};
+
+#define PERF_NPROFILES \
+    ((int)(sizeof(perf_profiles) / sizeof(perf_profiles[0])))
+
+/** One measured pipeline run, and the key it is recorded under. */
+typedef struct perf_result {
+    char key[32];               /**< "profile/block_len". */
+    double sig_mbs;
+    double delta_mbs;
+    double patch_mbs;
+    double ratio;               /**< Delta size over new-file size. */
+} perf_result_t;
+
+static size_t file_size(FILE *f)
+{
+    long len;
+
+    assert(fseek(f, 0, SEEK_END) == 0);
+    len = ftell(f);
+    assert(len >= 0);
+    rewind(f);
+    return (size_t)len;
+}
+
+/** Check that patching basis with the delta reproduced new_buf. */
+static void check_patched(FILE *out, const unsigned char *new_buf,
+                          size_t new_len)
+{
+    unsigned char chunk[65536];
+    size_t pos = 0, n;
+
+    assert(file_size(out) == new_len);
+    while ((n = fread(chunk, 1, sizeof(chunk), out))) {
+        assert(pos + n <= new_len);
+        assert(memcmp(chunk, new_buf + pos, n) == 0);
+        pos += n;
+    }
+    assert(pos == new_len);
+}
+
+/** Run sig/delta/patch for one profile and block length. */
+static void perf_run(const struct perf_profile *profile, int block_len,
+                     const unsigned char *basis_buf,
+                     const unsigned char *new_buf, size_t new_len,
+                     perf_result_t *r)
+{
+    FILE *basis = temp_file_from(basis_buf, PERF_FILE_SIZE);
+    FILE *new_file = temp_file_from(new_buf, new_len);
+    FILE *sig_file = tmpfile(), *delta_file = tmpfile(), *out = tmpfile();
+    rs_signature_t *sig = NULL;
+    double t;
+
+    assert(sig_file && delta_file && out);
+    snprintf(r->key, sizeof(r->key), "%s/%d", profile->name, block_len);
+
+    t = now();
+    assert(rs_sig_file(basis, sig_file, block_len, 0, RS_BLAKE2_SIG_MAGIC,
+                       NULL) == RS_DONE);
+    r->sig_mbs = PERF_FILE_SIZE / (now() - t) / 1e6;
+
+    rewind(sig_file);
+    assert(rs_loadsig_file(sig_file, &sig, NULL) == RS_DONE);
+    assert(rs_build_hash_table(sig) == RS_DONE);
+
+    t = now();
+    assert(rs_delta_file(sig, new_file, delta_file, NULL) == RS_DONE);
+    r->delta_mbs = new_len / (now() - t) / 1e6;
+    r->ratio = (double)file_size(delta_file) / new_len;
+
+    rewind(basis);
+    t = now();
+    assert(rs_patch_file(basis, delta_file, out, NULL) == RS_DONE);
+    r->patch_mbs = new_len / (now() - t) / 1e6;
+
+    rewind(out);
+    check_patched(out, new_buf, new_len);
+
+    rs_free_sumset(sig);
+    fclose(basis);
+    fclose(new_file);
+    fclose(sig_file);
+    fclose(delta_file);
+    fclose(out);
+}
+
+/** Look up a baseline entry by key, or return NULL. */
+static const perf_result_t *perf_find(const perf_result_t *base, int nbase,
+                                      const char *key)
+{
+    int i;
+
+    for (i = 0; i < nbase; i++)
+        if (!strcmp(base[i].key, key))
+            return &base[i];
+    return NULL;
+}
+
+/** Compare a run against its baseline entry.  Returns the number of
+ * regressions found (0 or more), printing one line per failure. */
+static int perf_check(const perf_result_t *r, const perf_result_t *b)
+{
+    int fails = 0;
+
+    if (r->sig_mbs < b->sig_mbs * PERF_MIN_SPEEDUP) {
+        printf("FAIL %-18s sig %.1f MB/s, baseline %.1f\n", r->key,
+               r->sig_mbs, b->sig_mbs);
+        fails++;
+    }
+    if (r->delta_mbs < b->delta_mbs * PERF_MIN_SPEEDUP) {
+        printf("FAIL %-18s delta %.1f MB/s, baseline %.1f\n", r->key,
+               r->delta_mbs, b->delta_mbs);
+        fails++;
+    }
+    if (r->patch_mbs < b->patch_mbs * PERF_MIN_SPEEDUP) {
+        printf("FAIL %-18s patch %.1f MB/s, baseline %.1f\n", r->key,
+               r->patch_mbs, b->patch_mbs);
+        fails++;
+    }
+    if (r->ratio > b->ratio + PERF_RATIO_SLACK) {
+        printf("FAIL %-18s delta ratio %.4f, baseline %.4f\n", r->key,
+               r->ratio, b->ratio);
+        fails++;
+    }
+    return fails;
+}
+
+static int perf_load_baseline(const char *path, perf_result_t *base, int max)
+{
+    FILE *f = fopen(path, "r");
+    int n = 0;
+
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    while (n < max
+           && fscanf(f, "%31s %lf %lf %lf %lf", base[n].key,
+                     &base[n].sig_mbs, &base[n].delta_mbs,
+                     &base[n].patch_mbs, &base[n].ratio) == 5)
+        n++;
+    fclose(f);
+    return n;
+}
+
+static void perf_save_baseline(const char *path, const perf_result_t *res,
+                               int nres)
+{
+    FILE *f = fopen(path, "w");
+    int i;
+
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    for (i = 0; i < nres; i++)
+        fprintf(f, "%s %.1f %.1f %.1f %.4f\n", res[i].key, res[i].sig_mbs,
+                res[i].delta_mbs, res[i].patch_mbs, res[i].ratio);
+    fclose(f);
+    printf("wrote baseline %s\n", path);
+}
+
+int main(int argc, char **argv)
+{
+    perf_result_t results[PERF_NPROFILES * PERF_NBLOCK_LENS];
+    perf_result_t baseline[PERF_NPROFILES * PERF_NBLOCK_LENS];
+    unsigned char *basis_buf = random_buf(PERF_FILE_SIZE, 42);
+    unsigned char *new_buf = malloc(PERF_FILE_SIZE + PERF_FILE_SLACK);
+    const char *write_path = NULL, *check_path = NULL;
+    int nbaseline = 0, nresults = 0, fails = 0;
+    int p, b;
+
+    assert(new_buf != NULL);
+    if (argc == 3 && !strcmp(argv[1], "--write")) {
+        write_path = argv[2];
+    } else if (argc == 2) {
+        check_path = argv[1];
+        nbaseline = perf_load_baseline(check_path, baseline,
+                                       PERF_NPROFILES * PERF_NBLOCK_LENS);
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: rs_perf [--write FILE | FILE]\n");
+        return 2;
+    }
+
+    printf("%s throughput: %d MB corpus\n", rs_librsync_version,
+           PERF_FILE_SIZE >> 20);
+    printf("%-18s %9s %9s %9s %8s\n", "profile/block", "sig MB/s",
+           "dlt MB/s", "pch MB/s", "ratio");
+    for (p = 0; p < PERF_NPROFILES; p++) {
+        size_t new_len = perf_profiles[p].mutate(basis_buf, new_buf);
+
+        for (b = 0; b < PERF_NBLOCK_LENS; b++) {
+            perf_result_t *r = &results[nresults++];
+            const perf_result_t *base;
+
+            perf_run(&perf_profiles[p], perf_block_lens[b], basis_buf,
+                     new_buf, new_len, r);
+            printf("%-18s %9.1f %9.1f %9.1f %8.4f\n", r->key, r->sig_mbs,
+                   r->delta_mbs, r->patch_mbs, r->ratio);
+            if (check_path) {
+                if ((base = perf_find(baseline, nbaseline, r->key)))
+                    fails += perf_check(r, base);
+                else {
+                    printf("FAIL %-18s missing from baseline\n", r->key);
+                    fails++;
+                }
+            }
+        }
+    }
+    if (write_path)
+        perf_save_baseline(write_path, results, nresults);
+    if (check_path)
+        printf("%d regressions against %s\n", fails, check_path);
+    free(basis_buf);
+    free(new_buf);
+    return fails ? 1 : 0;
+}
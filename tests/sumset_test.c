@@ -111,7 +111,7 @@ int main(int argc, char **argv)
     /* Prepare rs_build_hash_table() and rs_signature_find_match() tests. */
     res = rs_signature_init(&sig, 0, 16, 6, 0);
     for (i = 0; i < 256; i+=16) {
-        weak = rs_calc_weak_sum(&buf[i], 16);
+        weak = rs_signature_calc_weak_sum(&sig, &buf[i], 16);
 	rs_signature_calc_strong_sum(&sig, &buf[i], 16, &strong);
 	rs_signature_add_block(&sig, weak, &strong);
     }